@@ -5,6 +5,8 @@
 #include "util/error.h"
 #include "data_structures/linked_list.h"
 #include "util/config.h"
+#include "util/event_recorder.h"
+#include "util/server_clock.h"
 
 /* Standard includes */
 #include <stdio.h>
@@ -182,3 +184,36 @@ void control_pcmd_mag_handler(void *arg)
         session_data->seq_num = seq_num;
     }
 }
+
+void control_dump_handler(void *arg)
+{
+    struct control_session_data *session_data = arg;
+    char *args = control_read_args(session_data);
+
+    uint32_t seq_num;
+
+    sscanf(args, "%" SCNu32 "\r", &seq_num);
+
+    if(seq_num >= session_data->seq_num)
+    {
+        event_trigger("at");
+        session_data->seq_num = seq_num;
+    }
+}
+
+/* AT*CLOCK=<seq>,<token> marks when a datagram from the client arrived, for
+ * its next clock sync exchange. It does nothing to the vehicle, so it is
+ * taken out of order and leaves the sequence number alone. */
+void control_clock_handler(void *arg)
+{
+    struct control_session_data *session_data = arg;
+    char *args = control_read_args(session_data);
+
+    uint32_t seq_num;
+    uint32_t token = 0;
+
+    sscanf(args, "%" SCNu32 ",%" SCNu32 "\r", &seq_num, &token);
+
+    if(token)
+        server_clock_note_control(session_data->source, token, session_data->received);
+}
@@ -8,5 +8,7 @@ void control_ref_handler(void*);
 void control_pcmd_handler(void*);
 void control_pcmd_mag_handler(void*);
 void control_ctrl_handler(void*);
+void control_dump_handler(void*);
+void control_clock_handler(void*);
 
 #endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 /* user includes */
 #include "util/port_numbers.h"
 #include "util/error.h"
@@ -8,6 +10,10 @@
 #include "control/control_handlers.h"
 #include "control/control_messages.h"
 #include "data_structures/trie.h"
+#include "util/flood_guard.h"
+#include "qos/qos_governor.h"
+#include "util/reuseport.h"
+#include "util/server_clock.h"
 
 /* Standard includes */
 #include <string.h>
@@ -15,11 +21,18 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 /* Networking includes */
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+extern int ingest_shards;
+extern uint8_t ingest_steer_cpu;
+
+/* Datagrams fetched per recvmmsg() call */
+#define CONTROL_BATCH 16
+
 static struct trie control_command_trie;
 
 void create_control_command_trie(void)
@@ -35,6 +48,8 @@ void create_control_command_trie(void)
     insert_to_trie(&control_command_trie, "AT*COMWDG", &control_empty_handler);
     insert_to_trie(&control_command_trie, "AT*CALIB", &control_empty_handler);
     insert_to_trie(&control_command_trie, "AT*CTRL", &control_ctrl_handler);
+    insert_to_trie(&control_command_trie, "AT*DUMP", &control_dump_handler);
+    insert_to_trie(&control_command_trie, "AT*CLOCK", &control_clock_handler);
 
     /*struct trie *config_trie = get_config_trie();
 
@@ -42,78 +57,177 @@ void create_control_command_trie(void)
     insert_to_trie(config_trie, "control:control_vz_max", &control_vz_max_handler);*/
 }
 
-void *control_listen(void *args)
+static void control_parse_datagram(struct control_session_data *td)
 {
-    struct server_init *server_init = (struct server_init*)args;
-    int listen_port = server_init->port;
-
-    struct control_session_data td = {.done = 0,
-        .buf_size = 300,
-        .bytes_left = 0,
-        .seq_num = 0,
-        .len = sizeof(td.serv_addr),
-        .max_roll = 0.4f,
-        .max_pitch = 0.4f,
-        .max_vert_speed = 1000.0f,
-        .max_ang_speed = 1.0f,
-        .at_pcmd_mag = server_init->d->at_pcmd_mag,
-        .at_ref = server_init->d->at_ref,
-    };
-    
-    td.buffer = malloc(sizeof(char) * td.buf_size);
-
-    td.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-
-    td.serv_addr.sin_family = AF_INET;
-    td.serv_addr.sin_addr.s_addr = INADDR_ANY;
-    td.serv_addr.sin_port = htons(listen_port);
-
-    if (bind(td.sockfd, (struct sockaddr *)&td.serv_addr, td.len) < 0) 
-        error("ERROR on binding");
-
     struct trie_node *n = control_command_trie.root;
 
-    while(!td.done)
+    while(td->bytes_left > 0)
     {
-        if(!td.bytes_left)
+        if(*td->buf_ptr == '=')
         {
-            td.bytes_left = recvfrom(td.sockfd, td.buffer, td.buf_size, 0, NULL, NULL);
+            if(n && n->handler)
+            {
+                ++td->buf_ptr;
+                --td->bytes_left;
+                n->handler(td);
+                n = control_command_trie.root;
 
-            if(td.bytes_left < 1)
-                error("ERROR reading from socket");
+                continue;
+            }
 
-            td.buf_ptr = td.buffer;
+            n = control_command_trie.root;
         }
         else
         {
-            if(*td.buf_ptr == '=')
-            {
-                if(n && n->handler)
-                {
-                    ++td.buf_ptr;
-                    --td.bytes_left;
-                    n->handler(&td);
-                    n = control_command_trie.root;
-                    
-                    continue;
-                }
+            n = traverse_to_child_char(*td->buf_ptr, n);
 
+            if(!n)
                 n = control_command_trie.root;
-            }
-            else
-            {
-                n = traverse_to_child_char(*td.buf_ptr, n);
+        }
 
-                if(!n)
-                    n = control_command_trie.root;
-            }
+        ++td->buf_ptr;
+        --td->bytes_left;
+    }
+}
+
+/* One receive socket and thread in the control port's SO_REUSEPORT group.
+ * The session (sequence number and limits) and flood guard belong to the
+ * shard, so shards never share locks, and the kernel keeps each source on a
+ * single shard. */
+struct control_shard
+{
+    int index;
+    struct control_session_data td;
+    struct flood_guard guard;
+    struct qos_deadline *deadline;
+    struct metric *datagrams;
+};
+
+static void *control_shard_listen(void *args)
+{
+    struct control_shard *shard = args;
+    struct control_session_data *td = &shard->td;
+
+    if(ingest_steer_cpu)
+        reuseport_pin_thread(shard->index);
+
+    struct mmsghdr msgs[CONTROL_BATCH];
+    struct iovec iovecs[CONTROL_BATCH];
+    struct sockaddr_in sources[CONTROL_BATCH];
+
+    for(int i = 0; i < CONTROL_BATCH; ++i)
+    {
+        iovecs[i].iov_base = td->buffer + i * td->buf_size;
+        iovecs[i].iov_len = td->buf_size;
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_name = &sources[i],
+            .msg_iov = &iovecs[i],
+            .msg_iovlen = 1,
+        };
+    }
+
+    while(!td->done)
+    {
+        for(int i = 0; i < CONTROL_BATCH; ++i)
+            msgs[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+
+        int received = recvmmsg(td->sockfd, msgs, CONTROL_BATCH, MSG_WAITFORONE, NULL);
+
+        if(received < 1)
+            error("ERROR reading from socket");
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        metrics_add(shard->datagrams, received);
 
-            ++td.buf_ptr;
-            --td.bytes_left;
+        for(int i = 0; i < received; ++i)
+        {
+            char *datagram = iovecs[i].iov_base;
+            int length = msgs[i].msg_len;
+            unsigned counts[FLOOD_NUM_CLASSES];
+
+            /* Drop floods before any parsing happens. */
+            flood_classify_control(datagram, length, counts);
+            if(!flood_guard_admit_counts(&shard->guard, &sources[i], counts, &now))
+                continue;
+
+            td->buf_ptr = datagram;
+            td->bytes_left = length;
+            td->source = &sources[i];
+            td->received = server_clock_from_timespec(&now);
+            control_parse_datagram(td);
         }
+
+        if(td->at_flush)
+            td->at_flush(td);
+
+        qos_deadline_check(shard->deadline, &now);
     }
-    
-    free(td.buffer);
+
+    free(td->buffer);
+
+    return NULL;
+}
+
+void *control_listen(void *args)
+{
+    struct server_init *server_init = (struct server_init*)args;
+    int listen_port = server_init->port;
+    int shards = ingest_shards > 1 ? ingest_shards : 1;
+
+    struct control_shard *shard_data = calloc(shards, sizeof(struct control_shard));
+    pthread_t *threads = calloc(shards, sizeof(pthread_t));
+
+    if(!shard_data || !threads)
+        error("Could not allocate control shards");
+
+    struct qos_deadline *deadline = qos_deadline_register("control", 10, 1);
+
+    /* Bind in shard order so socket i in the reuseport group is shard i */
+    for(int i = 0; i < shards; ++i)
+    {
+        struct control_shard *shard = &shard_data[i];
+
+        shard->index = i;
+        shard->deadline = deadline;
+        shard->td = (struct control_session_data){.done = 0,
+            .buf_size = 300,
+            .bytes_left = 0,
+            .seq_num = 0,
+            .len = sizeof(shard->td.serv_addr),
+            .max_roll = 0.4f,
+            .max_pitch = 0.4f,
+            .max_vert_speed = 1000.0f,
+            .max_ang_speed = 1.0f,
+            .at_pcmd_mag = server_init->d->at_pcmd_mag,
+            .at_ref = server_init->d->at_ref,
+            .at_flush = server_init->d->at_flush,
+        };
+
+        shard->td.buffer = malloc(sizeof(char) * shard->td.buf_size * CONTROL_BATCH);
+        shard->td.sockfd = reuseport_bind_udp(listen_port, shards > 1);
+        getsockname(shard->td.sockfd, (struct sockaddr *)&shard->td.serv_addr, &shard->td.len);
+
+        flood_guard_init(&shard->guard);
+
+        char key[41];
+        snprintf(key, sizeof(key), "control_shard%d_datagrams", i);
+        shard->datagrams = metrics_counter(key);
+    }
+
+    if(shards > 1 && ingest_steer_cpu)
+        reuseport_steer_by_cpu(shard_data[0].td.sockfd, shards);
+
+    for(int i = 1; i < shards; ++i)
+        pthread_create(&threads[i], NULL, control_shard_listen, &shard_data[i]);
+
+    control_shard_listen(&shard_data[0]);
+
+    for(int i = 1; i < shards; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(shard_data);
 
     return NULL;
 }
@@ -21,9 +21,14 @@ struct control_session_data
 
     void (*at_ref)(struct control_session_data *d, uint8_t start, uint8_t select);
     void (*at_pcmd_mag)(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy);
+    void (*at_flush)(struct control_session_data *d);
 
     uint32_t seq_num;
 
+    /* Sender and arrival time (server_clock_us) of the datagram being parsed */
+    const struct sockaddr_in *source;
+    uint64_t received;
+
     int16_t buf_size;
     int16_t bytes_left;
     char *buffer;
@@ -0,0 +1,33 @@
+#include "control/null_control.h"
+#include "util/metrics.h"
+
+/* Commands reach here only once the control server has received, admitted
+ * and parsed them, so the count shows how much a load test really got
+ * through */
+static struct metric *discarded;
+
+/* Parses control commands and discards them. Useful to measure the control
+ * server on its own, e.g. with tools/at_loadgen. */
+void null_control_init(struct data_options *d)
+{
+    d->at_ref = null_at_ref;
+    d->at_pcmd_mag = null_at_pcmd_mag;
+    d->at_pcmd = null_at_pcmd;
+
+    discarded = metrics_counter("null_control_commands");
+}
+
+void null_at_ref(struct control_session_data *d, uint8_t start, uint8_t select)
+{
+    metrics_add(discarded, 1);
+}
+
+void null_at_pcmd(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed)
+{
+    metrics_add(discarded, 1);
+}
+
+void null_at_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy)
+{
+    metrics_add(discarded, 1);
+}
@@ -0,0 +1,33 @@
+#include "control/plugin_control.h"
+#include "util/vrep_plugin.h"
+
+void plugin_control_init(struct data_options *d)
+{
+    d->at_ref = plugin_at_ref;
+    d->at_pcmd_mag = plugin_at_pcmd_mag;
+    d->at_pcmd = plugin_at_pcmd;
+}
+
+void plugin_at_ref(struct control_session_data *d, uint8_t start, uint8_t select)
+{
+
+}
+
+void plugin_at_pcmd(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed)
+{
+    plugin_at_pcmd_mag(d, control, roll, pitch, vert_speed, ang_speed, 0.0f, 0.0f);
+}
+
+/* Scaled as for the QC signals, and given to the script with the rest of the
+ * step's commands */
+void plugin_at_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy)
+{
+    struct vrep_command c = {
+        .roll = roll * d->max_roll,
+        .pitch = -pitch * d->max_pitch,
+        .vert_speed = vert_speed * d->max_vert_speed / 1000.0f,
+        .yaw_rate = -ang_speed * d->max_ang_speed,
+    };
+
+    vrep_plugin_queue_command(c, d->received);
+}
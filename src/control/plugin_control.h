@@ -0,0 +1,16 @@
+#ifndef PLUGIN_CONTROL_H
+#define PLUGIN_CONTROL_H
+
+#include "control/control_server.h"
+#include "util/data_options.h"
+#include <inttypes.h>
+
+/* Queues commands for the drone's script on the next simulation step when
+ * the server runs as a V-REP plugin */
+void plugin_control_init(struct data_options *d);
+
+void plugin_at_ref(struct control_session_data *d, uint8_t start, uint8_t select);
+void plugin_at_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy);
+void plugin_at_pcmd(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed);
+
+#endif
@@ -0,0 +1,47 @@
+#include "control/sim_control.h"
+#include "sim/sim_backend.h"
+
+void sim_control_init(struct data_options *d)
+{
+    d->at_ref = sim_at_ref;
+    d->at_pcmd_mag = sim_at_pcmd_mag;
+    d->at_pcmd = sim_at_pcmd;
+
+    sim_backend_init();
+}
+
+void sim_at_ref(struct control_session_data *d, uint8_t start, uint8_t select)
+{
+    pthread_mutex_lock(&sim_mutex);
+
+    if(select)
+        sim_emergency(sim_backend_state());
+    else
+        sim_set_flying(sim_backend_state(), start);
+
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+void sim_at_pcmd(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed)
+{
+    sim_at_pcmd_mag(d, control, roll, pitch, vert_speed, ang_speed, 0.0f, 0.0f);
+}
+
+/* Scaled the way vrep_control scales the QC signals */
+void sim_at_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy)
+{
+    struct sim_command c = {
+        .roll = roll * d->max_roll,
+        .pitch = -pitch * d->max_pitch,
+        .vert_speed = vert_speed * d->max_vert_speed / 1000.0f,
+        .yaw_rate = -ang_speed * d->max_ang_speed,
+    };
+
+    /* Without the progressive bit the drone hovers */
+    if(!(control & 1))
+        c = (struct sim_command){ 0 };
+
+    pthread_mutex_lock(&sim_mutex);
+    sim_backend_state()->command = c;
+    pthread_mutex_unlock(&sim_mutex);
+}
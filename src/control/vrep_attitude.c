@@ -0,0 +1,313 @@
+/* User includes */
+#include "control/vrep_attitude.h"
+#include "navdata/vrep_navdata.h"
+#include "sim/sim_model.h"
+#include "util/vrep_link.h"
+#include "util/vrep_swarm.h"
+#include "util/config.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+extern pthread_mutex_t vrep_mutex;
+
+/* Set by -A */
+uint8_t native_attitude = 0;
+
+static pthread_mutex_t command_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_command command;
+
+static simxInt *body_handle;
+static struct sim_gains gains;
+
+/* With vrep:swarm_follow every drone of a swarm is flown, not just the
+ * first, as vrep_control queues commands for them */
+static uint8_t swarm_follow;
+
+/* Until a drone's script publishes its own, the native simulation's
+ * airframe */
+static struct sim_airframe default_airframe;
+
+/* N m of yaw torque per N of propeller force. 0 leaves yaw alone, as the
+ * script does. */
+static float torque_ratio;
+
+/* One drone the controller flies, on the signals its script suffixes */
+struct vrep_attitude_drone
+{
+    char forces_signal[sizeof(VREP_ATTITUDE_SIGNAL) + VREP_SWARM_SUFFIX];
+    char airframe_signal[sizeof(VREP_ATTITUDE_AIRFRAME) + VREP_SWARM_SUFFIX];
+
+    struct sim_airframe airframe;
+
+    /* Integrators of the roll, pitch and vertical loops, N, as in
+     * sim_model.c */
+    float t_force[3];
+
+    uint32_t sequence;
+};
+
+static struct vrep_attitude_drone drones[VREP_SWARM_MAX_DRONES];
+static simxInt bodies[VREP_SWARM_MAX_DRONES];
+static float poses[VREP_SWARM_MAX_DRONES * VREP_NAVDATA_POSE_FLOATS];
+static float velocities[VREP_SWARM_MAX_DRONES * VREP_NAVDATA_VELOCITY_FLOATS];
+static float packets[VREP_SWARM_MAX_DRONES][VREP_ATTITUDE_FLOATS];
+
+/* Set when V-REP comes back: the drones have been reset, so the integrators
+ * are emptied, and their airframes are streamed again */
+static volatile uint8_t reset = 1;
+
+static void vrep_attitude_subscribe(simxInt client_id, void *arg)
+{
+    simxInt count, *handles, float_count;
+    simxFloat *floats;
+
+    simxGetObjectGroupData(client_id, sim_object_shape_type, VREP_NAVDATA_POSE, &count, &handles, NULL, NULL, &float_count, &floats, NULL, NULL, simx_opmode_streaming);
+    simxGetObjectGroupData(client_id, sim_object_shape_type, VREP_NAVDATA_VELOCITY, &count, &handles, NULL, NULL, &float_count, &floats, NULL, NULL, simx_opmode_streaming);
+
+    reset = 1;
+}
+
+void vrep_attitude_init(struct data_options *d)
+{
+    char *body = config_get_option("vrep:drone_body");
+    struct sim_params p;
+
+    d->at_pcmd_mag = vrep_attitude_pcmd_mag;
+    d->at_flush = NULL;
+
+    sim_params_default(&p);
+    gains = p.gains;
+
+    default_airframe.mass = p.mass;
+    default_airframe.width = p.width;
+    default_airframe.length = p.length;
+    default_airframe.gravity = p.gravity;
+
+    torque_ratio = config_get_float("vrep:prop_torque_ratio", 0.0f);
+    swarm_follow = config_get_int("vrep:swarm_follow", 0);
+
+    body_handle = vrep_link_object_handle(body && *body ? body : VREP_NAVDATA_BODY);
+    vrep_link_on_connect(vrep_attitude_subscribe, NULL);
+}
+
+/* Scaled the way vrep_control scales the QC signals */
+void vrep_attitude_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy)
+{
+    struct sim_command c = {
+        .roll = roll * d->max_roll,
+        .pitch = -pitch * d->max_pitch,
+        .vert_speed = vert_speed * d->max_vert_speed / 1000.0f,
+        .yaw_rate = -ang_speed * d->max_ang_speed,
+    };
+
+    /* Without the progressive bit the drone hovers */
+    if(!(control & 1))
+        c = (struct sim_command){ 0 };
+
+    pthread_mutex_lock(&command_mutex);
+    command = c;
+    pthread_mutex_unlock(&command_mutex);
+}
+
+/* Roll and pitch in the drone's heading frame, the body rates and the world
+ * frame velocity, from the streamed pose and velocity. Yaw is not needed. */
+static void vrep_attitude_sense(const float *pose, const float *velocity, struct sim_sensors *sensed)
+{
+    float x = pose[3], y = pose[4], z = pose[5], w = pose[6];
+
+    memset(sensed, 0, sizeof(*sensed));
+
+    sensed->angle[0] = atan2f(2.0f * (w * x + y * z), 1.0f - 2.0f * (x * x + y * y));
+    sensed->angle[1] = asinf(fmaxf(-1.0f, fminf(1.0f, 2.0f * (w * y - z * x))));
+    sensed->altitude = pose[2];
+
+    float r[3][3] = {
+        { 1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y - z * w), 2.0f * (x * z + y * w) },
+        { 2.0f * (x * y + z * w), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z - x * w) },
+        { 2.0f * (x * z - y * w), 2.0f * (y * z + x * w), 1.0f - 2.0f * (x * x + y * y) },
+    };
+
+    /* The rotation's transpose takes the world angular velocity to the body */
+    for(int i = 0; i < 3; ++i)
+    {
+        sensed->rate[i] = r[0][i] * velocity[3] + r[1][i] * velocity[4] + r[2][i] * velocity[5];
+        sensed->vel[i] = velocity[i];
+    }
+}
+
+static float clampf(float v, float lo, float hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/* The cascade of the native simulation on V-REP's state, plus a yaw rate loop
+ * on the propellers' reaction torque when its ratio is known. Propellers 1
+ * and 3 turn one way and 2 and 4 the other. */
+static void vrep_attitude_step(struct vrep_attitude_drone *drone, const struct sim_command *c, const struct sim_sensors *sensed, float dt, float *forces)
+{
+    const struct sim_airframe *airframe = &drone->airframe;
+    float windup = airframe->mass * airframe->gravity;
+
+    sim_control_forces(&gains, airframe, c, sensed, drone->t_force, dt, forces);
+
+    if(torque_ratio > 0.0f)
+    {
+        float arm = (airframe->width + airframe->length) / 4;
+        float yaw = airframe->mass * arm * arm * gains.r_kp * (c->yaw_rate - sensed->rate[2]) / torque_ratio / 4;
+
+        forces[0] -= yaw;
+        forces[1] += yaw;
+        forces[2] -= yaw;
+        forces[3] += yaw;
+    }
+
+    /* Up to twice the hover thrust */
+    for(int i = 0; i < 4; ++i)
+        forces[i] = clampf(forces[i], 0.0f, windup / 2);
+}
+
+/* The session's drone, or with vrep:swarm_follow the whole swarm */
+static int vrep_attitude_drones(void)
+{
+    int n = swarm_follow && vrep_swarm_size() > 1 ? vrep_swarm_size() : 1;
+
+    for(int i = 0; i < n; ++i)
+    {
+        struct vrep_attitude_drone *drone = &drones[i];
+
+        snprintf(drone->forces_signal, sizeof(drone->forces_signal), "%s%s", VREP_ATTITUDE_SIGNAL, vrep_swarm_suffix(i));
+        snprintf(drone->airframe_signal, sizeof(drone->airframe_signal), "%s%s", VREP_ATTITUDE_AIRFRAME, vrep_swarm_suffix(i));
+
+        drone->airframe = default_airframe;
+    }
+
+    return n;
+}
+
+/* A swarm's bodies are fixed once it is built, the named body's handle is
+ * resolved again after a reconnect */
+static void vrep_attitude_bodies(int n)
+{
+    for(int i = 0; i < n; ++i)
+        bodies[i] = vrep_swarm_size() ? vrep_swarm_drones()[i].base : *body_handle;
+}
+
+void *vrep_attitude_run(void *args)
+{
+    struct metric *samples = metrics_counter("vrep_controller_samples");
+    int n = vrep_attitude_drones();
+
+    /* Simulation time of the step last flown on, ms, -1 for none. The
+     * streamed replies of a step all come back in one message, so it is the
+     * same for every drone. */
+    simxInt last_time = -1;
+
+    printf("Flying %d V-REP drone%s once per simulation step\n", n, n == 1 ? "" : "s");
+
+    while(1)
+    {
+        simxInt length, sim_time = -1;
+        simxChar *value;
+        uint8_t restart = 0;
+
+        /* The reads are of streamed replies already here, so the lock is only
+         * held for copies, and the forces go out as commands that do not
+         * wait on V-REP */
+        pthread_mutex_lock(&vrep_mutex);
+
+        if(reset && vrep_link_connected())
+        {
+            for(int i = 0; i < n; ++i)
+                simxGetStringSignal(vrep_link_client(), drones[i].airframe_signal, &value, &length, simx_opmode_streaming);
+
+            reset = 0;
+            restart = 1;
+        }
+
+        vrep_attitude_bodies(n);
+
+        uint8_t sensed = vrep_link_connected() && bodies[0] >= 0 &&
+            vrep_navdata_group_read(vrep_link_client(), VREP_NAVDATA_POSE, VREP_NAVDATA_POSE_FLOATS, n, bodies, poses) &&
+            vrep_navdata_group_read(vrep_link_client(), VREP_NAVDATA_VELOCITY, VREP_NAVDATA_VELOCITY_FLOATS, n, bodies, velocities);
+
+        if(sensed)
+            sim_time = simxGetLastCmdTime(vrep_link_client());
+
+        /* The airframes only matter when there is a step to fly */
+        for(int i = 0; sensed && sim_time != last_time && i < n; ++i)
+        {
+            if(simxGetStringSignal(vrep_link_client(), drones[i].airframe_signal, &value, &length, simx_opmode_buffer) == simx_error_noerror &&
+                    length >= (simxInt)sizeof(drones[i].airframe))
+                memcpy(&drones[i].airframe, value, sizeof(drones[i].airframe));
+        }
+
+        pthread_mutex_unlock(&vrep_mutex);
+
+        /* A restarted simulation's clock starts again */
+        if(restart || (sensed && sim_time < last_time))
+        {
+            for(int i = 0; i < n; ++i)
+                memset(drones[i].t_force, 0, sizeof(drones[i].t_force));
+
+            last_time = -1;
+        }
+
+        /* Between steps the sample is the one already flown on, so there is
+         * nothing new to integrate or send */
+        if(!sensed || sim_time == last_time)
+        {
+            usleep(VREP_ATTITUDE_POLL);
+            continue;
+        }
+
+        struct sim_command c;
+
+        /* The first sample only sets the integrators' clock going */
+        float dt = last_time < 0 ? 0.0f : (sim_time - last_time) / 1000.0f;
+        last_time = sim_time;
+
+        pthread_mutex_lock(&command_mutex);
+        c = command;
+        pthread_mutex_unlock(&command_mutex);
+
+        for(int i = 0; i < n; ++i)
+        {
+            struct vrep_attitude_drone *drone = &drones[i];
+            struct sim_sensors s;
+
+            vrep_attitude_sense(poses + i * VREP_NAVDATA_POSE_FLOATS, velocities + i * VREP_NAVDATA_VELOCITY_FLOATS, &s);
+            vrep_attitude_step(drone, &c, &s, dt, packets[i] + 1);
+
+            /* Tells the script the forces are fresh. Kept well inside a
+             * float's exact integers. */
+            drone->sequence = (drone->sequence + 1) & 0xFFFFF;
+            packets[i][0] = drone->sequence;
+        }
+
+        /* Every drone's forces go out in one message */
+        pthread_mutex_lock(&vrep_mutex);
+
+        if(vrep_link_connected())
+        {
+            simxPauseCommunication(vrep_link_client(), 1);
+
+            for(int i = 0; i < n; ++i)
+                simxSetStringSignal(vrep_link_client(), drones[i].forces_signal, (const simxChar*)packets[i], sizeof(packets[i]), simx_opmode_oneshot);
+
+            simxPauseCommunication(vrep_link_client(), 0);
+        }
+
+        pthread_mutex_unlock(&vrep_mutex);
+
+        metrics_add(samples, 1);
+    }
+
+    return NULL;
+}
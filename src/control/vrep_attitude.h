@@ -0,0 +1,37 @@
+#ifndef VREP_ATTITUDE_H
+#define VREP_ATTITUDE_H
+
+#include "control/control_server.h"
+#include "util/data_options.h"
+#include <inttypes.h>
+
+/* String signal with the propeller forces, as floats for simUnpackFloats:
+ * a sequence number, then the force on each propeller in N. Each drone of a
+ * swarm has its own, with its suffix on the name. */
+#define VREP_ATTITUDE_SIGNAL "QCForces"
+#define VREP_ATTITUDE_FLOATS 5
+
+/* String signal the drone's script publishes its mass (kg), the distances
+ * between its left and right and its front and back propellers (m) and
+ * gravity (m/s^2) on, as the floats of a struct sim_airframe, suffixed like
+ * the forces */
+#define VREP_ATTITUDE_AIRFRAME "QCAirframe"
+
+/* How often the controller checks for a new simulation step, us. It only
+ * flies on a new step, so this just bounds how late it picks one up. */
+#define VREP_ATTITUDE_POLL 1000
+
+/* Flies the drone in V-REP from the server: commands go to the controller
+ * here instead of to the drone's script, and the script applies the forces
+ * the controller sends. With vrep:swarm_follow every drone of a swarm is
+ * flown on the same commands. Call after vrep_control_init. */
+void vrep_attitude_init(struct data_options *d);
+
+void vrep_attitude_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy);
+
+/* Runs the controller once for each simulation step V-REP streams, over that
+ * step's simulation time, as V-REP only applies forces once a step. Start
+ * after the swarm is built. */
+void *vrep_attitude_run(void *args);
+
+#endif
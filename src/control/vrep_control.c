@@ -1,19 +1,51 @@
 #include "control/vrep_control.h"
 #include "util/error.h"
+#include "util/config.h"
+#include "util/vrep_link.h"
+#include "util/vrep_swarm.h"
+#include "util/server_clock.h"
 #include "libs/vrep/extApi.h"
 #include "libs/vrep/extApiPlatform.h"
 #include <stdio.h>
 
-static simxInt client_id;
 extern pthread_mutex_t vrep_mutex;
 
-void vrep_control_init(struct data_options *d, simxInt id)
+/* Commands parsed since the last flush, and the time they are stamped from */
+static struct vrep_command queue[VREP_CONTROL_QUEUE];
+static int queued;
+static uint64_t epoch;
+
+/* With vrep:swarm_follow every drone of a swarm gets the commands on its own
+ * queue, not just the first */
+static uint8_t swarm_follow;
+
+/* The queue a previous session left is for a drone that has been reset, so
+ * it is cleared before anything new goes on it */
+static void vrep_control_connected(simxInt client_id, void *arg)
 {
-    client_id = id;
+    epoch = server_clock_us();
+    queued = 0;
+
+    simxClearStringSignal(client_id, VREP_CONTROL_SIGNAL, simx_opmode_oneshot);
+}
 
+void vrep_control_init(struct data_options *d)
+{
     d->at_ref = vrep_at_ref;
     d->at_pcmd_mag = vrep_at_pcmd_mag;
     d->at_pcmd = vrep_at_pcmd;
+
+    /* The float signals only keep the latest command, for scenes that
+     * read those instead */
+    if(config_get_int("vrep:command_queue", 1))
+    {
+        d->at_pcmd_mag = vrep_queue_pcmd_mag;
+        d->at_flush = vrep_flush;
+
+        swarm_follow = config_get_int("vrep:swarm_follow", 0);
+
+        vrep_link_on_connect(vrep_control_connected, NULL);
+    }
 }
 
 void vrep_at_ref(struct control_session_data *d, uint8_t start, uint8_t select)
@@ -23,15 +55,75 @@ void vrep_at_ref(struct control_session_data *d, uint8_t start, uint8_t select)
 
 void vrep_at_pcmd(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed)
 {
-    vrep_at_pcmd_mag(d, control, roll, pitch, vert_speed, ang_speed, 0.0f, 0.0f);
+    d->at_pcmd_mag(d, control, roll, pitch, vert_speed, ang_speed, 0.0f, 0.0f);
 }
 
 void vrep_at_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy)
 {
 	pthread_mutex_lock(&vrep_mutex);
-    simxSetFloatSignal(client_id, "QCRoll", roll * d->max_roll, simx_opmode_oneshot);
-    simxSetFloatSignal(client_id, "QCPitch", -pitch * d->max_pitch, simx_opmode_oneshot);
-    simxSetFloatSignal(client_id, "QCVSpeed", vert_speed * d->max_vert_speed / 1000.0f, simx_opmode_oneshot);
-    simxSetFloatSignal(client_id, "QCASpeed", -ang_speed * d->max_ang_speed, simx_opmode_oneshot);
+
+    /* Commands sent while V-REP is away would be stale by the time it is
+     * back, so they are dropped */
+    if(vrep_link_connected())
+    {
+        simxInt client_id = vrep_link_client();
+
+        simxSetFloatSignal(client_id, "QCRoll", roll * d->max_roll, simx_opmode_oneshot);
+        simxSetFloatSignal(client_id, "QCPitch", -pitch * d->max_pitch, simx_opmode_oneshot);
+        simxSetFloatSignal(client_id, "QCVSpeed", vert_speed * d->max_vert_speed / 1000.0f, simx_opmode_oneshot);
+        simxSetFloatSignal(client_id, "QCASpeed", -ang_speed * d->max_ang_speed, simx_opmode_oneshot);
+    }
+
+    pthread_mutex_unlock(&vrep_mutex);
+}
+
+/* Appends the commands parsed so far to the queue signal as one command.
+ * Appends are never merged by the remote API, so nothing is lost if V-REP
+ * has not drained the last one, and none of them waits on a reply. The
+ * session flies the first drone of a swarm; followers get the same append on
+ * their own queue, all in one message. Call with vrep_mutex held. */
+static void vrep_flush_locked(void)
+{
+    if(queued && vrep_link_connected())
+    {
+        int drones = swarm_follow && vrep_swarm_size() > 1 ? vrep_swarm_size() : 1;
+        char signal[sizeof(VREP_CONTROL_SIGNAL) + VREP_SWARM_SUFFIX];
+
+        for(int i = 0; i < drones; ++i)
+        {
+            snprintf(signal, sizeof(signal), "%s%s", VREP_CONTROL_SIGNAL, vrep_swarm_suffix(i));
+            simxAppendStringSignal(vrep_link_client(), signal, (const simxChar*)queue, queued * sizeof(struct vrep_command), simx_opmode_oneshot);
+        }
+    }
+
+    queued = 0;
+}
+
+/* Scaled as for the QC signals, and stamped with when the datagram came in */
+void vrep_queue_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy)
+{
+    pthread_mutex_lock(&vrep_mutex);
+
+    if(vrep_link_connected())
+    {
+        if(queued == VREP_CONTROL_QUEUE)
+            vrep_flush_locked();
+
+        queue[queued++] = (struct vrep_command){
+            .time = (d->received > epoch ? d->received - epoch : 0) / 1e6f,
+            .roll = roll * d->max_roll,
+            .pitch = -pitch * d->max_pitch,
+            .vert_speed = vert_speed * d->max_vert_speed / 1000.0f,
+            .yaw_rate = -ang_speed * d->max_ang_speed,
+        };
+    }
+
+    pthread_mutex_unlock(&vrep_mutex);
+}
+
+void vrep_flush(struct control_session_data *d)
+{
+    pthread_mutex_lock(&vrep_mutex);
+    vrep_flush_locked();
     pthread_mutex_unlock(&vrep_mutex);
 }
@@ -6,10 +6,33 @@
 #include <inttypes.h>
 #include "libs/vrep/extApi.h"
 
-void vrep_control_init(struct data_options *d, simxInt id);
+/* String signal the drone's script drains each simulation step */
+#define VREP_CONTROL_SIGNAL "QCCommands"
+
+/* Commands held before a flush is forced, a few batches' worth */
+#define VREP_CONTROL_QUEUE 64
+
+/* One command on the queue signal, as floats so the script can read them
+ * with simUnpackFloats. time is seconds since the server connected to
+ * V-REP, from when the datagram was received. The rest are scaled as for
+ * the QC signals. */
+struct vrep_command
+{
+    float time;
+    float roll;
+    float pitch;
+    float vert_speed;
+    float yaw_rate;
+};
+
+void vrep_control_init(struct data_options *d);
 
 void vrep_at_ref(struct control_session_data *d, uint8_t start, uint8_t select);
 void vrep_at_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy);
 void vrep_at_pcmd(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed);
 
+/* Queues commands for the next flush instead of overwriting the QC signals */
+void vrep_queue_pcmd_mag(struct control_session_data *d, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed, float magneto_psi, float magneto_psi_accuracy);
+void vrep_flush(struct control_session_data *d);
+
 #endif
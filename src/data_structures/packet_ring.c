@@ -0,0 +1,154 @@
+/* User includes */
+#include "data_structures/packet_ring.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+void packet_ring_init(struct packet_ring *r, const char *name, uint32_t data_size, uint32_t max_entries, uint8_t key_aligned)
+{
+    char key[41];
+
+    memset(r, 0, sizeof(*r));
+
+    r->data = malloc(data_size);
+    r->entries = calloc(max_entries, sizeof(struct packet_ring_entry));
+
+    if(!r->data || !r->entries)
+        error("Could not allocate %s ring", name);
+
+    r->data_size = data_size;
+    r->max_entries = max_entries;
+    r->key_aligned = key_aligned;
+    r->waiting_for_key = key_aligned;
+
+    pthread_mutex_init(&r->mutex, NULL);
+
+    snprintf(key, sizeof(key), "%s_ring_dropped", name);
+    r->dropped = metrics_counter(key);
+}
+
+static struct packet_ring_entry *packet_ring_at(struct packet_ring *r, uint32_t index)
+{
+    return &r->entries[index % r->max_entries];
+}
+
+/* Finds room for size bytes without evicting anything. Returns the offset, or
+ * -1 if there is none. Live data runs from the head entry to write_offset,
+ * possibly wrapping round the end of the buffer. */
+static int64_t packet_ring_find_space(struct packet_ring *r, uint32_t size)
+{
+    if(r->head == r->tail)
+        return size <= r->data_size ? 0 : -1;
+
+    if(r->tail - r->head == r->max_entries)
+        return -1;
+
+    uint32_t head_offset = packet_ring_at(r, r->head)->offset;
+
+    if(r->write_offset > head_offset)
+    {
+        if(r->data_size - r->write_offset >= size)
+            return r->write_offset;
+        if(head_offset >= size)
+            return 0;
+    }
+    else if(head_offset - r->write_offset >= size)
+        return r->write_offset;
+
+    return -1;
+}
+
+/* Evicts the oldest packet and, for key aligned rings, everything up to the
+ * next key packet. Returns 0 if a reader holds the oldest packet. */
+static uint8_t packet_ring_evict(struct packet_ring *r)
+{
+    if(r->head == r->tail || packet_ring_at(r, r->head)->refs)
+        return 0;
+
+    ++r->head;
+
+    while(r->key_aligned && r->head != r->tail && !packet_ring_at(r, r->head)->key && !packet_ring_at(r, r->head)->refs)
+        ++r->head;
+
+    return 1;
+}
+
+void packet_ring_push(struct packet_ring *r, const void *data, uint32_t size, uint8_t key)
+{
+    int64_t offset;
+
+    if(!size)
+        return;
+
+    pthread_mutex_lock(&r->mutex);
+
+    if(r->waiting_for_key && !key)
+    {
+        pthread_mutex_unlock(&r->mutex);
+        return;
+    }
+
+    r->waiting_for_key = 0;
+
+    while((offset = packet_ring_find_space(r, size)) < 0)
+    {
+        if(!packet_ring_evict(r))
+        {
+            /* Full of held packets, or the packet is bigger than the ring */
+            r->waiting_for_key = r->key_aligned;
+            pthread_mutex_unlock(&r->mutex);
+
+            metrics_add(r->dropped, 1);
+            return;
+        }
+    }
+
+    struct packet_ring_entry *e = packet_ring_at(r, r->tail);
+
+    memcpy(r->data + offset, data, size);
+
+    e->offset = offset;
+    e->size = size;
+    e->key = key;
+    e->refs = 0;
+    clock_gettime(CLOCK_REALTIME, &e->time);
+
+    r->write_offset = offset + size;
+    ++r->tail;
+
+    pthread_mutex_unlock(&r->mutex);
+}
+
+uint32_t packet_ring_hold(struct packet_ring *r, uint32_t *first)
+{
+    pthread_mutex_lock(&r->mutex);
+
+    *first = r->head;
+
+    for(uint32_t i = r->head; i != r->tail; ++i)
+        ++packet_ring_at(r, i)->refs;
+
+    uint32_t count = r->tail - r->head;
+
+    pthread_mutex_unlock(&r->mutex);
+
+    return count;
+}
+
+const struct packet_ring_entry *packet_ring_entry(struct packet_ring *r, uint32_t index)
+{
+    return packet_ring_at(r, index);
+}
+
+void packet_ring_release(struct packet_ring *r, uint32_t first, uint32_t count)
+{
+    pthread_mutex_lock(&r->mutex);
+
+    for(uint32_t i = first; i != first + count; ++i)
+        --packet_ring_at(r, i)->refs;
+
+    pthread_mutex_unlock(&r->mutex);
+}
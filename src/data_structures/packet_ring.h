@@ -0,0 +1,57 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include "util/metrics.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+struct packet_ring_entry
+{
+    uint32_t offset;
+    uint32_t size;
+    uint8_t key;
+    uint32_t refs;
+    struct timespec time;   /* CLOCK_REALTIME when pushed */
+};
+
+/* A bounded ring of variable sized packets. All memory is allocated by
+ * packet_ring_init and the oldest packets are evicted to make room. Readers
+ * take references on the packets they want; the writer never evicts those and
+ * never waits for them, so while it is blocked the new packet is dropped from
+ * the ring instead. With key_aligned set the ring always starts on a key packet
+ * (an IDR frame) and skips to the next one after a drop, so what it holds can
+ * be decoded on its own. */
+struct packet_ring
+{
+    uint8_t *data;
+    uint32_t data_size;
+
+    struct packet_ring_entry *entries;
+    uint32_t max_entries;
+
+    /* Running entry counts; entry i lives in entries[i % max_entries] */
+    uint32_t head;
+    uint32_t tail;
+
+    uint32_t write_offset;
+
+    uint8_t key_aligned;
+    uint8_t waiting_for_key;
+
+    pthread_mutex_t mutex;
+
+    struct metric *dropped;
+};
+
+/* name is used for the ring's metrics (<name>_ring_dropped) */
+void packet_ring_init(struct packet_ring *r, const char *name, uint32_t data_size, uint32_t max_entries, uint8_t key_aligned);
+void packet_ring_push(struct packet_ring *r, const void *data, uint32_t size, uint8_t key);
+
+/* References every packet in the ring and returns how many there are, starting
+ * at *first. They stay valid until released. */
+uint32_t packet_ring_hold(struct packet_ring *r, uint32_t *first);
+const struct packet_ring_entry *packet_ring_entry(struct packet_ring *r, uint32_t index);
+void packet_ring_release(struct packet_ring *r, uint32_t first, uint32_t count);
+
+#endif
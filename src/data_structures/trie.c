@@ -11,49 +11,73 @@ struct trie *init_trie(void)
     return calloc(sizeof(struct trie), 1);
 }
 
+/* Visits every node holding a key in order: the node itself, then its left,
+ * centre and right subtrees. *reentrant must be NULL on the first call and is
+ * left pointing at the node returned, so the walk resumes from there. */
 uint8_t iterate_key_value_pairs(struct trie *t, struct trie_node **reentrant, char **key, char **value)
 {
     struct trie_node *n;
     if(*reentrant)
         n = *reentrant;
     else
+    {
         n = t->root;
 
-    while(!n->key)
+        if(!n)
+            return 0;
+
+        n->next_traverse = 0;
+    }
+
+    while(n)
     {
-        switch(n->next_traverse++)
+        switch(n->next_traverse)
         {
             case 0:
+                n->next_traverse = 1;
+
+                if(n->key && n->value)
+                {
+                    *reentrant = n;
+                    *value = n->value;
+                    *key = n->key;
+                    return 1;
+                }
+            case 1:
+                n->next_traverse = 2;
+
                 if(n->left)
                 {
                     n = n->left;
-                    break;
+                    n->next_traverse = 0;
+                    continue;
                 }
-            case 1:
+            case 2:
+                n->next_traverse = 3;
+
                 if(n->centre)
                 {
                     n = n->centre;
-                    break;
+                    n->next_traverse = 0;
+                    continue;
                 }
-            case 2:
+            case 3:
+                n->next_traverse = 4;
+
                 if(n->right)
                 {
                     n = n->right;
-                    break;
+                    n->next_traverse = 0;
+                    continue;
                 }
-            case 3:
+            default:
                 n->next_traverse = 0;
-
-                if(n->parent)
-                    n = n->parent;
-                else
-                    return 0;
+                n = n->parent;
         }
     }
 
-    *value = n->value;
-    *key = n->key;
-    return 1;
+    *reentrant = NULL;
+    return 0;
 }
 
 handler_t insert_kv_pair_to_trie(struct trie *t, char *key, char *value)
@@ -171,6 +195,21 @@ void insert_to_trie(struct trie *t, char *c, void (*handler)(void*))
     n->key = key;
 }
 
+char *lookup_value_in_trie(struct trie *t, char *key)
+{
+    struct trie_node *n = t->root;
+
+    while(*key)
+    {
+        n = traverse_to_child_char(*key++, n);
+
+        if(!n)
+            return NULL;
+    }
+
+    return n->value;
+}
+
 struct trie_node *traverse_to_child_char(char c, struct trie_node *n)
 {
     while(n)
@@ -29,6 +29,7 @@ typedef void (*handler_t)(void*);
 struct trie *init_trie(void);
 void insert_to_trie(struct trie *t, char *c, void (*handler)(void*));
 handler_t insert_kv_pair_to_trie(struct trie *t, char *key, char *value);
+char *lookup_value_in_trie(struct trie *t, char *key);
 struct trie_node *traverse_to_child_char(char c, struct trie_node *n);
 uint8_t iterate_key_value_pairs(struct trie *t, struct trie_node **reentrant, char **key, char **value);
 
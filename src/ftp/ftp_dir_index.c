@@ -0,0 +1,529 @@
+/* User includes */
+#include "ftp/ftp_dir_index.h"
+#include "ftp/ftp_messages.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+
+#define FTP_INDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Longest line a listing can have, apart from the name */
+#define FTP_LISTING_LINE 96
+
+struct ftp_dir_entry
+{
+    char *name;
+    uint64_t size;
+    time_t mtime;
+    mode_t mode;
+};
+
+struct ftp_dir
+{
+    char *path;
+    int wd;
+    uint32_t last_used;
+
+    /* Sorted by name */
+    struct ftp_dir_entry *entries;
+    int count;
+    int capacity;
+
+    /* Built on the first request after a change, NULL until then */
+    struct ftp_listing *listings[FTP_LISTING_KINDS];
+};
+
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ftp_dir dirs[FTP_INDEX_MAX_DIRS];
+static int num_dirs = 0;
+static uint32_t use_clock = 0;
+
+static int inotify_fd;
+static pthread_t index_thread;
+
+static struct metric *listings_sent;
+static struct metric *listings_built;
+static struct metric *dir_scans;
+
+void ftp_listing_release(struct ftp_listing *l)
+{
+    if(__sync_sub_and_fetch(&l->refs, 1) == 0)
+        free(l);
+}
+
+static void ftp_dir_invalidate(struct ftp_dir *dir)
+{
+    for(int k = 0; k < FTP_LISTING_KINDS; ++k)
+    {
+        if(dir->listings[k])
+        {
+            ftp_listing_release(dir->listings[k]);
+            dir->listings[k] = NULL;
+        }
+    }
+}
+
+static void ftp_dir_clear(struct ftp_dir *dir)
+{
+    for(int i = 0; i < dir->count; ++i)
+        free(dir->entries[i].name);
+
+    dir->count = 0;
+    ftp_dir_invalidate(dir);
+}
+
+/* Binary search. Returns the index of name, or -(insertion point) - 1. */
+static int ftp_dir_find(const struct ftp_dir *dir, const char *name)
+{
+    int lo = 0, hi = dir->count;
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(dir->entries[mid].name, name);
+
+        if(!c)
+            return mid;
+
+        if(c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -lo - 1;
+}
+
+static void ftp_dir_remove(struct ftp_dir *dir, const char *name)
+{
+    int i = ftp_dir_find(dir, name);
+
+    if(i < 0)
+        return;
+
+    free(dir->entries[i].name);
+    memmove(&dir->entries[i], &dir->entries[i + 1], (dir->count - i - 1) * sizeof(struct ftp_dir_entry));
+    --dir->count;
+}
+
+/* Stats one name, and adds, updates or removes its entry to match */
+static void ftp_dir_update(struct ftp_dir *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+
+    if(stat(path, &st) < 0)
+    {
+        ftp_dir_remove(dir, name);
+        return;
+    }
+
+    int i = ftp_dir_find(dir, name);
+
+    if(i < 0)
+    {
+        i = -i - 1;
+
+        if(dir->count == dir->capacity)
+        {
+            dir->capacity = dir->capacity ? dir->capacity * 2 : 64;
+            dir->entries = realloc(dir->entries, dir->capacity * sizeof(struct ftp_dir_entry));
+            if(!dir->entries)
+                error("Could not grow directory index");
+        }
+
+        memmove(&dir->entries[i + 1], &dir->entries[i], (dir->count - i) * sizeof(struct ftp_dir_entry));
+        dir->entries[i].name = strdup(name);
+        ++dir->count;
+    }
+
+    dir->entries[i].size = st.st_size;
+    dir->entries[i].mtime = st.st_mtime;
+    dir->entries[i].mode = st.st_mode;
+}
+
+static void ftp_dir_scan(struct ftp_dir *dir)
+{
+    DIR *d = opendir(dir->path);
+    struct dirent *e;
+
+    ftp_dir_clear(dir);
+    metrics_add(dir_scans, 1);
+
+    if(!d)
+        return;
+
+    while((e = readdir(d)))
+    {
+        if(strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+            ftp_dir_update(dir, e->d_name);
+    }
+
+    closedir(d);
+}
+
+static void ftp_dir_drop(struct ftp_dir *dir, uint8_t remove_watch)
+{
+    if(remove_watch)
+        inotify_rm_watch(inotify_fd, dir->wd);
+
+    ftp_dir_clear(dir);
+    free(dir->entries);
+    free(dir->path);
+
+    *dir = dirs[--num_dirs];
+    memset(&dirs[num_dirs], 0, sizeof(struct ftp_dir));
+}
+
+static struct ftp_dir *ftp_dir_by_wd(int wd)
+{
+    for(int i = 0; i < num_dirs; ++i)
+    {
+        if(dirs[i].wd == wd)
+            return &dirs[i];
+    }
+
+    return NULL;
+}
+
+/* "", "." and "./" are all the current directory, and "a/" is "a" */
+static void ftp_normalise_path(const char *path, char *out, size_t size)
+{
+    if(!path)
+        path = "";
+
+    while(path[0] == '.' && path[1] == '/')
+        path += 2;
+
+    snprintf(out, size, "%s", *path ? path : ".");
+
+    for(size_t len = strlen(out); len > 1 && out[len - 1] == '/'; --len)
+        out[len - 1] = 0;
+}
+
+/* Finds path in the index, adding and scanning it if needed. Called with
+ * index_mutex held. */
+static struct ftp_dir *ftp_dir_get(const char *path)
+{
+    struct stat st;
+
+    for(int i = 0; i < num_dirs; ++i)
+    {
+        if(!strcmp(dirs[i].path, path))
+        {
+            dirs[i].last_used = ++use_clock;
+            return &dirs[i];
+        }
+    }
+
+    if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    /* Watch before scanning, so nothing is missed in between */
+    int wd = inotify_add_watch(inotify_fd, path, FTP_INDEX_EVENTS);
+    if(wd < 0)
+        return NULL;
+
+    /* The same directory under another name */
+    struct ftp_dir *dir = ftp_dir_by_wd(wd);
+    if(dir)
+    {
+        dir->last_used = ++use_clock;
+        return dir;
+    }
+
+    if(num_dirs == FTP_INDEX_MAX_DIRS)
+    {
+        struct ftp_dir *oldest = &dirs[0];
+
+        for(int i = 1; i < num_dirs; ++i)
+        {
+            if(dirs[i].last_used < oldest->last_used)
+                oldest = &dirs[i];
+        }
+
+        ftp_dir_drop(oldest, 1);
+    }
+
+    dir = &dirs[num_dirs++];
+    dir->path = strdup(path);
+    dir->wd = wd;
+    dir->last_used = ++use_clock;
+
+    ftp_dir_scan(dir);
+
+    return dir;
+}
+
+static int ftp_format_list(char *out, size_t size, const struct ftp_dir_entry *e, time_t now)
+{
+    char mode[11];
+    char date[13];
+    struct tm tm;
+    const char *rwx = "rwxrwxrwx";
+
+    mode[0] = S_ISDIR(e->mode) ? 'd' : '-';
+    for(int i = 0; i < 9; ++i)
+        mode[i + 1] = e->mode & (0400 >> i) ? rwx[i] : '-';
+    mode[10] = 0;
+
+    /* Like ls, the year instead of the time for anything not recent */
+    localtime_r(&e->mtime, &tm);
+    if(e->mtime > now || now - e->mtime > 180 * 24 * 3600)
+        strftime(date, sizeof(date), "%b %e  %Y", &tm);
+    else
+        strftime(date, sizeof(date), "%b %e %H:%M", &tm);
+
+    return snprintf(out, size, "%s 1 ftp ftp %13" PRIu64 " %s %s\r\n", mode, e->size, date, e->name);
+}
+
+static int ftp_format_facts(char *out, size_t size, const struct ftp_dir_entry *e)
+{
+    char modify[15];
+    struct tm tm;
+
+    gmtime_r(&e->mtime, &tm);
+    strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm);
+
+    /* perm: files can be retrieved, stored and appended to, and directories
+     * listed */
+    if(S_ISDIR(e->mode))
+        return snprintf(out, size, "type=dir;modify=%s;perm=l; %s\r\n", modify, e->name);
+
+    return snprintf(out, size, "type=file;size=%" PRIu64 ";modify=%s;perm=arw; %s\r\n", e->size, modify, e->name);
+}
+
+static struct ftp_listing *ftp_listing_build(const struct ftp_dir *dir, enum ftp_listing_kind kind)
+{
+    size_t capacity = 0;
+    time_t now = time(NULL);
+
+    for(int i = 0; i < dir->count; ++i)
+        capacity += strlen(dir->entries[i].name) + FTP_LISTING_LINE;
+
+    struct ftp_listing *l = malloc(sizeof(struct ftp_listing) + capacity + 1);
+    if(!l)
+        error("Could not allocate directory listing");
+
+    l->refs = 1;
+    l->size = 0;
+
+    for(int i = 0; i < dir->count; ++i)
+    {
+        const struct ftp_dir_entry *e = &dir->entries[i];
+        char *out = l->data + l->size;
+        size_t room = capacity + 1 - l->size;
+
+        if(kind == FTP_LISTING_LIST)
+            l->size += ftp_format_list(out, room, e, now);
+        else if(kind == FTP_LISTING_MLSD)
+            l->size += ftp_format_facts(out, room, e);
+        else
+            l->size += snprintf(out, room, "%s\r\n", e->name);
+    }
+
+    metrics_add(listings_built, 1);
+
+    return l;
+}
+
+struct ftp_listing *ftp_dir_index_listing(const char *path, enum ftp_listing_kind kind)
+{
+    char normalised[PATH_MAX];
+    struct ftp_listing *l = NULL;
+
+    ftp_normalise_path(path, normalised, sizeof(normalised));
+
+    if(strcmp(normalised, ".") && !ftp_path_allowed(normalised))
+        return NULL;
+
+    pthread_mutex_lock(&index_mutex);
+
+    struct ftp_dir *dir = ftp_dir_get(normalised);
+
+    if(dir)
+    {
+        if(!dir->listings[kind])
+            dir->listings[kind] = ftp_listing_build(dir, kind);
+
+        l = dir->listings[kind];
+        __sync_fetch_and_add(&l->refs, 1);
+    }
+
+    pthread_mutex_unlock(&index_mutex);
+
+    return l;
+}
+
+int ftp_dir_index_facts(const char *path, char *buffer, size_t size)
+{
+    char normalised[PATH_MAX];
+    char parent[PATH_MAX] = ".";
+    int len = -1;
+
+    ftp_normalise_path(path, normalised, sizeof(normalised));
+
+    if(!strcmp(normalised, "."))
+    {
+        struct ftp_dir_entry cdir = { .name = ".", .mode = S_IFDIR };
+        struct stat st;
+
+        if(stat(".", &st) == 0)
+            cdir.mtime = st.st_mtime;
+
+        return ftp_format_facts(buffer, size, &cdir);
+    }
+
+    if(!ftp_path_allowed(normalised))
+        return -1;
+
+    char *slash = strrchr(normalised, '/');
+    const char *name = normalised;
+
+    if(slash)
+    {
+        *slash = 0;
+        snprintf(parent, sizeof(parent), "%s", normalised);
+        name = slash + 1;
+    }
+
+    pthread_mutex_lock(&index_mutex);
+
+    struct ftp_dir *dir = ftp_dir_get(parent);
+
+    if(dir)
+    {
+        int i = ftp_dir_find(dir, name);
+
+        if(i >= 0)
+            len = ftp_format_facts(buffer, size, &dir->entries[i]);
+    }
+
+    pthread_mutex_unlock(&index_mutex);
+
+    return len;
+}
+
+const char *ftp_dir_index_send(struct session_data *d, int sockfd, enum ftp_listing_kind kind)
+{
+    struct ftp_listing *l = ftp_dir_index_listing(d->filename, kind);
+    const char *reply = MSG_RETR_SUCCESS;
+
+    if(!l)
+        return MSG_NO_SUCH_FILE;
+
+    int bytes_written = write(d->client_sockfd, MSG_OPENING_ASCII_CONN, strlen(MSG_OPENING_ASCII_CONN));
+    if (bytes_written < 0)
+        error("ERROR writing to socket");
+
+    for(size_t offset = 0; offset < l->size;)
+    {
+        size_t chunk = l->size - offset < FTP_LISTING_CHUNK ? l->size - offset : FTP_LISTING_CHUNK;
+        ssize_t sent = send(sockfd, l->data + offset, chunk, MSG_NOSIGNAL);
+
+        if(sent < 0)
+        {
+            reply = MSG_TRANSFER_ABORTED;
+            break;
+        }
+
+        offset += sent;
+    }
+
+    ftp_listing_release(l);
+    metrics_add(listings_sent, 1);
+
+    return reply;
+}
+
+static void ftp_dir_index_event(const struct inotify_event *ev)
+{
+    if(ev->mask & IN_Q_OVERFLOW)
+    {
+        for(int i = 0; i < num_dirs; ++i)
+            ftp_dir_scan(&dirs[i]);
+        return;
+    }
+
+    struct ftp_dir *dir = ftp_dir_by_wd(ev->wd);
+
+    if(!dir)
+        return;
+
+    /* The directory itself went away; it is scanned afresh if it comes back */
+    if(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        ftp_dir_drop(dir, !(ev->mask & IN_IGNORED));
+        return;
+    }
+
+    if(!ev->len)
+        return;
+
+    if(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        ftp_dir_remove(dir, ev->name);
+    else
+        ftp_dir_update(dir, ev->name);
+
+    ftp_dir_invalidate(dir);
+}
+
+static void *ftp_dir_index_run(void *args)
+{
+    char buffer[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while(1)
+    {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+
+        if(len <= 0)
+            continue;
+
+        /* A whole batch of events under one lock, so a burst of new files
+         * costs one rebuild on the next request, not one per file */
+        pthread_mutex_lock(&index_mutex);
+
+        for(char *p = buffer; p < buffer + len;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event*)p;
+
+            ftp_dir_index_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+
+        pthread_mutex_unlock(&index_mutex);
+    }
+
+    return NULL;
+}
+
+void ftp_dir_index_init(void)
+{
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if(inotify_fd < 0)
+        error("Could not start inotify for the FTP directory index");
+
+    listings_sent = metrics_counter("ftp_listings_sent");
+    listings_built = metrics_counter("ftp_listings_built");
+    dir_scans = metrics_counter("ftp_dir_scans");
+
+    pthread_create(&index_thread, NULL, ftp_dir_index_run, NULL);
+}
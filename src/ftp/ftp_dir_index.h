@@ -0,0 +1,47 @@
+#ifndef FTP_DIR_INDEX_H
+#define FTP_DIR_INDEX_H
+
+#include "ftp_server.h"
+#include <stddef.h>
+
+/* Directories kept in the index. Past this, the least recently listed one
+ * is dropped and rescanned when it is next asked for. */
+#define FTP_INDEX_MAX_DIRS 64
+
+/* Listings go out on the data connection in pieces of this size */
+#define FTP_LISTING_CHUNK (64 * 1024)
+
+enum ftp_listing_kind
+{
+    FTP_LISTING_LIST,       /* ls -l style, for people */
+    FTP_LISTING_NLST,       /* names only */
+    FTP_LISTING_MLSD,       /* RFC 3659 facts, for programs */
+    FTP_LISTING_KINDS
+};
+
+/* A formatted listing. Shared between sessions, and freed when the last one
+ * to hold it lets go after the directory has changed. */
+struct ftp_listing
+{
+    int refs;
+    size_t size;
+    char data[];
+};
+
+/* Starts the inotify thread that keeps the index current */
+void ftp_dir_index_init(void);
+
+/* Returns the listing of path (the current directory if NULL), held for the
+ * caller, or NULL if path is not a directory that can be listed */
+struct ftp_listing *ftp_dir_index_listing(const char *path, enum ftp_listing_kind kind);
+void ftp_listing_release(struct ftp_listing *l);
+
+/* Writes the MLST facts line for path into buffer. Returns its length, or -1
+ * if there is no such file. */
+int ftp_dir_index_facts(const char *path, char *buffer, size_t size);
+
+/* Sends the listing of d->filename over sockfd. Returns the reply for the
+ * control connection. */
+const char *ftp_dir_index_send(struct session_data *d, int sockfd, enum ftp_listing_kind kind);
+
+#endif
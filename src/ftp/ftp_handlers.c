@@ -2,6 +2,7 @@
 #include "ftp_handlers.h"
 #include "ftp_server.h"
 #include "ftp_messages.h"
+#include "ftp_dir_index.h"
 #include "util/error.h"
 
 /* Standard includes */
@@ -12,6 +13,7 @@
 #include <pthread.h>
 #include <strings.h>
 #include <string.h>
+#include <limits.h>
 
 /* Networking includes */
 
@@ -138,7 +140,24 @@ void ftp_pasv_handler(void *data)
     struct session_data *d = data;
     char ret_message[sizeof(MSG_PASSIVE_SUCCESS) + 29];
 
+    if(d->data_pending)
+    {
+        /* A PASV that was never used; its data thread gives up on it */
+        shutdown(d->data_sockfd, SHUT_RDWR);
+        pthread_mutex_lock(&d->transfer_mutex);
+        d->transfer = 'Q';
+        pthread_cond_signal(&d->transfer_cond);
+        pthread_mutex_unlock(&d->transfer_mutex);
+        pthread_join(d->data_thread, NULL);
+    }
+
+    /* Each PASV gets its own socket, so sessions never share a data port */
+    d->data_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(d->data_sockfd < 0)
+        error("ERROR opening data socket");
+
     d->data_sock.sin_port = 0;
+    d->transfer = 0;
 
     if (bind(d->data_sockfd, (struct sockaddr *)&d->data_sock, sizeof(d->data_sock)) < 0) 
         error("ERROR on PASV binding");
@@ -150,6 +169,7 @@ void ftp_pasv_handler(void *data)
         error("getsockname");
 
     pthread_create(&d->data_thread, NULL, ftp_data_listen, d);
+    d->data_pending = 1;
 
     snprintf(ret_message, sizeof(MSG_PASSIVE_SUCCESS) + 29, MSG_PASSIVE_SUCCESS " (%d,%d,%d,%d,%d,%d)\r\n", 192, 168, 1, 1, 255 & d->data_sock.sin_port, 255 & (d->data_sock.sin_port >> 8));
 
@@ -172,28 +192,108 @@ void ftp_empty_handler(void *data)
     write(d->client_sockfd, MSG_UNSUPPORTED, strlen(MSG_UNSUPPORTED));
 }
 
-void ftp_retr_handler(void *data)
+/* Passes the command to the data thread started by PASV and sends its reply
+ * once the transfer is over */
+static void ftp_run_transfer(struct session_data *d, char transfer)
 {
-    struct session_data *d = data;
     char *args = read_args(d->client_sockfd);
     char *tokeniser_saveptr;
 
+    if(!d->data_pending)
+    {
+        write(d->client_sockfd, MSG_NO_DATA_CONN, strlen(MSG_NO_DATA_CONN));
+        free(args);
+        return;
+    }
+
     d->filename = strtok_r(args, "\r\n ", &tokeniser_saveptr);
 
-    pthread_mutex_unlock(&d->retr_mutex);
+    /* LIST options such as -la; the listing format is fixed */
+    while(d->filename && d->filename[0] == '-')
+        d->filename = strtok_r(NULL, "\r\n ", &tokeniser_saveptr);
 
-    pthread_join(d->data_thread, NULL);
+    d->reply = MSG_TRANSFER_ABORTED;
 
-    struct sockaddr_in client_sock;
-    socklen_t len = sizeof(client_sock);
-    if (getsockname(d->client_sockfd, (struct sockaddr *)&client_sock, &len) == -1)
-        error("getsockname");
+    pthread_mutex_lock(&d->transfer_mutex);
+    d->transfer = transfer;
+    pthread_cond_signal(&d->transfer_cond);
+    pthread_mutex_unlock(&d->transfer_mutex);
 
-    printf("client_sock port: %d\n", ntohs(client_sock.sin_port));
+    pthread_join(d->data_thread, NULL);
+    d->data_pending = 0;
+    d->allocate = 0;
 
-    int bytes_written = write(d->client_sockfd, MSG_RETR_SUCCESS, strlen(MSG_RETR_SUCCESS));
+    int bytes_written = write(d->client_sockfd, d->reply, strlen(d->reply));
     if (bytes_written < 0)
         error("ERROR writing to socket");
 
     free(args);
 }
+
+void ftp_retr_handler(void *data)
+{
+    ftp_run_transfer(data, 'R');
+}
+
+void ftp_stor_handler(void *data)
+{
+    ftp_run_transfer(data, 'S');
+}
+
+void ftp_appe_handler(void *data)
+{
+    ftp_run_transfer(data, 'A');
+}
+
+void ftp_list_handler(void *data)
+{
+    ftp_run_transfer(data, 'L');
+}
+
+void ftp_nlst_handler(void *data)
+{
+    ftp_run_transfer(data, 'N');
+}
+
+void ftp_mlsd_handler(void *data)
+{
+    ftp_run_transfer(data, 'M');
+}
+
+/* Facts for a single file, sent on the control connection */
+void ftp_mlst_handler(void *data)
+{
+    struct session_data *d = data;
+    char *args = read_args(d->client_sockfd);
+    char *tokeniser_saveptr;
+    char facts[PATH_MAX + 128];
+
+    char *path = strtok_r(args, "\r\n ", &tokeniser_saveptr);
+
+    int len = ftp_dir_index_facts(path, facts, sizeof(facts));
+
+    if(len < 0)
+        write(d->client_sockfd, MSG_NO_SUCH_FILE, strlen(MSG_NO_SUCH_FILE));
+    else
+    {
+        char ret_message[sizeof(facts) + PATH_MAX + 32];
+
+        size_t message_size = snprintf(ret_message, sizeof(ret_message), MSG_MLST_START " %s\r\n %s" MSG_MLST_END, path ? path : ".", facts);
+
+        write(d->client_sockfd, ret_message, message_size);
+    }
+
+    free(args);
+}
+
+void ftp_allo_handler(void *data)
+{
+    struct session_data *d = data;
+    char *args = read_args(d->client_sockfd);
+
+    d->allocate = strtoull(args, NULL, 10);
+
+    write(d->client_sockfd, MSG_COMMAND_OK, strlen(MSG_COMMAND_OK));
+
+    free(args);
+}
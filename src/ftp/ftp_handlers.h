@@ -9,6 +9,13 @@ void ftp_pasv_handler(void*);
 void ftp_size_handler(void*);
 void ftp_type_handler(void*);
 void ftp_retr_handler(void*);
+void ftp_stor_handler(void*);
+void ftp_appe_handler(void*);
+void ftp_allo_handler(void*);
+void ftp_list_handler(void*);
+void ftp_nlst_handler(void*);
+void ftp_mlsd_handler(void*);
+void ftp_mlst_handler(void*);
 void ftp_quit_handler(void*);
 
 void ftp_empty_handler(void*);
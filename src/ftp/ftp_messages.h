@@ -8,8 +8,16 @@
 #define MSG_PASSIVE_SUCCESS "227 PASV ok"
 #define MSG_RETR_SUCCESS "226 operation successful\r\n"
 #define MSG_TELL_SIZE  "213"
+#define MSG_MLST_START "250-Listing"
+#define MSG_MLST_END "250 End\r\n"
 #define MSG_OPENING_BINARY_CONN "150 opening binary connection\r\n"
+#define MSG_OPENING_ASCII_CONN "150 opening ASCII connection for listing\r\n"
 #define MSG_QUIT_SUCCESS "221 quit successful\r\n"
 #define MSG_NO_SUCH_FILE "550 file not found\r\n"
+#define MSG_STOR_SUCCESS "226 transfer complete\r\n"
+#define MSG_NO_DATA_CONN "425 use PASV first\r\n"
+#define MSG_TRANSFER_ABORTED "451 transfer aborted\r\n"
+#define MSG_NO_SPACE "452 insufficient storage\r\n"
+#define MSG_BAD_FILENAME "553 file name not allowed\r\n"
 
 #endif
@@ -5,6 +5,8 @@
 #include "ftp/ftp_server.h"
 #include "ftp/ftp_handlers.h"
 #include "ftp/ftp_messages.h"
+#include "ftp/ftp_store.h"
+#include "ftp/ftp_dir_index.h"
 #include "data_structures/trie.h"
 
 /* Standard includes */
@@ -43,10 +45,10 @@ void create_ftp_command_trie(void)
 
     /* FTP service commands */
     insert_to_trie(&ftp_command_trie, "RETR", &ftp_retr_handler);
-    insert_to_trie(&ftp_command_trie, "STOR", &ftp_empty_handler);
+    insert_to_trie(&ftp_command_trie, "STOR", &ftp_stor_handler);
     insert_to_trie(&ftp_command_trie, "ATOU", &ftp_empty_handler);
-    insert_to_trie(&ftp_command_trie, "APPE", &ftp_empty_handler);
-    insert_to_trie(&ftp_command_trie, "ALLO", &ftp_empty_handler);
+    insert_to_trie(&ftp_command_trie, "APPE", &ftp_appe_handler);
+    insert_to_trie(&ftp_command_trie, "ALLO", &ftp_allo_handler);
     insert_to_trie(&ftp_command_trie, "REST", &ftp_empty_handler);
     insert_to_trie(&ftp_command_trie, "RNFR", &ftp_empty_handler);
     insert_to_trie(&ftp_command_trie, "RNTO", &ftp_empty_handler);
@@ -55,8 +57,8 @@ void create_ftp_command_trie(void)
     insert_to_trie(&ftp_command_trie, "RMD", &ftp_empty_handler);
     insert_to_trie(&ftp_command_trie, "MKD", &ftp_empty_handler);
     insert_to_trie(&ftp_command_trie, "PWD", &ftp_empty_handler);
-    insert_to_trie(&ftp_command_trie, "LIST", &ftp_empty_handler);
-    insert_to_trie(&ftp_command_trie, "NLST", &ftp_empty_handler);
+    insert_to_trie(&ftp_command_trie, "LIST", &ftp_list_handler);
+    insert_to_trie(&ftp_command_trie, "NLST", &ftp_nlst_handler);
     insert_to_trie(&ftp_command_trie, "SITE", &ftp_empty_handler);
     insert_to_trie(&ftp_command_trie, "SYST", &ftp_empty_handler);
     insert_to_trie(&ftp_command_trie, "STAT", &ftp_empty_handler);
@@ -66,8 +68,26 @@ void create_ftp_command_trie(void)
     /* FTP extensions */
     insert_to_trie(&ftp_command_trie, "SIZE", &ftp_size_handler);
     insert_to_trie(&ftp_command_trie, "MTDM", &ftp_empty_handler);
-    insert_to_trie(&ftp_command_trie, "MLST", &ftp_empty_handler);
-    insert_to_trie(&ftp_command_trie, "MLSD", &ftp_empty_handler);
+    insert_to_trie(&ftp_command_trie, "MLST", &ftp_mlst_handler);
+    insert_to_trie(&ftp_command_trie, "MLSD", &ftp_mlsd_handler);
+
+    ftp_store_init();
+    ftp_dir_index_init();
+}
+
+/* Paths given by clients stay under the directory the server runs in */
+uint8_t ftp_path_allowed(const char *path)
+{
+    if(!path || !*path || *path == '/')
+        return 0;
+
+    for(const char *p = path; (p = strstr(p, "..")); p += 2)
+    {
+        if((p == path || p[-1] == '/') && (!p[2] || p[2] == '/'))
+            return 0;
+    }
+
+    return 1;
 }
 
 void *ftp_listen(void *args)
@@ -76,11 +96,10 @@ void *ftp_listen(void *args)
     int listen_port = server_init->port;
 
     struct session_data td = {.type = 'A',
-        .retr_mutex = PTHREAD_MUTEX_INITIALIZER,
         .data_sock = {  .sin_family = AF_INET,
             .sin_addr = {.s_addr = INADDR_ANY},
             .sin_port = htons(20)},
-        .data_sockfd = socket(AF_INET, SOCK_STREAM, 0),
+        .data_sockfd = -1,
         .done = 0,
     };
 
@@ -115,6 +134,9 @@ void *ftp_listen(void *args)
         struct session_data *session_data = malloc(sizeof(struct session_data));
         *session_data = td;
 
+        pthread_mutex_init(&session_data->transfer_mutex, NULL);
+        pthread_cond_init(&session_data->transfer_cond, NULL);
+
         pthread_t session_thread;
         pthread_create(&session_thread, NULL, ftp_session, session_data);
     }
@@ -128,8 +150,6 @@ void *ftp_session(void *args)
     uint8_t cr = 0;
     char current_char;
 
-    pthread_mutex_lock(&session_data->retr_mutex);
-
     while(!session_data->done)
     {
         int8_t bytes_read = recv(session_data->client_sockfd, &current_char, 1, 0);
@@ -163,57 +183,91 @@ void *ftp_session(void *args)
         }
     }
 
+    if(session_data->data_pending)
+    {
+        /* Wakes a data thread still waiting for a connection or a command */
+        shutdown(session_data->data_sockfd, SHUT_RDWR);
+        pthread_mutex_lock(&session_data->transfer_mutex);
+        session_data->transfer = 'Q';
+        pthread_cond_signal(&session_data->transfer_cond);
+        pthread_mutex_unlock(&session_data->transfer_mutex);
+        pthread_join(session_data->data_thread, NULL);
+    }
+
+    pthread_mutex_destroy(&session_data->transfer_mutex);
+    pthread_cond_destroy(&session_data->transfer_cond);
     free(session_data);
 
     return NULL;
 }
 
-void *ftp_data_listen(void *args)
+static const char *ftp_send_file(struct session_data *d, int data_client_sockfd)
 {
-    struct session_data *d = (struct session_data*)args;
+    FILE *f = fopen(d->filename, "rb");
 
-    struct sockaddr_in cli_addr;
-    socklen_t clilen = sizeof(cli_addr);
+    if(!f)
+        return MSG_NO_SUCH_FILE;
 
-    int data_client_sockfd = accept(d->data_sockfd, (struct sockaddr *) &cli_addr, &clilen);
-    if(data_client_sockfd < 0)
-        error("ERROR on data accept");
+    fseek (f , 0 , SEEK_END);
+    size_t size = ftell (f);
+    rewind (f);
 
-    pthread_mutex_lock(&d->retr_mutex);
+    char *buffer = malloc(size);
 
-    FILE *f = fopen(d->filename, "rb");
+    fread(buffer, 1, size, f);
 
-    if(!f)
-    {
-        size_t message_size = strlen(MSG_NO_SUCH_FILE);
-        write(d->client_sockfd, MSG_NO_SUCH_FILE, message_size);
-    }
-    else
-    {
-        fseek (f , 0 , SEEK_END);
-        size_t size = ftell (f);
-        rewind (f);
+    fclose(f);
 
-        char *buffer = malloc(size);
+    int bytes_written = write(d->client_sockfd,MSG_OPENING_BINARY_CONN, strlen(MSG_OPENING_BINARY_CONN));
+    if (bytes_written < 0)
+        error("ERROR writing to socket");
 
-        fread(buffer, 1, size, f);
+    bytes_written = send(data_client_sockfd, buffer, size, 0);
+    if (bytes_written < 0)
+        error("ERROR writing to socket");
 
-        fclose(f);
+    free(buffer);
 
-        int bytes_written = write(d->client_sockfd,MSG_OPENING_BINARY_CONN, strlen(MSG_OPENING_BINARY_CONN));
-        if (bytes_written < 0)
-            error("ERROR writing to socket");
+    return MSG_RETR_SUCCESS;
+}
 
-        bytes_written = send(data_client_sockfd, buffer, size, 0);
-        if (bytes_written < 0)
-            error("ERROR writing to socket");
+/* One per PASV. Runs the transfer once both the data connection and the
+ * command that says what to do with it have arrived. */
+void *ftp_data_listen(void *args)
+{
+    struct session_data *d = (struct session_data*)args;
 
-        free(buffer);
-    }
+    struct sockaddr_in cli_addr;
+    socklen_t clilen = sizeof(cli_addr);
+
+    int data_client_sockfd = accept(d->data_sockfd, (struct sockaddr *) &cli_addr, &clilen);
+
+    pthread_mutex_lock(&d->transfer_mutex);
+
+    while(!d->transfer)
+        pthread_cond_wait(&d->transfer_cond, &d->transfer_mutex);
 
-    close(data_client_sockfd);
+    char transfer = d->transfer;
 
-    pthread_mutex_unlock(&d->retr_mutex);
+    pthread_mutex_unlock(&d->transfer_mutex);
+
+    if(data_client_sockfd < 0)
+        d->reply = MSG_NO_DATA_CONN;
+    else if(transfer == 'R')
+        d->reply = ftp_send_file(d, data_client_sockfd);
+    else if(transfer == 'S' || transfer == 'A')
+        d->reply = ftp_store(d, data_client_sockfd, transfer == 'A');
+    else if(transfer == 'L')
+        d->reply = ftp_dir_index_send(d, data_client_sockfd, FTP_LISTING_LIST);
+    else if(transfer == 'N')
+        d->reply = ftp_dir_index_send(d, data_client_sockfd, FTP_LISTING_NLST);
+    else if(transfer == 'M')
+        d->reply = ftp_dir_index_send(d, data_client_sockfd, FTP_LISTING_MLSD);
+
+    if(data_client_sockfd >= 0)
+        close(data_client_sockfd);
+
+    close(d->data_sockfd);
 
     return NULL;
 }
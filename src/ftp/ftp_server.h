@@ -10,6 +10,7 @@ void create_ftp_command_trie(void);
 void *ftp_listen(void*);
 void *ftp_session(void*);
 void *ftp_data_listen(void*);
+uint8_t ftp_path_allowed(const char *path);
 
 struct session_data
 {
@@ -27,7 +28,16 @@ struct session_data
     int data_client_sockfd;
     struct sockaddr_in data_sock;
     pthread_t data_thread;
-    pthread_mutex_t retr_mutex;
+    uint8_t data_pending;       /* PASV done, data thread not yet joined */
+
+    /* Hands the transfer command to the data thread, whichever of the
+     * command and the data connection comes first */
+    pthread_mutex_t transfer_mutex;
+    pthread_cond_t transfer_cond;
+    char transfer;              /* 'R'ETR, 'S'TOR, 'A'PPE, 'L'IST, 'N'LST or 'M'LSD; 0 until known */
+    const char *reply;          /* set by the data thread */
+
+    uint64_t allocate;          /* from ALLO, for the next STOR or APPE */
 };
 
 #endif
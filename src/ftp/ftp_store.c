@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "ftp/ftp_store.h"
+#include "ftp/ftp_messages.h"
+#include "util/config.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+static enum ftp_fsync_policy fsync_policy;
+static uint64_t fsync_bytes;
+
+static struct metric *stored_bytes;
+static struct metric *stores;
+static struct metric *store_failures;
+static struct metric *store_mbps;
+
+void ftp_store_init(void)
+{
+    char *policy = config_get_option("ftp:fsync");
+
+    if(!policy || !*policy || !strcmp(policy, "close"))
+        fsync_policy = FTP_FSYNC_CLOSE;
+    else if(!strcmp(policy, "none"))
+        fsync_policy = FTP_FSYNC_NONE;
+    else if(!strcmp(policy, "periodic"))
+        fsync_policy = FTP_FSYNC_PERIODIC;
+    else
+        error("ftp:fsync must be none, close or periodic");
+
+    int bytes = config_get_int("ftp:fsync_bytes", FTP_DEFAULT_FSYNC_BYTES);
+    if(bytes < 1)
+        error("ftp:fsync_bytes must be at least 1");
+
+    fsync_bytes = bytes;
+
+    stored_bytes = metrics_counter("ftp_stored_bytes");
+    stores = metrics_counter("ftp_stores");
+    store_failures = metrics_counter("ftp_store_failures");
+    store_mbps = metrics_gauge("ftp_store_mbps");
+}
+
+/* Makes a rename in the directory holding path survive a crash */
+static void ftp_sync_directory(const char *path)
+{
+    char dir[PATH_MAX] = ".";
+    const char *slash = strrchr(path, '/');
+
+    if(slash)
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if(fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Starts the temporary file with the current contents of the target. The copy
+ * stays in the kernel, like the upload itself. */
+static uint8_t ftp_copy_existing(int fd, const char *path)
+{
+    int existing = open(path, O_RDONLY);
+
+    if(existing < 0)
+        return errno == ENOENT;
+
+    struct stat st;
+    off_t offset = 0;
+
+    if(fstat(existing, &st) < 0)
+        st.st_size = -1;
+
+    while(offset < st.st_size)
+    {
+        if(sendfile(fd, existing, &offset, st.st_size - offset) <= 0)
+            break;
+    }
+
+    close(existing);
+
+    return offset == st.st_size;
+}
+
+const char *ftp_store(struct session_data *d, int sockfd, uint8_t append)
+{
+    const char *failure = NULL;
+    char tmp_path[PATH_MAX];
+    int pipefd[2];
+    uint64_t total = 0, synced = 0;
+    off_t base = 0;
+
+    if(!ftp_path_allowed(d->filename) || snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", d->filename) >= (int)sizeof(tmp_path))
+        return MSG_BAD_FILENAME;
+
+    int fd = mkstemp(tmp_path);
+    if(fd < 0)
+        return MSG_BAD_FILENAME;
+
+    fchmod(fd, 0644);
+
+    if(append && (!ftp_copy_existing(fd, d->filename) || (base = lseek(fd, 0, SEEK_CUR)) < 0))
+    {
+        close(fd);
+        unlink(tmp_path);
+        metrics_add(store_failures, 1);
+        return MSG_TRANSFER_ABORTED;
+    }
+
+    /* Filesystems without fallocate just get the space as it is written */
+    if(d->allocate && fallocate(fd, FALLOC_FL_KEEP_SIZE, base, d->allocate) < 0 && errno == ENOSPC)
+    {
+        close(fd);
+        unlink(tmp_path);
+        metrics_add(store_failures, 1);
+        return MSG_NO_SPACE;
+    }
+
+    if(pipe(pipefd) < 0)
+        error("Could not create upload pipe");
+
+    /* Failing leaves the default pipe size, which only means more calls */
+    fcntl(pipefd[1], F_SETPIPE_SZ, FTP_SPLICE_CHUNK);
+
+    int bytes_written = write(d->client_sockfd, MSG_OPENING_BINARY_CONN, strlen(MSG_OPENING_BINARY_CONN));
+    if (bytes_written < 0)
+        error("ERROR writing to socket");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while(!failure)
+    {
+        ssize_t in = splice(sockfd, NULL, pipefd[1], NULL, FTP_SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if(in == 0)
+            break;
+
+        if(in < 0)
+        {
+            if(errno != EINTR)
+                failure = MSG_TRANSFER_ABORTED;
+            continue;
+        }
+
+        while(in > 0)
+        {
+            ssize_t out = splice(pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+            if(out < 0 && errno == EINTR)
+                continue;
+
+            if(out <= 0)
+            {
+                failure = out < 0 && errno == ENOSPC ? MSG_NO_SPACE : MSG_TRANSFER_ABORTED;
+                break;
+            }
+
+            in -= out;
+            total += out;
+        }
+
+        /* Only starts writeback, so dirty pages stay bounded without waiting
+         * on the disk in the middle of the transfer */
+        if(fsync_policy == FTP_FSYNC_PERIODIC && total - synced >= fsync_bytes)
+        {
+            sync_file_range(fd, base + synced, total - synced, SYNC_FILE_RANGE_WRITE);
+            synced = total;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    /* Give back whatever ALLO reserved past the end */
+    if(d->allocate && !failure && ftruncate(fd, base + total) < 0)
+        failure = MSG_TRANSFER_ABORTED;
+
+    if(fsync_policy != FTP_FSYNC_NONE && !failure && fsync(fd) < 0)
+        failure = MSG_TRANSFER_ABORTED;
+
+    close(fd);
+
+    if(!failure && rename(tmp_path, d->filename) < 0)
+        failure = MSG_TRANSFER_ABORTED;
+
+    if(failure)
+    {
+        unlink(tmp_path);
+        metrics_add(store_failures, 1);
+        printf("%s %s failed after %" PRIu64 " bytes\n", append ? "APPE" : "STOR", d->filename, total);
+        return failure;
+    }
+
+    if(fsync_policy != FTP_FSYNC_NONE)
+        ftp_sync_directory(d->filename);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double mbps = seconds > 0 ? total * 8 / 1e6 / seconds : 0;
+
+    printf("%s %s: %" PRIu64 " bytes in %.3f s (%.1f Mbit/s)\n", append ? "APPE" : "STOR", d->filename, total, seconds, mbps);
+
+    metrics_add(stored_bytes, total);
+    metrics_add(stores, 1);
+    metrics_set(store_mbps, mbps);
+
+    return MSG_STOR_SUCCESS;
+}
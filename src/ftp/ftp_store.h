@@ -0,0 +1,30 @@
+#ifndef FTP_STORE_H
+#define FTP_STORE_H
+
+#include "ftp_server.h"
+
+/* Bytes moved per splice() call, and the size asked for the pipe between the
+ * socket and the file */
+#define FTP_SPLICE_CHUNK (1 << 20)
+
+/* With ftp:fsync = periodic, writeback is started every this many bytes.
+ * Can be overridden with ftp:fsync_bytes in the configuration file. */
+#define FTP_DEFAULT_FSYNC_BYTES (4 << 20)
+
+enum ftp_fsync_policy
+{
+    FTP_FSYNC_NONE,         /* leave it to the page cache */
+    FTP_FSYNC_CLOSE,        /* fsync the file before the rename and the directory after */
+    FTP_FSYNC_PERIODIC      /* as close, but also start writeback as data comes in */
+};
+
+/* Reads ftp:fsync (none, close or periodic; close by default) */
+void ftp_store_init(void);
+
+/* Receives d->filename from sockfd until the client closes it. The data goes
+ * to a temporary file next to the target, which is renamed over the target
+ * once complete, so readers only ever see a whole file. Returns the reply
+ * for the control connection. */
+const char *ftp_store(struct session_data *d, int sockfd, uint8_t append);
+
+#endif
@@ -3,16 +3,34 @@
 #include "util/server_init.h"
 #include "util/error.h"
 #include "util/config.h"
+#include "util/metrics.h"
 #include "ftp/ftp_server.h"
 #include "video/video_server.h"
 #include "video/vrep_video.h"
 #include "video/webcam_video.h"
+#include "video/file_video.h"
+#include "video/encoder_calibration.h"
 #include "control/control_server.h"
 #include "control/vrep_control.h"
+#include "control/vrep_attitude.h"
 #include "navdata/navdata_server.h"
 #include "navdata/vrep_navdata.h"
 #include "control/print_control.h"
+#include "control/null_control.h"
+#include "control/sim_control.h"
+#include "navdata/sim_navdata.h"
+#include "sim/sim_backend.h"
 #include "controlcomm/controlcomm_server.h"
+#include "qos/qos_governor.h"
+#include "util/vrep_link.h"
+#include "util/vrep_swarm.h"
+#include "util/vrep_plugin.h"
+#include "video/plugin_video.h"
+#include "navdata/plugin_navdata.h"
+#include "control/plugin_control.h"
+#include "util/event_recorder.h"
+#include "util/server_clock.h"
+#include "util/numa_place.h"
 
 /* V-rep includes */
 #include "libs/vrep/extApi.h"
@@ -23,6 +41,18 @@
 #include <stdio.h>
 #include <unistd.h>
 
+extern uint8_t pace_video;
+extern uint8_t compute_flow;
+extern uint8_t run_governor;
+extern int ingest_shards;
+extern uint8_t ingest_steer_cpu;
+extern uint8_t record_events;
+extern uint8_t monitor_quality;
+extern uint8_t serve_clock;
+extern uint8_t embed_pose;
+extern int numa_place_node;
+extern uint8_t native_attitude;
+
 static void usage(char *pname)
 {
     printf("Usage: %s [options]\n"\
@@ -30,28 +60,53 @@ static void usage(char *pname)
             "\t-h\t\tPrint this help text.\n"\
             "\t-v\t\tGet video stream from v-rep (requires v-rep to be running).\n"\
             "\t-w <filename>\tGet video stream from camera specified by filename. If no filename specified, defaults to /dev/video0.\n"\
-            "\t-c {vrep|print}\tUse the specified method to deal with control commands.\n"\
-            "\t-n {vrep}\tUse the specified source of navigation data. Right now, only v-rep is supported.\n",
+            "\t-f <filename>\tDecode a video file once and stream it in a loop at its frame rate.\n"\
+            "\t-c {vrep|sim|print|null}\tUse the specified method to deal with control commands.\n"\
+            "\t-n {vrep|sim}\tUse the specified source of navigation data.\n"\
+            "\t-P\t\tPace video transmission so each frame is spread over the frame interval.\n"\
+            "\t-m\t\tPeriodically write server counters to the metrics file.\n"\
+            "\t-o\t\tCompute optical flow on the video stream and add it to navdata.\n"\
+            "\t-C <filename>\tPick the encoder preset and thread count that fit the frame budget and save them to the configuration. Uses a synthetic clip unless a recorded one is given.\n"\
+            "\t-G\t\tRun the QoS governor, which degrades video to protect control and navdata deadlines and refuses clients when the host is full.\n"\
+            "\t-R <shards>\tReceive control and navdata on this many SO_REUSEPORT sockets, each with its own thread.\n"\
+            "\t-B\t\tSteer each shard's datagrams by receiving CPU and pin shard threads to CPUs.\n"\
+            "\t-E\t\tKeep the last seconds of video and navdata in memory and write them out on a crash, AT*DUMP or metric threshold.\n"\
+            "\t-Q\t\tDecode a sample of the encoded frames in the background and report PSNR and SSIM as metrics.\n"\
+            "\t-T\t\tAnswer clock sync requests and add server time to navdata, so clients can measure one-way latency.\n"\
+            "\t-S <drones>\tBuild a swarm of this many drones in V-REP at start up.\n"\
+            "\t-M\t\tPut the navdata pose at capture into every video frame as an H.264 SEI message.\n"\
+            "\t-N <node|auto>\tRun the drone on one NUMA node's CPUs and memory, with its frame pools in huge pages.\n"\
+            "\t-A\t\tFly the V-REP drone with the server's attitude controller, once per simulation step, instead of its script's (needs -c vrep).\n",
             pname);
 }
 
+/* Inside V-REP the plugin calls this, on its own thread */
+#ifdef VREP_PLUGIN
+int server_main(int argc, char **argv)
+#else
 int main(int argc, char **argv)
+#endif
 {
     config_read_options();
 
-    struct data_options data_options;
+    struct data_options data_options = { 0 };
 
     uint8_t video_specified = 0;
     uint8_t navdata_specified = 0;
     uint8_t control_specified = 0;
+    uint8_t metrics_enabled = 0;
+    uint8_t calibrate = 0;
+    char *calibration_clip = NULL;
     uint8_t vrep_init = 0;
+    uint8_t sim_init = 0;
+    uint8_t vrep_control_specified = 0;
+    int swarm_size = 0;
     uint32_t vrep_port = 20000;
     char vrep_ip[16] = "127.0.0.1";
-    simxInt vrep_client_id;
 
     int c;
 
-    while ((c = getopt (argc, argv, "n:c:vw::hp:i:")) != -1)
+    while ((c = getopt (argc, argv, "n:c:vw::f:hp:i:PmoC::GR:BEQTS:MN:A")) != -1)
     {
         switch (c)
         {
@@ -68,22 +123,74 @@ int main(int argc, char **argv)
                     error("Can only have one video source");
                 }
 
-                if(!vrep_init)
+                if(vrep_plugin_active())
+                    plugin_video_init(&data_options);
+                else
                 {
-                    vrep_client_id = simxStart(vrep_ip, vrep_port, 1, 1, 2000, 5);
-                    if(vrep_client_id == -1)
-                        error("Could not connect to vrep");
+                    if(!vrep_init)
+                    {
+                        vrep_link_connect(vrep_ip, vrep_port);
+                        vrep_init = 1;
+                    }
 
-                    vrep_init = 1;
+                    vrep_video_init(&data_options);
                 }
 
-                vrep_video_init(&data_options, vrep_client_id);
-
                 video_specified = 1;
                 break;
             case 'h':
                 usage(argv[0]);
                 return 0;
+            case 'P':
+                pace_video = 1;
+                break;
+            case 'm':
+                metrics_enabled = 1;
+                break;
+            case 'o':
+                compute_flow = 1;
+                break;
+            case 'C':
+                calibrate = 1;
+                calibration_clip = optarg;
+                break;
+            case 'G':
+                run_governor = 1;
+                break;
+            case 'R':
+                ingest_shards = atoi(optarg);
+                if(ingest_shards < 1)
+                    error("Need at least one shard");
+                break;
+            case 'B':
+                ingest_steer_cpu = 1;
+                break;
+            case 'E':
+                record_events = 1;
+                break;
+            case 'Q':
+                monitor_quality = 1;
+                break;
+            case 'T':
+                serve_clock = 1;
+                break;
+            case 'M':
+                embed_pose = 1;
+                break;
+            case 'A':
+                native_attitude = 1;
+                break;
+            case 'N':
+                if(!strcmp(optarg, "auto"))
+                    numa_place_node = NUMA_PLACE_AUTO;
+                else if((numa_place_node = atoi(optarg)) < 0)
+                    error("Need a NUMA node number or auto");
+                break;
+            case 'S':
+                swarm_size = atoi(optarg);
+                if(swarm_size < 1)
+                    error("Need at least one drone");
+                break;
             case 'n':
                 if(navdata_specified)
                 {
@@ -91,9 +198,26 @@ int main(int argc, char **argv)
                     error("Can only have one navdata source");
                 }
 
-                if(!strcmp(optarg, "vrep"))
+                if(!strcmp(optarg, "vrep") && vrep_plugin_active())
                 {
-                    vrep_navdata_init(&data_options, vrep_client_id);
+                    plugin_navdata_init(&data_options);
+                    navdata_specified = 1;
+                }
+                else if(!strcmp(optarg, "vrep"))
+                {
+                    if(!vrep_init)
+                    {
+                        vrep_link_connect(vrep_ip, vrep_port);
+                        vrep_init = 1;
+                    }
+
+                    vrep_navdata_init(&data_options);
+                    navdata_specified = 1;
+                }
+                else if(!strcmp(optarg, "sim"))
+                {
+                    sim_navdata_init(&data_options);
+                    sim_init = 1;
                     navdata_specified = 1;
                 }
 
@@ -107,6 +231,17 @@ int main(int argc, char **argv)
 
                 webcam_video_init(&data_options, optarg);
 
+                video_specified = 1;
+                break;
+            case 'f':
+                if(video_specified)
+                {
+                    usage(argv[0]);
+                    error("Can only have one video source");
+                }
+
+                file_video_init(&data_options, optarg);
+
                 video_specified = 1;
                 break;
             case 'c':
@@ -116,19 +251,28 @@ int main(int argc, char **argv)
                     error("Can only have one control send");
                 }
 
-                if(!strcmp(optarg, "vrep"))
+                if(!strcmp(optarg, "vrep") && vrep_plugin_active())
+                {
+                    plugin_control_init(&data_options);
+                    control_specified = 1;
+                }
+                else if(!strcmp(optarg, "vrep"))
                 {
                     if(!vrep_init)
                     {
-                        vrep_client_id = simxStart(vrep_ip, vrep_port, 1, 1, 2000, 5);
-                        if(vrep_client_id == -1)
-                            error("Could not connect to vrep");
-
+                        vrep_link_connect(vrep_ip, vrep_port);
                         vrep_init = 1;
                     }
 
-                    vrep_control_init(&data_options, vrep_client_id);
+                    vrep_control_init(&data_options);
 
+                    vrep_control_specified = 1;
+                    control_specified = 1;
+                }
+                else if(!strcmp(optarg, "sim"))
+                {
+                    sim_control_init(&data_options);
+                    sim_init = 1;
                     control_specified = 1;
                 }
                 else if(!strcmp(optarg, "print"))
@@ -136,6 +280,11 @@ int main(int argc, char **argv)
                     print_control_init(&data_options);
                     control_specified = 1;
                 }
+                else if(!strcmp(optarg, "null"))
+                {
+                    null_control_init(&data_options);
+                    control_specified = 1;
+                }
 
                 break;
             case '?':
@@ -148,11 +297,77 @@ int main(int argc, char **argv)
         }
     }
 
+    if(native_attitude)
+    {
+        if(!vrep_control_specified)
+            error("The attitude controller flies V-REP over the remote API, so needs -c vrep outside the plugin");
+
+        vrep_attitude_init(&data_options);
+    }
+
+    if(numa_place_node != NUMA_PLACE_OFF)
+    {
+        if(vrep_plugin_active())
+            error("Place V-REP itself to place the plugin, for example with numactl");
+
+        numa_place_init();
+    }
+
+    if(swarm_size)
+    {
+        if(vrep_plugin_active())
+            error("Swarms are built over the remote API, not from the plugin");
+
+        if(!vrep_init)
+        {
+            vrep_link_connect(vrep_ip, vrep_port);
+            vrep_init = 1;
+        }
+
+        vrep_swarm_spawn(swarm_size);
+    }
+
+    if(calibrate)
+        encoder_calibrate(calibration_clip);
+
     pthread_t ftp_thread;
     pthread_t video_thread;
     pthread_t control_thread;
     pthread_t controlcomm_thread;
     pthread_t navdata_thread;
+    pthread_t metrics_thread;
+    pthread_t governor_thread;
+    pthread_t vrep_thread;
+    pthread_t event_thread;
+    pthread_t clocksync_thread;
+    pthread_t sim_thread;
+    pthread_t attitude_thread;
+
+    if(metrics_enabled)
+        pthread_create(&metrics_thread, NULL, metrics_listen, NULL);
+
+    if(vrep_init)
+        pthread_create(&vrep_thread, NULL, vrep_link_supervise, NULL);
+
+    if(sim_init)
+        pthread_create(&sim_thread, NULL, sim_backend_run, NULL);
+
+    if(native_attitude)
+        pthread_create(&attitude_thread, NULL, vrep_attitude_run, NULL);
+
+    if(record_events)
+    {
+        event_recorder_init();
+        pthread_create(&event_thread, NULL, event_recorder_listen, NULL);
+    }
+
+    if(run_governor)
+    {
+        if(!qos_admit())
+            error("Host is over capacity, refusing to start another drone");
+
+        pthread_create(&governor_thread, NULL, qos_governor_listen, NULL);
+    }
 
     struct server_init ftp_server_init = {
         .port = FTP_LISTEN_PORT,
@@ -169,6 +384,14 @@ int main(int argc, char **argv)
 
     pthread_create(&controlcomm_thread, NULL, controlcomm_listen, (void*)&controlcomm_server_init);
 
+    struct server_init clocksync_server_init = {
+        .port = CLOCKSYNC_PORT,
+        .d = &data_options,
+    };
+
+    if(serve_clock)
+        pthread_create(&clocksync_thread, NULL, clocksync_listen, (void*)&clocksync_server_init);
+
     if(video_specified)
     {
         struct server_init video_server_init = {
@@ -208,4 +431,6 @@ int main(int argc, char **argv)
         pthread_join(video_thread, NULL);
     pthread_join(controlcomm_thread, NULL);
     pthread_join(ftp_thread, NULL);
+
+    return 0;
 }
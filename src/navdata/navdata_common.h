@@ -622,6 +622,15 @@ typedef struct _navdata_vision_raw_t {
 }_ATTRIBUTE_PACKED_ navdata_vision_raw_t;
 
 
+typedef struct _navdata_vision_of_t {
+  uint16_t   tag;
+  uint16_t   size;
+
+  uint32_t   of_dx[5]; /* floating point value */
+  uint32_t   of_dy[5]; /* floating point value */
+}_ATTRIBUTE_PACKED_ navdata_vision_of_t;
+
+
 typedef struct _navdata_vision_t {
   uint16_t   tag;
   uint16_t   size;
@@ -1,9 +1,17 @@
+#define _GNU_SOURCE
+
 /* user includes */
 #include "util/port_numbers.h"
 #include "util/error.h"
 #include "util/server_init.h"
 #include "navdata/navdata_server.h"
 #include "navdata/navdata_common.h"
+#include "util/flood_guard.h"
+#include "video/optical_flow.h"
+#include "qos/qos_governor.h"
+#include "util/reuseport.h"
+#include "util/event_recorder.h"
+#include "util/server_clock.h"
 
 /* Standard includes */
 #include <string.h>
@@ -11,56 +19,124 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 /* Networking includes */
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-void *navdata_listen(void *args)
+extern uint8_t compute_flow;
+extern int ingest_shards;
+extern uint8_t ingest_steer_cpu;
+extern uint8_t record_events;
+extern uint8_t serve_clock;
+
+/* Requests fetched per recvmmsg() call */
+#define NAVDATA_BATCH 8
+
+/* Receives a batch of navdata requests and points client_addr at the last one
+ * the flood guard lets through. If sequence is given, it is restarted from the
+ * request payload. Returns the number admitted. */
+static int navdata_receive_requests(int sockfd, int flags, struct flood_guard *guard, struct sockaddr_in *client_addr, uint32_t *sequence)
 {
-    struct server_init *server_init = (struct server_init*)args;
-    int listen_port = server_init->port;
+    uint32_t requests[NAVDATA_BATCH];
+    struct mmsghdr msgs[NAVDATA_BATCH];
+    struct iovec iovecs[NAVDATA_BATCH];
+    struct sockaddr_in sources[NAVDATA_BATCH];
 
-    struct sockaddr_in serv_addr;
+    for(int i = 0; i < NAVDATA_BATCH; ++i)
+    {
+        iovecs[i].iov_base = &requests[i];
+        iovecs[i].iov_len = sizeof(requests[i]);
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_name = &sources[i],
+            .msg_namelen = sizeof(sources[i]),
+            .msg_iov = &iovecs[i],
+            .msg_iovlen = 1,
+        };
+    }
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int received = recvmmsg(sockfd, msgs, NAVDATA_BATCH, flags, NULL);
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(listen_port);
+    if(received < 1)
+        return 0;
 
-    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) 
-        error("ERROR on binding");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    listen(sockfd, 5);
+    int admitted = 0;
+
+    for(int i = 0; i < received; ++i)
+    {
+        if(!msgs[i].msg_len || !flood_guard_admit(guard, &sources[i], FLOOD_CLASS_NAVDATA, &now))
+            continue;
+
+        *client_addr = sources[i];
+
+        if(sequence && msgs[i].msg_len >= sizeof(uint32_t))
+            *sequence = requests[i];
+
+        ++admitted;
+    }
+
+    return admitted;
+}
+
+/* One receive socket and thread in the navdata port's SO_REUSEPORT group. Each
+ * shard streams to the last client whose requests the kernel steered to it. */
+struct navdata_shard
+{
+    int index;
+    int sockfd;
+    struct data_options *d;
+    struct flood_guard guard;
+    struct qos_deadline *deadline;
+};
+
+static void *navdata_shard_listen(void *args)
+{
+    struct navdata_shard *shard = args;
+    int sockfd = shard->sockfd;
 
-    int8_t bytes_read;
-    
     uint32_t sequence = 0;
     
     struct sockaddr_in client_addr;
     socklen_t client_length = sizeof(struct sockaddr_in);
-    
+
     int navdata_size = sizeof(navdata_t) + sizeof(navdata_demo_t) + sizeof(navdata_cks_t) - sizeof(navdata_option_t);
+
+    if(serve_clock)
+        navdata_size += sizeof(navdata_time_t);
+
+    if(compute_flow)
+        navdata_size += sizeof(navdata_vision_t) + sizeof(navdata_vision_of_t);
+
     navdata_t *navdata = calloc(navdata_size, 1);
     
-    do {
-        bytes_read = recvfrom(sockfd, &sequence, sizeof(sequence), 0, (struct sockaddr*)&client_addr, &client_length);
+    if(ingest_steer_cpu)
+        reuseport_pin_thread(shard->index);
 
-        if(bytes_read < 1)
-            error("ERROR reading from socket");
-    } while(!bytes_read);
+    while(!navdata_receive_requests(sockfd, MSG_WAITFORONE, &shard->guard, &client_addr, &sequence));
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
 
     while(1)
     {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /* Pick up any new requests without blocking the stream. */
+        navdata_receive_requests(sockfd, MSG_DONTWAIT, &shard->guard, &client_addr, NULL);
+
         navdata->header = NAVDATA_HEADER;
         navdata->ardrone_state = ARDRONE_NAVDATA_DEMO_MASK;
         navdata->sequence = sequence++;
-        navdata->vision_defined = 0;
+        navdata->vision_defined = compute_flow;
         
         navdata_demo_t *demo = (navdata_demo_t*)(&navdata->options[0]);
-        server_init->d->fill_navdata_demo(demo);
+        shard->d->fill_navdata_demo(demo);
 
 /*        demo->tag = NAVDATA_DEMO_TAG;
         demo->ctrl_state = 0;
@@ -78,10 +154,34 @@ void *navdata_listen(void *args)
         
         demo->size = sizeof(navdata_demo_t);*/
         
-        navdata_cks_t *cks = (navdata_cks_t*)(demo + 1);
+        uint8_t *option = (uint8_t*)(demo + 1);
+
+        /* Stamped as late as possible, just before the checksum and send */
+        navdata_time_t *time_option = NULL;
+
+        if(serve_clock)
+        {
+            time_option = (navdata_time_t*)option;
+            time_option->tag = NAVDATA_TIME_TAG;
+            time_option->size = sizeof(navdata_time_t);
+            option = (uint8_t*)(time_option + 1);
+        }
+
+        if(compute_flow)
+        {
+            navdata_vision_t *vision = (navdata_vision_t*)option;
+            navdata_vision_of_t *vision_of = (navdata_vision_of_t*)(vision + 1);
+            optical_flow_fill_navdata(vision, vision_of, *(float*)&demo->altitude);
+            option = (uint8_t*)(vision_of + 1);
+        }
+
+        navdata_cks_t *cks = (navdata_cks_t*)option;
         cks->tag = NAVDATA_CKS_TAG;
         cks->size = sizeof(navdata_cks_t);
         
+        if(time_option)
+            time_option->time = server_clock_navdata_time(server_clock_us());
+
         uint32_t i = 0;
         uint32_t checksum = 0;
         
@@ -90,10 +190,74 @@ void *navdata_listen(void *args)
         
         cks->cks = checksum;
 
+        if(record_events)
+            event_record_navdata(navdata, navdata_size, demo);
+
         sendto(sockfd, navdata, navdata_size, 0, (struct sockaddr*)&client_addr, client_length);
+
+        qos_deadline_check(shard->deadline, &start);
+
+        /* Backends no longer block on the simulator, so pace the stream. If a
+         * packet ran long, start again from now rather than bursting. */
+        next.tv_nsec += 1000000000L / NAVDATA_DEMO_RATE;
+        if(next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            ++next.tv_sec;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if(next.tv_sec < now.tv_sec || (next.tv_sec == now.tv_sec && next.tv_nsec < now.tv_nsec))
+            next = now;
+        else
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
     }
     
     free(navdata);
 
     return NULL;
 }
+
+void *navdata_listen(void *args)
+{
+    struct server_init *server_init = (struct server_init*)args;
+    int listen_port = server_init->port;
+    int shards = ingest_shards > 1 ? ingest_shards : 1;
+
+    struct navdata_shard *shard_data = calloc(shards, sizeof(struct navdata_shard));
+    pthread_t *threads = calloc(shards, sizeof(pthread_t));
+
+    if(!shard_data || !threads)
+        error("Could not allocate navdata shards");
+
+    /* One demo mode packet period (15 Hz) */
+    struct qos_deadline *deadline = qos_deadline_register("navdata", 1000.0 / 15, 1);
+
+    /* Bind in shard order so socket i in the reuseport group is shard i */
+    for(int i = 0; i < shards; ++i)
+    {
+        shard_data[i].index = i;
+        shard_data[i].d = server_init->d;
+        shard_data[i].deadline = deadline;
+        shard_data[i].sockfd = reuseport_bind_udp(listen_port, shards > 1);
+        flood_guard_init(&shard_data[i].guard);
+    }
+
+    if(shards > 1 && ingest_steer_cpu)
+        reuseport_steer_by_cpu(shard_data[0].sockfd, shards);
+
+    for(int i = 1; i < shards; ++i)
+        pthread_create(&threads[i], NULL, navdata_shard_listen, &shard_data[i]);
+
+    navdata_shard_listen(&shard_data[0]);
+
+    for(int i = 1; i < shards; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(shard_data);
+
+    return NULL;
+}
@@ -6,6 +6,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+/* Packets per second in demo mode, as sent by the drone */
+#define NAVDATA_DEMO_RATE 15
+
 void *navdata_listen(void*);
 
 #endif
@@ -0,0 +1,34 @@
+#include "navdata/plugin_navdata.h"
+#include "navdata/vrep_navdata.h"
+#include "util/vrep_plugin.h"
+
+#include <string.h>
+
+void plugin_navdata_init(struct data_options *d)
+{
+    d->fill_navdata_demo = plugin_fill_navdata_demo;
+}
+
+/* The simulation thread copies the pose out every step, so this never waits
+ * on V-REP. Before the first step the drone is level at the origin. */
+void plugin_fill_navdata_demo(navdata_demo_t *demo)
+{
+    float pose[VREP_NAVDATA_POSE_FLOATS], velocity[VREP_NAVDATA_VELOCITY_FLOATS];
+
+    if(!vrep_plugin_read_pose(pose, velocity))
+    {
+        memset(pose, 0, sizeof(pose));
+        memset(velocity, 0, sizeof(velocity));
+        pose[6] = 1.0f;
+    }
+
+    demo->tag = NAVDATA_DEMO_TAG;
+    demo->ctrl_state = 0;
+    demo->vbat_flying_percentage = 0xFFFFFFFF;
+
+    vrep_navdata_convert(pose, velocity, demo);
+
+    demo->num_frames = 0;
+
+    demo->size = sizeof(navdata_demo_t);
+}
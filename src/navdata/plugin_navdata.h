@@ -0,0 +1,13 @@
+#ifndef PLUGIN_NAVDATA_H
+#define PLUGIN_NAVDATA_H
+
+#include "navdata/navdata_common.h"
+#include "util/data_options.h"
+
+/* Ground truth from the simulation's last step when the server runs as a
+ * V-REP plugin, in the same units as vrep_navdata */
+void plugin_navdata_init(struct data_options *d);
+
+void plugin_fill_navdata_demo(navdata_demo_t *demo);
+
+#endif
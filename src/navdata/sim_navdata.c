@@ -0,0 +1,60 @@
+#include "navdata/navdata_common.h"
+#include "navdata/sim_navdata.h"
+#include "sim/sim_backend.h"
+
+#include <math.h>
+
+/* Major control states of the AR.Drone, sent in the top half of ctrl_state */
+#define CTRL_LANDED 2
+#define CTRL_HOVERING 4
+#define CTRL_TRANS_TAKEOFF 6
+#define CTRL_TRANS_LANDING 8
+
+static const uint32_t ctrl_states[] = {
+    [SIM_LANDED] = CTRL_LANDED,
+    [SIM_TAKING_OFF] = CTRL_TRANS_TAKEOFF,
+    [SIM_FLYING] = CTRL_HOVERING,
+    [SIM_LANDING] = CTRL_TRANS_LANDING,
+};
+
+#define MILLIDEGREES (180000.0f / (float)M_PI)
+
+void sim_navdata_init(struct data_options *d)
+{
+    d->fill_navdata_demo = sim_fill_navdata_demo;
+
+    sim_backend_init();
+}
+
+/* Reports what the drone's own sensors would: attitude in millidegrees
+ * (theta positive nose up), altitude in metres as optical flow expects, and
+ * velocity in mm/s in the body frame */
+void sim_fill_navdata_demo(navdata_demo_t *demo)
+{
+    pthread_mutex_lock(&sim_mutex);
+
+    const struct sim_state *s = sim_backend_state();
+    struct sim_sensors sensed = s->sensed;
+    enum sim_mode mode = s->mode;
+
+    pthread_mutex_unlock(&sim_mutex);
+
+    float cy = cosf(sensed.angle[2]), sy = sinf(sensed.angle[2]);
+
+    demo->tag = NAVDATA_DEMO_TAG;
+    demo->ctrl_state = ctrl_states[mode] << 16;
+    demo->vbat_flying_percentage = 100;
+
+    *(float*)&demo->theta = -sensed.angle[1] * MILLIDEGREES;
+    *(float*)&demo->phi = sensed.angle[0] * MILLIDEGREES;
+    *(float*)&demo->psi = sensed.angle[2] * MILLIDEGREES;
+    *(float*)&demo->altitude = sensed.altitude;
+
+    *(float*)&demo->vx = (cy * sensed.vel[0] + sy * sensed.vel[1]) * 1000.0f;
+    *(float*)&demo->vy = (-sy * sensed.vel[0] + cy * sensed.vel[1]) * 1000.0f;
+    *(float*)&demo->vz = sensed.vel[2] * 1000.0f;
+
+    demo->num_frames = 0;
+
+    demo->size = sizeof(navdata_demo_t);
+}
@@ -0,0 +1,11 @@
+#ifndef SIM_NAVDATA_H
+#define SIM_NAVDATA_H
+
+#include "navdata/navdata_common.h"
+#include "util/data_options.h"
+
+void sim_navdata_init(struct data_options *d);
+
+void sim_fill_navdata_demo(navdata_demo_t *demo);
+
+#endif
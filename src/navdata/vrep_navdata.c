@@ -1,29 +1,127 @@
 #include "navdata/navdata_common.h"
 #include "navdata/vrep_navdata.h"
+#include "util/vrep_link.h"
+#include "util/config.h"
+
+#include <math.h>
+#include <string.h>
 
-static simxInt client_id;
 extern pthread_mutex_t vrep_mutex;
 
-void vrep_navdata_init(struct data_options *d, simxInt id)
+#define MILLIDEGREES (180000.0f / (float)M_PI)
+
+/* The drone body, looked up by name rather than published by its script */
+static simxInt *body_handle;
+
+/* Last pose and velocity V-REP streamed, which are sent on while it is away */
+static float pose[VREP_NAVDATA_POSE_FLOATS];
+static float velocity[VREP_NAVDATA_VELOCITY_FLOATS];
+
+/* Both group queries are streamed every tick and ride the same reply, however
+ * many fields navdata uses */
+static void vrep_navdata_subscribe(simxInt client_id, void *arg)
+{
+    simxInt count, *handles, float_count;
+    simxFloat *floats;
+
+    simxGetObjectGroupData(client_id, sim_object_shape_type, VREP_NAVDATA_POSE, &count, &handles, NULL, NULL, &float_count, &floats, NULL, NULL, simx_opmode_streaming);
+    simxGetObjectGroupData(client_id, sim_object_shape_type, VREP_NAVDATA_VELOCITY, &count, &handles, NULL, NULL, &float_count, &floats, NULL, NULL, simx_opmode_streaming);
+}
+
+uint8_t vrep_navdata_group_read(simxInt client_id, simxInt data_type, int stride, int num_bodies, const simxInt *bodies, float *out)
+{
+    simxInt count, *handles, float_count;
+    simxFloat *floats;
+    uint8_t found = 0;
+
+    if(simxGetObjectGroupData(client_id, sim_object_shape_type, data_type, &count, &handles, NULL, NULL, &float_count, &floats, NULL, NULL, simx_opmode_buffer) != simx_error_noerror)
+        return 0;
+
+    /* Every shape in the scene is in the reply, in the same order as the
+     * handles */
+    for(int i = 0; i < count && (i + 1) * stride <= float_count; ++i)
+    {
+        for(int b = 0; b < num_bodies; ++b)
+        {
+            if(handles[i] != bodies[b])
+                continue;
+
+            memcpy(out + b * stride, floats + i * stride, stride * sizeof(float));
+            ++found;
+        }
+    }
+
+    return found == num_bodies;
+}
+
+void vrep_navdata_convert(const float *pose, const float *velocity, navdata_demo_t *demo)
 {
-    client_id = id;
+    float qx = pose[3], qy = pose[4], qz = pose[5], qw = pose[6];
+
+    /* Roll, pitch and yaw (about x, y and z of the world frame, in that
+     * order) from the body's quaternion */
+    float roll = atan2f(2.0f * (qw * qx + qy * qz), 1.0f - 2.0f * (qx * qx + qy * qy));
+    float pitch = asinf(fmaxf(-1.0f, fminf(1.0f, 2.0f * (qw * qy - qz * qx))));
+    float yaw = atan2f(2.0f * (qw * qz + qx * qy), 1.0f - 2.0f * (qy * qy + qz * qz));
+
+    float cy = cosf(yaw), sy = sinf(yaw);
+
+    *(float*)&demo->theta = -pitch * MILLIDEGREES;
+    *(float*)&demo->phi = roll * MILLIDEGREES;
+    *(float*)&demo->psi = yaw * MILLIDEGREES;
+    *(float*)&demo->altitude = pose[2];
+
+    *(float*)&demo->vx = (cy * velocity[0] + sy * velocity[1]) * 1000.0f;
+    *(float*)&demo->vy = (-sy * velocity[0] + cy * velocity[1]) * 1000.0f;
+    *(float*)&demo->vz = velocity[2] * 1000.0f;
+}
+
+void vrep_navdata_init(struct data_options *d)
+{
+    char *body = config_get_option("vrep:drone_body");
+
     d->fill_navdata_demo = vrep_fill_navdata_demo;
+
+    pose[6] = 1.0f;
+
+    body_handle = vrep_link_object_handle(body && *body ? body : VREP_NAVDATA_BODY);
+    vrep_link_on_connect(vrep_navdata_subscribe, NULL);
 }
 
+/* Ground truth in the same units as the native simulation: attitude in
+ * millidegrees (theta positive nose up), altitude in metres and velocity in
+ * mm/s in the heading frame */
 void vrep_fill_navdata_demo(navdata_demo_t *demo)
 {
     demo->tag = NAVDATA_DEMO_TAG;
     demo->ctrl_state = 0;
     demo->vbat_flying_percentage = 0xFFFFFFFF;
 
-    simxGetFloatSignal(client_id, "theta", (float*)&demo->theta, simx_opmode_oneshot_wait);
-    simxGetFloatSignal(client_id, "phi", (float*)&demo->phi, simx_opmode_oneshot_wait);
-    simxGetFloatSignal(client_id, "psi", (float*)&demo->psi, simx_opmode_oneshot_wait);
-    simxGetFloatSignal(client_id, "altitude", (float*)&demo->altitude, simx_opmode_oneshot_wait);
+    float p[VREP_NAVDATA_POSE_FLOATS], v[VREP_NAVDATA_VELOCITY_FLOATS];
+
+    /* Streamed replies are already in the local buffer, so this does not wait
+     * on V-REP and can share the lock with control. Each read overwrites the
+     * last one's data, so the floats are copied out straight away. Navdata
+     * shards and the video thread call this at once, so the last pose is
+     * only touched under the lock too. */
+    pthread_mutex_lock(&vrep_mutex);
+
+    if(vrep_link_connected() && *body_handle >= 0)
+    {
+        if(vrep_navdata_group_read(vrep_link_client(), VREP_NAVDATA_POSE, VREP_NAVDATA_POSE_FLOATS, 1, body_handle, p) &&
+                vrep_navdata_group_read(vrep_link_client(), VREP_NAVDATA_VELOCITY, VREP_NAVDATA_VELOCITY_FLOATS, 1, body_handle, v))
+        {
+            memcpy(pose, p, sizeof(pose));
+            memcpy(velocity, v, sizeof(velocity));
+        }
+    }
+
+    memcpy(p, pose, sizeof(pose));
+    memcpy(v, velocity, sizeof(velocity));
+
+    pthread_mutex_unlock(&vrep_mutex);
 
-    simxGetFloatSignal(client_id, "vx", (float*)&demo->vx, simx_opmode_oneshot_wait);
-    simxGetFloatSignal(client_id, "vy", (float*)&demo->vy, simx_opmode_oneshot_wait);
-    simxGetFloatSignal(client_id, "vz", (float*)&demo->vz, simx_opmode_oneshot_wait);
+    vrep_navdata_convert(p, v, demo);
 
     demo->num_frames = 0;
 
@@ -5,8 +5,30 @@
 #include "util/data_options.h"
 #include "libs/vrep/extApi.h"
 
-void vrep_navdata_init(struct data_options *d, simxInt id);
+/* Name of the drone's dynamic body in the scene, unless vrep:drone_body
+ * says otherwise */
+#define VREP_NAVDATA_BODY "Quadricopter"
+
+/* simxGetObjectGroupData data types: absolute position and orientation as a
+ * quaternion (x, y, z, qx, qy, qz, qw), and linear and angular velocity (vx,
+ * vy, vz, wx, wy, wz), per object. 17 and 18 would give only one of the two
+ * velocities, and 16 is joint data. */
+#define VREP_NAVDATA_POSE 11
+#define VREP_NAVDATA_POSE_FLOATS 7
+#define VREP_NAVDATA_VELOCITY 19
+#define VREP_NAVDATA_VELOCITY_FLOATS 6
+
+void vrep_navdata_init(struct data_options *d);
 
 void vrep_fill_navdata_demo(navdata_demo_t *demo);
 
+/* Copies stride floats per body from the streamed group data of data_type
+ * into out, in the order of bodies. Returns 0 unless every body was found.
+ * Call with vrep_mutex held. */
+uint8_t vrep_navdata_group_read(simxInt client_id, simxInt data_type, int stride, int num_bodies, const simxInt *bodies, float *out);
+
+/* Fills the attitude, altitude and velocity fields from one body's pose and
+ * velocity */
+void vrep_navdata_convert(const float *pose, const float *velocity, navdata_demo_t *demo);
+
 #endif
@@ -0,0 +1,250 @@
+/* User includes */
+#include "qos/qos_governor.h"
+#include "video/video_server.h"
+#include "util/config.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+uint8_t run_governor = 0;
+
+/* Degradation steps, lightest first */
+static const struct qos_level levels[] = {
+    { VIDEO_FPS, VIDEO_WIDTH, VIDEO_HEIGHT, 1.0f },
+    { 20, VIDEO_WIDTH, VIDEO_HEIGHT, 1.0f },
+    { 15, VIDEO_WIDTH, VIDEO_HEIGHT, 1.0f },
+    { 15, 480, 272, 1.0f },
+    { 15, 320, 176, 1.0f },
+    { 15, 320, 176, 0.5f },
+    { 10, 320, 176, 0.25f },
+};
+
+#define NUM_LEVELS (sizeof(levels) / sizeof(levels[0]))
+
+static struct qos_deadline deadlines[QOS_MAX_DEADLINES];
+static int num_deadlines = 0;
+
+static struct qos_stream video_stream;
+
+static pthread_mutex_t qos_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set while overloaded with the stream at its lowest level */
+static uint8_t saturated = 0;
+
+struct qos_deadline *qos_deadline_register(const char *name, double budget_ms, uint8_t protected)
+{
+    char key[41];
+    struct qos_deadline *d;
+
+    pthread_mutex_lock(&qos_mutex);
+
+    for(int i = 0; i < num_deadlines; ++i)
+    {
+        if(!strcmp(deadlines[i].name, name))
+        {
+            pthread_mutex_unlock(&qos_mutex);
+            return &deadlines[i];
+        }
+    }
+
+    if(num_deadlines == QOS_MAX_DEADLINES)
+        error("Too many QoS deadlines registered");
+
+    d = &deadlines[num_deadlines++];
+    d->name = name;
+    d->protected = protected;
+
+    snprintf(key, sizeof(key), "qos:%s_budget_ms", name);
+    d->budget_ms = config_get_float(key, budget_ms);
+
+    pthread_mutex_unlock(&qos_mutex);
+
+    snprintf(key, sizeof(key), "qos_%s_checks", name);
+    d->checks = metrics_counter(key);
+    snprintf(key, sizeof(key), "qos_%s_misses", name);
+    d->misses = metrics_counter(key);
+    snprintf(key, sizeof(key), "qos_%s_miss_ratio", name);
+    d->miss_ratio = metrics_gauge(key);
+
+    return d;
+}
+
+/* Records one piece of work that began at start (CLOCK_MONOTONIC) and has
+ * just finished */
+void qos_deadline_check(struct qos_deadline *d, const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+
+    __sync_fetch_and_add(&d->window_checks, 1);
+    metrics_add(d->checks, 1);
+
+    if(elapsed > d->budget_ms)
+    {
+        __sync_fetch_and_add(&d->window_misses, 1);
+        metrics_add(d->misses, 1);
+    }
+}
+
+/* A new client starts at full quality */
+struct qos_stream *qos_stream_register(void)
+{
+    struct qos_stream *s = &video_stream;
+
+    pthread_mutex_lock(&qos_mutex);
+
+    if(s->used)
+        error("QoS video stream registered twice");
+
+    s->used = 1;
+    s->level = 0;
+
+    pthread_mutex_unlock(&qos_mutex);
+
+    if(!s->level_gauge)
+        s->level_gauge = metrics_gauge("qos_video_level");
+    metrics_set(s->level_gauge, 0);
+
+    return s;
+}
+
+void qos_stream_unregister(struct qos_stream *s)
+{
+    pthread_mutex_lock(&qos_mutex);
+    s->used = 0;
+    pthread_mutex_unlock(&qos_mutex);
+}
+
+const struct qos_level *qos_stream_level(struct qos_stream *s)
+{
+    return &levels[s->level];
+}
+
+static double host_load(void)
+{
+    double load[1];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(getloadavg(load, 1) < 1)
+        return 0;
+
+    return load[0] / (cpus > 0 ? cpus : 1);
+}
+
+uint8_t qos_admit(void)
+{
+    static struct metric *refused = NULL;
+
+    if(!refused)
+        refused = metrics_counter("qos_refused");
+
+    if(saturated || host_load() > config_get_float("qos:admit_load", 1.5f))
+    {
+        metrics_add(refused, 1);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Every QOS_INTERVAL, moves the video stream one level down if a protected
+ * deadline missed more than qos:miss_threshold of its checks or the load per
+ * CPU is above qos:load_high, and one level up after qos:restore_intervals
+ * intervals with no misses and load below qos:load_low. Without a client
+ * there is nothing to shed, so overload only counts as saturation. */
+void *qos_governor_listen(void *args)
+{
+    float miss_threshold = config_get_float("qos:miss_threshold", 0.05f);
+    float load_high = config_get_float("qos:load_high", 1.0f);
+    float load_low = config_get_float("qos:load_low", 0.7f);
+    int restore_intervals = config_get_int("qos:restore_intervals", 5);
+    int hold_intervals = config_get_int("qos:hold_intervals", 5);
+
+    struct metric *load_gauge = metrics_gauge("qos_load");
+    struct metric *saturated_gauge = metrics_gauge("qos_saturated");
+    struct metric *degrades = metrics_counter("qos_degrade_steps");
+    struct metric *restores = metrics_counter("qos_restore_steps");
+
+    int quiet = 0;
+    int hold = 0;
+
+    while(1)
+    {
+        sleep(QOS_INTERVAL);
+
+        double worst_miss = 0;
+        double load = host_load();
+
+        pthread_mutex_lock(&qos_mutex);
+
+        for(int i = 0; i < num_deadlines; ++i)
+        {
+            struct qos_deadline *d = &deadlines[i];
+            uint32_t checks = __sync_lock_test_and_set(&d->window_checks, 0);
+            uint32_t misses = __sync_lock_test_and_set(&d->window_misses, 0);
+            double ratio = checks ? (double)misses / checks : 0;
+
+            metrics_set(d->miss_ratio, ratio);
+
+            if(d->protected && ratio > worst_miss)
+                worst_miss = ratio;
+        }
+
+        metrics_set(load_gauge, load);
+
+        if(hold)
+            --hold;
+
+        /* The load average lags, so load alone only moves a step once per
+         * hold period. Deadline misses act at once. */
+        struct qos_stream *s = &video_stream;
+
+        if(worst_miss > miss_threshold || (load > load_high && !hold))
+        {
+            uint8_t can_degrade = s->used && s->level < NUM_LEVELS - 1;
+            quiet = 0;
+            hold = hold_intervals;
+
+            if(can_degrade)
+            {
+                ++s->level;
+                metrics_set(s->level_gauge, s->level);
+                metrics_add(degrades, 1);
+                printf("QoS: degrading video stream to level %d (miss ratio %.2f, load %.2f)\n", s->level, worst_miss, load);
+            }
+
+            saturated = !can_degrade;
+        }
+        else if(!worst_miss && load < load_low)
+        {
+            if(++quiet >= restore_intervals)
+            {
+                quiet = 0;
+                saturated = 0;
+
+                if(s->used && s->level > 0)
+                {
+                    --s->level;
+                    metrics_set(s->level_gauge, s->level);
+                    metrics_add(restores, 1);
+                    printf("QoS: restoring video stream to level %d\n", s->level);
+                }
+            }
+        }
+        else
+            quiet = 0;
+
+        metrics_set(saturated_gauge, saturated);
+
+        pthread_mutex_unlock(&qos_mutex);
+    }
+
+    return NULL;
+}
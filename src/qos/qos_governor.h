@@ -0,0 +1,63 @@
+#ifndef QOS_GOVERNOR_H
+#define QOS_GOVERNOR_H
+
+#include "util/metrics.h"
+#include <stdint.h>
+#include <time.h>
+
+#define QOS_MAX_DEADLINES 16
+
+/* Seconds between governor decisions */
+#define QOS_INTERVAL 1
+
+/* A repeating piece of work with a time budget, e.g. handling one control
+ * batch. Protected deadlines are the ones the governor sheds video load for;
+ * the others are only measured. The budget can be overridden with
+ * qos:<name>_budget_ms in the configuration file. Callers keep their own
+ * start times, so threads doing the same work can share a deadline. */
+struct qos_deadline
+{
+    const char *name;
+    double budget_ms;
+    uint8_t protected;
+
+    volatile uint32_t window_checks;
+    volatile uint32_t window_misses;
+
+    struct metric *checks;
+    struct metric *misses;
+    struct metric *miss_ratio;
+};
+
+/* One step of video degradation. fps first, then resolution, then bitrate.
+ * No level is larger than level 0, VIDEO_WIDTH x VIDEO_HEIGHT. */
+struct qos_level
+{
+    int fps;
+    int width;
+    int height;
+    float bit_rate_scale;
+};
+
+/* The video stream, the one thing the governor degrades to keep the protected
+ * deadlines (navdata, control) on time. The server sends one at a time. */
+struct qos_stream
+{
+    uint8_t used;
+    volatile int level;
+    struct metric *level_gauge;
+};
+
+struct qos_deadline *qos_deadline_register(const char *name, double budget_ms, uint8_t protected);
+void qos_deadline_check(struct qos_deadline *d, const struct timespec *start);
+
+struct qos_stream *qos_stream_register(void);
+void qos_stream_unregister(struct qos_stream *s);
+const struct qos_level *qos_stream_level(struct qos_stream *s);
+
+/* Returns 0 if the host has no room for another drone or video client */
+uint8_t qos_admit(void);
+
+void *qos_governor_listen(void *args);
+
+#endif
@@ -0,0 +1,95 @@
+/* User includes */
+#include "sim/sim_backend.h"
+#include "util/config.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <time.h>
+
+pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sim_state state;
+static struct sim_params params;
+static uint8_t initialised = 0;
+
+void sim_backend_init(void)
+{
+    if(initialised)
+        return;
+
+    sim_params_default(&params);
+
+    params.mass = config_get_float("sim:mass", params.mass);
+    params.wind[0] = config_get_float("sim:wind_x", 0.0f);
+    params.wind[1] = config_get_float("sim:wind_y", 0.0f);
+    params.gust = config_get_float("sim:gust", 0.0f);
+
+    sim_init(&state, config_get_int("sim:seed", 1));
+
+    char *checkpoint = config_get_option("sim:checkpoint");
+
+    if(checkpoint && !sim_checkpoint_read(checkpoint, &state))
+        error("Could not load simulation checkpoint %s", checkpoint);
+
+    initialised = 1;
+}
+
+struct sim_state *sim_backend_state(void)
+{
+    return &state;
+}
+
+const struct sim_params *sim_backend_params(void)
+{
+    return &params;
+}
+
+static void timespec_add_ns(struct timespec *t, long ns)
+{
+    t->tv_nsec += ns;
+
+    while(t->tv_nsec >= 1000000000L)
+    {
+        t->tv_nsec -= 1000000000L;
+        ++t->tv_sec;
+    }
+}
+
+void *sim_backend_run(void *args)
+{
+    long step_ns = params.dt * 1e9f;
+    struct metric *steps = metrics_counter("sim_steps");
+    struct metric *late = metrics_counter("sim_late_steps");
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while(1)
+    {
+        pthread_mutex_lock(&sim_mutex);
+        sim_step(&state, &params);
+        pthread_mutex_unlock(&sim_mutex);
+
+        metrics_add(steps, 1);
+
+        timespec_add_ns(&next, step_ns);
+
+        /* Behind by more than a step: skip ahead rather than run fast */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int64_t lag = (int64_t)(now.tv_sec - next.tv_sec) * 1000000000L + (now.tv_nsec - next.tv_nsec);
+
+        if(lag > step_ns)
+        {
+            metrics_add(late, 1);
+            next = now;
+            continue;
+        }
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef SIM_BACKEND_H
+#define SIM_BACKEND_H
+
+#include "sim/sim_model.h"
+#include <pthread.h>
+
+/* Guards the live simulation; hold it to read or command the state */
+extern pthread_mutex_t sim_mutex;
+
+/* Sets up the simulation the server flies, from sim:seed, sim:mass, sim:wind_x,
+ * sim:wind_y and sim:gust. If sim:checkpoint names a file written by
+ * tools/sim_fork, the flight resumes from it. Safe to call more than once. */
+void sim_backend_init(void);
+
+/* The live state and parameters. Only touch them with sim_mutex held. */
+struct sim_state *sim_backend_state(void);
+const struct sim_params *sim_backend_params(void);
+
+/* Steps the simulation in real time */
+void *sim_backend_run(void *args);
+
+#endif
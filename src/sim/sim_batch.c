@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "sim/sim_batch.h"
+#include "util/reuseport.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+struct sim_batch;
+
+struct sim_worker
+{
+    int index;
+    struct sim_batch *batch;
+
+    /* Run numbers still to do are [begin, end). The owner takes from begin,
+     * thieves from end. */
+    pthread_mutex_t mutex;
+    int begin;
+    int end;
+
+    struct sim_pool pool;
+    int runs;
+    uint64_t steals;
+
+    pthread_t thread;
+};
+
+struct sim_batch
+{
+    struct sim_worker *workers;
+    int count;
+    sim_batch_fn fn;
+    void *arg;
+};
+
+void *sim_pool_alloc(struct sim_pool *p, size_t size)
+{
+    size_t start = (p->used + 15) & ~(size_t)15;
+
+    if(start + size > p->size)
+        error("Worker pool of %zu bytes is too small", p->size);
+
+    p->used = start + size;
+
+    return p->base + start;
+}
+
+static int sim_worker_remaining(struct sim_worker *w)
+{
+    return __atomic_load_n(&w->end, __ATOMIC_RELAXED) - __atomic_load_n(&w->begin, __ATOMIC_RELAXED);
+}
+
+/* Next run from the worker's own range, or -1 when it is empty */
+static int sim_worker_take(struct sim_worker *w)
+{
+    int run = -1;
+
+    pthread_mutex_lock(&w->mutex);
+
+    if(w->begin < w->end)
+        run = __atomic_fetch_add(&w->begin, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&w->mutex);
+
+    return run;
+}
+
+/* Moves the back half of the fullest other range into w's, which is empty.
+ * The sizes are read without locks, so the choice is a hint that is checked
+ * again under the victim's lock. Returns 0 once there is nothing left. */
+static uint8_t sim_worker_steal(struct sim_batch *b, struct sim_worker *w)
+{
+    while(1)
+    {
+        struct sim_worker *victim = NULL;
+        int most = 0;
+
+        for(int i = 1; i < b->count; ++i)
+        {
+            struct sim_worker *v = &b->workers[(w->index + i) % b->count];
+            int remaining = sim_worker_remaining(v);
+
+            if(remaining > most)
+            {
+                most = remaining;
+                victim = v;
+            }
+        }
+
+        if(!victim)
+            return 0;
+
+        pthread_mutex_lock(&victim->mutex);
+
+        int remaining = victim->end - victim->begin;
+        int take = (remaining + 1) / 2;
+        int end = victim->end;
+
+        if(take > 0)
+            __atomic_store_n(&victim->end, end - take, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&victim->mutex);
+
+        /* Only one lock is held at a time, so two workers stealing from each
+         * other cannot deadlock. In between, the runs are in neither range
+         * and another worker may give up early, which costs it nothing but
+         * the chance to help. */
+        if(take > 0)
+        {
+            pthread_mutex_lock(&w->mutex);
+            __atomic_store_n(&w->begin, end - take, __ATOMIC_RELAXED);
+            __atomic_store_n(&w->end, end, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&w->mutex);
+
+            ++w->steals;
+
+            return 1;
+        }
+    }
+}
+
+static void *sim_worker_loop(void *args)
+{
+    struct sim_worker *w = args;
+    struct sim_batch *b = w->batch;
+
+    reuseport_pin_thread(w->index);
+
+    /* Allocated and touched once pinned, so the pages are local to the CPU */
+    w->pool.base = malloc(w->pool.size ? w->pool.size : 1);
+    if(!w->pool.base)
+        error("Could not allocate a %zu byte worker pool", w->pool.size);
+
+    memset(w->pool.base, 0, w->pool.size);
+
+    do
+    {
+        int run;
+
+        while((run = sim_worker_take(w)) >= 0)
+        {
+            w->pool.used = 0;
+            b->fn(run, w->index, &w->pool, b->arg);
+            ++w->runs;
+        }
+    } while(sim_worker_steal(b, w));
+
+    return NULL;
+}
+
+void sim_batch_run(int runs, int workers, size_t pool_size, sim_batch_fn fn, void *arg, struct sim_batch_stats *stats)
+{
+    if(workers < 1 || workers > SIM_BATCH_MAX_WORKERS)
+        error("Need 1 to %d workers", SIM_BATCH_MAX_WORKERS);
+
+    struct sim_batch b = {
+        .count = workers,
+        .fn = fn,
+        .arg = arg,
+    };
+
+    b.workers = calloc(workers, sizeof(struct sim_worker));
+    if(!b.workers)
+        error("Could not allocate workers");
+
+    for(int i = 0; i < workers; ++i)
+    {
+        struct sim_worker *w = &b.workers[i];
+
+        w->index = i;
+        w->batch = &b;
+        w->begin = (int64_t)runs * i / workers;
+        w->end = (int64_t)runs * (i + 1) / workers;
+        pthread_mutex_init(&w->mutex, NULL);
+
+        w->pool.size = pool_size;
+    }
+
+    for(int i = 0; i < workers; ++i)
+        pthread_create(&b.workers[i].thread, NULL, sim_worker_loop, &b.workers[i]);
+
+    if(stats)
+        memset(stats, 0, sizeof(*stats));
+
+    for(int i = 0; i < workers; ++i)
+    {
+        struct sim_worker *w = &b.workers[i];
+
+        pthread_join(w->thread, NULL);
+
+        if(stats)
+        {
+            stats->steals += w->steals;
+
+            if(!i || w->runs < stats->min_runs)
+                stats->min_runs = w->runs;
+            if(!i || w->runs > stats->max_runs)
+                stats->max_runs = w->runs;
+        }
+
+        pthread_mutex_destroy(&w->mutex);
+        free(w->pool.base);
+    }
+
+    free(b.workers);
+}
@@ -0,0 +1,40 @@
+#ifndef SIM_BATCH_H
+#define SIM_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_BATCH_MAX_WORKERS 256
+
+/* Bump allocator over memory a worker allocates once. Emptied before every
+ * run, so runs allocate nothing from the heap and workers share no allocator
+ * state. */
+struct sim_pool
+{
+    uint8_t *base;
+    size_t size;
+    size_t used;
+};
+
+/* 16 byte aligned. Exits if the pool is too small, which means it was sized
+ * wrongly for the runs. */
+void *sim_pool_alloc(struct sim_pool *p, size_t size);
+
+/* Runs run number run on the given worker. The pool is empty on entry. */
+typedef void (*sim_batch_fn)(int run, int worker, struct sim_pool *pool, void *arg);
+
+struct sim_batch_stats
+{
+    uint64_t steals;
+    int min_runs;       /* fewest runs one worker did */
+    int max_runs;
+};
+
+/* Runs 0 to runs - 1 on workers threads, one pinned to each CPU. Every worker
+ * starts with an even share of the run numbers as a range, takes runs from
+ * the front of its own and, once it is empty, steals the back half of the
+ * largest range it finds, so slow runs do not leave CPUs idle at the end.
+ * stats may be NULL. */
+void sim_batch_run(int runs, int workers, size_t pool_size, sim_batch_fn fn, void *arg, struct sim_batch_stats *stats);
+
+#endif
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "sim/sim_fork.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static void sim_fork_pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+int sim_fork(const struct sim_state *checkpoint, int variants, sim_variant_fn run, void *arg, void *results, size_t result_size)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int slots = cpus > 0 ? cpus : 1;
+    size_t shared_size = variants * result_size;
+    int failed = 0;
+
+    if(variants < 1)
+        return 0;
+
+    uint8_t *shared = mmap(NULL, shared_size ? shared_size : 1, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED)
+        error("Could not map fork results");
+
+    pid_t pids[slots];
+    int running = 0, next = 0;
+
+    memset(pids, 0, sizeof(pids));
+
+    while(next < variants || running)
+    {
+        /* Fill every free CPU */
+        for(int cpu = 0; cpu < slots && next < variants; ++cpu)
+        {
+            if(pids[cpu])
+                continue;
+
+            pid_t pid = fork();
+
+            if(pid < 0)
+                error("Could not fork variant %d", next);
+
+            if(!pid)
+            {
+                struct sim_state s = *checkpoint;
+
+                sim_fork_pin(cpu);
+                run(&s, next, arg, shared + next * result_size);
+
+                _exit(0);
+            }
+
+            pids[cpu] = pid;
+            ++running;
+            ++next;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+
+        if(pid < 0)
+            break;
+
+        for(int cpu = 0; cpu < slots; ++cpu)
+        {
+            if(pids[cpu] == pid)
+            {
+                pids[cpu] = 0;
+                --running;
+
+                if(!WIFEXITED(status) || WEXITSTATUS(status))
+                    ++failed;
+            }
+        }
+    }
+
+    memcpy(results, shared, shared_size);
+    munmap(shared, shared_size ? shared_size : 1);
+
+    return failed;
+}
@@ -0,0 +1,20 @@
+#ifndef SIM_FORK_H
+#define SIM_FORK_H
+
+#include "sim/sim_model.h"
+
+#include <stddef.h>
+
+/* Runs one variant from its own copy of the checkpoint and writes what it
+ * found to result, which has the size given to sim_fork and starts zeroed */
+typedef void (*sim_variant_fn)(struct sim_state *s, int variant, void *arg, void *result);
+
+/* Forks variants children from checkpoint, as many at a time as there are
+ * CPUs, each pinned to its own. The children share the parent's pages copy on
+ * write, so the shared prefix is neither rerun nor copied, and each writes its
+ * result into a shared mapping that is copied to results[variant]. Safe only
+ * from a process with a single thread. Returns the number of variants that
+ * did not finish; their results may be partly written. */
+int sim_fork(const struct sim_state *checkpoint, int variants, sim_variant_fn run, void *arg, void *results, size_t result_size);
+
+#endif
@@ -0,0 +1,268 @@
+/* User includes */
+#include "sim/sim_model.h"
+#include "navdata/navdata_common.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+void sim_gains_default(struct sim_gains *g)
+{
+    g->pq_kp = CTRL_DEFAULT_NUM_PQ_KP_NO_SHELL / CTRL_DEFAULT_DEN_W;
+    g->ea_kp = CTRL_DEFAULT_NUM_EA_KP_NO_SHELL / CTRL_DEFAULT_DEN_EA;
+    g->ea_ki = CTRL_DEFAULT_NUM_EA_KI_NO_SHELL / CTRL_DEFAULT_DEN_EA;
+    g->r_kp = CTRL_DEFAULT_NUM_R_KP / CTRL_DEFAULT_DEN_W;
+    g->alt_kp = CTRL_DEFAULT_NUM_ALT_KP / CTRL_DEFAULT_DEN_ALT;
+    g->alt_ki = CTRL_DEFAULT_NUM_ALT_KI / CTRL_DEFAULT_DEN_ALT;
+}
+
+/* Roughly an AR.Drone 2 with the outdoor hull */
+void sim_params_default(struct sim_params *p)
+{
+    memset(p, 0, sizeof(*p));
+
+    p->dt = SIM_DEFAULT_DT;
+    p->mass = 0.42f;
+    p->nominal_mass = 0.42f;
+    p->width = 0.2f;
+    p->length = 0.2f;
+    p->gravity = 9.81f;
+    p->drag = 0.15f;
+    p->max_prop_force = 2.0f;
+    p->gust_time = 2.0f;
+    p->angle_noise = 0.002f;
+    p->rate_noise = 0.01f;
+    p->velocity_noise = 0.02f;
+
+    sim_gains_default(&p->gains);
+}
+
+uint64_t sim_rng_next(struct sim_rng *r)
+{
+    r->s ^= r->s >> 12;
+    r->s ^= r->s << 25;
+    r->s ^= r->s >> 27;
+
+    return r->s * 0x2545F4914F6CDD1DULL;
+}
+
+/* In (0, 1] */
+float sim_rng_uniform(struct sim_rng *r)
+{
+    return ((sim_rng_next(r) >> 40) + 1) / 16777216.0f;
+}
+
+/* Box-Muller. Always draws two numbers, so the stream stays aligned between
+ * runs whatever they use the result for. */
+float sim_rng_gaussian(struct sim_rng *r)
+{
+    float u1 = sim_rng_uniform(r);
+    float u2 = sim_rng_uniform(r);
+
+    return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2);
+}
+
+void sim_init(struct sim_state *s, uint64_t seed)
+{
+    memset(s, 0, sizeof(*s));
+
+    s->mode = SIM_LANDED;
+
+    /* xorshift must not start at zero */
+    s->rng.s = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+void sim_set_flying(struct sim_state *s, uint8_t flying)
+{
+    if(flying && (s->mode == SIM_LANDED || s->mode == SIM_LANDING))
+        s->mode = SIM_TAKING_OFF;
+    else if(!flying && (s->mode == SIM_TAKING_OFF || s->mode == SIM_FLYING))
+        s->mode = SIM_LANDING;
+}
+
+void sim_emergency(struct sim_state *s)
+{
+    s->mode = SIM_LANDED;
+}
+
+static float clampf(float v, float lo, float hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static void sim_sense(struct sim_state *s, const struct sim_params *p)
+{
+    for(int i = 0; i < 3; ++i)
+    {
+        s->sensed.angle[i] = s->angle[i] + p->angle_noise * sim_rng_gaussian(&s->rng);
+        s->sensed.rate[i] = s->rate[i] + p->rate_noise * sim_rng_gaussian(&s->rng);
+        s->sensed.vel[i] = s->vel[i] + p->velocity_noise * sim_rng_gaussian(&s->rng);
+    }
+
+    s->sensed.altitude = s->pos[2];
+}
+
+/* The controller of maindrone.lua: a force per axis, mixed onto the four
+ * propellers the same way. The script's roll and pitch loops feed the last
+ * output back through tForce, which only holds with V-REP's damping, so here
+ * they are a cascade of an angle loop with an integrator (t_force) and a rate
+ * loop, and the vertical loop gets the same integrator. */
+void sim_control_forces(const struct sim_gains *g, const struct sim_airframe *a, const struct sim_command *c,
+        const struct sim_sensors *sensed, float *t_force, float dt, float *forces)
+{
+    float desired[2] = { c->roll, c->pitch };
+    float arms[2] = { a->width / 2, a->length / 2 };
+    float windup = a->mass * a->gravity;
+    float force[3];
+
+    for(int i = 0; i < 2; ++i)
+    {
+        float inertia = a->mass * arms[i] * arms[i];
+        float err = desired[i] - sensed->angle[i];
+        float alpha = g->pq_kp * (g->ea_kp * err - sensed->rate[i]);
+
+        t_force[i] = clampf(t_force[i] + inertia / arms[i] * g->pq_kp * g->ea_ki * err * dt, -windup, windup);
+        force[i] = inertia / arms[i] * alpha + t_force[i];
+    }
+
+    float vert = cosf(sensed->angle[0]) * cosf(sensed->angle[1]);
+    float verr = c->vert_speed - sensed->vel[2];
+
+    t_force[2] = clampf(t_force[2] + a->mass * g->alt_ki * verr * dt, -windup, windup);
+    force[2] = (a->gravity + g->alt_kp * verr) * a->mass / fmaxf(vert, 0.5f) + t_force[2];
+
+    forces[0] = force[2] / 4 - force[1] / 4 + force[0] / 4;
+    forces[1] = force[2] / 4 + force[1] / 4 + force[0] / 4;
+    forces[2] = force[2] / 4 + force[1] / 4 - force[0] / 4;
+    forces[3] = force[2] / 4 - force[1] / 4 - force[0] / 4;
+}
+
+static void sim_control(struct sim_state *s, const struct sim_params *p)
+{
+    const struct sim_gains *g = &p->gains;
+    struct sim_airframe a = { p->nominal_mass, p->width, p->length, p->gravity };
+    struct sim_command c = s->command;
+
+    if(s->mode == SIM_LANDED)
+    {
+        memset(s->t_force, 0, sizeof(s->t_force));
+        memset(s->prop_forces, 0, sizeof(s->prop_forces));
+        return;
+    }
+
+    if(s->mode == SIM_TAKING_OFF || s->mode == SIM_LANDING)
+    {
+        memset(&c, 0, sizeof(c));
+        c.vert_speed = s->mode == SIM_TAKING_OFF ? SIM_TAKEOFF_SPEED : -SIM_LAND_SPEED;
+    }
+
+    sim_control_forces(g, &a, &c, &s->sensed, s->t_force, p->dt, s->prop_forces);
+
+    for(int i = 0; i < 4; ++i)
+        s->prop_forces[i] = clampf(s->prop_forces[i], 0.0f, p->max_prop_force);
+
+    /* Yaw has no propeller model, so its rate loop drives the rate directly */
+    s->rate[2] += g->r_kp * (c.yaw_rate - s->sensed.rate[2]) * p->dt;
+}
+
+void sim_step(struct sim_state *s, const struct sim_params *p)
+{
+    float dt = p->dt;
+    float *f = s->prop_forces;
+
+    sim_sense(s, p);
+    sim_control(s, p);
+
+    /* Gusts are a first order random process around the steady wind */
+    float gust_scale = p->gust * sqrtf(2.0f * dt / p->gust_time);
+
+    for(int i = 0; i < 3; ++i)
+        s->gust[i] += -s->gust[i] * dt / p->gust_time + gust_scale * sim_rng_gaussian(&s->rng);
+
+    float arm_roll = p->width / 2, arm_pitch = p->length / 2;
+
+    s->rate[0] += (f[0] + f[1] - f[2] - f[3]) * arm_roll / (p->mass * arm_roll * arm_roll) * dt;
+    s->rate[1] += (f[1] + f[2] - f[0] - f[3]) * arm_pitch / (p->mass * arm_pitch * arm_pitch) * dt;
+
+    for(int i = 0; i < 3; ++i)
+        s->angle[i] += s->rate[i] * dt;
+
+    if(s->angle[2] > (float)M_PI)
+        s->angle[2] -= 2.0f * (float)M_PI;
+    else if(s->angle[2] < -(float)M_PI)
+        s->angle[2] += 2.0f * (float)M_PI;
+
+    float thrust = f[0] + f[1] + f[2] + f[3];
+    float sr = sinf(s->angle[0]), cr = cosf(s->angle[0]);
+    float sp = sinf(s->angle[1]), cp = cosf(s->angle[1]);
+    float sy = sinf(s->angle[2]), cy = cosf(s->angle[2]);
+
+    /* Body z axis in the world frame (yaw, pitch, roll order) */
+    float up[3] = { cy * sp * cr + sy * sr, sy * sp * cr - cy * sr, cp * cr };
+
+    for(int i = 0; i < 3; ++i)
+    {
+        float airspeed = s->vel[i] - p->wind[i] - s->gust[i];
+        float accel = (thrust * up[i] - p->drag * airspeed) / p->mass;
+
+        if(i == 2)
+            accel -= p->gravity;
+
+        s->vel[i] += accel * dt;
+        s->pos[i] += s->vel[i] * dt;
+    }
+
+    /* The ground holds the drone level and still until the thrust lifts it */
+    if(s->pos[2] <= 0.0f)
+    {
+        s->pos[2] = 0.0f;
+        memset(s->vel, 0, sizeof(s->vel));
+        s->angle[0] = s->angle[1] = 0.0f;
+        memset(s->rate, 0, sizeof(s->rate));
+
+        if(s->mode == SIM_LANDING)
+            s->mode = SIM_LANDED;
+    }
+    else if(s->mode == SIM_TAKING_OFF && s->pos[2] >= SIM_TAKEOFF_ALTITUDE)
+        s->mode = SIM_FLYING;
+
+    s->t += dt;
+    ++s->steps;
+}
+
+void sim_run(struct sim_state *s, const struct sim_params *p, double until)
+{
+    while(s->t < until)
+        sim_step(s, p);
+}
+
+uint8_t sim_checkpoint_write(const char *filename, const struct sim_state *s)
+{
+    uint32_t header[2] = { SIM_CHECKPOINT_MAGIC, sizeof(*s) };
+    FILE *f = fopen(filename, "wb");
+
+    if(!f)
+        return 0;
+
+    uint8_t ok = fwrite(header, sizeof(header), 1, f) == 1 && fwrite(s, sizeof(*s), 1, f) == 1;
+
+    return fclose(f) == 0 && ok;
+}
+
+uint8_t sim_checkpoint_read(const char *filename, struct sim_state *s)
+{
+    uint32_t header[2];
+    FILE *f = fopen(filename, "rb");
+
+    if(!f)
+        return 0;
+
+    uint8_t ok = fread(header, sizeof(header), 1, f) == 1
+        && header[0] == SIM_CHECKPOINT_MAGIC && header[1] == sizeof(*s)
+        && fread(s, sizeof(*s), 1, f) == 1;
+
+    fclose(f);
+
+    return ok;
+}
@@ -0,0 +1,158 @@
+#ifndef SIM_MODEL_H
+#define SIM_MODEL_H
+
+#include <stdint.h>
+
+/* "SIMC", first word of a checkpoint file */
+#define SIM_CHECKPOINT_MAGIC 0x434D4953
+
+/* Step of the native simulation, in seconds (200 Hz) */
+#define SIM_DEFAULT_DT 0.005f
+
+/* Automatic takeoff climbs to this height, and landing descends, at these
+ * vertical speeds */
+#define SIM_TAKEOFF_ALTITUDE 1.0f
+#define SIM_TAKEOFF_SPEED 0.7f
+#define SIM_LAND_SPEED 0.5f
+
+enum sim_mode
+{
+    SIM_LANDED,
+    SIM_TAKING_OFF,
+    SIM_FLYING,
+    SIM_LANDING,
+};
+
+/* xorshift64*, kept in the state so a checkpoint carries the random stream
+ * and a restored run draws the same gusts and noise */
+struct sim_rng
+{
+    uint64_t s;
+};
+
+/* Controller gains, in the units of the CTRL_DEFAULT_* values divided by their
+ * denominators */
+struct sim_gains
+{
+    float pq_kp;        /* roll and pitch rate loop, 1/s */
+    float ea_kp;        /* Euler angle loop, 1/s */
+    float ea_ki;        /* Euler angle loop integral, 1/s^2 */
+    float r_kp;         /* yaw rate loop, 1/s */
+    float alt_kp;       /* vertical speed loop, 1/s */
+    float alt_ki;       /* vertical speed loop integral, 1/s^2 */
+};
+
+/* Everything a run may vary. Not part of the state: variants forked from one
+ * checkpoint can each be given their own. */
+struct sim_params
+{
+    float dt;
+    float mass;             /* kg, true mass */
+    float nominal_mass;     /* kg, what the controller assumes */
+    float width;            /* m, between the left and right propellers */
+    float length;           /* m, between the front and back propellers */
+    float gravity;          /* m/s^2 */
+    float drag;             /* N per m/s of airspeed */
+    float max_prop_force;   /* N per propeller */
+    float wind[3];          /* m/s, steady */
+    float gust;             /* m/s, standard deviation of the gusts */
+    float gust_time;        /* s, correlation time of the gusts */
+    float angle_noise;      /* rad, standard deviation of the attitude estimate */
+    float rate_noise;       /* rad/s, standard deviation of the gyros */
+    float velocity_noise;   /* m/s, standard deviation of the velocity estimate */
+    struct sim_gains gains;
+};
+
+/* What the pilot asks for, already scaled from AT*PCMD */
+struct sim_command
+{
+    float roll;         /* rad */
+    float pitch;        /* rad */
+    float vert_speed;   /* m/s */
+    float yaw_rate;     /* rad/s */
+};
+
+/* What the controller assumes of the drone. Laid out as the QCAirframe
+ * signal's floats. */
+struct sim_airframe
+{
+    float mass;         /* kg */
+    float width;        /* m, between the left and right propellers */
+    float length;       /* m, between the front and back propellers */
+    float gravity;      /* m/s^2 */
+};
+
+/* Sensor readings the controller flies on and navdata reports */
+struct sim_sensors
+{
+    float angle[3];
+    float rate[3];
+    float vel[3];
+    float altitude;
+};
+
+/* The whole simulation: dynamics, controller and random stream. It is plain
+ * data with no pointers, so copying it is a checkpoint, and a copy stepped
+ * with the same parameters follows exactly the same path. */
+struct sim_state
+{
+    double t;
+    uint64_t steps;
+
+    enum sim_mode mode;
+    struct sim_command command;
+
+    /* World frame, z up */
+    float pos[3];
+    float vel[3];
+
+    /* Roll, pitch, yaw and their rates */
+    float angle[3];
+    float rate[3];
+
+    float gust[3];
+
+    /* Integrators of the roll, pitch and vertical loops, in newtons. They
+     * play the part of tForce in maindrone.lua. */
+    float t_force[3];
+    float prop_forces[4];
+
+    struct sim_sensors sensed;
+    struct sim_rng rng;
+};
+
+void sim_gains_default(struct sim_gains *g);
+void sim_params_default(struct sim_params *p);
+
+/* One step of the roll, pitch and vertical speed loops on the sensed angles,
+ * rates and vertical velocity, integrating t_force over dt seconds. Leaves
+ * the four propeller forces in forces, not yet limited, for the caller to
+ * add yaw to and clamp. Shared by the native simulation and the V-REP
+ * attitude controller. */
+void sim_control_forces(const struct sim_gains *g, const struct sim_airframe *a, const struct sim_command *c,
+        const struct sim_sensors *sensed, float *t_force, float dt, float *forces);
+
+/* Landed at the origin, with the random stream seeded from seed */
+void sim_init(struct sim_state *s, uint64_t seed);
+
+void sim_step(struct sim_state *s, const struct sim_params *p);
+
+/* Steps until t reaches until */
+void sim_run(struct sim_state *s, const struct sim_params *p, double until);
+
+/* AT*REF's takeoff bit: takes off when set on the ground, lands otherwise */
+void sim_set_flying(struct sim_state *s, uint8_t flying);
+
+/* Stops the motors wherever the drone is, as AT*REF's emergency bit does */
+void sim_emergency(struct sim_state *s);
+
+/* Checkpoint files hold the state as is, behind a magic number and its size,
+ * so they only load into the build that wrote them. Both return 0 on failure. */
+uint8_t sim_checkpoint_write(const char *filename, const struct sim_state *s);
+uint8_t sim_checkpoint_read(const char *filename, struct sim_state *s);
+
+uint64_t sim_rng_next(struct sim_rng *r);
+float sim_rng_uniform(struct sim_rng *r);
+float sim_rng_gaussian(struct sim_rng *r);
+
+#endif
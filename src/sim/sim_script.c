@@ -0,0 +1,172 @@
+/* User includes */
+#include "sim/sim_script.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+static void sim_script_pcmd(struct sim_script_step *step, uint32_t control, float roll, float pitch, float vert_speed, float ang_speed)
+{
+    step->action = SIM_SCRIPT_COMMAND;
+    memset(&step->command, 0, sizeof(step->command));
+
+    /* Without the progressive bit the drone hovers */
+    if(!(control & 1))
+        return;
+
+    step->command.roll = roll * SIM_SCRIPT_MAX_ROLL;
+    step->command.pitch = -pitch * SIM_SCRIPT_MAX_PITCH;
+    step->command.vert_speed = vert_speed * SIM_SCRIPT_MAX_VERT_SPEED / 1000.0f;
+    step->command.yaw_rate = -ang_speed * SIM_SCRIPT_MAX_ANG_SPEED;
+}
+
+/* AT*PCMD sends its floats as the integers with the same bits */
+static float sim_script_at_float(int32_t bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+
+    return f;
+}
+
+static uint8_t sim_script_parse(const char *line, struct sim_script_step *step)
+{
+    char command[32];
+    int offset;
+
+    if(sscanf(line, "%lf %31[^=\r\n ]%n", &step->t, command, &offset) != 2)
+        return 0;
+
+    const char *args = line + offset;
+
+    if(!strcmp(command, "takeoff"))
+        step->action = SIM_SCRIPT_TAKEOFF;
+    else if(!strcmp(command, "land"))
+        step->action = SIM_SCRIPT_LAND;
+    else if(!strcmp(command, "hover"))
+        sim_script_pcmd(step, 0, 0, 0, 0, 0);
+    else if(!strcmp(command, "pcmd"))
+    {
+        float r, p, v, a;
+
+        if(sscanf(args, "%f %f %f %f", &r, &p, &v, &a) != 4)
+            return 0;
+
+        sim_script_pcmd(step, 1, r, p, v, a);
+    }
+    else if(!strcmp(command, "AT*REF"))
+    {
+        uint32_t seq, control;
+
+        if(sscanf(args, "=%" SCNu32 ",%" SCNu32, &seq, &control) != 2)
+            return 0;
+
+        if((control >> 8) & 1)
+            step->action = SIM_SCRIPT_EMERGENCY;
+        else
+            step->action = (control >> 9) & 1 ? SIM_SCRIPT_TAKEOFF : SIM_SCRIPT_LAND;
+    }
+    else if(!strcmp(command, "AT*PCMD") || !strcmp(command, "AT*PCMD_MAG"))
+    {
+        uint32_t seq, control;
+        int32_t r, p, v, a;
+
+        if(sscanf(args, "=%" SCNu32 ",%" SCNu32 ",%" SCNd32 ",%" SCNd32 ",%" SCNd32 ",%" SCNd32, &seq, &control, &r, &p, &v, &a) != 6)
+            return 0;
+
+        sim_script_pcmd(step, control, sim_script_at_float(r), sim_script_at_float(p), sim_script_at_float(v), sim_script_at_float(a));
+    }
+    else
+        return 0;
+
+    return 1;
+}
+
+uint8_t sim_script_read(const char *filename, struct sim_script *script)
+{
+    FILE *f = fopen(filename, "r");
+    char line[256];
+    int number = 0;
+
+    if(!f)
+    {
+        printf("Could not open script %s\n", filename);
+        return 0;
+    }
+
+    script->count = 0;
+
+    while(fgets(line, sizeof(line), f))
+    {
+        ++number;
+
+        const char *start = line + strspn(line, " \t");
+
+        if(*start == '#' || *start == '\n' || *start == '\r' || !*start)
+            continue;
+
+        struct sim_script_step *step = &script->steps[script->count];
+
+        if(script->count == SIM_SCRIPT_MAX_STEPS || !sim_script_parse(start, step)
+                || (script->count && step->t < script->steps[script->count - 1].t))
+        {
+            printf("%s:%d: cannot use \"%.*s\"\n", filename, number, (int)strcspn(start, "\r\n"), start);
+            fclose(f);
+            return 0;
+        }
+
+        ++script->count;
+    }
+
+    fclose(f);
+
+    return 1;
+}
+
+void sim_script_default(struct sim_script *script)
+{
+    static const char *steps[] = {
+        "0 takeoff",
+        "5 pcmd 0 0 0.5 0",
+        "7 hover",
+        "10 pcmd 0 -0.3 0 0",
+        "14 hover",
+        "17 pcmd 0.3 0 0 0",
+        "21 hover",
+        "24 pcmd 0 0.3 0 0",
+        "28 hover",
+        "31 pcmd -0.3 0 0 0",
+        "35 hover",
+        "37 land",
+    };
+
+    script->count = 0;
+
+    for(size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i)
+        sim_script_parse(steps[i], &script->steps[script->count++]);
+}
+
+void sim_script_apply(const struct sim_script *script, int *next, struct sim_state *s)
+{
+    for(; *next < script->count && script->steps[*next].t <= s->t; ++*next)
+    {
+        const struct sim_script_step *step = &script->steps[*next];
+
+        switch(step->action)
+        {
+            case SIM_SCRIPT_TAKEOFF:
+                sim_set_flying(s, 1);
+                break;
+            case SIM_SCRIPT_LAND:
+                sim_set_flying(s, 0);
+                break;
+            case SIM_SCRIPT_EMERGENCY:
+                sim_emergency(s);
+                break;
+            case SIM_SCRIPT_COMMAND:
+                s->command = step->command;
+                break;
+        }
+    }
+}
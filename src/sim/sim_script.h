@@ -0,0 +1,50 @@
+#ifndef SIM_SCRIPT_H
+#define SIM_SCRIPT_H
+
+#include "sim/sim_model.h"
+
+#define SIM_SCRIPT_MAX_STEPS 4096
+
+/* AT*PCMD scaling, the control server's defaults */
+#define SIM_SCRIPT_MAX_ROLL 0.4f
+#define SIM_SCRIPT_MAX_PITCH 0.4f
+#define SIM_SCRIPT_MAX_VERT_SPEED 1000.0f
+#define SIM_SCRIPT_MAX_ANG_SPEED 1.0f
+
+enum sim_script_action
+{
+    SIM_SCRIPT_TAKEOFF,
+    SIM_SCRIPT_LAND,
+    SIM_SCRIPT_EMERGENCY,
+    SIM_SCRIPT_COMMAND,
+};
+
+struct sim_script_step
+{
+    double t;
+    enum sim_script_action action;
+    struct sim_command command;
+};
+
+/* A timed command sequence, in time order */
+struct sim_script
+{
+    int count;
+    struct sim_script_step steps[SIM_SCRIPT_MAX_STEPS];
+};
+
+/* Reads a script: one command per line, "<seconds> <command>", where command
+ * is takeoff, land, hover, pcmd <roll> <pitch> <vert_speed> <ang_speed> (each
+ * -1 to 1, as in AT*PCMD) or a journaled AT*REF, AT*PCMD or AT*PCMD_MAG exactly
+ * as a client sent it. Lines starting with # are skipped. Returns 0 and says
+ * which line is wrong if it cannot be read. */
+uint8_t sim_script_read(const char *filename, struct sim_script *script);
+
+/* Takeoff, a climb, a box at 2 m and a landing, 40 s in all */
+void sim_script_default(struct sim_script *script);
+
+/* Applies the steps due by s->t. next is where the script is up to and starts
+ * at 0. */
+void sim_script_apply(const struct sim_script *script, int *next, struct sim_state *s);
+
+#endif
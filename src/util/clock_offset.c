@@ -0,0 +1,54 @@
+/* User includes */
+#include "util/clock_offset.h"
+
+/* Standard includes */
+#include <string.h>
+
+void clock_offset_init(struct clock_offset *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+void clock_offset_add(struct clock_offset *c, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4)
+{
+    struct clock_offset_sample *s = &c->samples[c->next];
+
+    s->offset = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+    s->delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+
+    c->next = (c->next + 1) % CLOCK_OFFSET_WINDOW;
+    if(c->count < CLOCK_OFFSET_WINDOW)
+        ++c->count;
+}
+
+uint8_t clock_offset_estimate(const struct clock_offset *c, int64_t *offset, int64_t *error)
+{
+    const struct clock_offset_sample *best = NULL;
+
+    for(int i = 0; i < c->count; ++i)
+    {
+        if(!best || c->samples[i].delay < best->delay)
+            best = &c->samples[i];
+    }
+
+    if(!best)
+        return 0;
+
+    *offset = best->offset;
+    *error = best->delay > 0 ? best->delay / 2 : 0;
+
+    return 1;
+}
+
+uint64_t clock_offset_unwrap(uint64_t reference, uint64_t value, uint64_t modulus)
+{
+    uint64_t base = reference - reference % modulus;
+    uint64_t t = base + value % modulus;
+
+    if(t > reference && t - reference > modulus / 2 && t >= modulus)
+        t -= modulus;
+    else if(t < reference && reference - t > modulus / 2)
+        t += modulus;
+
+    return t;
+}
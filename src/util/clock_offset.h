@@ -0,0 +1,41 @@
+#ifndef CLOCK_OFFSET_H
+#define CLOCK_OFFSET_H
+
+#include <stdint.h>
+
+/* Exchanges the estimate is taken from */
+#define CLOCK_OFFSET_WINDOW 8
+
+struct clock_offset_sample
+{
+    int64_t offset;     /* server minus client, microseconds */
+    int64_t delay;      /* round trip less the server's turnaround */
+};
+
+/* Offset between a client clock and the server clock from clock sync
+ * exchanges. Only needs the four timestamps of each exchange, so benchmark
+ * harnesses can use it with their own sockets. */
+struct clock_offset
+{
+    struct clock_offset_sample samples[CLOCK_OFFSET_WINDOW];
+    int count;
+    int next;
+};
+
+void clock_offset_init(struct clock_offset *c);
+
+/* t1 client send, t2 server receive, t3 server send, t4 client receive */
+void clock_offset_add(struct clock_offset *c, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4);
+
+/* As NTP does, trusts the exchange in the window with the shortest round
+ * trip, since queueing only ever adds delay, and usually unevenly. error is
+ * half that round trip: the true offset is within offset +- error. Returns 0
+ * before the first exchange. */
+uint8_t clock_offset_estimate(const struct clock_offset *c, int64_t *offset, int64_t *error);
+
+/* Finds the time congruent to value modulo modulus nearest reference. For
+ * server times that only arrive in part, like navdata_time (2048 s) and the
+ * PaVE timestamp (2^32 ms). */
+uint64_t clock_offset_unwrap(uint64_t reference, uint64_t value, uint64_t modulus);
+
+#endif
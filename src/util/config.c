@@ -22,14 +22,40 @@ void config_set_option(char *param_name, char *param_value, struct control_sessi
         handler(&d);
 }
 
+char *config_get_option(char *param_name)
+{
+    return lookup_value_in_trie(&opt_trie, param_name);
+}
+
+float config_get_float(char *param_name, float fallback)
+{
+    char *value = config_get_option(param_name);
+
+    if(!value || !*value)
+        return fallback;
+
+    return atof(value);
+}
+
+int config_get_int(char *param_name, int fallback)
+{
+    char *value = config_get_option(param_name);
+
+    if(!value || !*value)
+        return fallback;
+
+    return atoi(value);
+}
+
 void config_read_options(void)
 {
     FILE *f = fopen("configuration", "rb");
     fseek(f, 0L, SEEK_END);
     size_t sz = ftell(f);
     fseek(f, 0L, SEEK_SET);
-    char *buffer = malloc(sz);
+    char *buffer = malloc(sz + 1);
     fread(buffer, sz, 1, f);
+    buffer[sz] = 0;
 
     char *saveptr = NULL;
     char key[41];
@@ -43,8 +69,9 @@ void config_read_options(void)
 
     while( (token = strtok_r(buf_ptr, "\n", &saveptr)) )
     {
-        sscanf(token, "%40s%*[\t ]=%*[\t ]%80c\n",key,value);
-        insert_kv_pair_to_trie(&opt_trie, key, value);
+        memset(value, 0, 81);
+        if(sscanf(token, "%40s%*[\t ]=%*[\t ]%80c\n",key,value) >= 1)
+            insert_kv_pair_to_trie(&opt_trie, key, value);
 
         buf_ptr = NULL;
     }
@@ -67,6 +94,7 @@ void config_write_options(void)
         fwrite(key, strlen(key), 1, f);
         fwrite("\t=\t", 3, 1, f);
         fwrite(value, strlen(value), 1, f);
+        fwrite("\n", 1, 1, f);
     }
 
     fclose(f);
@@ -10,6 +10,9 @@ struct config_handler_data
 };
 
 void config_set_option(char *param_name, char *param_value, struct control_session_data *session_data);
+char *config_get_option(char *param_name);
+float config_get_float(char *param_name, float fallback);
+int config_get_int(char *param_name, int fallback);
 void config_read_options(void);
 void config_write_options(void);
 struct trie *get_config_trie(void);
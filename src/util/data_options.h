@@ -13,7 +13,15 @@ struct data_options
     void (*at_ref)(struct control_session_data*, uint8_t, uint8_t);
     void (*at_pcmd_mag)(struct control_session_data*, uint32_t, float, float, float, float, float, float);
     void (*at_pcmd)(struct control_session_data*, uint32_t, float, float, float, float);
+    /* Called once a batch of datagrams has been parsed, for methods that send
+     * commands on in batches. NULL if they go as they come. */
+    void (*at_flush)(struct control_session_data*);
     void (*open_video_stream)(struct input_stream *in_stream);
+    /* Set by sources that keep decoded frames themselves. The frame points at
+     * the source's memory until the next call. NULL to decode packets. */
+    int (*read_video_frame)(struct input_stream *in_stream, AVFrame *frame);
+    /* Called at once from every navdata shard and the video thread, so it
+     * must lock any state it shares between calls */
     void (*fill_navdata_demo)(navdata_demo_t *nd);
 };
 
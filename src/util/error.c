@@ -6,8 +6,19 @@
 #include <string.h>
 #include "error.h"
 
+#ifdef VREP_PLUGIN
+#include <pthread.h>
+#include "util/plugin_threads.h"
+#endif
+
 void error(char *msg, ...)
 {
+#ifdef VREP_PLUGIN
+    /* Threads failing on the sockets a stop shut down have nothing to add */
+    if(plugin_threads_stopping() && plugin_threads_own())
+        pthread_exit(NULL);
+#endif
+
     va_list args;
     va_start(args, msg);
     vfprintf(stderr, msg, args);
@@ -16,5 +27,18 @@ void error(char *msg, ...)
     else
         printf("\n");
     va_end(args);
+
+#ifdef VREP_PLUGIN
+    /* Exiting would take V-REP down with the server, so the server stops
+     * instead and the simulator carries on. V-REP's own threads only reach
+     * the server through the callbacks, which never fail this way. */
+    if(plugin_threads_own())
+    {
+        printf("The drone server has stopped\n");
+        plugin_threads_stop();
+        pthread_exit(NULL);
+    }
+#endif
+
     exit(1);
 }
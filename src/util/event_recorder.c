@@ -0,0 +1,239 @@
+/* User includes */
+#include "util/event_recorder.h"
+#include "data_structures/packet_ring.h"
+#include "navdata/navdata_server.h"
+#include "video/video_server.h"
+#include "util/config.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+uint8_t record_events = 0;
+
+static struct packet_ring video_ring;
+static struct packet_ring navdata_ring;
+
+static int seconds;
+static float crash_tilt;
+static float crash_dv;
+
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static const char *pending = NULL;
+
+void event_recorder_init(void)
+{
+    seconds = config_get_int("event:seconds", EVENT_DEFAULT_SECONDS);
+    crash_tilt = config_get_float("event:crash_tilt", 70000.0f);
+    crash_dv = config_get_float("event:crash_dv", 3000.0f);
+
+    if(seconds < 1)
+        error("event:seconds must be at least 1");
+
+    uint32_t video_size = (uint64_t)seconds * VIDEO_BIT_RATE / 8 * EVENT_VIDEO_HEADROOM;
+    uint32_t navdata_size = seconds * NAVDATA_DEMO_RATE * EVENT_NAVDATA_MAX;
+
+    packet_ring_init(&video_ring, "video", video_size, seconds * VIDEO_FPS * EVENT_VIDEO_HEADROOM, 1);
+    packet_ring_init(&navdata_ring, "navdata", navdata_size, seconds * NAVDATA_DEMO_RATE * 2, 0);
+
+    printf("Event recorder: keeping %d s in %u KB of video and %u KB of navdata\n", seconds, video_size / 1024, navdata_size / 1024);
+}
+
+void event_record_video(const uint8_t *data, int size, uint8_t key)
+{
+    packet_ring_push(&video_ring, data, size, key);
+}
+
+void event_record_navdata(const void *packet, int size, const navdata_demo_t *demo)
+{
+    static float last_v[3];
+    static uint8_t have_last = 0;
+
+    float v[3] = { *(float*)&demo->vx, *(float*)&demo->vy, *(float*)&demo->vz };
+    uint8_t crashed;
+
+    packet_ring_push(&navdata_ring, packet, size, 1);
+
+    pthread_mutex_lock(&event_mutex);
+
+    crashed = fabsf(*(float*)&demo->theta) > crash_tilt || fabsf(*(float*)&demo->phi) > crash_tilt;
+
+    if(have_last)
+    {
+        float dx = v[0] - last_v[0], dy = v[1] - last_v[1], dz = v[2] - last_v[2];
+
+        if(sqrtf(dx * dx + dy * dy + dz * dz) > crash_dv)
+            crashed = 1;
+    }
+
+    memcpy(last_v, v, sizeof(v));
+    have_last = 1;
+
+    pthread_mutex_unlock(&event_mutex);
+
+    if(crashed)
+        event_trigger("crash");
+}
+
+void event_trigger(const char *reason)
+{
+    if(!record_events)
+        return;
+
+    pthread_mutex_lock(&event_mutex);
+
+    if(!pending)
+    {
+        pending = reason;
+        pthread_cond_signal(&event_cond);
+    }
+
+    pthread_mutex_unlock(&event_mutex);
+}
+
+/* The rings keep as much as fits, which is more than event:seconds at low
+ * bitrates, so the dump starts at the last key packet before the window. */
+static void event_dump_ring(struct packet_ring *r, const char *path, uint8_t records)
+{
+    uint32_t first;
+    uint32_t count = packet_ring_hold(r, &first);
+    uint32_t start = first;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for(uint32_t i = first; i != first + count; ++i)
+    {
+        const struct packet_ring_entry *e = packet_ring_entry(r, i);
+
+        if(e->time.tv_sec + seconds > now.tv_sec)
+            break;
+
+        if(e->key)
+            start = i;
+    }
+
+    FILE *f = fopen(path, "wb");
+
+    if(f)
+    {
+        for(uint32_t i = start; i != first + count; ++i)
+        {
+            const struct packet_ring_entry *e = packet_ring_entry(r, i);
+
+            if(records)
+            {
+                struct event_navdata_record record = {
+                    .size = e->size,
+                    .sec = e->time.tv_sec,
+                    .nsec = e->time.tv_nsec,
+                };
+
+                fwrite(&record, sizeof(record), 1, f);
+            }
+
+            fwrite(r->data + e->offset, e->size, 1, f);
+        }
+
+        fclose(f);
+    }
+    else
+        printf("Could not write event dump %s\n", path);
+
+    packet_ring_release(r, first, count);
+}
+
+void *event_recorder_listen(void *args)
+{
+    char *metric_name = config_get_option("event:metric");
+    float metric_above = config_get_float("event:metric_above", 0.0f);
+    float cooldown = config_get_float("event:cooldown", 5.0f);
+
+    struct metric *watched = NULL;
+    struct metric *dumps = metrics_counter("event_dumps");
+    struct metric *dump_ms = metrics_gauge("event_dump_ms");
+
+    uint8_t was_above = 0;
+    struct timespec last_dump = {0, 0};
+
+    mkdir(EVENT_DIR, 0755);
+
+    while(1)
+    {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        ++wake.tv_sec;
+
+        pthread_mutex_lock(&event_mutex);
+
+        if(!pending)
+            pthread_cond_timedwait(&event_cond, &event_mutex, &wake);
+
+        const char *reason = pending;
+
+        pthread_mutex_unlock(&event_mutex);
+
+        /* Only crossing the threshold counts, not staying above it */
+        if(metric_name && (watched || (watched = metrics_find(metric_name))))
+        {
+            uint8_t above = metrics_value(watched) > metric_above;
+
+            if(above && !was_above && !reason)
+                reason = "metric";
+
+            was_above = above;
+        }
+
+        if(!reason)
+            continue;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if(last_dump.tv_sec && start.tv_sec - last_dump.tv_sec + (start.tv_nsec - last_dump.tv_nsec) / 1e9 < cooldown)
+        {
+            pthread_mutex_lock(&event_mutex);
+            pending = NULL;
+            pthread_mutex_unlock(&event_mutex);
+
+            continue;
+        }
+
+        char stamp[20];
+        char path[80];
+        time_t t = time(NULL);
+        struct tm tm;
+
+        localtime_r(&t, &tm);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+        snprintf(path, sizeof(path), EVENT_DIR "/%s-%s.h264", stamp, reason);
+        event_dump_ring(&video_ring, path, 0);
+
+        snprintf(path, sizeof(path), EVENT_DIR "/%s-%s.navdata", stamp, reason);
+        event_dump_ring(&navdata_ring, path, 1);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        last_dump = end;
+
+        metrics_add(dumps, 1);
+        metrics_set(dump_ms, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+        printf("Event %s: wrote " EVENT_DIR "/%s-%s.*\n", reason, stamp, reason);
+
+        /* Triggers that came in while writing are part of the same event */
+        pthread_mutex_lock(&event_mutex);
+        pending = NULL;
+        pthread_mutex_unlock(&event_mutex);
+    }
+
+    return NULL;
+}
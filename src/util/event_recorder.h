@@ -0,0 +1,45 @@
+#ifndef EVENT_RECORDER_H
+#define EVENT_RECORDER_H
+
+#include "navdata/navdata_common.h"
+#include <stdint.h>
+
+/* Seconds of video and navdata kept before an event. Can be overridden with
+ * event:seconds in the configuration file. */
+#define EVENT_DEFAULT_SECONDS 10
+
+/* Dumps are written here, relative to bin/ */
+#define EVENT_DIR "events"
+
+/* Headroom over the nominal bitrate for IDR frames and rate control overshoot */
+#define EVENT_VIDEO_HEADROOM 2
+
+/* Upper bound on a navdata packet, used to size the navdata ring */
+#define EVENT_NAVDATA_MAX 512
+
+/* Each packet in a .navdata dump is preceded by this */
+struct event_navdata_record
+{
+    uint32_t size;
+    uint32_t sec;
+    uint32_t nsec;
+} __attribute__ ((packed));
+
+/* Allocates the rings. Memory use is fixed from here on. */
+void event_recorder_init(void);
+
+void event_record_video(const uint8_t *data, int size, uint8_t key);
+
+/* Also checks demo for a crash: a tilt beyond event:crash_tilt (millidegrees)
+ * or a change in velocity between packets beyond event:crash_dv (mm/s). */
+void event_record_navdata(const void *packet, int size, const navdata_demo_t *demo);
+
+/* Asks for the rings to be written out. Never blocks; triggers during a dump
+ * or within event:cooldown seconds of the last one are ignored. */
+void event_trigger(const char *reason);
+
+/* Writes out the rings when triggered, and triggers when the metric named by
+ * event:metric goes above event:metric_above */
+void *event_recorder_listen(void *args);
+
+#endif
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "util/flood_guard.h"
+#include "util/config.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+struct flood_limit
+{
+    char *name;
+    float rate;     /* datagrams per second, 0 disables the limit */
+    float burst;
+};
+
+/* Defaults leave plenty of room for a client sending its usual 30 ms command
+ * cycle and start-up configuration burst. Each can be overridden with
+ * flood:<name>_rate and flood:<name>_burst in the configuration file. */
+static struct flood_limit limits[FLOOD_NUM_CLASSES] = {
+    [FLOOD_CLASS_CONFIG] = { .name = "config", .rate = 20, .burst = 50 },
+    [FLOOD_CLASS_PILOT] = { .name = "pilot", .rate = 200, .burst = 50 },
+    [FLOOD_CLASS_OTHER] = { .name = "other", .rate = 50, .burst = 50 },
+    [FLOOD_CLASS_NAVDATA] = { .name = "navdata", .rate = 10, .burst = 5 },
+    [FLOOD_CLASS_CLOCKSYNC] = { .name = "clocksync", .rate = 20, .burst = 20 },
+};
+
+static pthread_once_t limits_once = PTHREAD_ONCE_INIT;
+
+static void flood_load_limits(void)
+{
+    char key[41];
+
+    for(int i = 0; i < FLOOD_NUM_CLASSES; ++i)
+    {
+        snprintf(key, sizeof(key), "flood:%s_rate", limits[i].name);
+        limits[i].rate = config_get_float(key, limits[i].rate);
+        snprintf(key, sizeof(key), "flood:%s_burst", limits[i].name);
+        limits[i].burst = config_get_float(key, limits[i].burst);
+    }
+}
+
+void flood_guard_init(struct flood_guard *g)
+{
+    char key[41];
+
+    pthread_once(&limits_once, flood_load_limits);
+
+    memset(g->sources, 0, sizeof(g->sources));
+
+    for(int i = 0; i < FLOOD_NUM_CLASSES; ++i)
+    {
+        token_bucket_init(&g->newcomers[i], limits[i].rate, limits[i].burst);
+
+        snprintf(key, sizeof(key), "flood_%s_passed", limits[i].name);
+        g->passed[i] = metrics_counter(key);
+        snprintf(key, sizeof(key), "flood_%s_dropped", limits[i].name);
+        g->dropped[i] = metrics_counter(key);
+    }
+}
+
+/* Classifies one command by its name, given what follows its AT* */
+static enum flood_class flood_classify_command(const char *name, int len)
+{
+    switch(len > 0 ? name[0] : 0)
+    {
+        case 'C':
+            if(len >= 4 && (!memcmp(name, "CONF", 4) || !memcmp(name, "CTRL", 4)))
+                return FLOOD_CLASS_CONFIG;
+            if(len >= 6 && !memcmp(name, "COMWDG", 6))
+                return FLOOD_CLASS_PILOT;
+            break;
+        case 'P':
+            if(len >= 4 && !memcmp(name, "PCMD", 4))
+                return FLOOD_CLASS_PILOT;
+            break;
+        case 'R':
+            if(len >= 3 && !memcmp(name, "REF", 3))
+                return FLOOD_CLASS_PILOT;
+            break;
+    }
+
+    return FLOOD_CLASS_OTHER;
+}
+
+/* Counts the commands in a control datagram by class, so a datagram packing
+ * many commands behind a cheap one pays for each of them. Commands are found
+ * by their AT* prefix and classified by name, which is a scan rather than a
+ * parse. A datagram with no command counts as one other. */
+void flood_classify_control(const char *buf, int len, unsigned counts[FLOOD_NUM_CLASSES])
+{
+    const char *end = buf + len;
+    const char *cmd = buf;
+    unsigned total = 0;
+
+    memset(counts, 0, FLOOD_NUM_CLASSES * sizeof(counts[0]));
+
+    while(cmd < end && (cmd = memmem(cmd, end - cmd, "AT*", 3)))
+    {
+        cmd += 3;
+        ++counts[flood_classify_command(cmd, end - cmd)];
+        ++total;
+    }
+
+    if(!total)
+        counts[FLOOD_CLASS_OTHER] = 1;
+}
+
+static struct flood_source *flood_find_source(struct flood_guard *g, uint32_t addr, uint16_t port, const struct timespec *now)
+{
+    uint32_t hash = (addr * 2654435761u) ^ (port * 40503u);
+    struct flood_source *oldest = NULL;
+
+    for(int i = 0; i < FLOOD_PROBE; ++i)
+    {
+        struct flood_source *s = &g->sources[(hash + i) % FLOOD_TABLE_SIZE];
+
+        if(s->used && s->addr == addr && s->port == port)
+            return s;
+
+        if(!s->used)
+        {
+            oldest = s;
+            break;
+        }
+
+        if(!oldest || s->last_seen.tv_sec < oldest->last_seen.tv_sec)
+            oldest = s;
+    }
+
+    oldest->used = 1;
+    oldest->addr = addr;
+    oldest->port = port;
+
+    /* The first burst comes out of the shared allowance rather than a full
+     * bucket, which a flood could get again just by changing source port */
+    for(int i = 0; i < FLOOD_NUM_CLASSES; ++i)
+    {
+        struct token_bucket *tb = &oldest->buckets[i];
+        struct token_bucket *shared = &g->newcomers[i];
+
+        token_bucket_init(tb, limits[i].rate, limits[i].burst);
+        tb->last = *now;
+
+        token_bucket_refill(shared, now);
+        tb->tokens = shared->tokens < tb->depth ? shared->tokens : tb->depth;
+        shared->tokens -= tb->tokens;
+    }
+
+    return oldest;
+}
+
+uint8_t flood_guard_admit_counts(struct flood_guard *g, const struct sockaddr_in *from, const unsigned counts[FLOOD_NUM_CLASSES], const struct timespec *now)
+{
+    struct flood_source *s = NULL;
+    uint8_t admit = 1;
+
+    for(int i = 0; i < FLOOD_NUM_CLASSES; ++i)
+    {
+        if(!counts[i] || limits[i].rate <= 0)
+            continue;
+
+        if(!s)
+        {
+            s = flood_find_source(g, from->sin_addr.s_addr, from->sin_port, now);
+            s->last_seen = *now;
+        }
+
+        token_bucket_refill(&s->buckets[i], now);
+
+        if(s->buckets[i].tokens < counts[i])
+            admit = 0;
+    }
+
+    for(int i = 0; i < FLOOD_NUM_CLASSES; ++i)
+    {
+        if(!counts[i])
+            continue;
+
+        if(!admit)
+        {
+            metrics_add(g->dropped[i], counts[i]);
+            continue;
+        }
+
+        if(s && limits[i].rate > 0)
+            s->buckets[i].tokens -= counts[i];
+
+        metrics_add(g->passed[i], counts[i]);
+    }
+
+    return admit;
+}
+
+uint8_t flood_guard_admit(struct flood_guard *g, const struct sockaddr_in *from, enum flood_class c, const struct timespec *now)
+{
+    unsigned counts[FLOOD_NUM_CLASSES] = { 0 };
+
+    counts[c] = 1;
+
+    return flood_guard_admit_counts(g, from, counts, now);
+}
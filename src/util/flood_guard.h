@@ -0,0 +1,52 @@
+#ifndef FLOOD_GUARD_H
+#define FLOOD_GUARD_H
+
+#include "util/token_bucket.h"
+#include "util/metrics.h"
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/* Number of client addresses tracked per listener. When the table is full the
+ * least recently seen source in the probe window is recycled. A new source
+ * draws its first burst from an allowance all new sources share, so cycling
+ * through addresses or ports earns no more than one client gets. */
+#define FLOOD_TABLE_SIZE 64
+#define FLOOD_PROBE 8
+
+enum flood_class
+{
+    FLOOD_CLASS_CONFIG,     /* AT*CONFIG, AT*CONFIG_IDS, AT*CTRL */
+    FLOOD_CLASS_PILOT,      /* AT*PCMD, AT*PCMD_MAG, AT*REF, AT*COMWDG */
+    FLOOD_CLASS_OTHER,      /* any other AT command */
+    FLOOD_CLASS_NAVDATA,    /* navdata stream requests */
+    FLOOD_CLASS_CLOCKSYNC,  /* clock sync exchanges */
+    FLOOD_NUM_CLASSES
+};
+
+struct flood_source
+{
+    uint32_t addr;
+    uint16_t port;
+    uint8_t used;
+    struct timespec last_seen;
+    struct token_bucket buckets[FLOOD_NUM_CLASSES];
+};
+
+struct flood_guard
+{
+    struct flood_source sources[FLOOD_TABLE_SIZE];
+    struct token_bucket newcomers[FLOOD_NUM_CLASSES];
+    struct metric *passed[FLOOD_NUM_CLASSES];
+    struct metric *dropped[FLOOD_NUM_CLASSES];
+};
+
+void flood_guard_init(struct flood_guard *g);
+void flood_classify_control(const char *buf, int len, unsigned counts[FLOOD_NUM_CLASSES]);
+uint8_t flood_guard_admit(struct flood_guard *g, const struct sockaddr_in *from, enum flood_class c, const struct timespec *now);
+
+/* Admits a datagram if the source has a token in each class for each of its
+ * commands there, and takes them all. Otherwise none are taken. */
+uint8_t flood_guard_admit_counts(struct flood_guard *g, const struct sockaddr_in *from, const unsigned counts[FLOOD_NUM_CLASSES], const struct timespec *now);
+
+#endif
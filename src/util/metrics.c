@@ -0,0 +1,112 @@
+/* User includes */
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+static struct metric metrics[METRICS_MAX];
+static int num_metrics = 0;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Registration happens while services start up, so a linear search under a
+ * lock is fine. Updates go straight to the returned metric. */
+static struct metric *metrics_register(const char *name, uint8_t gauge)
+{
+    struct metric *m = NULL;
+
+    pthread_mutex_lock(&metrics_mutex);
+
+    for(int i = 0; i < num_metrics; ++i)
+    {
+        if(!strcmp(metrics[i].name, name))
+        {
+            m = &metrics[i];
+            break;
+        }
+    }
+
+    if(!m)
+    {
+        if(num_metrics == METRICS_MAX)
+            error("Too many metrics registered");
+
+        m = &metrics[num_metrics++];
+        m->name = strdup(name);
+        m->gauge = gauge;
+    }
+
+    pthread_mutex_unlock(&metrics_mutex);
+
+    return m;
+}
+
+struct metric *metrics_counter(const char *name)
+{
+    return metrics_register(name, 0);
+}
+
+struct metric *metrics_gauge(const char *name)
+{
+    return metrics_register(name, 1);
+}
+
+struct metric *metrics_find(const char *name)
+{
+    struct metric *m = NULL;
+
+    pthread_mutex_lock(&metrics_mutex);
+
+    for(int i = 0; i < num_metrics; ++i)
+    {
+        if(!strcmp(metrics[i].name, name))
+        {
+            m = &metrics[i];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&metrics_mutex);
+
+    return m;
+}
+
+void metrics_write(FILE *f)
+{
+    pthread_mutex_lock(&metrics_mutex);
+    int n = num_metrics;
+    pthread_mutex_unlock(&metrics_mutex);
+
+    for(int i = 0; i < n; ++i)
+    {
+        if(metrics[i].gauge)
+            fprintf(f, "%s\t=\t%f\n", metrics[i].name, metrics[i].value);
+        else
+            fprintf(f, "%s\t=\t%" PRIu64 "\n", metrics[i].name, metrics[i].count);
+    }
+}
+
+/* Rewrites the metrics file once a second. It lives next to the configuration
+ * file, so clients can fetch it over FTP. */
+void *metrics_listen(void *args)
+{
+    while(1)
+    {
+        FILE *f = fopen(METRICS_FILE ".tmp", "wb");
+
+        if(f)
+        {
+            metrics_write(f);
+            fclose(f);
+            rename(METRICS_FILE ".tmp", METRICS_FILE);
+        }
+
+        sleep(1);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_MAX 128
+#define METRICS_FILE "metrics"
+
+struct metric
+{
+    const char *name;
+    uint8_t gauge;
+    volatile uint64_t count;
+    volatile double value;
+};
+
+struct metric *metrics_counter(const char *name);
+struct metric *metrics_gauge(const char *name);
+
+/* Returns NULL if nothing has registered name (yet) */
+struct metric *metrics_find(const char *name);
+
+static inline void metrics_add(struct metric *m, uint64_t n)
+{
+    __sync_fetch_and_add(&m->count, n);
+}
+
+static inline void metrics_set(struct metric *m, double value)
+{
+    m->value = value;
+}
+
+static inline double metrics_value(const struct metric *m)
+{
+    return m->gauge ? m->value : m->count;
+}
+
+void metrics_write(FILE *f);
+void *metrics_listen(void *args);
+
+#endif
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "util/numa_place.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define NODE_PATH "/sys/devices/system/node"
+#define THP_ENABLED "/sys/kernel/mm/transparent_hugepage/enabled"
+
+/* The kernel reads one bit fewer of a node mask than it is told to */
+#define NODE_MASK_BITS (NUMA_PLACE_MAX_NODES + 1)
+
+/* Node to put the drone on, set by -N */
+int numa_place_node = NUMA_PLACE_OFF;
+
+/* Node the drone went on, or -1 if it was not placed */
+static int placed_node = -1;
+static unsigned long node_mask[NUMA_PLACE_MAX_NODES / (8 * sizeof(unsigned long))];
+
+static uint8_t read_line(const char *path, char *line, int size)
+{
+    FILE *f = fopen(path, "r");
+
+    if(!f)
+        return 0;
+
+    uint8_t ok = fgets(line, size, f) != NULL;
+    fclose(f);
+
+    line[strcspn(line, "\n")] = '\0';
+
+    return ok;
+}
+
+/* Reads a sysfs list like "0-3,8-11" into a set. Returns the number in it. */
+static int parse_list(const char *list, cpu_set_t *set)
+{
+    int count = 0;
+
+    CPU_ZERO(set);
+
+    while(*list)
+    {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+
+        if(end == list)
+            break;
+
+        if(*end == '-')
+            last = strtol(end + 1, &end, 10);
+
+        for(long i = first; i <= last && i < CPU_SETSIZE; ++i, ++count)
+            CPU_SET(i, set);
+
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+static int node_cpus(int node, cpu_set_t *cpus, char *list, int size)
+{
+    char path[128];
+
+    snprintf(path, sizeof(path), NODE_PATH "/node%d/cpulist", node);
+
+    if(!read_line(path, list, size))
+        return 0;
+
+    return parse_list(list, cpus);
+}
+
+/* A field of the node's meminfo, in kB */
+static unsigned long node_meminfo(int node, const char *field)
+{
+    char path[128], line[256], key[32];
+    unsigned long value, found = 0;
+
+    snprintf(path, sizeof(path), NODE_PATH "/node%d/meminfo", node);
+
+    FILE *f = fopen(path, "r");
+    if(!f)
+        return 0;
+
+    while(fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, "Node %*d %31[^:]: %lu", key, &value) == 2 && !strcmp(key, field))
+        {
+            found = value;
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return found;
+}
+
+static size_t huge_page_size(void)
+{
+    static size_t size = 0;
+    char line[256];
+
+    if(size)
+        return size;
+
+    size = 2 * 1024 * 1024;
+
+    FILE *f = fopen("/proc/meminfo", "r");
+    if(!f)
+        return size;
+
+    unsigned long kb;
+
+    while(fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+        {
+            size = kb * 1024;
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return size;
+}
+
+static unsigned long node_huge_pages(int node, const char *count)
+{
+    char path[160], line[32];
+
+    snprintf(path, sizeof(path), NODE_PATH "/node%d/hugepages/hugepages-%zukB/%s", node, huge_page_size() / 1024, count);
+
+    return read_line(path, line, sizeof(line)) ? strtoul(line, NULL, 10) : 0;
+}
+
+/* Node the page at p is on, once it has been faulted in */
+static int page_node(void *p)
+{
+    int node = -1;
+
+    if(syscall(SYS_get_mempolicy, &node, NULL, 0, p, MPOL_F_NODE | MPOL_F_ADDR) < 0)
+        return -1;
+
+    return node;
+}
+
+static uint8_t pick_node(const cpu_set_t *online)
+{
+    char list[256];
+    cpu_set_t cpus;
+    unsigned long most = 0;
+
+    if(numa_place_node != NUMA_PLACE_AUTO)
+        return 1;
+
+    /* Nodes that are only memory cannot run the drone */
+    for(int n = 0; n < NUMA_PLACE_MAX_NODES; ++n)
+    {
+        if(!CPU_ISSET(n, online) || !node_cpus(n, &cpus, list, sizeof(list)))
+            continue;
+
+        unsigned long free_kb = node_meminfo(n, "MemFree");
+
+        if(numa_place_node == NUMA_PLACE_AUTO || free_kb > most)
+        {
+            numa_place_node = n;
+            most = free_kb;
+        }
+    }
+
+    return numa_place_node != NUMA_PLACE_AUTO;
+}
+
+/* Threads the process already has, such as the remote API's, are moved as
+ * well. Ones made later get the mask from the thread making them. */
+static void move_threads(const cpu_set_t *cpus)
+{
+    DIR *tasks = opendir("/proc/self/task");
+    struct dirent *task;
+
+    if(!tasks)
+    {
+        if(sched_setaffinity(0, sizeof(*cpus), cpus) < 0)
+            error("Could not move the drone to node %d's CPUs", numa_place_node);
+
+        return;
+    }
+
+    while((task = readdir(tasks)))
+    {
+        pid_t tid = atoi(task->d_name);
+
+        if(tid > 0 && sched_setaffinity(tid, sizeof(*cpus), cpus) < 0)
+            error("Could not move thread %d to node %d's CPUs", tid, numa_place_node);
+    }
+
+    closedir(tasks);
+}
+
+void numa_place_init(void)
+{
+    char line[256], list[256];
+    cpu_set_t online, cpus;
+
+    if(numa_place_node == NUMA_PLACE_OFF)
+        return;
+
+    if(!read_line(NODE_PATH "/online", line, sizeof(line)) || !parse_list(line, &online) || !pick_node(&online))
+    {
+        printf("NUMA: no nodes to place the drone on, leaving it to the kernel\n");
+        return;
+    }
+
+    int node = numa_place_node;
+
+    if(node >= NUMA_PLACE_MAX_NODES || !CPU_ISSET(node, &online))
+        error("NUMA node %d is not online", node);
+
+    int num_cpus = node_cpus(node, &cpus, list, sizeof(list));
+    if(!num_cpus)
+        error("NUMA node %d has no CPUs to run the drone on", node);
+
+    move_threads(&cpus);
+
+    /* Preferred rather than bound, so a full node spills over instead of the
+     * drone being killed. The pool reports show if anything did. This only
+     * sets the policy of the calling thread and the threads it makes from
+     * now on, which is why the pools are bound as ranges as well. */
+    node_mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask, NODE_MASK_BITS) < 0)
+        error("Could not give the drone node %d's memory", node);
+
+    placed_node = node;
+
+    printf("NUMA: drone on node %d of %d, CPUs %s (%d), %lu MB free, %lu of %lu %zu kB huge pages free\n",
+            node, CPU_COUNT(&online), list, num_cpus, node_meminfo(node, "MemFree") / 1024,
+            node_huge_pages(node, "free_hugepages"), node_huge_pages(node, "nr_hugepages"), huge_page_size() / 1024);
+}
+
+uint8_t numa_place_active(void)
+{
+    return placed_node >= 0;
+}
+
+static uint8_t thp_enabled(void)
+{
+    char line[128];
+
+    return read_line(THP_ENABLED, line, sizeof(line)) && !strstr(line, "[never]");
+}
+
+/* Returns whether the range can get transparent huge pages */
+static uint8_t advise(void *p, size_t size)
+{
+    uint8_t thp = madvise(p, size, MADV_HUGEPAGE) == 0 && thp_enabled();
+
+    /* On the range as well as the thread, so it holds whichever thread
+     * faults the pages in */
+    if(placed_node >= 0)
+        syscall(SYS_mbind, p, size, MPOL_PREFERRED, node_mask, NODE_MASK_BITS, 0);
+
+    return thp;
+}
+
+void *numa_place_alloc(size_t size, const char *what)
+{
+    size_t huge = huge_page_size();
+    size_t rounded = (size + huge - 1) & ~(huge - 1);
+    const char *pages = "huge pages";
+
+    /* Reserved huge pages are claimed by mmap, so a shortage fails here
+     * rather than faulting later. They come from the node by the thread's
+     * policy. */
+    void *p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+    if(p == MAP_FAILED)
+    {
+        p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED)
+            error("Could not allocate %zu bytes for the %s", size, what);
+
+        pages = advise(p, rounded) ? "transparent huge pages" : "small pages";
+
+        /* Faulted in now rather than on the first frames */
+        memset(p, 0, rounded);
+    }
+
+    if(placed_node >= 0)
+        printf("NUMA: %s, %zu kB on node %d in %s\n", what, rounded / 1024, page_node(p), pages);
+
+    return p;
+}
+
+void numa_place_bind(void *p, size_t size, const char *what)
+{
+    const char *pages = advise(p, size) ? "transparent huge pages" : "small pages";
+
+    if(placed_node >= 0)
+        printf("NUMA: %s, up to %zu kB on node %d in %s\n", what, size / 1024, placed_node, pages);
+}
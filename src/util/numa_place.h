@@ -0,0 +1,38 @@
+#ifndef NUMA_PLACE_H
+#define NUMA_PLACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Values of numa_place_node besides a node number */
+#define NUMA_PLACE_OFF -2
+#define NUMA_PLACE_AUTO -1
+
+/* Highest node number placement handles */
+#define NUMA_PLACE_MAX_NODES 64
+
+/* Puts the whole drone on one node: every thread of the process is moved to
+ * the node's CPUs, and the calling thread's memory comes from the node while
+ * it has any. With NUMA_PLACE_AUTO the node with the most free memory is
+ * picked. The memory policy is per thread: only threads the caller makes
+ * afterwards inherit it, so this is called from the thread that starts the
+ * servers, before it does. Threads already running, such as the remote
+ * API's, keep allocating wherever they did. Prints where the drone went.
+ * Does nothing unless -N was given. */
+void numa_place_init(void);
+
+/* Returns 1 once the drone has been placed on a node */
+uint8_t numa_place_active(void);
+
+/* Allocates a pool that lives as long as the server, zeroed and already
+ * faulted in. It is taken from reserved huge pages if there are enough, or
+ * else is ordinary memory marked for transparent huge pages. Placed on the
+ * drone's node and reported, what naming it. Only for use once
+ * numa_place_active says placement is on. */
+void *numa_place_alloc(size_t size, const char *what);
+
+/* For a mapping made elsewhere that has not been touched yet: marks it for
+ * transparent huge pages and, if placement is on, for the drone's node */
+void numa_place_bind(void *p, size_t size, const char *what);
+
+#endif
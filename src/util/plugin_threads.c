@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "util/plugin_threads.h"
+
+/* The __real_ functions only exist when linked with --wrap */
+#ifdef VREP_PLUGIN
+
+/* Standard includes */
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+
+struct plugin_thread
+{
+    pthread_t id;
+    void *(*start)(void *);
+    void *arg;
+    struct plugin_thread *next;
+};
+
+int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start)(void *), void *arg);
+int __real_socket(int domain, int type, int protocol);
+int __real_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+int __real_close(int fd);
+
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t threads_cond = PTHREAD_COND_INITIALIZER;
+static struct plugin_thread *threads = NULL;
+static uint8_t stopping = 0;
+
+/* Sockets the server has open, by descriptor */
+static uint8_t sockets[PLUGIN_THREADS_MAX_FDS];
+
+/* Runs however the thread ends: returning, pthread_exit or cancellation */
+static void plugin_thread_done(void *arg)
+{
+    struct plugin_thread *t = arg;
+
+    pthread_mutex_lock(&threads_mutex);
+
+    for(struct plugin_thread **p = &threads; *p; p = &(*p)->next)
+    {
+        if(*p == t)
+        {
+            *p = t->next;
+            break;
+        }
+    }
+
+    pthread_cond_broadcast(&threads_cond);
+    pthread_mutex_unlock(&threads_mutex);
+
+    free(t);
+}
+
+static void *plugin_thread_run(void *arg)
+{
+    struct plugin_thread *t = arg;
+    void *ret;
+
+    pthread_cleanup_push(plugin_thread_done, t);
+    ret = t->start(t->arg);
+    pthread_cleanup_pop(1);
+
+    return ret;
+}
+
+/* The lock is held across the create, so the thread is on the list with its
+ * id before it can finish or be cancelled */
+int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start)(void *), void *arg)
+{
+    struct plugin_thread *t = malloc(sizeof(struct plugin_thread));
+    int ret;
+
+    if(!t)
+        return EAGAIN;
+
+    t->start = start;
+    t->arg = arg;
+
+    pthread_mutex_lock(&threads_mutex);
+
+    if(stopping)
+        ret = EAGAIN;
+    else if(!(ret = __real_pthread_create(thread, attr, plugin_thread_run, t)))
+    {
+        t->id = *thread;
+        t->next = threads;
+        threads = t;
+    }
+
+    pthread_mutex_unlock(&threads_mutex);
+
+    if(ret)
+        free(t);
+
+    return ret;
+}
+
+static int track_socket(int fd)
+{
+    if(fd < 0 || fd >= PLUGIN_THREADS_MAX_FDS)
+        return fd;
+
+    pthread_mutex_lock(&threads_mutex);
+    sockets[fd] = 1;
+    pthread_mutex_unlock(&threads_mutex);
+
+    return fd;
+}
+
+int __wrap_socket(int domain, int type, int protocol)
+{
+    return track_socket(__real_socket(domain, type, protocol));
+}
+
+int __wrap_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    return track_socket(__real_accept(sockfd, addr, addrlen));
+}
+
+/* Untracked before the descriptor can be reused, so a stop never shuts a
+ * socket of V-REP's down */
+int __wrap_close(int fd)
+{
+    if(fd >= 0 && fd < PLUGIN_THREADS_MAX_FDS)
+    {
+        pthread_mutex_lock(&threads_mutex);
+        sockets[fd] = 0;
+        pthread_mutex_unlock(&threads_mutex);
+    }
+
+    return __real_close(fd);
+}
+
+/* Threads on the list other than the caller. Call with threads_mutex held. */
+static int others(void)
+{
+    int count = 0;
+
+    for(struct plugin_thread *t = threads; t; t = t->next)
+    {
+        if(!pthread_equal(t->id, pthread_self()))
+            ++count;
+    }
+
+    return count;
+}
+
+int plugin_threads_stop(void)
+{
+    struct timespec deadline;
+    int left, cancel_state;
+
+    /* A server thread stopping after an error may be cancelled by another
+     * doing the same, and must not be inside the lock when it is */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PLUGIN_THREADS_STOP_TIMEOUT;
+
+    pthread_mutex_lock(&threads_mutex);
+
+    /* Blocked reads and accepts return at once on a shut down socket, and
+     * cancellation ends the threads waiting anywhere else */
+    if(!stopping)
+    {
+        stopping = 1;
+
+        for(int fd = 0; fd < PLUGIN_THREADS_MAX_FDS; ++fd)
+        {
+            if(sockets[fd])
+                shutdown(fd, SHUT_RDWR);
+        }
+
+        for(struct plugin_thread *t = threads; t; t = t->next)
+        {
+            if(!pthread_equal(t->id, pthread_self()))
+                pthread_cancel(t->id);
+        }
+    }
+
+    while((left = others()) && pthread_cond_timedwait(&threads_cond, &threads_mutex, &deadline) != ETIMEDOUT)
+        ;
+
+    left = others();
+
+    /* Leaves the ports free for a server started again, unless a thread that
+     * might still use one is left */
+    if(!left)
+    {
+        for(int fd = 0; fd < PLUGIN_THREADS_MAX_FDS; ++fd)
+        {
+            if(sockets[fd])
+            {
+                __real_close(fd);
+                sockets[fd] = 0;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&threads_mutex);
+
+    pthread_setcancelstate(cancel_state, NULL);
+
+    return left;
+}
+
+uint8_t plugin_threads_stopping(void)
+{
+    pthread_mutex_lock(&threads_mutex);
+    uint8_t s = stopping;
+    pthread_mutex_unlock(&threads_mutex);
+
+    return s;
+}
+
+uint8_t plugin_threads_own(void)
+{
+    uint8_t own = 0;
+
+    pthread_mutex_lock(&threads_mutex);
+
+    for(struct plugin_thread *t = threads; t && !own; t = t->next)
+        own = pthread_equal(t->id, pthread_self());
+
+    pthread_mutex_unlock(&threads_mutex);
+
+    return own;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef PLUGIN_THREADS_H
+#define PLUGIN_THREADS_H
+
+#include <stdint.h>
+
+/* Inside V-REP the server cannot exit the process to stop, so the plugin is
+ * linked with --wrap for pthread_create, socket, accept and close, and every
+ * thread the server starts and socket it opens is tracked here. Only built
+ * into the plugin. */
+
+/* Seconds a stop waits for the server's threads to finish */
+#define PLUGIN_THREADS_STOP_TIMEOUT 2
+
+/* Descriptors above this are not tracked */
+#define PLUGIN_THREADS_MAX_FDS 65536
+
+/* Shuts down every socket the server has open and cancels all of its threads
+ * but the caller, then waits for them to finish, up to
+ * PLUGIN_THREADS_STOP_TIMEOUT. Once they have, the sockets are closed.
+ * Returns the number of threads still running. No thread can be started
+ * after the first call. */
+int plugin_threads_stop(void);
+
+uint8_t plugin_threads_stopping(void);
+
+/* Returns 1 on a thread the server started, 0 on one of V-REP's */
+uint8_t plugin_threads_own(void);
+
+#endif
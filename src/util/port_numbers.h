@@ -13,5 +13,6 @@
 #define FTP_LISTEN_PORT 25551
 #define VIDEO_PORT 25555
 #define CONTROLCOMM_LISTEN_PORT 25559
+#define CLOCKSYNC_PORT 25557
 
 #endif
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "util/reuseport.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+
+/* Number of sockets, each with its own thread, receiving on the control and
+ * navdata ports */
+int ingest_shards = 1;
+uint8_t ingest_steer_cpu = 0;
+
+int reuseport_bind_udp(uint16_t port, uint8_t shared)
+{
+    struct sockaddr_in serv_addr;
+    int one = 1;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sockfd < 0)
+        error("ERROR opening socket");
+
+    if(shared && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        error("Could not set SO_REUSEPORT");
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+        error("ERROR on binding");
+
+    return sockfd;
+}
+
+void reuseport_steer_by_cpu(int fd, int shards)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, shards },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0)
+        return;
+#endif
+
+    printf("Could not attach CPU steering program, using the kernel's flow hash\n");
+}
+
+/* Counts through the CPUs the thread may run on, which are only the drone's
+ * node's under NUMA placement */
+void reuseport_pin_thread(int cpu)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t allowed, set;
+
+    CPU_ZERO(&set);
+
+    if(pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed))
+    {
+        int n = cpu % CPU_COUNT(&allowed);
+
+        for(int i = 0; i < CPU_SETSIZE; ++i)
+        {
+            if(CPU_ISSET(i, &allowed) && n-- == 0)
+            {
+                CPU_SET(i, &set);
+                break;
+            }
+        }
+    }
+    else
+        CPU_SET(cpu % (cpus > 0 ? cpus : 1), &set);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
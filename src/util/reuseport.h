@@ -0,0 +1,19 @@
+#ifndef REUSEPORT_H
+#define REUSEPORT_H
+
+#include <stdint.h>
+
+/* Binds a UDP socket to port on all addresses. With shared set the socket
+ * joins the port's SO_REUSEPORT group, and the kernel spreads datagrams over
+ * the group by flow hash, so every datagram from one source reaches the same
+ * socket in order. */
+int reuseport_bind_udp(uint16_t port, uint8_t shared);
+
+/* Replaces the flow hash for the group fd belongs to with a program that picks
+ * socket (receiving CPU % shards). Sockets are numbered in the order they were
+ * bound. */
+void reuseport_steer_by_cpu(int fd, int shards);
+
+void reuseport_pin_thread(int cpu);
+
+#endif
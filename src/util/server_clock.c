@@ -0,0 +1,136 @@
+/* User includes */
+#include "util/server_clock.h"
+#include "util/server_init.h"
+#include "util/flood_guard.h"
+#include "util/reuseport.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <pthread.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+
+uint8_t serve_clock = 0;
+
+struct control_stamp
+{
+    uint32_t addr;
+    uint32_t token;
+    uint64_t received;
+};
+
+static pthread_mutex_t stamps_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct control_stamp stamps[CLOCKSYNC_CLIENTS];
+static int next_stamp = 0;
+
+uint64_t server_clock_from_timespec(const struct timespec *t)
+{
+    return (uint64_t)t->tv_sec * 1000000 + t->tv_nsec / 1000;
+}
+
+uint64_t server_clock_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return server_clock_from_timespec(&now);
+}
+
+uint32_t server_clock_navdata_time(uint64_t us)
+{
+    uint32_t seconds = (us / 1000000) & 0x7FF;
+
+    return seconds << 21 | (uint32_t)(us % 1000000);
+}
+
+void server_clock_note_control(const struct sockaddr_in *from, uint32_t token, uint64_t received)
+{
+    struct control_stamp *s = NULL;
+
+    pthread_mutex_lock(&stamps_mutex);
+
+    for(int i = 0; i < CLOCKSYNC_CLIENTS; ++i)
+    {
+        if(stamps[i].token && stamps[i].addr == from->sin_addr.s_addr)
+        {
+            s = &stamps[i];
+            break;
+        }
+    }
+
+    if(!s)
+    {
+        s = &stamps[next_stamp];
+        next_stamp = (next_stamp + 1) % CLOCKSYNC_CLIENTS;
+    }
+
+    s->addr = from->sin_addr.s_addr;
+    s->token = token;
+    s->received = received;
+
+    pthread_mutex_unlock(&stamps_mutex);
+}
+
+/* Control and clock sync come from different ports, so match on the address */
+static void server_clock_find_control(const struct sockaddr_in *from, struct clocksync_packet *p)
+{
+    p->control_token = 0;
+    p->control_receive = 0;
+
+    pthread_mutex_lock(&stamps_mutex);
+
+    for(int i = 0; i < CLOCKSYNC_CLIENTS; ++i)
+    {
+        if(stamps[i].token && stamps[i].addr == from->sin_addr.s_addr)
+        {
+            p->control_token = stamps[i].token;
+            p->control_receive = stamps[i].received;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&stamps_mutex);
+}
+
+void *clocksync_listen(void *args)
+{
+    struct server_init *server_init = (struct server_init*)args;
+    int sockfd = reuseport_bind_udp(server_init->port, 0);
+
+    struct flood_guard guard;
+    flood_guard_init(&guard);
+
+    struct metric *exchanges = metrics_counter("clocksync_exchanges");
+
+    while(1)
+    {
+        struct clocksync_packet p;
+        struct sockaddr_in client_addr;
+        socklen_t client_length = sizeof(client_addr);
+
+        ssize_t received = recvfrom(sockfd, &p, sizeof(p), 0, (struct sockaddr*)&client_addr, &client_length);
+
+        /* Taken first, as close to the arrival as userspace gets */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if(received != sizeof(p) || p.magic != CLOCKSYNC_MAGIC)
+            continue;
+
+        if(!flood_guard_admit(&guard, &client_addr, FLOOD_CLASS_CLOCKSYNC, &now))
+            continue;
+
+        p.server_receive = server_clock_from_timespec(&now);
+        server_clock_find_control(&client_addr, &p);
+        p.server_send = server_clock_us();
+
+        sendto(sockfd, &p, sizeof(p), 0, (struct sockaddr*)&client_addr, client_length);
+
+        metrics_add(exchanges, 1);
+    }
+
+    return NULL;
+}
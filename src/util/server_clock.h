@@ -0,0 +1,48 @@
+#ifndef SERVER_CLOCK_H
+#define SERVER_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/* "CSYN", first word of every clock sync packet */
+#define CLOCKSYNC_MAGIC 0x4E595343
+
+/* Client addresses whose last AT*CLOCK is remembered */
+#define CLOCKSYNC_CLIENTS 16
+
+/* One NTP-style exchange on the clock sync port. The client fills in magic,
+ * sequence and client_send; the server sends the packet back with its times
+ * added. Times are microseconds, the client's on its own clock and the
+ * server's on server_clock_us(). */
+struct clocksync_packet
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint64_t client_send;       /* t1 */
+    uint64_t server_receive;    /* t2 */
+    uint64_t server_send;       /* t3 */
+
+    /* The last AT*CLOCK=<seq>,<token> the control port got from the client's
+     * address and when it arrived, so the client can time the control path
+     * itself. A token of 0 means none yet. */
+    uint32_t control_token;
+    uint32_t reserved;
+    uint64_t control_receive;
+} __attribute__ ((packed));
+
+/* The server's time base: CLOCK_MONOTONIC in microseconds. It is the clock
+ * behind the clock sync port, navdata_time and the PaVE timestamp. */
+uint64_t server_clock_us(void);
+uint64_t server_clock_from_timespec(const struct timespec *t);
+
+/* Packs a server time the way navdata_time_t carries it: 11 bits of seconds
+ * and 21 bits of microseconds, so it wraps every 2048 s */
+uint32_t server_clock_navdata_time(uint64_t us);
+
+/* Remembers an AT*CLOCK from a client for its next clock sync exchange */
+void server_clock_note_control(const struct sockaddr_in *from, uint32_t token, uint64_t received);
+
+void *clocksync_listen(void *args);
+
+#endif
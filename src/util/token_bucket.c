@@ -0,0 +1,45 @@
+#include "util/token_bucket.h"
+
+void token_bucket_init(struct token_bucket *tb, double rate, double depth)
+{
+    tb->rate = rate;
+    tb->depth = depth;
+    tb->tokens = depth;
+    clock_gettime(CLOCK_MONOTONIC, &tb->last);
+}
+
+void token_bucket_refill(struct token_bucket *tb, const struct timespec *now)
+{
+    double elapsed = (now->tv_sec - tb->last.tv_sec) + (now->tv_nsec - tb->last.tv_nsec) / 1e9;
+
+    if(elapsed <= 0)
+        return;
+
+    tb->tokens += elapsed * tb->rate;
+    if(tb->tokens > tb->depth)
+        tb->tokens = tb->depth;
+
+    tb->last = *now;
+}
+
+/* Takes amount tokens if they are available. Returns 0 and leaves the bucket
+ * untouched otherwise. */
+uint8_t token_bucket_take(struct token_bucket *tb, double amount, const struct timespec *now)
+{
+    token_bucket_refill(tb, now);
+
+    if(tb->tokens < amount)
+        return 0;
+
+    tb->tokens -= amount;
+    return 1;
+}
+
+/* Seconds until amount tokens will be available. */
+double token_bucket_delay(const struct token_bucket *tb, double amount)
+{
+    if(tb->tokens >= amount || tb->rate <= 0)
+        return 0;
+
+    return (amount - tb->tokens) / tb->rate;
+}
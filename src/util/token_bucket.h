@@ -0,0 +1,20 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <stdint.h>
+#include <time.h>
+
+struct token_bucket
+{
+    double rate;    /* tokens added per second */
+    double depth;   /* maximum number of tokens the bucket holds */
+    double tokens;
+    struct timespec last;
+};
+
+void token_bucket_init(struct token_bucket *tb, double rate, double depth);
+void token_bucket_refill(struct token_bucket *tb, const struct timespec *now);
+uint8_t token_bucket_take(struct token_bucket *tb, double amount, const struct timespec *now);
+double token_bucket_delay(const struct token_bucket *tb, double amount);
+
+#endif
@@ -0,0 +1,350 @@
+/* User includes */
+#include "util/vrep_async.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+extern pthread_mutex_t vrep_mutex;
+
+/* Every pending future, in no particular order. Only changes with
+ * async_mutex held, which is taken after vrep_mutex when both are needed. */
+static struct vrep_future *pending = NULL;
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+
+static simxInt vrep_async_exec(struct vrep_future *f, simxInt mode)
+{
+    switch(f->request)
+    {
+        case VREP_REQUEST_INTEGER_SIGNAL:
+            return simxGetIntegerSignal(f->client_id, f->name, &f->value.i, mode);
+        case VREP_REQUEST_FLOAT_SIGNAL:
+            return simxGetFloatSignal(f->client_id, f->name, &f->value.f, mode);
+        case VREP_REQUEST_OBJECT_HANDLE:
+            return simxGetObjectHandle(f->client_id, f->name, &f->value.i, mode);
+    }
+
+    return simx_error_local_error_flag;
+}
+
+/* Whether another pending future is waiting on the same reply. extApi keeps
+ * one reply per command and arguments, so both complete from it. */
+static uint8_t vrep_async_shared(struct vrep_future *f)
+{
+    for(struct vrep_future *o = pending; o; o = o->next)
+    {
+        if(o != f && o->client_id == f->client_id && o->request == f->request && !strcmp(o->name, f->name))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Called without async_mutex. The callback runs before the state changes, so
+ * whoever sees the future done also sees what the callback did. */
+static void vrep_async_finish(struct vrep_future *f)
+{
+    uint64_t one = 1;
+
+    if(f->callback)
+        f->callback(f, f->arg);
+
+    __atomic_store_n(&f->state, f->error == simx_error_noerror ? VREP_FUTURE_DONE : VREP_FUTURE_FAILED, __ATOMIC_RELEASE);
+
+    if(write(f->fd, &one, sizeof(one)) != sizeof(one))
+        error("Could not signal V-REP future");
+}
+
+/* Id of the last message in on the client, -1 if none. Only takes extApi's
+ * own lock, not vrep_mutex. */
+static simxInt vrep_async_last_in(simxInt client_id)
+{
+    simxInt last;
+
+    return simxGetInMessageInfo(client_id, simx_headeroffset_message_id, &last) == 1 ? last : -1;
+}
+
+/* Whether a message has come in since f was last checked. Replies only come
+ * with a message, so until one does the inbox need not be read. Called with
+ * async_mutex held, which keeps the client from being finished: the link
+ * cancels its futures first. */
+static uint8_t vrep_async_new_message(struct vrep_future *f)
+{
+    return f->checked_id < 0 || vrep_async_last_in(f->client_id) != f->checked_id;
+}
+
+/* Returns 1 once f has its reply or can no longer get one. The message id is
+ * read before the inbox, so a reply arriving in between is not mistaken for
+ * one that never came. */
+static uint8_t vrep_async_check(struct vrep_future *f)
+{
+    simxInt last = vrep_async_last_in(f->client_id);
+    uint8_t replied = last >= 0 && last >= f->message_id;
+
+    f->checked_id = last;
+    f->error = vrep_async_exec(f, simx_opmode_buffer);
+
+    if(f->error != simx_error_novalue_flag)
+        return 1;
+
+    return replied;
+}
+
+static void *vrep_async_poll(void *args)
+{
+    while(1)
+    {
+        struct vrep_future *done = NULL;
+
+        pthread_mutex_lock(&async_mutex);
+
+        while(!pending)
+            pthread_cond_wait(&async_cond, &async_mutex);
+
+        uint8_t fresh = 0;
+
+        for(struct vrep_future *f = pending; f && !fresh; f = f->next)
+            fresh = vrep_async_new_message(f);
+
+        pthread_mutex_unlock(&async_mutex);
+
+        /* Nothing new in, so nothing can have been answered. The control
+         * and navdata threads keep vrep_mutex to themselves meanwhile. */
+        if(!fresh)
+        {
+            usleep(VREP_ASYNC_POLL);
+            continue;
+        }
+
+        /* Buffer reads go through the client's one fetched command buffer,
+         * which other users of the client read from under vrep_mutex */
+        pthread_mutex_lock(&vrep_mutex);
+        pthread_mutex_lock(&async_mutex);
+
+        struct vrep_future **p = &pending;
+
+        while(*p)
+        {
+            struct vrep_future *f = *p;
+
+            if(vrep_async_check(f))
+            {
+                *p = f->next;
+                f->next = done;
+                done = f;
+            }
+            else
+                p = &f->next;
+        }
+
+        /* Oneshot replies stay in the inbox until removed */
+        for(struct vrep_future *f = done; f; f = f->next)
+        {
+            if(!vrep_async_shared(f))
+                vrep_async_exec(f, simx_opmode_remove);
+        }
+
+        pthread_mutex_unlock(&async_mutex);
+        pthread_mutex_unlock(&vrep_mutex);
+
+        while(done)
+        {
+            struct vrep_future *f = done;
+            done = f->next;
+            f->next = NULL;
+
+            vrep_async_finish(f);
+        }
+
+        usleep(VREP_ASYNC_POLL);
+    }
+
+    return NULL;
+}
+
+void vrep_async_start(void)
+{
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, vrep_async_poll, NULL))
+        error("Could not start the V-REP future poller");
+
+    pthread_detach(thread);
+}
+
+void vrep_future_init(struct vrep_future *f, vrep_future_callback callback, void *arg)
+{
+    f->state = VREP_FUTURE_IDLE;
+    f->callback = callback;
+    f->arg = arg;
+    f->next = NULL;
+
+    f->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(f->fd < 0)
+        error("Could not create an eventfd for a V-REP future");
+}
+
+static void vrep_async_issue(struct vrep_future *f, enum vrep_request request, simxInt client_id, const char *name)
+{
+    uint64_t count;
+
+    if(__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) == VREP_FUTURE_PENDING)
+        error("V-REP future for %s issued again while pending", name);
+
+    f->request = request;
+    f->client_id = client_id;
+    f->name = name;
+    f->checked_id = -1;
+
+    /* Clear the signal from the last time it was used */
+    if(read(f->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        error("Could not reset V-REP future");
+
+    pthread_mutex_lock(&async_mutex);
+
+    /* An old reply left in the inbox would complete this straight away with
+     * a stale value, unless it is one a pending duplicate waits for */
+    if(!vrep_async_shared(f))
+        vrep_async_exec(f, simx_opmode_remove);
+
+    f->error = vrep_async_exec(f, simx_opmode_oneshot);
+
+    /* Commands already queued go out in the next message, so its id is the
+     * latest the reply can come back in */
+    if(f->error == simx_error_novalue_flag && simxGetOutMessageInfo(client_id, simx_headeroffset_message_id, &f->message_id) == 1)
+    {
+        f->state = VREP_FUTURE_PENDING;
+        f->next = pending;
+        pending = f;
+
+        pthread_cond_signal(&async_cond);
+        pthread_mutex_unlock(&async_mutex);
+
+        return;
+    }
+
+    pthread_mutex_unlock(&async_mutex);
+
+    /* Either the reply already came back or the request failed */
+    if(f->error == simx_error_novalue_flag)
+        f->error = simx_error_local_error_flag;
+
+    vrep_async_finish(f);
+}
+
+void vrep_async_get_integer_signal(struct vrep_future *f, simxInt client_id, const char *signal)
+{
+    vrep_async_issue(f, VREP_REQUEST_INTEGER_SIGNAL, client_id, signal);
+}
+
+void vrep_async_get_float_signal(struct vrep_future *f, simxInt client_id, const char *signal)
+{
+    vrep_async_issue(f, VREP_REQUEST_FLOAT_SIGNAL, client_id, signal);
+}
+
+void vrep_async_get_object_handle(struct vrep_future *f, simxInt client_id, const char *object)
+{
+    vrep_async_issue(f, VREP_REQUEST_OBJECT_HANDLE, client_id, object);
+}
+
+void vrep_async_cancel(simxInt client_id)
+{
+    struct vrep_future *cancelled = NULL;
+
+    pthread_mutex_lock(&async_mutex);
+
+    struct vrep_future **p = &pending;
+
+    while(*p)
+    {
+        struct vrep_future *f = *p;
+
+        if(f->client_id == client_id)
+        {
+            *p = f->next;
+            f->next = cancelled;
+            cancelled = f;
+        }
+        else
+            p = &f->next;
+    }
+
+    pthread_mutex_unlock(&async_mutex);
+
+    while(cancelled)
+    {
+        struct vrep_future *f = cancelled;
+        cancelled = f->next;
+        f->next = NULL;
+
+        f->error = simx_error_local_error_flag;
+        vrep_async_finish(f);
+    }
+}
+
+uint8_t vrep_async_wait(struct vrep_future **futures, int n, int timeout)
+{
+    /* Nothing to wait for, and no empty arrays below */
+    if(n <= 0)
+        return 1;
+
+    struct pollfd fds[n];
+    struct vrep_future *waiting[n];
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while(1)
+    {
+        int count = 0;
+
+        for(int i = 0; i < n; ++i)
+        {
+            if(__atomic_load_n(&futures[i]->state, __ATOMIC_ACQUIRE) != VREP_FUTURE_PENDING)
+                continue;
+
+            waiting[count] = futures[i];
+            fds[count].fd = futures[i]->fd;
+            fds[count].events = POLLIN;
+            ++count;
+        }
+
+        if(!count)
+            return 1;
+
+        int left = -1;
+
+        if(timeout >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+
+            if(left <= 0)
+                return 0;
+        }
+
+        if(poll(fds, count, left) < 0 && errno != EINTR)
+            error("Could not wait on V-REP futures");
+
+        /* A future reissued before the poller signalled its last completion
+         * can be readable while still pending. The state is what counts, so
+         * drain those or they would wake every poll. */
+        for(int i = 0; i < count; ++i)
+        {
+            uint64_t value;
+
+            if((fds[i].revents & POLLIN) && __atomic_load_n(&waiting[i]->state, __ATOMIC_ACQUIRE) == VREP_FUTURE_PENDING)
+            {
+                if(read(fds[i].fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                    error("Could not reset V-REP future");
+            }
+        }
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef VREP_ASYNC_H
+#define VREP_ASYNC_H
+
+#include "libs/vrep/extApi.h"
+#include <stdint.h>
+
+/* How often the inbox is checked for a new message while futures are
+ * pending, us. The comm thread cycle is 5 ms, so a reply waits at most this
+ * long on top of it. Only a new message costs vrep_mutex. */
+#define VREP_ASYNC_POLL 500
+
+enum vrep_future_state
+{
+    VREP_FUTURE_IDLE,
+    VREP_FUTURE_PENDING,
+    VREP_FUTURE_DONE,
+    VREP_FUTURE_FAILED,
+};
+
+enum vrep_request
+{
+    VREP_REQUEST_INTEGER_SIGNAL,
+    VREP_REQUEST_FLOAT_SIGNAL,
+    VREP_REQUEST_OBJECT_HANDLE,
+};
+
+struct vrep_future;
+
+/* Runs once the future is done or failed, before its eventfd is signalled.
+ * That is on the poller thread, or on the issuing one if the request never
+ * went out. Must not block or issue requests. */
+typedef void (*vrep_future_callback)(struct vrep_future *f, void *arg);
+
+/* One remote API request in flight. Owned by the caller, who must not touch
+ * it while it is pending other than to wait on it. */
+struct vrep_future
+{
+    enum vrep_request request;
+    const char *name;
+    simxInt client_id;
+
+    /* The reply is in the message with this id or an earlier one */
+    simxInt message_id;
+
+    /* Id of the last message in when the inbox was checked for the reply,
+     * -1 before the first check */
+    simxInt checked_id;
+
+    volatile enum vrep_future_state state;
+    simxInt error;
+    union
+    {
+        simxInt i;
+        simxFloat f;
+    } value;
+
+    vrep_future_callback callback;
+    void *arg;
+
+    /* Readable once the future is done or failed */
+    int fd;
+
+    struct vrep_future *next;
+};
+
+/* Starts the poller thread. Called by vrep_link_connect. */
+void vrep_async_start(void);
+
+/* callback may be NULL */
+void vrep_future_init(struct vrep_future *f, vrep_future_callback callback, void *arg);
+
+/* Queue the request and return straight away. Requests issued between
+ * simxPauseCommunication(client_id, 1) and (client_id, 0) go out in one
+ * message. Call with vrep_mutex held, as for any use of the client. The name
+ * must outlive the request. */
+void vrep_async_get_integer_signal(struct vrep_future *f, simxInt client_id, const char *signal);
+void vrep_async_get_float_signal(struct vrep_future *f, simxInt client_id, const char *signal);
+void vrep_async_get_object_handle(struct vrep_future *f, simxInt client_id, const char *object);
+
+/* Fails everything pending on a client that is about to be finished */
+void vrep_async_cancel(simxInt client_id);
+
+/* Waits up to timeout ms (-1 for ever) for all n futures to be done or
+ * failed. Returns 1 if they all are, or n is 0, and 0 on timeout. The poller
+ * needs vrep_mutex, so it must not be held. */
+uint8_t vrep_async_wait(struct vrep_future **futures, int n, int timeout);
+
+#endif
@@ -0,0 +1,334 @@
+/* User includes */
+#include "util/vrep_link.h"
+#include "util/vrep_async.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+extern pthread_mutex_t vrep_mutex;
+
+struct vrep_link_handle
+{
+    const char *name;
+    uint8_t object;     /* looked up by object name rather than a signal */
+    simxInt value;
+    uint8_t reported;   /* a failure has been printed */
+    struct vrep_future future;
+};
+
+struct vrep_link_hook
+{
+    vrep_link_callback callback;
+    void *arg;
+};
+
+static char link_ip[16];
+static int link_port;
+
+/* Both only change with vrep_mutex held */
+static simxInt client_id = -1;
+static volatile uint8_t connected = 0;
+
+static struct vrep_link_handle handles[VREP_LINK_MAX_HANDLES];
+static int num_handles = 0;
+
+static struct vrep_link_hook hooks[VREP_LINK_MAX_CALLBACKS];
+static int num_hooks = 0;
+
+void vrep_link_connect(const char *ip, int port)
+{
+    strncpy(link_ip, ip, sizeof(link_ip) - 1);
+    link_port = port;
+
+    client_id = simxStart(link_ip, link_port, 1, 1, VREP_LINK_CONNECT_TIMEOUT, 5);
+    if(client_id == -1)
+        error("Could not connect to vrep");
+
+    connected = 1;
+
+    vrep_async_start();
+}
+
+uint8_t vrep_link_connected(void)
+{
+    return connected;
+}
+
+simxInt vrep_link_client(void)
+{
+    return client_id;
+}
+
+static void vrep_link_handle_resolved(struct vrep_future *f, void *arg)
+{
+    struct vrep_link_handle *h = arg;
+
+    if(f->error == simx_error_noerror)
+    {
+        h->value = f->value.i;
+        h->reported = 0;
+    }
+    else if(!h->reported)
+    {
+        printf("Could not get handle %s from V-REP, retrying\n", h->name);
+        h->reported = 1;
+    }
+}
+
+/* Called with vrep_mutex held */
+static void vrep_link_request(struct vrep_link_handle *h, simxInt id)
+{
+    if(h->object)
+        vrep_async_get_object_handle(&h->future, id, h->name);
+    else
+        vrep_async_get_integer_signal(&h->future, id, h->name);
+}
+
+static simxInt *vrep_link_add_handle(const char *name, uint8_t object)
+{
+    pthread_mutex_lock(&vrep_mutex);
+
+    if(num_handles == VREP_LINK_MAX_HANDLES)
+        error("Too many V-REP handles registered");
+
+    struct vrep_link_handle *h = &handles[num_handles];
+    h->name = name;
+    h->object = object;
+    h->value = -1;
+    h->reported = 0;
+    vrep_future_init(&h->future, vrep_link_handle_resolved, h);
+
+    __atomic_store_n(&num_handles, num_handles + 1, __ATOMIC_RELEASE);
+
+    if(connected)
+        vrep_link_request(h, client_id);
+    else
+        printf("Could not get handle %s from V-REP yet\n", name);
+
+    pthread_mutex_unlock(&vrep_mutex);
+
+    return &h->value;
+}
+
+simxInt *vrep_link_signal_handle(const char *signal)
+{
+    return vrep_link_add_handle(signal, 0);
+}
+
+simxInt *vrep_link_object_handle(const char *name)
+{
+    return vrep_link_add_handle(name, 1);
+}
+
+/* Handles are only ever added, so the futures can be collected without the
+ * lock */
+uint8_t vrep_link_wait_handles(int timeout)
+{
+    struct vrep_future *futures[VREP_LINK_MAX_HANDLES];
+    int count = __atomic_load_n(&num_handles, __ATOMIC_ACQUIRE);
+
+    for(int i = 0; i < count; ++i)
+        futures[i] = &handles[i].future;
+
+    return vrep_async_wait(futures, count, timeout);
+}
+
+void vrep_link_on_connect(vrep_link_callback callback, void *arg)
+{
+    pthread_mutex_lock(&vrep_mutex);
+
+    if(num_hooks == VREP_LINK_MAX_CALLBACKS)
+        error("Too many V-REP reconnect callbacks registered");
+
+    hooks[num_hooks].callback = callback;
+    hooks[num_hooks].arg = arg;
+    ++num_hooks;
+
+    if(connected)
+        callback(client_id, arg);
+
+    pthread_mutex_unlock(&vrep_mutex);
+}
+
+/* Asks for every handle in one message. Called with vrep_mutex held; the
+ * replies are waited for once it is released. */
+static void vrep_link_request_handles(simxInt id)
+{
+    simxPauseCommunication(id, 1);
+
+    for(int i = 0; i < num_handles; ++i)
+        vrep_link_request(&handles[i], id);
+
+    simxPauseCommunication(id, 0);
+}
+
+/* Runs the callbacks on a client with communication paused. Called with
+ * vrep_mutex held. */
+static void vrep_link_run_hooks(simxInt id)
+{
+    simxPauseCommunication(id, 1);
+
+    for(int i = 0; i < num_hooks; ++i)
+        hooks[i].callback(id, hooks[i].arg);
+
+    simxPauseCommunication(id, 0);
+}
+
+/* Called by the supervisor while the link is up. Asks again for the handles
+ * that failed, such as a signal the script had not set yet, and once any of
+ * them comes back runs the callbacks again, as the streams they set up with
+ * -1 are no use. */
+static void vrep_link_retry_handles(void)
+{
+    static int ticks = 0;
+    static uint8_t retrying = 0;
+    static uint8_t was_missing[VREP_LINK_MAX_HANDLES];
+
+    if(retrying)
+    {
+        int count = __atomic_load_n(&num_handles, __ATOMIC_ACQUIRE);
+        uint8_t resolved = 0;
+
+        for(int i = 0; i < count; ++i)
+        {
+            if(__atomic_load_n(&handles[i].future.state, __ATOMIC_ACQUIRE) == VREP_FUTURE_PENDING)
+                return;
+
+            if(was_missing[i] && handles[i].value >= 0)
+                resolved = 1;
+        }
+
+        retrying = 0;
+
+        if(!resolved)
+            return;
+
+        pthread_mutex_lock(&vrep_mutex);
+
+        if(connected)
+        {
+            printf("Got the missing V-REP handles, subscribing again\n");
+            vrep_link_run_hooks(client_id);
+        }
+
+        pthread_mutex_unlock(&vrep_mutex);
+
+        return;
+    }
+
+    if(++ticks < VREP_LINK_HANDLE_RETRY / VREP_LINK_POLL)
+        return;
+
+    ticks = 0;
+
+    pthread_mutex_lock(&vrep_mutex);
+
+    if(connected)
+    {
+        simxPauseCommunication(client_id, 1);
+
+        for(int i = 0; i < num_handles; ++i)
+        {
+            was_missing[i] = handles[i].value < 0 &&
+                __atomic_load_n(&handles[i].future.state, __ATOMIC_ACQUIRE) != VREP_FUTURE_PENDING;
+
+            if(was_missing[i])
+            {
+                vrep_link_request(&handles[i], client_id);
+                retrying = 1;
+            }
+        }
+
+        simxPauseCommunication(client_id, 0);
+    }
+
+    pthread_mutex_unlock(&vrep_mutex);
+}
+
+/* Backends check vrep_link_connected() with vrep_mutex held before touching
+ * the client, so the old client can be finished outside the lock once the
+ * new one is in place. */
+void *vrep_link_supervise(void *args)
+{
+    struct metric *up = metrics_gauge("vrep_link_up");
+    struct metric *reconnects = metrics_counter("vrep_reconnects");
+    struct metric *recovery = metrics_gauge("vrep_recovery_ms");
+
+    metrics_set(up, 1);
+
+    while(1)
+    {
+        usleep(VREP_LINK_POLL * 1000);
+
+        if(simxGetConnectionId(client_id) != -1)
+        {
+            vrep_link_retry_handles();
+            continue;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        printf("Lost connection to V-REP, reconnecting\n");
+
+        pthread_mutex_lock(&vrep_mutex);
+        connected = 0;
+        simxInt old_id = client_id;
+        pthread_mutex_unlock(&vrep_mutex);
+
+        /* Nothing more will come back on the old client */
+        vrep_async_cancel(old_id);
+
+        metrics_set(up, 0);
+
+        simxInt id;
+        int backoff = VREP_LINK_MIN_BACKOFF;
+
+        while((id = simxStart(link_ip, link_port, 1, 1, VREP_LINK_RECONNECT_TIMEOUT, 5)) == -1)
+        {
+            usleep(backoff * 1000);
+
+            if(backoff < VREP_LINK_MAX_BACKOFF)
+                backoff *= 2;
+        }
+
+        pthread_mutex_lock(&vrep_mutex);
+
+        client_id = id;
+        vrep_link_request_handles(id);
+
+        pthread_mutex_unlock(&vrep_mutex);
+
+        /* One round trip for all of them. Backends still see the link as
+         * down, so nothing else uses the client meanwhile. */
+        if(!vrep_link_wait_handles(VREP_LINK_CONNECT_TIMEOUT))
+            printf("V-REP did not answer for the handles\n");
+
+        pthread_mutex_lock(&vrep_mutex);
+
+        vrep_link_run_hooks(id);
+
+        connected = 1;
+
+        pthread_mutex_unlock(&vrep_mutex);
+
+        simxFinish(old_id);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+        metrics_set(up, 1);
+        metrics_add(reconnects, 1);
+        metrics_set(recovery, ms);
+
+        printf("Reconnected to V-REP in %.0f ms\n", ms);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef VREP_LINK_H
+#define VREP_LINK_H
+
+#include "libs/vrep/extApi.h"
+#include <stdint.h>
+
+#define VREP_LINK_MAX_HANDLES 16
+#define VREP_LINK_MAX_CALLBACKS 8
+
+/* Timeout for the first connection and for each reconnection attempt, ms */
+#define VREP_LINK_CONNECT_TIMEOUT 2000
+#define VREP_LINK_RECONNECT_TIMEOUT 100
+
+/* Wait between reconnection attempts, doubled after every failure, ms */
+#define VREP_LINK_MIN_BACKOFF 10
+#define VREP_LINK_MAX_BACKOFF 160
+
+/* How often the supervisor checks the link, ms */
+#define VREP_LINK_POLL 10
+
+/* How often a handle V-REP did not have is asked for again, ms */
+#define VREP_LINK_HANDLE_RETRY 1000
+
+/* Run with vrep_mutex held and communication paused, so everything the
+ * callbacks send goes out in one message. */
+typedef void (*vrep_link_callback)(simxInt client_id, void *arg);
+
+/* Connects to V-REP, exiting if it is not there. */
+void vrep_link_connect(const char *ip, int port);
+
+uint8_t vrep_link_connected(void);
+
+/* The client id changes on reconnect, so fetch it for every call and hold
+ * vrep_mutex while using it. */
+simxInt vrep_link_client(void);
+
+/* Resolves the handle V-REP publishes in an integer signal (e.g.
+ * QCFrontSensor). Does not wait for V-REP, so the value is -1 until the reply
+ * comes back; handles registered together go out in one message. The returned
+ * value is kept up to date across reconnects, and one V-REP did not have is
+ * asked for again every VREP_LINK_HANDLE_RETRY ms. */
+simxInt *vrep_link_signal_handle(const char *signal);
+
+/* The same for an object looked up by name (e.g. Quadricopter) */
+simxInt *vrep_link_object_handle(const char *name);
+
+/* Waits up to timeout ms for every handle registered so far. Returns 0 on
+ * timeout. Call without vrep_mutex held. */
+uint8_t vrep_link_wait_handles(int timeout);
+
+/* Called after every reconnection, once handles are resolved again, and
+ * whenever a handle that had failed is resolved later. Streaming
+ * subscriptions are lost when V-REP restarts, so this is where backends set
+ * them up. Also called straight away if the link is up. */
+void vrep_link_on_connect(vrep_link_callback callback, void *arg);
+
+/* Watches the link and reconnects with backoff when it drops */
+void *vrep_link_supervise(void *args);
+
+#endif
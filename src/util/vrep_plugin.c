@@ -0,0 +1,434 @@
+/* User includes */
+#include "util/vrep_plugin.h"
+#include "util/server_clock.h"
+#include "util/metrics.h"
+#include "util/config.h"
+#include "util/error.h"
+#include "util/vrep_swarm.h"
+#include "util/plugin_threads.h"
+#include "navdata/vrep_navdata.h"
+#include "libs/vrep/v_repLib.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+extern volatile uint8_t force_idr;
+
+/* The entry points and the simulator's API only exist in the plugin build.
+ * The rest is the data exchange the plugin backends call, which the
+ * standalone server links too but never reaches. */
+#ifdef VREP_PLUGIN
+
+/* The part of the simulator's API the server uses, bound in
+ * getVrepProcAddresses */
+ptrSimGetObjectHandle simGetObjectHandle = NULL;
+ptrSimGetObjectPosition simGetObjectPosition = NULL;
+ptrSimGetObjectQuaternion simGetObjectQuaternion = NULL;
+ptrSimGetObjectVelocity simGetObjectVelocity = NULL;
+ptrSimGetVisionSensorResolution simGetVisionSensorResolution = NULL;
+ptrSimGetVisionSensorImage simGetVisionSensorImage = NULL;
+ptrSimGetStringSignal simGetStringSignal = NULL;
+ptrSimSetStringSignal simSetStringSignal = NULL;
+ptrSimReleaseBuffer simReleaseBuffer = NULL;
+
+static LIBRARY vrep_lib;
+static pthread_t server_thread;
+
+/* Only touched by the simulation thread */
+static simInt body_handle = -1;
+static simInt sensor_handle = -1;
+
+#endif
+
+static volatile uint8_t active = 0;
+
+/* Everything below is shared between the simulation thread and the server's
+ * own threads */
+static pthread_mutex_t plugin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t plugin_cond = PTHREAD_COND_INITIALIZER;
+
+/* Images are triple buffered: the simulation thread renders into a slot that
+ * is neither the newest nor the one the video thread is encoding from */
+static uint8_t *slots[3];
+static int width, height;
+static int latest = -1;
+static int reading = -1;
+static uint8_t fresh = 0;
+
+static float pose[VREP_NAVDATA_POSE_FLOATS];
+static float velocity[VREP_NAVDATA_VELOCITY_FLOATS];
+static uint8_t have_pose = 0;
+
+/* Commands since the last step, stamped from the start of the simulation */
+static struct vrep_command queue[VREP_PLUGIN_QUEUE];
+static int queued;
+static uint64_t epoch;
+static uint8_t running = 0;
+static struct metric *dropped_commands;
+
+/* Set when V-REP closes, to let threads waiting on the simulation go */
+static uint8_t ending = 0;
+
+#ifdef VREP_PLUGIN
+
+LIBRARY loadVrepLibrary(const char *pathAndFilename)
+{
+    return dlopen(pathAndFilename, RTLD_LAZY);
+}
+
+void unloadVrepLibrary(LIBRARY lib)
+{
+    dlclose(lib);
+}
+
+FARPROC _getProcAddress(LIBRARY lib, const char *funcName)
+{
+    return dlsym(lib, funcName);
+}
+
+#define BIND(name) if(!(*(void**)&name = _getProcAddress(lib, #name))) return 0
+
+int getVrepProcAddresses(LIBRARY lib)
+{
+    BIND(simGetObjectHandle);
+    BIND(simGetObjectPosition);
+    BIND(simGetObjectQuaternion);
+    BIND(simGetObjectVelocity);
+    BIND(simGetVisionSensorResolution);
+    BIND(simGetVisionSensorImage);
+    BIND(simGetStringSignal);
+    BIND(simSetStringSignal);
+    BIND(simReleaseBuffer);
+
+    return 1;
+}
+
+#endif
+
+uint8_t vrep_plugin_active(void)
+{
+    return active;
+}
+
+static void unlock_plugin_mutex(void *arg)
+{
+    pthread_mutex_unlock(&plugin_mutex);
+}
+
+/* Both waits end the calling thread when V-REP closes, and release the lock
+ * if the thread is cancelled in them */
+void vrep_plugin_wait_resolution(int *w, int *h)
+{
+    pthread_mutex_lock(&plugin_mutex);
+    pthread_cleanup_push(unlock_plugin_mutex, NULL);
+
+    while(!slots[0] && !ending)
+        pthread_cond_wait(&plugin_cond, &plugin_mutex);
+
+    if(ending)
+        pthread_exit(NULL);
+
+    *w = width;
+    *h = height;
+
+    pthread_cleanup_pop(1);
+}
+
+const uint8_t *vrep_plugin_wait_frame(void)
+{
+    pthread_mutex_lock(&plugin_mutex);
+    pthread_cleanup_push(unlock_plugin_mutex, NULL);
+
+    while(!fresh && !ending)
+        pthread_cond_wait(&plugin_cond, &plugin_mutex);
+
+    if(ending)
+        pthread_exit(NULL);
+
+    reading = latest;
+    fresh = 0;
+
+    pthread_cleanup_pop(1);
+
+    return slots[reading];
+}
+
+uint8_t vrep_plugin_read_pose(float *p, float *v)
+{
+    pthread_mutex_lock(&plugin_mutex);
+
+    uint8_t found = have_pose;
+
+    memcpy(p, pose, sizeof(pose));
+    memcpy(v, velocity, sizeof(velocity));
+
+    pthread_mutex_unlock(&plugin_mutex);
+
+    return found;
+}
+
+void vrep_plugin_queue_command(struct vrep_command c, uint64_t received)
+{
+    pthread_mutex_lock(&plugin_mutex);
+
+    /* As with the remote API, commands sent while the simulation is stopped
+     * would be stale by the time it runs */
+    if(running && queued < VREP_PLUGIN_QUEUE)
+    {
+        c.time = (received > epoch ? received - epoch : 0) / 1e6f;
+        queue[queued++] = c;
+    }
+    else if(running)
+        metrics_add(dropped_commands, 1);
+
+    pthread_mutex_unlock(&plugin_mutex);
+}
+
+#ifdef VREP_PLUGIN
+
+static void plugin_simulation_start(void)
+{
+    char *body = config_get_option("vrep:drone_body");
+    char *sensor = config_get_option("vrep:front_sensor");
+    simInt resolution[2] = {0, 0};
+
+    body_handle = simGetObjectHandle(body && *body ? body : VREP_NAVDATA_BODY);
+    sensor_handle = simGetObjectHandle(sensor && *sensor ? sensor : VREP_SWARM_FRONT_SENSOR);
+
+    if(sensor_handle >= 0)
+        simGetVisionSensorResolution(sensor_handle, resolution);
+
+    pthread_mutex_lock(&plugin_mutex);
+
+    /* The encoder is opened for the first resolution, so it stays. This is
+     * V-REP's thread, so a failure turns video off rather than calling
+     * error(). */
+    if(!slots[0] && resolution[0] > 0 && resolution[1] > 0)
+    {
+        uint8_t *images = malloc(resolution[0] * resolution[1] * 3 * 3);
+
+        if(images)
+        {
+            width = resolution[0];
+            height = resolution[1];
+
+            for(int i = 0; i < 3; ++i)
+                slots[i] = images + i * width * height * 3;
+        }
+        else
+        {
+            printf("Could not allocate vision sensor images, video is off\n");
+            sensor_handle = -1;
+        }
+    }
+    else if(sensor_handle >= 0 && (resolution[0] != width || resolution[1] != height))
+    {
+        printf("Vision sensor is %dx%d, not %dx%d as before. Video is off until V-REP restarts.\n", resolution[0], resolution[1], width, height);
+        sensor_handle = -1;
+    }
+
+    epoch = server_clock_us();
+    queued = 0;
+    running = 1;
+
+    pthread_cond_broadcast(&plugin_cond);
+    pthread_mutex_unlock(&plugin_mutex);
+
+    /* The stream has a gap, so clients resync on the next frame */
+    force_idr = 1;
+}
+
+static void plugin_simulation_end(void)
+{
+    pthread_mutex_lock(&plugin_mutex);
+    running = 0;
+    pthread_mutex_unlock(&plugin_mutex);
+}
+
+/* Hands the commands since the last step to the drone's script before it
+ * runs, on the same queue signal the remote API appends to. Whatever the
+ * script has not drained yet is kept in front. */
+static void plugin_send_commands(void)
+{
+    static struct vrep_command batch[VREP_PLUGIN_QUEUE];
+    static simChar merged[VREP_PLUGIN_SIGNAL_MAX + sizeof(batch)];
+
+    pthread_mutex_lock(&plugin_mutex);
+
+    int n = queued;
+    memcpy(batch, queue, n * sizeof(struct vrep_command));
+    queued = 0;
+
+    pthread_mutex_unlock(&plugin_mutex);
+
+    if(!n)
+        return;
+
+    simInt length = 0;
+    simChar *pending = simGetStringSignal(VREP_CONTROL_SIGNAL, &length);
+    int size = 0;
+
+    if(pending)
+    {
+        if(length <= VREP_PLUGIN_SIGNAL_MAX)
+        {
+            memcpy(merged, pending, length);
+            size = length;
+        }
+
+        simReleaseBuffer(pending);
+    }
+
+    memcpy(merged + size, batch, n * sizeof(struct vrep_command));
+    size += n * sizeof(struct vrep_command);
+
+    simSetStringSignal(VREP_CONTROL_SIGNAL, merged, size);
+}
+
+/* Runs once the step's dynamics and sensors have been handled */
+static void plugin_sense(void)
+{
+    float p[VREP_NAVDATA_POSE_FLOATS], v[VREP_NAVDATA_VELOCITY_FLOATS];
+
+    if(body_handle >= 0 &&
+            simGetObjectPosition(body_handle, -1, p) != -1 &&
+            simGetObjectQuaternion(body_handle, -1, p + 3) != -1 &&
+            simGetObjectVelocity(body_handle, v, v + 3) != -1)
+    {
+        pthread_mutex_lock(&plugin_mutex);
+
+        memcpy(pose, p, sizeof(pose));
+        memcpy(velocity, v, sizeof(velocity));
+        have_pose = 1;
+
+        pthread_mutex_unlock(&plugin_mutex);
+    }
+
+    if(sensor_handle < 0)
+        return;
+
+    simFloat *image = simGetVisionSensorImage(sensor_handle);
+    if(!image)
+        return;
+
+    pthread_mutex_lock(&plugin_mutex);
+
+    int w = 0;
+    while(w == latest || w == reading)
+        ++w;
+
+    pthread_mutex_unlock(&plugin_mutex);
+
+    /* Floats from 0 to 1 per channel, bottom row first */
+    for(int i = 0; i < width * height * 3; ++i)
+        slots[w][i] = image[i] * 255.0f + 0.5f;
+
+    simReleaseBuffer((simChar*)image);
+
+    pthread_mutex_lock(&plugin_mutex);
+
+    latest = w;
+    fresh = 1;
+
+    pthread_cond_broadcast(&plugin_cond);
+    pthread_mutex_unlock(&plugin_mutex);
+}
+
+/* Runs the server with the options from the configuration, as main() would
+ * with them on the command line */
+static void *vrep_plugin_server(void *args)
+{
+    static char options[81];
+    static char *argv[VREP_PLUGIN_MAX_ARGS + 2] = { "v_repExtDrone" };
+    int argc = 1;
+    char *saveptr = NULL;
+
+    config_read_options();
+
+    dropped_commands = metrics_counter("vrep_plugin_dropped_commands");
+
+    char *o = config_get_option("vrep:plugin_options");
+    strncpy(options, o && *o ? o : VREP_PLUGIN_OPTIONS, sizeof(options) - 1);
+
+    for(char *token = strtok_r(options, " \t", &saveptr); token && argc <= VREP_PLUGIN_MAX_ARGS; token = strtok_r(NULL, " \t", &saveptr))
+        argv[argc++] = token;
+
+    argv[argc] = NULL;
+
+    server_main(argc, argv);
+
+    return NULL;
+}
+
+/* The simulator is already loaded, so its API is looked up in the process
+ * rather than in a library opened by path */
+unsigned char v_repStart(void *reservedPointer, int reservedInt)
+{
+    vrep_lib = loadVrepLibrary(NULL);
+
+    if(!vrep_lib || !getVrepProcAddresses(vrep_lib))
+    {
+        printf("Could not find the V-REP API in this process, the drone server is not loaded\n");
+        return 0;
+    }
+
+    active = 1;
+
+    /* The network services run on their own threads as in the standalone
+     * server; only the exchange with the scene happens on V-REP's. This and
+     * every thread it starts are tracked, to be stopped in v_repEnd. */
+    if(pthread_create(&server_thread, NULL, vrep_plugin_server, NULL))
+    {
+        active = 0;
+        return 0;
+    }
+
+    pthread_detach(server_thread);
+
+    return VREP_PLUGIN_VERSION;
+}
+
+/* V-REP is about to unload the plugin, so none of the server's code may be
+ * left running. Threads waiting on the simulation are let go, and the rest
+ * are stopped through their sockets or cancelled, and waited for. */
+void v_repEnd(void)
+{
+    pthread_mutex_lock(&plugin_mutex);
+    running = 0;
+    ending = 1;
+    pthread_cond_broadcast(&plugin_cond);
+    pthread_mutex_unlock(&plugin_mutex);
+
+    int left = plugin_threads_stop();
+    if(left)
+        printf("%d drone server threads did not stop within %d s\n", left, PLUGIN_THREADS_STOP_TIMEOUT);
+
+    active = 0;
+}
+
+void *v_repMessage(int message, int *auxiliaryData, void *customData, int *replyData)
+{
+    switch(message)
+    {
+        case sim_message_eventcallback_simulationabouttostart:
+            plugin_simulation_start();
+            break;
+        case sim_message_eventcallback_mainscriptabouttobecalled:
+            plugin_send_commands();
+            break;
+        case sim_message_eventcallback_modulehandleinsensingpart:
+            plugin_sense();
+            break;
+        case sim_message_eventcallback_simulationended:
+            plugin_simulation_end();
+            break;
+    }
+
+    return NULL;
+}
+
+#endif
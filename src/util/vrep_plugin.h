@@ -0,0 +1,45 @@
+#ifndef VREP_PLUGIN_H
+#define VREP_PLUGIN_H
+
+#include "control/vrep_control.h"
+#include <stdint.h>
+
+/* Reported to V-REP from v_repStart */
+#define VREP_PLUGIN_VERSION 1
+
+/* Command line the server runs with inside V-REP, unless
+ * vrep:plugin_options says otherwise */
+#define VREP_PLUGIN_OPTIONS "-v -n vrep -c vrep"
+#define VREP_PLUGIN_MAX_ARGS 32
+
+/* Commands held between simulation steps */
+#define VREP_PLUGIN_QUEUE 256
+
+/* Largest queue signal kept if the drone's script is not draining it */
+#define VREP_PLUGIN_SIGNAL_MAX (16 * 1024)
+
+/* Set once V-REP has loaded the server as a plugin. The vrep video, navdata
+ * and control methods then go through the simulator in process instead of
+ * the remote API. */
+uint8_t vrep_plugin_active(void);
+
+/* The server's main(), which the plugin runs on its own thread */
+int server_main(int argc, char **argv);
+
+/* Blocks until the simulation has a vision sensor image, and gives its size */
+void vrep_plugin_wait_resolution(int *width, int *height);
+
+/* Blocks until an image newer than the last one returned has been rendered
+ * and returns it as bottom-up RGB24. It is not written to until the next
+ * call. */
+const uint8_t *vrep_plugin_wait_frame(void);
+
+/* Copies the drone's last pose and velocity, laid out as the group data
+ * vrep_navdata reads. Returns 0 if there has been none yet. */
+uint8_t vrep_plugin_read_pose(float *pose, float *velocity);
+
+/* Queues a command received at server time received for the next step. Its
+ * time is filled in on the simulation's clock. */
+void vrep_plugin_queue_command(struct vrep_command c, uint64_t received);
+
+#endif
@@ -0,0 +1,280 @@
+/* User includes */
+#include "util/vrep_swarm.h"
+#include "util/vrep_link.h"
+#include "util/config.h"
+#include "util/error.h"
+#include "navdata/vrep_navdata.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+extern pthread_mutex_t vrep_mutex;
+
+/* simxGetObjectGroupData data types for every object in the scene */
+#define GROUP_NAMES 0
+#define GROUP_PARENTS 2
+
+static struct vrep_drone drones[VREP_SWARM_MAX_DRONES];
+static int num_drones = 0;
+
+/* Round trips to V-REP, for the startup report */
+static int messages;
+
+static simxInt swarm_template(simxInt id)
+{
+    char *model = config_get_option("vrep:swarm_model");
+    char *body = config_get_option("vrep:drone_body");
+    simxInt base;
+
+    ++messages;
+
+    if(model && *model)
+    {
+        /* Option 1: the file is on this side and is sent over first */
+        if(simxLoadModel(id, model, 1, &base, simx_opmode_oneshot_wait) != simx_error_noerror)
+            error("Could not load drone model %s into V-REP", model);
+
+        /* That was a transfer as well as the load */
+        ++messages;
+    }
+    else
+    {
+        body = body && *body ? body : VREP_NAVDATA_BODY;
+
+        if(simxGetObjectHandle(id, body, &base, simx_opmode_oneshot_wait) != simx_error_noerror)
+            error("No drone named %s in the scene to copy", body);
+    }
+
+    return base;
+}
+
+/* Copy and paste commands with the same arguments replace each other in the
+ * outgoing message, so one message can only make one copy. Copying every
+ * drone so far instead doubles the swarm per message. */
+static void swarm_replicate(simxInt id, simxInt *bases, int n)
+{
+    int count = 1;
+
+    while(count < n)
+    {
+        int copy = count < n - count ? count : n - count;
+        simxInt *pasted, pasted_count;
+
+        ++messages;
+
+        if(simxCopyPasteObjects(id, bases, copy, &pasted, &pasted_count, simx_opmode_oneshot_wait) != simx_error_noerror || pasted_count < copy)
+            error("Could not copy drones in V-REP (%d of %d made)", count, n);
+
+        memcpy(bases + count, pasted, copy * sizeof(simxInt));
+        count += copy;
+    }
+}
+
+/* Matches names of copies too, which V-REP suffixes with #<n> */
+static uint8_t same_object(const char *name, const char *wanted)
+{
+    size_t length = strcspn(name, "#");
+
+    return length == strlen(wanted) && !strncmp(name, wanted, length);
+}
+
+/* Finds each drone's front sensor by walking up from every object with that
+ * name to the drone base it belongs to, and each base's name suffix. The
+ * names and parents of every object were asked for in the same message as
+ * the placement, so this waits for that one reply. */
+static void swarm_resolve(simxInt id, const char *sensor)
+{
+    simxInt count, *handles, int_count, *ints, string_count;
+    simxChar *strings;
+
+    ++messages;
+
+    if(simxGetObjectGroupData(id, sim_appobj_object_type, GROUP_PARENTS, &count, &handles, &int_count, &ints, NULL, NULL, NULL, NULL, simx_opmode_oneshot_wait) != simx_error_noerror
+            || int_count < count)
+        error("Could not get the V-REP scene tree");
+
+    /* Handles are small and dense, so parents can be looked up by handle.
+     * The reply is overwritten by the next read, so it is copied out. */
+    simxInt max_handle = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        if(handles[i] > max_handle)
+            max_handle = handles[i];
+    }
+
+    simxInt *parent = malloc((max_handle + 1) * sizeof(simxInt));
+    simxInt *objects = malloc(count * sizeof(simxInt));
+    int *drone_of = malloc((max_handle + 1) * sizeof(int));
+    if(!parent || !objects || !drone_of)
+        error("Could not allocate the scene tree");
+
+    for(int i = 0; i <= max_handle; ++i)
+    {
+        parent[i] = -1;
+        drone_of[i] = -1;
+    }
+
+    for(int d = 0; d < num_drones; ++d)
+    {
+        if(drones[d].base >= 0 && drones[d].base <= max_handle)
+            drone_of[drones[d].base] = d;
+    }
+
+    for(int i = 0; i < count; ++i)
+    {
+        objects[i] = handles[i];
+
+        if(handles[i] >= 0)
+            parent[handles[i]] = ints[i];
+    }
+
+    int objects_count = count;
+
+    if(simxGetObjectGroupData(id, sim_appobj_object_type, GROUP_NAMES, &count, &handles, NULL, NULL, NULL, NULL, &string_count, &strings, simx_opmode_buffer) != simx_error_noerror
+            || count != objects_count)
+        error("Could not get the V-REP object names");
+
+    for(int i = 0; i < num_drones; ++i)
+    {
+        drones[i].front_sensor = -1;
+        drones[i].suffix[0] = '\0';
+    }
+
+    /* Names are back to back, each null terminated */
+    const char *name = strings;
+
+    for(int i = 0; i < count && i < string_count; ++i, name += strlen(name) + 1)
+    {
+        simxInt object = objects[i];
+
+        if(object >= 0 && object <= max_handle && drone_of[object] >= 0)
+        {
+            const char *suffix = strchr(name, '#');
+
+            if(suffix && strlen(suffix) < VREP_SWARM_SUFFIX)
+                strcpy(drones[drone_of[object]].suffix, suffix);
+        }
+
+        if(!same_object(name, sensor))
+            continue;
+
+        for(simxInt h = object; h >= 0 && h <= max_handle; h = parent[h])
+        {
+            if(drone_of[h] >= 0)
+            {
+                drones[drone_of[h]].front_sensor = object;
+                break;
+            }
+        }
+    }
+
+    for(int i = 0; i < num_drones; ++i)
+    {
+        if(drones[i].front_sensor < 0)
+            printf("Drone %d has no %s\n", i, sensor);
+
+        if(i && !drones[i].suffix[0])
+            printf("Drone %d has no name suffix, so shares the first drone's signals\n", i);
+    }
+
+    free(parent);
+    free(objects);
+    free(drone_of);
+}
+
+void vrep_swarm_spawn(int n)
+{
+    if(n < 1 || n > VREP_SWARM_MAX_DRONES)
+        error("Need 1 to %d drones", VREP_SWARM_MAX_DRONES);
+
+    char *sensor = config_get_option("vrep:front_sensor");
+    float spacing = config_get_float("vrep:swarm_spacing", VREP_SWARM_SPACING);
+    simxInt bases[VREP_SWARM_MAX_DRONES];
+    struct timespec start, end;
+
+    sensor = sensor && *sensor ? sensor : VREP_SWARM_FRONT_SENSOR;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&vrep_mutex);
+
+    if(!vrep_link_connected())
+        error("Cannot build a swarm without V-REP");
+
+    simxInt id = vrep_link_client();
+    messages = 0;
+
+    bases[0] = swarm_template(id);
+
+    /* Queued before the first copy waits, so it comes back with it */
+    float origin[3];
+    simxGetObjectPosition(id, bases[0], -1, origin, simx_opmode_oneshot);
+
+    swarm_replicate(id, bases, n);
+
+    if(simxGetObjectPosition(id, bases[0], -1, origin, simx_opmode_buffer) != simx_error_noerror &&
+            simxGetObjectPosition(id, bases[0], -1, origin, simx_opmode_oneshot_wait) != simx_error_noerror)
+        error("Could not get the drone's position");
+
+    /* Every copy is pasted on top of the first, so all of them are moved to
+     * the grid and the tree is asked for in one message */
+    int columns = ceilf(sqrtf(n));
+
+    simxPauseCommunication(id, 1);
+
+    for(int i = 0; i < n; ++i)
+    {
+        struct vrep_drone *d = &drones[i];
+
+        d->base = bases[i];
+        d->position[0] = origin[0] + (i % columns) * spacing;
+        d->position[1] = origin[1] + (i / columns) * spacing;
+        d->position[2] = origin[2];
+
+        if(i)
+            simxSetObjectPosition(id, d->base, -1, d->position, simx_opmode_oneshot);
+    }
+
+    simxInt count, *handles, string_count;
+    simxChar *strings;
+
+    simxGetObjectGroupData(id, sim_appobj_object_type, GROUP_NAMES, &count, &handles, NULL, NULL, NULL, NULL, &string_count, &strings, simx_opmode_oneshot);
+    simxGetObjectGroupData(id, sim_appobj_object_type, GROUP_PARENTS, &count, &handles, NULL, NULL, NULL, NULL, NULL, NULL, simx_opmode_oneshot);
+
+    simxPauseCommunication(id, 0);
+
+    num_drones = n;
+
+    swarm_resolve(id, sensor);
+
+    /* Replies stay in the inbox until removed */
+    simxGetObjectGroupData(id, sim_appobj_object_type, GROUP_NAMES, &count, &handles, NULL, NULL, NULL, NULL, &string_count, &strings, simx_opmode_remove);
+    simxGetObjectPosition(id, bases[0], -1, origin, simx_opmode_remove);
+
+    pthread_mutex_unlock(&vrep_mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    printf("Built a swarm of %d drones in %.0f ms and %d round trips\n", n, ms, messages);
+}
+
+int vrep_swarm_size(void)
+{
+    return num_drones;
+}
+
+const struct vrep_drone *vrep_swarm_drones(void)
+{
+    return drones;
+}
+
+const char *vrep_swarm_suffix(int i)
+{
+    return i < num_drones ? drones[i].suffix : "";
+}
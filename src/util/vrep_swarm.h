@@ -0,0 +1,46 @@
+#ifndef VREP_SWARM_H
+#define VREP_SWARM_H
+
+#include "libs/vrep/extApi.h"
+#include <stdint.h>
+
+#define VREP_SWARM_MAX_DRONES 1024
+
+/* Distance between neighbouring drones on the grid, m, unless
+ * vrep:swarm_spacing says otherwise */
+#define VREP_SWARM_SPACING 1.0f
+
+/* Object in each drone's model tree whose handle is resolved with the rest,
+ * unless vrep:front_sensor says otherwise */
+#define VREP_SWARM_FRONT_SENSOR "Quadricopter_frontCamera"
+
+/* Longest #<n> suffix V-REP gives a copy's names */
+#define VREP_SWARM_SUFFIX 12
+
+struct vrep_drone
+{
+    simxInt base;           /* model base, the dynamic body */
+    simxInt front_sensor;   /* -1 if the model has none */
+    float position[3];
+
+    /* The #<n> of the base's name, empty for a plain name like the first
+     * drone's in a scene made by hand. Each drone's
+     * script appends it to the QC signal names, so every drone has its own
+     * command queue and attitude signals. */
+    char suffix[VREP_SWARM_SUFFIX];
+};
+
+/* Builds a swarm of n drones on a square grid, starting from the drone at
+ * grid position 0. That drone is loaded from vrep:swarm_model (a .ttm on this
+ * machine) if set, or else is the one already in the scene. Copies are made
+ * by doubling, so this takes one message per doubling plus one to place them
+ * all and resolve their handles. Exits if V-REP cannot do it. */
+void vrep_swarm_spawn(int n);
+
+int vrep_swarm_size(void);
+const struct vrep_drone *vrep_swarm_drones(void);
+
+/* The suffix drone i's script puts on its signal names, "" without a swarm */
+const char *vrep_swarm_suffix(int i);
+
+#endif
@@ -0,0 +1,255 @@
+/* User includes */
+#include "video/block_flow.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FLOW_X86
+#include <immintrin.h>
+#endif
+
+typedef uint32_t (*sad_fn)(const uint8_t *a, const uint8_t *b, int stride);
+
+static uint32_t sad16_scalar(const uint8_t *a, const uint8_t *b, int stride)
+{
+    uint32_t sum = 0;
+
+    for(int y = 0; y < FLOW_BLOCK_SIZE; ++y, a += stride, b += stride)
+        for(int x = 0; x < FLOW_BLOCK_SIZE; ++x)
+            sum += abs(a[x] - b[x]);
+
+    return sum;
+}
+
+#ifdef FLOW_X86
+/* One 16 byte row per psadbw */
+__attribute__((target("sse2")))
+static uint32_t sad16_sse2(const uint8_t *a, const uint8_t *b, int stride)
+{
+    __m128i acc = _mm_setzero_si128();
+
+    for(int y = 0; y < FLOW_BLOCK_SIZE; ++y, a += stride, b += stride)
+    {
+        __m128i ra = _mm_loadu_si128((const __m128i*)a);
+        __m128i rb = _mm_loadu_si128((const __m128i*)b);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(ra, rb));
+    }
+
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+}
+
+/* Two rows per vpsadbw, one in each 128 bit lane */
+__attribute__((target("avx2")))
+static uint32_t sad16_avx2(const uint8_t *a, const uint8_t *b, int stride)
+{
+    __m256i acc = _mm256_setzero_si256();
+
+    for(int y = 0; y < FLOW_BLOCK_SIZE; y += 2, a += 2 * stride, b += 2 * stride)
+    {
+        __m256i ra = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)a)),
+                _mm_loadu_si128((const __m128i*)(a + stride)), 1);
+        __m256i rb = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)b)),
+                _mm_loadu_si128((const __m128i*)(b + stride)), 1);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(ra, rb));
+    }
+
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+    return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+}
+#endif
+
+static sad_fn sad16 = NULL;
+static const char *sad16_name = "none";
+
+uint8_t flow_set_impl(enum flow_impl impl)
+{
+    switch(impl)
+    {
+        case FLOW_IMPL_AUTO:
+#ifdef FLOW_X86
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2"))
+                return flow_set_impl(FLOW_IMPL_AVX2);
+            if(__builtin_cpu_supports("sse2"))
+                return flow_set_impl(FLOW_IMPL_SSE2);
+#endif
+            return flow_set_impl(FLOW_IMPL_SCALAR);
+        case FLOW_IMPL_SCALAR:
+            sad16 = sad16_scalar;
+            sad16_name = "scalar";
+            return 1;
+#ifdef FLOW_X86
+        case FLOW_IMPL_SSE2:
+            __builtin_cpu_init();
+            if(!__builtin_cpu_supports("sse2"))
+                return 0;
+            sad16 = sad16_sse2;
+            sad16_name = "sse2";
+            return 1;
+        case FLOW_IMPL_AVX2:
+            __builtin_cpu_init();
+            if(!__builtin_cpu_supports("avx2"))
+                return 0;
+            sad16 = sad16_avx2;
+            sad16_name = "avx2";
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+const char *flow_impl_name(void)
+{
+    return sad16_name;
+}
+
+void flow_pyramid_init(struct flow_pyramid *p, int width, int height)
+{
+    if(!sad16)
+        flow_set_impl(FLOW_IMPL_AUTO);
+
+    for(int l = 0; l < FLOW_LEVELS; ++l)
+    {
+        p->width[l] = l ? p->width[l - 1] / 2 : width;
+        p->height[l] = l ? p->height[l - 1] / 2 : height;
+        p->plane[l] = malloc(p->width[l] * p->height[l]);
+
+        if(!p->plane[l])
+            error("Could not allocate flow pyramid");
+    }
+}
+
+void flow_pyramid_free(struct flow_pyramid *p)
+{
+    for(int l = 0; l < FLOW_LEVELS; ++l)
+    {
+        free(p->plane[l]);
+        p->plane[l] = NULL;
+    }
+}
+
+void flow_pyramid_build(struct flow_pyramid *p, const uint8_t *luma, int linesize)
+{
+    for(int y = 0; y < p->height[0]; ++y)
+        memcpy(p->plane[0] + y * p->width[0], luma + y * linesize, p->width[0]);
+
+    for(int l = 1; l < FLOW_LEVELS; ++l)
+    {
+        int src_w = p->width[l - 1];
+
+        for(int y = 0; y < p->height[l]; ++y)
+        {
+            const uint8_t *s = p->plane[l - 1] + 2 * y * src_w;
+            uint8_t *d = p->plane[l] + y * p->width[l];
+
+            for(int x = 0; x < p->width[l]; ++x, s += 2)
+                d[x] = (s[0] + s[1] + s[src_w] + s[src_w + 1] + 2) >> 2;
+        }
+    }
+}
+
+static int clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* SAD of the candidate at (tx, ty), or UINT32_MAX if the block leaves the plane */
+static uint32_t flow_candidate(const struct flow_pyramid *cur, int l, const uint8_t *ref, int tx, int ty)
+{
+    int w = cur->width[l];
+
+    if(tx < 0 || ty < 0 || tx > w - FLOW_BLOCK_SIZE || ty > cur->height[l] - FLOW_BLOCK_SIZE)
+        return UINT32_MAX;
+
+    return sad16(ref, cur->plane[l] + ty * w + tx, w);
+}
+
+/* Offset of the minimum of a parabola through three SAD values */
+static float flow_subpixel(uint32_t left, uint32_t centre, uint32_t right)
+{
+    if(left == UINT32_MAX || right == UINT32_MAX)
+        return 0;
+
+    float denominator = (float)left - 2.0f * centre + right;
+
+    if(denominator <= 0)
+        return 0;
+
+    return ((float)left - (float)right) / (2.0f * denominator);
+}
+
+void flow_estimate(const struct flow_pyramid *prev, const struct flow_pyramid *cur, float dx[FLOW_BLOCKS], float dy[FLOW_BLOCKS])
+{
+    int w = prev->width[0];
+    int h = prev->height[0];
+
+    /* Centre of the image and the centre of each quadrant */
+    int centres[FLOW_BLOCKS][2] = {
+        { w / 2, h / 2 },
+        { w / 4, h / 4 },
+        { 3 * w / 4, h / 4 },
+        { w / 4, 3 * h / 4 },
+        { 3 * w / 4, 3 * h / 4 },
+    };
+
+    for(int b = 0; b < FLOW_BLOCKS; ++b)
+    {
+        int bx = 0, by = 0;
+        int x = 0, y = 0;
+        const uint8_t *ref = NULL;
+        uint32_t best = UINT32_MAX;
+
+        for(int l = FLOW_LEVELS - 1; l >= 0; --l)
+        {
+            int lw = prev->width[l];
+            int lh = prev->height[l];
+            int radius = l == FLOW_LEVELS - 1 ? FLOW_COARSE_RADIUS : FLOW_REFINE_RADIUS;
+
+            bx *= 2;
+            by *= 2;
+
+            if(lw < FLOW_BLOCK_SIZE || lh < FLOW_BLOCK_SIZE)
+                continue;
+
+            x = clamp((centres[b][0] >> l) - FLOW_BLOCK_SIZE / 2, 0, lw - FLOW_BLOCK_SIZE);
+            y = clamp((centres[b][1] >> l) - FLOW_BLOCK_SIZE / 2, 0, lh - FLOW_BLOCK_SIZE);
+            ref = prev->plane[l] + y * lw + x;
+
+            /* Start from the prediction so flat regions keep it */
+            int best_x = 0, best_y = 0;
+            best = flow_candidate(cur, l, ref, x + bx, y + by);
+
+            for(int sy = -radius; sy <= radius; ++sy)
+            {
+                for(int sx = -radius; sx <= radius; ++sx)
+                {
+                    uint32_t s = flow_candidate(cur, l, ref, x + bx + sx, y + by + sy);
+
+                    if(s < best)
+                    {
+                        best = s;
+                        best_x = sx;
+                        best_y = sy;
+                    }
+                }
+            }
+
+            bx += best_x;
+            by += best_y;
+        }
+
+        dx[b] = bx;
+        dy[b] = by;
+
+        if(!ref || best == UINT32_MAX)
+            continue;
+
+        dx[b] += flow_subpixel(flow_candidate(cur, 0, ref, x + bx - 1, y + by), best, flow_candidate(cur, 0, ref, x + bx + 1, y + by));
+        dy[b] += flow_subpixel(flow_candidate(cur, 0, ref, x + bx, y + by - 1), best, flow_candidate(cur, 0, ref, x + bx, y + by + 1));
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef BLOCK_FLOW_H
+#define BLOCK_FLOW_H
+
+#include <stdint.h>
+
+/* Number of flow vectors, matching navdata_vision_of_t */
+#define FLOW_BLOCKS 5
+#define FLOW_BLOCK_SIZE 16
+
+/* Level 0 is full resolution, each level above halves both dimensions */
+#define FLOW_LEVELS 3
+
+/* Search radius in pixels at the coarsest level and on each finer level */
+#define FLOW_COARSE_RADIUS 4
+#define FLOW_REFINE_RADIUS 2
+
+enum flow_impl
+{
+    FLOW_IMPL_AUTO,
+    FLOW_IMPL_SCALAR,
+    FLOW_IMPL_SSE2,
+    FLOW_IMPL_AVX2
+};
+
+struct flow_pyramid
+{
+    int width[FLOW_LEVELS];
+    int height[FLOW_LEVELS];
+    uint8_t *plane[FLOW_LEVELS];
+};
+
+void flow_pyramid_init(struct flow_pyramid *p, int width, int height);
+void flow_pyramid_free(struct flow_pyramid *p);
+void flow_pyramid_build(struct flow_pyramid *p, const uint8_t *luma, int linesize);
+
+/* Displacement in full resolution pixels of each block from prev to cur */
+void flow_estimate(const struct flow_pyramid *prev, const struct flow_pyramid *cur, float dx[FLOW_BLOCKS], float dy[FLOW_BLOCKS]);
+
+/* Returns 0 if the requested SAD implementation is not supported here */
+uint8_t flow_set_impl(enum flow_impl impl);
+const char *flow_impl_name(void);
+
+#endif
@@ -0,0 +1,275 @@
+/* User includes */
+#include "video/encoder_calibration.h"
+#include "video/video_server.h"
+#include "util/config.h"
+#include "util/error.h"
+
+/* Video includes */
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Slowest (best quality for the bitrate) first */
+static const char *presets[] = {
+    "slower", "slow", "medium", "fast", "faster", "veryfast", "superfast", "ultrafast",
+};
+
+static const int thread_counts[] = { 1, 2, 4 };
+
+#define NUM_PRESETS (sizeof(presets) / sizeof(presets[0]))
+#define NUM_THREAD_COUNTS (sizeof(thread_counts) / sizeof(thread_counts[0]))
+
+static AVFrame *alloc_clip_frame(void)
+{
+    AVFrame *frame = avcodec_alloc_frame();
+
+    if(!frame || avpicture_alloc((AVPicture*)frame, AV_PIX_FMT_YUV420P, VIDEO_WIDTH, VIDEO_HEIGHT) < 0)
+        error("Could not allocate calibration frame");
+
+    frame->width = VIDEO_WIDTH;
+    frame->height = VIDEO_HEIGHT;
+    frame->format = AV_PIX_FMT_YUV420P;
+
+    return frame;
+}
+
+/* Textured background panning under a moving block with some sensor noise,
+ * so the encoder has both motion and detail to spend its time on. */
+static int synthetic_clip(AVFrame **frames)
+{
+    unsigned seed = 1;
+
+    for(int i = 0; i < CALIBRATION_FRAMES; ++i)
+    {
+        AVFrame *f = frames[i] = alloc_clip_frame();
+
+        for(int y = 0; y < VIDEO_HEIGHT; ++y)
+        {
+            uint8_t *row = f->data[0] + y * f->linesize[0];
+
+            for(int x = 0; x < VIDEO_WIDTH; ++x)
+            {
+                int u = x + 3 * i, v = y + i;
+                seed = seed * 1103515245 + 12345;
+
+                row[x] = (((u >> 4) ^ (v >> 4)) & 1 ? 160 : 80) + ((u * v) & 31) + ((seed >> 16) & 7);
+            }
+        }
+
+        int bx = (i * 7) % (VIDEO_WIDTH - 64), by = VIDEO_HEIGHT / 3;
+        for(int y = by; y < by + 64; ++y)
+            memset(f->data[0] + y * f->linesize[0] + bx, 235, 64);
+
+        for(int y = 0; y < VIDEO_HEIGHT / 2; ++y)
+        {
+            for(int x = 0; x < VIDEO_WIDTH / 2; ++x)
+            {
+                f->data[1][y * f->linesize[1] + x] = 128 + ((x + i) & 15);
+                f->data[2][y * f->linesize[2] + x] = 128 - ((y + i) & 15);
+            }
+        }
+    }
+
+    return CALIBRATION_FRAMES;
+}
+
+/* Decodes up to CALIBRATION_FRAMES frames of a recorded clip, scaled to the
+ * stream size. Returns the number of frames read. */
+static int recorded_clip(const char *filename, AVFrame **frames)
+{
+    AVFormatContext *ifcx = NULL;
+
+    if(avformat_open_input(&ifcx, filename, NULL, NULL) != 0)
+        error("Cannot open calibration clip %s", filename);
+
+    if(avformat_find_stream_info(ifcx, NULL) < 0)
+        error("Cannot find stream info");
+
+    int stream_index = -1;
+    AVCodecContext *iccx = NULL;
+
+    for(int ix = 0; ix < ifcx->nb_streams; ++ix)
+    {
+        if(ifcx->streams[ix]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            iccx = ifcx->streams[ix]->codec;
+            stream_index = ix;
+            break;
+        }
+    }
+
+    if(stream_index < 0)
+        error("Cannot find video stream in calibration clip");
+
+    AVCodec *decoder = avcodec_find_decoder(iccx->codec_id);
+    if(!decoder || avcodec_open2(iccx, decoder, NULL) < 0)
+        error("Could not open codec");
+
+    struct SwsContext *sws = NULL;
+    AVFrame *decoded = avcodec_alloc_frame();
+    AVPacket pkt;
+    int n = 0;
+
+    av_init_packet(&pkt);
+
+    while(n < CALIBRATION_FRAMES && av_read_frame(ifcx, &pkt) >= 0)
+    {
+        int got_picture = 0;
+
+        if(pkt.stream_index == stream_index)
+            avcodec_decode_video2(iccx, decoded, &got_picture, &pkt);
+
+        if(got_picture)
+        {
+            sws = sws_getCachedContext(sws, iccx->width, iccx->height, iccx->pix_fmt,
+                    VIDEO_WIDTH, VIDEO_HEIGHT, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+            if(!sws)
+                error("Cannot initialize the conversion context");
+
+            frames[n] = alloc_clip_frame();
+            sws_scale(sws, (const uint8_t* const*)decoded->data, decoded->linesize, 0, iccx->height, frames[n]->data, frames[n]->linesize);
+            ++n;
+        }
+
+        av_free_packet(&pkt);
+        av_init_packet(&pkt);
+    }
+
+    sws_freeContext(sws);
+    avcodec_free_frame(&decoded);
+    avcodec_close(iccx);
+    avformat_close_input(&ifcx);
+
+    if(!n)
+        error("No frames decoded from calibration clip %s", filename);
+
+    return n;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double*)a, db = *(const double*)b;
+
+    return (da > db) - (da < db);
+}
+
+/* Encodes the clip and returns the 95th percentile encode time in ms. The
+ * clip is replayed if it is shorter than CALIBRATION_FRAMES. */
+static double time_setting(AVFrame **frames, int num_frames, const char *preset, int threads, double *mean)
+{
+    AVCodecContext *occx = open_video_encoder(AV_CODEC_ID_H264, preset, threads, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_BIT_RATE);
+    double times[CALIBRATION_FRAMES];
+    int timed = 0;
+    AVPacket pkt;
+
+    *mean = 0;
+
+    for(int i = 0; i < CALIBRATION_FRAMES; ++i)
+    {
+        AVFrame *frame = frames[i % num_frames];
+        struct timespec start, end;
+        int got_packet;
+
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        frame->pts = i;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if(avcodec_encode_video2(occx, &pkt, frame, &got_packet) < 0)
+            error("Encoding failed");
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if(got_packet)
+            av_free_packet(&pkt);
+
+        if(i < CALIBRATION_WARMUP)
+            continue;
+
+        times[timed] = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        *mean += times[timed++];
+    }
+
+    avcodec_close(occx);
+    av_free(occx);
+
+    *mean /= timed;
+    qsort(times, timed, sizeof(double), compare_doubles);
+
+    return times[timed * 95 / 100];
+}
+
+void encoder_calibrate(const char *clip)
+{
+    av_register_all();
+    avcodec_register_all();
+
+    AVFrame *frames[CALIBRATION_FRAMES];
+    int num_frames = clip ? recorded_clip(clip, frames) : synthetic_clip(frames);
+
+    float headroom = config_get_float("video:calibration_headroom", CALIBRATION_DEFAULT_HEADROOM);
+    double budget = 1000.0 / VIDEO_FPS * headroom;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1)
+        cpus = 1;
+
+    printf("Calibrating encoder on %s: budget %.1f ms per frame\n", clip ? clip : "synthetic clip", budget);
+
+    const char *chosen_preset = NULL;
+    int chosen_threads = 1;
+
+    /* The first setting that fits is the slowest preset with the fewest
+     * threads, which leaves the most CPU to everything else. */
+    for(int p = 0; p < NUM_PRESETS && !chosen_preset; ++p)
+    {
+        for(int t = 0; t < NUM_THREAD_COUNTS; ++t)
+        {
+            if(thread_counts[t] > cpus && t)
+                break;
+
+            double mean;
+            double p95 = time_setting(frames, num_frames, presets[p], thread_counts[t], &mean);
+
+            printf("\t%-10s %d thread%s\tmean %6.2f ms\tp95 %6.2f ms\n", presets[p], thread_counts[t], thread_counts[t] == 1 ? " " : "s", mean, p95);
+
+            if(p95 <= budget)
+            {
+                chosen_preset = presets[p];
+                chosen_threads = thread_counts[t];
+                break;
+            }
+        }
+    }
+
+    if(!chosen_preset)
+    {
+        chosen_preset = presets[NUM_PRESETS - 1];
+        chosen_threads = cpus < thread_counts[NUM_THREAD_COUNTS - 1] ? cpus : thread_counts[NUM_THREAD_COUNTS - 1];
+        printf("No setting fits the frame budget, falling back to the fastest\n");
+    }
+
+    printf("Chose preset %s with %d thread%s\n", chosen_preset, chosen_threads, chosen_threads == 1 ? "" : "s");
+
+    char threads[12];
+    snprintf(threads, sizeof(threads), "%d", chosen_threads);
+
+    config_set_option("video:encoder_preset", (char*)chosen_preset, NULL);
+    config_set_option("video:encoder_threads", threads, NULL);
+    config_write_options();
+
+    for(int i = 0; i < num_frames; ++i)
+    {
+        avpicture_free((AVPicture*)frames[i]);
+        avcodec_free_frame(&frames[i]);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef ENCODER_CALIBRATION_H
+#define ENCODER_CALIBRATION_H
+
+/* Frames encoded per setting, the first few of which are not timed while the
+ * encoder settles */
+#define CALIBRATION_FRAMES 60
+#define CALIBRATION_WARMUP 5
+
+/* Share of the frame interval the encoder may use at the 95th percentile. The
+ * rest is left for decoding, scaling and other streams on the host. Can be
+ * overridden with video:calibration_headroom in the configuration file. */
+#define CALIBRATION_DEFAULT_HEADROOM 0.5f
+
+/* Encodes a short clip at each preset and thread count, picks the slowest
+ * preset that fits the frame budget and stores it in the configuration. If
+ * clip is NULL a synthetic clip is used. */
+void encoder_calibrate(const char *clip);
+
+#endif
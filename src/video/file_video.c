@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+
+/* User includes */
+#include "video/file_video.h"
+#include "util/metrics.h"
+#include "util/config.h"
+#include "util/error.h"
+#include "util/numa_place.h"
+
+/* Video includes */
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+/* Standard includes */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static char *filename;
+
+/* The decoded clip. Frames are never written once the pool is built, so the
+ * encoder side only ever reads from it. */
+static struct file_video_header header;
+static uint8_t *pool;
+static size_t pool_size;
+
+/* Replay position and schedule */
+static uint32_t next_frame;
+static struct timespec next_time;
+static int64_t interval_ns;
+static struct metric *late_frames;
+
+/* Slots are cache line aligned so each frame starts on its own line */
+static uint64_t slot_size(enum AVPixelFormat fmt, int width, int height)
+{
+    return ((uint64_t)avpicture_get_size(fmt, width, height) + 63) & ~(uint64_t)63;
+}
+
+static uint8_t *pool_slot(uint32_t n)
+{
+    return pool + n * header.slot_size;
+}
+
+/* Maps an existing cache of the same clip. Returns 0 if there is none or it
+ * was made from something else. */
+static uint8_t map_cache(const char *cache, const struct file_video_header *want)
+{
+    struct file_video_header h;
+    struct stat st;
+    int fd = open(cache, O_RDONLY);
+
+    if(fd < 0)
+        return 0;
+
+    if(read(fd, &h, sizeof(h)) != sizeof(h) || fstat(fd, &st) < 0 ||
+            h.magic != FILE_VIDEO_CACHE_MAGIC || h.width != want->width || h.height != want->height ||
+            h.pix_fmt != want->pix_fmt || h.slot_size != want->slot_size ||
+            h.source_size != want->source_size || h.source_mtime != want->source_mtime ||
+            !h.count || (uint64_t)st.st_size < sizeof(h) + h.count * h.slot_size)
+    {
+        close(fd);
+        return 0;
+    }
+
+    /* Populated up front so replay never faults a page in */
+    size_t size = sizeof(h) + h.count * h.slot_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+
+    close(fd);
+
+    if(map == MAP_FAILED)
+        return 0;
+
+    header = h;
+    pool = map + sizeof(h);
+    pool_size = size;
+
+    return 1;
+}
+
+static void write_cache(const char *cache)
+{
+    FILE *f = fopen(cache, "wb");
+
+    if(!f)
+    {
+        printf("Could not write frame cache %s\n", cache);
+        return;
+    }
+
+    if(fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(pool, header.slot_size, header.count, f) != header.count)
+        printf("Could not write frame cache %s\n", cache);
+
+    fclose(f);
+}
+
+static void store_frame(AVCodecContext *iccx, AVFrame *decoded)
+{
+    AVPicture slot;
+
+    avpicture_fill(&slot, pool_slot(header.count), iccx->pix_fmt, iccx->width, iccx->height);
+    av_picture_copy(&slot, (const AVPicture*)decoded, iccx->pix_fmt, iccx->width, iccx->height);
+
+    ++header.count;
+}
+
+/* Decodes up to max_frames frames into anonymous memory. Pages past the end
+ * of a short clip are never touched and are given back afterwards. */
+static void decode_clip(struct input_stream *in_stream, int max_frames)
+{
+    AVCodecContext *iccx = in_stream->iccx;
+    AVFrame *decoded = avcodec_alloc_frame();
+    AVPacket pkt;
+    int got_picture;
+
+    pool_size = max_frames * header.slot_size;
+    pool = mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(pool == MAP_FAILED)
+        error("Could not allocate %zu bytes of frames", pool_size);
+
+    numa_place_bind(pool, pool_size, "decoded clip");
+
+    av_init_packet(&pkt);
+
+    while(header.count < max_frames && av_read_frame(in_stream->ifcx, &pkt) >= 0)
+    {
+        got_picture = 0;
+
+        if(pkt.stream_index == in_stream->video_stream_index)
+            avcodec_decode_video2(iccx, decoded, &got_picture, &pkt);
+
+        if(got_picture)
+            store_frame(iccx, decoded);
+
+        av_free_packet(&pkt);
+        av_init_packet(&pkt);
+    }
+
+    /* Frames the decoder is still holding back */
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    while(header.count < max_frames && avcodec_decode_video2(iccx, decoded, &got_picture, &pkt) >= 0 && got_picture)
+        store_frame(iccx, decoded);
+
+    avcodec_free_frame(&decoded);
+
+    if(!header.count)
+        error("No frames decoded from %s", filename);
+
+    size_t used = header.count * header.slot_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t keep = (used + page - 1) & ~(page - 1);
+
+    if(keep < pool_size)
+    {
+        munmap(pool + keep, pool_size - keep);
+        pool_size = keep;
+    }
+}
+
+void open_file_stream(struct input_stream *in_stream)
+{
+    struct stat st;
+
+    if(avformat_open_input(&in_stream->ifcx, filename, NULL, NULL) != 0 || stat(filename, &st) < 0)
+        error("Cannot open input file %s", filename);
+
+    if(avformat_find_stream_info(in_stream->ifcx, NULL) < 0)
+        error("Cannot find stream info");
+
+    in_stream->video_stream_index = -1;
+
+    for(int ix = 0; ix < in_stream->ifcx->nb_streams; ++ix)
+    {
+        if(in_stream->ifcx->streams[ix]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            in_stream->ist = in_stream->ifcx->streams[ix];
+            in_stream->iccx = in_stream->ist->codec;
+            in_stream->video_stream_index = ix;
+            break;
+        }
+    }
+
+    if(in_stream->video_stream_index < 0)
+        error("Cannot find input video stream");
+
+    AVCodecContext *iccx = in_stream->iccx;
+
+    iccx->codec = avcodec_find_decoder(iccx->codec_id);
+    if(!iccx->codec || avcodec_open2(iccx, iccx->codec, NULL) < 0)
+        error("Could not open codec");
+
+    /* Nominal rate of the clip, or the stream rate if it does not say */
+    AVRational fps = in_stream->ist->avg_frame_rate;
+    if(!fps.num || !fps.den)
+        fps = in_stream->ist->r_frame_rate;
+    if(!fps.num || !fps.den)
+        fps = (AVRational){VIDEO_FPS, 1};
+
+    header.magic = FILE_VIDEO_CACHE_MAGIC;
+    header.width = iccx->width;
+    header.height = iccx->height;
+    header.pix_fmt = iccx->pix_fmt;
+    header.fps_num = fps.num;
+    header.fps_den = fps.den;
+    header.slot_size = slot_size(iccx->pix_fmt, iccx->width, iccx->height);
+    header.source_size = st.st_size;
+    header.source_mtime = st.st_mtime;
+
+    char *cache = config_get_option("video:frame_cache");
+    uint8_t cached = cache && *cache && map_cache(cache, &header);
+
+    if(!cached)
+    {
+        decode_clip(in_stream, config_get_int("video:file_max_frames", FILE_VIDEO_MAX_FRAMES));
+
+        if(cache && *cache)
+            write_cache(cache);
+    }
+
+    printf("%s: %u frames of %ux%u at %u/%u fps%s\n", filename, header.count, header.width, header.height,
+            header.fps_num, header.fps_den, cached ? " from the frame cache" : "");
+
+    interval_ns = (int64_t)1000000000 * header.fps_den / header.fps_num;
+    late_frames = metrics_counter("file_video_late_frames");
+
+    next_frame = 0;
+    clock_gettime(CLOCK_MONOTONIC, &next_time);
+}
+
+/* Hands out the next frame at its time on an absolute schedule, so time spent
+ * converting and encoding does not add up into drift. If the pipeline falls
+ * more than a frame behind the schedule starts again from now rather than
+ * sending a burst to catch up. The frame points into the pool. */
+int read_file_frame(struct input_stream *in_stream, AVFrame *frame)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t late = (now.tv_sec - next_time.tv_sec) * 1000000000LL + (now.tv_nsec - next_time.tv_nsec);
+
+    if(late > interval_ns)
+    {
+        metrics_add(late_frames, 1);
+        next_time = now;
+    }
+    else
+    {
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_time, NULL))
+            ;
+    }
+
+    avpicture_fill((AVPicture*)frame, pool_slot(next_frame), header.pix_fmt, header.width, header.height);
+    frame->format = header.pix_fmt;
+    frame->width = header.width;
+    frame->height = header.height;
+
+    next_frame = (next_frame + 1) % header.count;
+
+    int64_t ns = next_time.tv_nsec + interval_ns;
+    next_time.tv_sec += ns / 1000000000;
+    next_time.tv_nsec = ns % 1000000000;
+
+    return 0;
+}
+
+void file_video_init(struct data_options *d, char *file)
+{
+    filename = file;
+    d->open_video_stream = open_file_stream;
+    d->read_video_frame = read_file_frame;
+}
@@ -0,0 +1,36 @@
+#ifndef FILE_VIDEO_H
+#define FILE_VIDEO_H
+
+#include "video/video_server.h"
+#include "util/data_options.h"
+
+/* Clips longer than this are cut, 10 s at 30 fps. Can be set with
+ * video:file_max_frames. */
+#define FILE_VIDEO_MAX_FRAMES 300
+
+#define FILE_VIDEO_CACHE_MAGIC 0x46444956
+
+/* Start of a frame cache file, followed by the frames, each slot_size apart */
+struct file_video_header
+{
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    int32_t pix_fmt;
+    uint32_t count;
+    uint32_t fps_num;
+    uint32_t fps_den;
+    uint32_t reserved;
+    uint64_t slot_size;
+
+    /* Of the clip the cache was decoded from, to notice when it changes */
+    uint64_t source_size;
+    int64_t source_mtime;
+};
+
+/* Decodes the clip once and then replays the decoded frames in a loop */
+void open_file_stream(struct input_stream *in_stream);
+int read_file_frame(struct input_stream *in_stream, AVFrame *frame);
+void file_video_init(struct data_options *d, char *file);
+
+#endif
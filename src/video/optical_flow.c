@@ -0,0 +1,233 @@
+/* User includes */
+#include "video/optical_flow.h"
+#include "video/block_flow.h"
+#include "util/config.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+uint8_t compute_flow = 0;
+
+/* Frame handoff from the video thread. The video thread only ever tries the
+ * lock, so a busy flow thread costs it a skipped flow sample, never a delay.
+ * Each frame carries its size, which can change mid-stream when the video
+ * server scales to a new QoS level or the V-REP camera resolution changes. */
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+static uint8_t *pending = NULL;
+static size_t pending_capacity = 0;
+static int pending_width;
+static int pending_height;
+static uint8_t pending_ready = 0;
+static struct timespec pending_time;
+
+static pthread_t flow_thread;
+static float flow_fov;              /* degrees */
+
+/* Latest result, read by the navdata thread */
+static pthread_mutex_t result_mutex = PTHREAD_MUTEX_INITIALIZER;
+static float result_dx[FLOW_BLOCKS];
+static float result_dy[FLOW_BLOCKS];
+static float result_interval = 0;   /* seconds between the two frames compared */
+static uint32_t result_frames = 0;
+
+static float focal_length;          /* pixels */
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void *optical_flow_run(void *args)
+{
+    struct flow_pyramid pyramids[2];
+    struct timespec times[2];
+    int cur = 0;
+    uint8_t have_prev = 0;
+    int width = 0, height = 0;
+
+    uint8_t *working = NULL;
+    size_t working_capacity = 0;
+
+    struct metric *compute_ms = metrics_gauge("optical_flow_ms");
+    struct metric *frames = metrics_counter("optical_flow_frames");
+
+    while(1)
+    {
+        pthread_mutex_lock(&handoff_mutex);
+
+        while(!pending_ready)
+            pthread_cond_wait(&handoff_cond, &handoff_mutex);
+
+        uint8_t *tmp = working;
+        size_t tmp_capacity = working_capacity;
+        working = pending;
+        working_capacity = pending_capacity;
+        pending = tmp;
+        pending_capacity = tmp_capacity;
+        pending_ready = 0;
+        times[cur] = pending_time;
+
+        int frame_width = pending_width;
+        int frame_height = pending_height;
+
+        pthread_mutex_unlock(&handoff_mutex);
+
+        /* A new size lays the block grid out again over the new frame, and
+         * the first frame at it has nothing to be compared with */
+        if(frame_width != width || frame_height != height)
+        {
+            if(width)
+            {
+                flow_pyramid_free(&pyramids[0]);
+                flow_pyramid_free(&pyramids[1]);
+            }
+
+            width = frame_width;
+            height = frame_height;
+            flow_pyramid_init(&pyramids[0], width, height);
+            flow_pyramid_init(&pyramids[1], width, height);
+            have_prev = 0;
+
+            pthread_mutex_lock(&result_mutex);
+            focal_length = (width / 2.0f) / tanf(flow_fov * (float)M_PI / 360.0f);
+            pthread_mutex_unlock(&result_mutex);
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        flow_pyramid_build(&pyramids[cur], working, width);
+
+        if(have_prev)
+        {
+            float dx[FLOW_BLOCKS], dy[FLOW_BLOCKS];
+            flow_estimate(&pyramids[!cur], &pyramids[cur], dx, dy);
+
+            pthread_mutex_lock(&result_mutex);
+            memcpy(result_dx, dx, sizeof(dx));
+            memcpy(result_dy, dy, sizeof(dy));
+            result_interval = timespec_diff(&times[cur], &times[!cur]);
+            ++result_frames;
+            pthread_mutex_unlock(&result_mutex);
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            metrics_set(compute_ms, timespec_diff(&end, &start) * 1000);
+            metrics_add(frames, 1);
+        }
+
+        have_prev = 1;
+        cur = !cur;
+    }
+
+    return NULL;
+}
+
+/* Called by the video thread with each frame's luma plane */
+void optical_flow_submit(const uint8_t *luma, int linesize, int width, int height)
+{
+    static uint8_t started = 0;
+
+    if(!started)
+    {
+        flow_fov = config_get_float("video:of_fov", OPTICAL_FLOW_DEFAULT_FOV);
+        pthread_create(&flow_thread, NULL, optical_flow_run, NULL);
+        started = 1;
+    }
+
+    if(pthread_mutex_trylock(&handoff_mutex))
+        return;
+
+    if(!pending_ready)
+    {
+        size_t size = (size_t)width * height;
+
+        /* Only grows, and only on a size change, as the buffers swap */
+        if(pending_capacity < size)
+        {
+            uint8_t *grown = realloc(pending, size);
+            if(!grown)
+                error("Could not allocate flow frame");
+
+            pending = grown;
+            pending_capacity = size;
+        }
+
+        for(int y = 0; y < height; ++y)
+            memcpy(pending + y * width, luma + y * linesize, width);
+
+        pending_width = width;
+        pending_height = height;
+
+        clock_gettime(CLOCK_MONOTONIC, &pending_time);
+        pending_ready = 1;
+        pthread_cond_signal(&handoff_cond);
+    }
+
+    pthread_mutex_unlock(&handoff_mutex);
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float*)a, fb = *(const float*)b;
+
+    return (fa > fb) - (fa < fb);
+}
+
+static float median(const float *v)
+{
+    float sorted[FLOW_BLOCKS];
+
+    memcpy(sorted, v, sizeof(sorted));
+    qsort(sorted, FLOW_BLOCKS, sizeof(float), compare_floats);
+
+    return sorted[FLOW_BLOCKS / 2];
+}
+
+/* Fills the vision options from the latest flow. Altitude is in metres; body
+ * velocities are in mm/s with x forward (image up) and y right. */
+void optical_flow_fill_navdata(navdata_vision_t *vision, navdata_vision_of_t *vision_of, float altitude)
+{
+    float dx[FLOW_BLOCKS], dy[FLOW_BLOCKS];
+    float interval, focal;
+    uint32_t frames;
+
+    pthread_mutex_lock(&result_mutex);
+    memcpy(dx, result_dx, sizeof(dx));
+    memcpy(dy, result_dy, sizeof(dy));
+    interval = result_interval;
+    frames = result_frames;
+    focal = focal_length;
+    pthread_mutex_unlock(&result_mutex);
+
+    memset(vision_of, 0, sizeof(navdata_vision_of_t));
+    vision_of->tag = NAVDATA_VISION_OF_TAG;
+    vision_of->size = sizeof(navdata_vision_of_t);
+
+    for(int i = 0; i < FLOW_BLOCKS; ++i)
+    {
+        *(float*)&vision_of->of_dx[i] = dx[i];
+        *(float*)&vision_of->of_dy[i] = dy[i];
+    }
+
+    memset(vision, 0, sizeof(navdata_vision_t));
+    vision->tag = NAVDATA_VISION_TAG;
+    vision->size = sizeof(navdata_vision_t);
+    vision->new_raw_picture = frames;
+    vision->altitude_capture = altitude * 1000;
+
+    if(interval <= 0 || focal <= 0)
+        return;
+
+    /* The ground moves opposite to the drone in the image */
+    float scale = altitude * 1000 / (focal * interval);
+
+    *(float*)&vision->body_v.x = median(dy) * scale;
+    *(float*)&vision->body_v.y = -median(dx) * scale;
+}
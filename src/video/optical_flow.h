@@ -0,0 +1,14 @@
+#ifndef OPTICAL_FLOW_H
+#define OPTICAL_FLOW_H
+
+#include "navdata/navdata_common.h"
+#include <stdint.h>
+
+/* Horizontal field of view of the camera feeding the flow, in degrees. Can be
+ * overridden with video:of_fov in the configuration file. */
+#define OPTICAL_FLOW_DEFAULT_FOV 64.0f
+
+void optical_flow_submit(const uint8_t *luma, int linesize, int width, int height);
+void optical_flow_fill_navdata(navdata_vision_t *vision, navdata_vision_of_t *vision_of, float altitude);
+
+#endif
@@ -0,0 +1,54 @@
+/* User includes */
+#include "video/plugin_video.h"
+#include "util/vrep_plugin.h"
+#include "util/error.h"
+
+/* Video includes */
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+extern uint8_t flip_video;
+
+void plugin_video_init(struct data_options *d)
+{
+    /* V-REP images are bottom row first */
+    flip_video = 1;
+    d->open_video_stream = open_plugin_stream;
+    d->read_video_frame = read_plugin_frame;
+}
+
+/* There is nothing to demux or decode, so the stream only describes the
+ * images. Waits for the simulation to start to learn their size. */
+void open_plugin_stream(struct input_stream *in_stream)
+{
+    int width, height;
+
+    vrep_plugin_wait_resolution(&width, &height);
+
+    in_stream->ifcx = avformat_alloc_context();
+    in_stream->iccx = avcodec_alloc_context3(NULL);
+    if(!in_stream->ifcx || !in_stream->iccx)
+        error("Could not allocate the plugin video stream");
+
+    in_stream->iccx->codec_type = AVMEDIA_TYPE_VIDEO;
+    in_stream->iccx->pix_fmt = AV_PIX_FMT_RGB24;
+    in_stream->iccx->width = width;
+    in_stream->iccx->height = height;
+
+    in_stream->ist = NULL;
+    in_stream->video_stream_index = 0;
+}
+
+/* Blocks until the next simulation step renders. The frame points at the
+ * image, which the simulation leaves alone until the next call. */
+int read_plugin_frame(struct input_stream *in_stream, AVFrame *frame)
+{
+    AVCodecContext *iccx = in_stream->iccx;
+
+    avpicture_fill((AVPicture*)frame, (uint8_t*)vrep_plugin_wait_frame(), iccx->pix_fmt, iccx->width, iccx->height);
+    frame->format = iccx->pix_fmt;
+    frame->width = iccx->width;
+    frame->height = iccx->height;
+
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef PLUGIN_VIDEO_H
+#define PLUGIN_VIDEO_H
+
+#include "video/video_server.h"
+#include "util/data_options.h"
+
+/* Takes the front camera's images straight from the simulation when the
+ * server runs as a V-REP plugin */
+void plugin_video_init(struct data_options *d);
+void open_plugin_stream(struct input_stream *in_stream);
+int read_plugin_frame(struct input_stream *in_stream, AVFrame *frame);
+
+#endif
@@ -0,0 +1,133 @@
+/* User includes */
+#include "video/pose_sei.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+
+#define NAL_SEI 6
+#define SEI_USER_DATA_UNREGISTERED 5
+
+uint8_t embed_pose = 0;
+
+/* Identifies the payload to clients among other user data, such as x264's
+ * own version string */
+const uint8_t pose_sei_uuid[16] = {
+    0x3b, 0x5c, 0x8e, 0x21, 0x94, 0x6d, 0x4f, 0x0a,
+    0xb7, 0x12, 0xd9, 0x4e, 0x60, 0xa3, 0x7f, 0xc5,
+};
+
+static uint8_t *put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+
+    return p + 4;
+}
+
+/* The demo fields hold float bits */
+static uint8_t *put_field(uint8_t *p, const void *field)
+{
+    uint32_t v;
+
+    memcpy(&v, field, sizeof(v));
+
+    return put_be32(p, v);
+}
+
+int pose_sei_write(uint8_t *out, uint64_t capture_us, const navdata_demo_t *demo)
+{
+    uint8_t rbsp[2 + POSE_SEI_PAYLOAD_SIZE];
+    uint8_t *p = rbsp;
+
+    *p++ = SEI_USER_DATA_UNREGISTERED;
+    *p++ = POSE_SEI_PAYLOAD_SIZE;
+
+    memcpy(p, pose_sei_uuid, sizeof(pose_sei_uuid));
+    p += sizeof(pose_sei_uuid);
+
+    p = put_be32(p, capture_us >> 32);
+    p = put_be32(p, capture_us);
+    p = put_field(p, &demo->theta);
+    p = put_field(p, &demo->phi);
+    p = put_field(p, &demo->psi);
+    p = put_field(p, &demo->altitude);
+    p = put_field(p, &demo->vx);
+    p = put_field(p, &demo->vy);
+    p = put_field(p, &demo->vz);
+
+    uint8_t *o = out;
+
+    *o++ = 0;
+    *o++ = 0;
+    *o++ = 0;
+    *o++ = 1;
+    *o++ = NAL_SEI;
+
+    /* Times and floats can hold any bytes, so start codes are escaped */
+    int zeros = 0;
+
+    for(uint8_t *b = rbsp; b < p; ++b)
+    {
+        if(zeros == 2 && *b <= 3)
+        {
+            *o++ = 3;
+            zeros = 0;
+        }
+
+        *o++ = *b;
+        zeros = *b ? 0 : zeros + 1;
+    }
+
+    /* rbsp_trailing_bits */
+    *o++ = 0x80;
+
+    return o - out;
+}
+
+/* Offset of the start code of the first slice NAL unit, or size if there
+ * is none */
+static int first_slice(const uint8_t *data, int size)
+{
+    for(int i = 0; i + 3 < size; ++i)
+    {
+        if(data[i] || data[i + 1] || data[i + 2] != 1)
+            continue;
+
+        int type = data[i + 3] & 0x1F;
+
+        if(type >= 1 && type <= 5)
+            return i > 0 && !data[i - 1] ? i - 1 : i;
+
+        i += 2;
+    }
+
+    return size;
+}
+
+void pose_sei_splice(struct pose_sei *s, const AVPacket *in, AVPacket *out, uint64_t capture_us, const navdata_demo_t *demo)
+{
+    av_fast_malloc(&s->buffer, &s->buffer_size, in->size + POSE_SEI_MAX_SIZE);
+    if(!s->buffer)
+        error("Could not allocate %d bytes for a video frame", in->size + POSE_SEI_MAX_SIZE);
+
+    int at = first_slice(in->data, in->size);
+
+    memcpy(s->buffer, in->data, at);
+    int length = pose_sei_write(s->buffer + at, capture_us, demo);
+    memcpy(s->buffer + at + length, in->data + at, in->size - at);
+
+    /* The encoder's packet keeps its own data and destructor */
+    *out = *in;
+    out->data = s->buffer;
+    out->size = in->size + length;
+    out->destruct = NULL;
+}
+
+void pose_sei_free(struct pose_sei *s)
+{
+    av_freep(&s->buffer);
+    s->buffer_size = 0;
+}
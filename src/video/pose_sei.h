@@ -0,0 +1,43 @@
+#ifndef POSE_SEI_H
+#define POSE_SEI_H
+
+#include "navdata/navdata_common.h"
+
+/* Video includes */
+#include <libavcodec/avcodec.h>
+
+#include <stdint.h>
+
+/* user_data_unregistered payload: the UUID below, then big endian capture
+ * time in server_clock_us() (uint64), theta, phi and psi in millidegrees,
+ * altitude in metres and vx, vy and vz in mm/s (float32), in navdata_demo
+ * units */
+#define POSE_SEI_PAYLOAD_SIZE (16 + 8 + 7 * 4)
+
+/* Largest SEI NAL unit pose_sei_write() makes: start code, NAL header, type,
+ * size, payload and trailing bits, with room for an emulation prevention
+ * byte after every two payload bytes */
+#define POSE_SEI_MAX_SIZE (4 + 3 + POSE_SEI_PAYLOAD_SIZE + POSE_SEI_PAYLOAD_SIZE / 2 + 1)
+
+extern const uint8_t pose_sei_uuid[16];
+
+struct pose_sei
+{
+    /* Last access unit with the SEI spliced in. Only grown, so once it holds
+     * an IDR no frame allocates. */
+    uint8_t *buffer;
+    unsigned int buffer_size;
+};
+
+/* Writes an Annex B SEI NAL unit carrying the pose in demo, captured at
+ * capture_us, into out. Returns its length. */
+int pose_sei_write(uint8_t *out, uint64_t capture_us, const navdata_demo_t *demo);
+
+/* Points out at a copy of the encoded access unit in with the pose SEI
+ * inserted before its first slice, so it follows any SPS and PPS. out is
+ * valid until the next call and must not be freed. */
+void pose_sei_splice(struct pose_sei *s, const AVPacket *in, AVPacket *out, uint64_t capture_us, const navdata_demo_t *demo);
+
+void pose_sei_free(struct pose_sei *s);
+
+#endif
@@ -0,0 +1,337 @@
+/* User includes */
+#include "video/quality_kernels.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QUALITY_X86
+#include <immintrin.h>
+#endif
+
+typedef uint64_t (*sse_row_fn)(const uint8_t *a, const uint8_t *b, int width);
+
+/* Sums for each of a row of 4x4 blocks: sum of a, sum of b, sum of a^2 + b^2
+ * and sum of a * b */
+typedef void (*ssim_sums_fn)(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int32_t (*sums)[4], int blocks);
+
+static uint64_t sse_row_scalar(const uint8_t *a, const uint8_t *b, int width)
+{
+    uint64_t sum = 0;
+
+    for(int x = 0; x < width; ++x)
+    {
+        int d = a[x] - b[x];
+        sum += d * d;
+    }
+
+    return sum;
+}
+
+static void ssim_sums_scalar(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int32_t (*sums)[4], int blocks)
+{
+    for(int i = 0; i < blocks; ++i, a += 4, b += 4)
+    {
+        int32_t s1 = 0, s2 = 0, ss = 0, s12 = 0;
+
+        for(int y = 0; y < 4; ++y)
+        {
+            for(int x = 0; x < 4; ++x)
+            {
+                int pa = a[y * a_stride + x];
+                int pb = b[y * b_stride + x];
+
+                s1 += pa;
+                s2 += pb;
+                ss += pa * pa + pb * pb;
+                s12 += pa * pb;
+            }
+        }
+
+        sums[i][0] = s1;
+        sums[i][1] = s2;
+        sums[i][2] = ss;
+        sums[i][3] = s12;
+    }
+}
+
+#ifdef QUALITY_X86
+/* 16 pixels per iteration, differences squared and pairwise added by pmaddwd.
+ * A 32 bit lane gains at most 4 * 255^2 per iteration, so rows up to 8192
+ * pixels cannot overflow. */
+__attribute__((target("sse2")))
+static uint64_t sse_row_sse2(const uint8_t *a, const uint8_t *b, int width)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    int x = 0;
+
+    for(; x + 16 <= width; x += 16)
+    {
+        __m128i ra = _mm_loadu_si128((const __m128i*)(a + x));
+        __m128i rb = _mm_loadu_si128((const __m128i*)(b + x));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(ra, zero), _mm_unpacklo_epi8(rb, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(ra, zero), _mm_unpackhi_epi8(rb, zero));
+
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+
+    return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] + sse_row_scalar(a + x, b + x, width - x);
+}
+
+/* phaddd without SSSE3: (a0 + a1, a2 + a3, b0 + b1, b2 + b3) */
+__attribute__((target("sse2")))
+static inline __m128i ssim_hadd_sse2(__m128i a, __m128i b)
+{
+    __m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))),
+            _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+/* Two blocks (8 pixels) per iteration. Column sums are kept in 16 bits and
+ * folded into per block sums at the end. */
+__attribute__((target("sse2")))
+static void ssim_sums_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int32_t (*sums)[4], int blocks)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_set1_epi16(1);
+    int i = 0;
+
+    for(; i + 2 <= blocks; i += 2, a += 8, b += 8)
+    {
+        __m128i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+
+        for(int y = 0; y < 4; ++y)
+        {
+            __m128i ra = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(a + y * a_stride)), zero);
+            __m128i rb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + y * b_stride)), zero);
+
+            s1 = _mm_add_epi16(s1, ra);
+            s2 = _mm_add_epi16(s2, rb);
+            ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(ra, ra), _mm_madd_epi16(rb, rb)));
+            s12 = _mm_add_epi32(s12, _mm_madd_epi16(ra, rb));
+        }
+
+        /* Fold pairs of columns into blocks and transpose so each block's
+         * four sums are adjacent, matching the layout of sums */
+        __m128i sums_ab = ssim_hadd_sse2(_mm_madd_epi16(s1, ones), _mm_madd_epi16(s2, ones));
+        __m128i sums_sq = ssim_hadd_sse2(ss, s12);
+
+        sums_ab = _mm_shuffle_epi32(sums_ab, _MM_SHUFFLE(3, 1, 2, 0));
+        sums_sq = _mm_shuffle_epi32(sums_sq, _MM_SHUFFLE(3, 1, 2, 0));
+
+        _mm_storeu_si128((__m128i*)sums[i], _mm_unpacklo_epi64(sums_ab, sums_sq));
+        _mm_storeu_si128((__m128i*)sums[i + 1], _mm_unpackhi_epi64(sums_ab, sums_sq));
+    }
+
+    ssim_sums_scalar(a, a_stride, b, b_stride, sums + i, blocks - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sse_row_avx2(const uint8_t *a, const uint8_t *b, int width)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int x = 0;
+
+    for(; x + 32 <= width; x += 32)
+    {
+        __m256i lo = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + x))),
+                _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + x))));
+        __m256i hi = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + x + 16))),
+                _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + x + 16))));
+
+        acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+
+    uint64_t sum = 0;
+    for(int i = 0; i < 8; ++i)
+        sum += lanes[i];
+
+    return sum + sse_row_scalar(a + x, b + x, width - x);
+}
+
+/* Four blocks (16 pixels) per iteration */
+__attribute__((target("avx2")))
+static void ssim_sums_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int32_t (*sums)[4], int blocks)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi16(1);
+    int i = 0;
+
+    for(; i + 4 <= blocks; i += 4, a += 16, b += 16)
+    {
+        __m256i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+
+        for(int y = 0; y < 4; ++y)
+        {
+            __m256i ra = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + y * a_stride)));
+            __m256i rb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + y * b_stride)));
+
+            s1 = _mm256_add_epi16(s1, ra);
+            s2 = _mm256_add_epi16(s2, rb);
+            ss = _mm256_add_epi32(ss, _mm256_add_epi32(_mm256_madd_epi16(ra, ra), _mm256_madd_epi16(rb, rb)));
+            s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(ra, rb));
+        }
+
+        /* As for SSE2, with blocks i and i + 1 in the low lane and i + 2
+         * and i + 3 in the high lane */
+        __m256i sums_ab = _mm256_hadd_epi32(_mm256_madd_epi16(s1, ones), _mm256_madd_epi16(s2, ones));
+        __m256i sums_sq = _mm256_hadd_epi32(ss, s12);
+
+        sums_ab = _mm256_shuffle_epi32(sums_ab, _MM_SHUFFLE(3, 1, 2, 0));
+        sums_sq = _mm256_shuffle_epi32(sums_sq, _MM_SHUFFLE(3, 1, 2, 0));
+
+        __m256i even = _mm256_unpacklo_epi64(sums_ab, sums_sq);
+        __m256i odd = _mm256_unpackhi_epi64(sums_ab, sums_sq);
+
+        _mm_storeu_si128((__m128i*)sums[i], _mm256_castsi256_si128(even));
+        _mm_storeu_si128((__m128i*)sums[i + 1], _mm256_castsi256_si128(odd));
+        _mm_storeu_si128((__m128i*)sums[i + 2], _mm256_extracti128_si256(even, 1));
+        _mm_storeu_si128((__m128i*)sums[i + 3], _mm256_extracti128_si256(odd, 1));
+    }
+
+    ssim_sums_scalar(a, a_stride, b, b_stride, sums + i, blocks - i);
+}
+#endif
+
+static sse_row_fn sse_row = NULL;
+static ssim_sums_fn ssim_sums = NULL;
+static const char *impl_name = "none";
+
+uint8_t quality_set_impl(enum quality_impl impl)
+{
+    switch(impl)
+    {
+        case QUALITY_IMPL_AUTO:
+#ifdef QUALITY_X86
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2"))
+                return quality_set_impl(QUALITY_IMPL_AVX2);
+            if(__builtin_cpu_supports("sse2"))
+                return quality_set_impl(QUALITY_IMPL_SSE2);
+#endif
+            return quality_set_impl(QUALITY_IMPL_SCALAR);
+        case QUALITY_IMPL_SCALAR:
+            sse_row = sse_row_scalar;
+            ssim_sums = ssim_sums_scalar;
+            impl_name = "scalar";
+            return 1;
+#ifdef QUALITY_X86
+        case QUALITY_IMPL_SSE2:
+            __builtin_cpu_init();
+            if(!__builtin_cpu_supports("sse2"))
+                return 0;
+            sse_row = sse_row_sse2;
+            ssim_sums = ssim_sums_sse2;
+            impl_name = "sse2";
+            return 1;
+        case QUALITY_IMPL_AVX2:
+            __builtin_cpu_init();
+            if(!__builtin_cpu_supports("avx2"))
+                return 0;
+            sse_row = sse_row_avx2;
+            ssim_sums = ssim_sums_avx2;
+            impl_name = "avx2";
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+const char *quality_impl_name(void)
+{
+    return impl_name;
+}
+
+uint64_t quality_sse_plane(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    uint64_t sum = 0;
+
+    if(!sse_row)
+        quality_set_impl(QUALITY_IMPL_AUTO);
+
+    for(int y = 0; y < height; ++y, a += a_stride, b += b_stride)
+        sum += sse_row(a, b, width);
+
+    return sum;
+}
+
+double quality_psnr(uint64_t sse, uint64_t count)
+{
+    if(!sse)
+        return 100;
+
+    return 10 * log10(255.0 * 255.0 * count / sse);
+}
+
+/* Constants and integer scaling as in x264, for windows of 64 samples. Every
+ * intermediate fits in 32 bits for 8 bit samples. */
+static float ssim_end(int32_t s1, int32_t s2, int32_t ss, int32_t s12)
+{
+    static const int32_t c1 = (int32_t)(.01 * .01 * 255 * 255 * 64 + .5);
+    static const int32_t c2 = (int32_t)(.03 * .03 * 255 * 255 * 64 * 63 + .5);
+
+    int32_t vars = ss * 64 - s1 * s1 - s2 * s2;
+    int32_t covar = s12 * 64 - s1 * s2;
+
+    return (float)(2 * s1 * s2 + c1) * (float)(2 * covar + c2) / ((float)(s1 * s1 + s2 * s2 + c1) * (float)(vars + c2));
+}
+
+/* Each 8x8 window is four neighbouring 4x4 blocks, so only two rows of block
+ * sums are kept */
+double quality_ssim_plane(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    int bw = width / 4;
+    int bh = height / 4;
+
+    if(bw < 2 || bh < 2)
+        return 1;
+
+    if(!ssim_sums)
+        quality_set_impl(QUALITY_IMPL_AUTO);
+
+    int32_t (*rows[2])[4];
+    rows[0] = malloc(bw * sizeof(*rows[0]));
+    rows[1] = malloc(bw * sizeof(*rows[1]));
+
+    if(!rows[0] || !rows[1])
+        error("Could not allocate SSIM rows");
+
+    double total = 0;
+
+    ssim_sums(a, a_stride, b, b_stride, rows[0], bw);
+
+    for(int by = 1; by < bh; ++by)
+    {
+        int32_t (*prev)[4] = rows[(by - 1) & 1];
+        int32_t (*cur)[4] = rows[by & 1];
+
+        ssim_sums(a + 4 * by * a_stride, a_stride, b + 4 * by * b_stride, b_stride, cur, bw);
+
+        for(int bx = 0; bx < bw - 1; ++bx)
+        {
+            int32_t s[4];
+
+            for(int k = 0; k < 4; ++k)
+                s[k] = prev[bx][k] + prev[bx + 1][k] + cur[bx][k] + cur[bx + 1][k];
+
+            total += ssim_end(s[0], s[1], s[2], s[3]);
+        }
+    }
+
+    free(rows[0]);
+    free(rows[1]);
+
+    return total / ((bw - 1) * (bh - 1));
+}
@@ -0,0 +1,28 @@
+#ifndef QUALITY_KERNELS_H
+#define QUALITY_KERNELS_H
+
+#include <stdint.h>
+
+enum quality_impl
+{
+    QUALITY_IMPL_AUTO,
+    QUALITY_IMPL_SCALAR,
+    QUALITY_IMPL_SSE2,
+    QUALITY_IMPL_AVX2
+};
+
+/* Sum of squared differences between two 8 bit planes */
+uint64_t quality_sse_plane(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+
+/* Peak signal to noise ratio in dB for an sse over count samples. Identical
+ * planes give 100. */
+double quality_psnr(uint64_t sse, uint64_t count);
+
+/* Mean SSIM over 8x8 windows on a 4 pixel grid, as x264 computes it */
+double quality_ssim_plane(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+
+/* Returns 0 if the requested implementation is not supported here */
+uint8_t quality_set_impl(enum quality_impl impl);
+const char *quality_impl_name(void);
+
+#endif
@@ -0,0 +1,266 @@
+/* User includes */
+#include "video/quality_monitor.h"
+#include "video/quality_kernels.h"
+#include "util/config.h"
+#include "util/metrics.h"
+#include "util/error.h"
+
+/* Video includes */
+#include <libavcodec/avcodec.h>
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+uint8_t monitor_quality = 0;
+
+struct quality_packet
+{
+    uint8_t *data;
+    int size;
+    int capacity;
+    uint8_t restart;        /* first packet after a skip: flush the decoder */
+    uint8_t sampled;        /* luma holds the encoder input for this packet */
+    uint8_t *luma;
+    int luma_capacity;
+    int width;
+    int height;
+};
+
+/* Packet queue from the video thread. As with the flow handoff, the video
+ * thread only ever tries the lock; slots from head to tail belong to the
+ * monitor thread and everything else to the video thread. */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct quality_packet queue[QUALITY_QUEUE];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+
+static pthread_t quality_thread;
+static int interval;
+
+static volatile uint64_t sent_bytes = 0;
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void quality_compare(AVFrame *decoded, const struct quality_packet *p, struct metric *psnr, struct metric *ssim, struct metric *compute_ms, struct metric *samples)
+{
+    /* The encoder was reopened at another level since this was queued */
+    if(decoded->width != p->width || decoded->height != p->height)
+        return;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t sse = quality_sse_plane(decoded->data[0], decoded->linesize[0], p->luma, p->width, p->width, p->height);
+    double s = quality_ssim_plane(decoded->data[0], decoded->linesize[0], p->luma, p->width, p->width, p->height);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    metrics_set(psnr, quality_psnr(sse, (uint64_t)p->width * p->height));
+    metrics_set(ssim, s);
+    metrics_set(compute_ms, timespec_diff(&end, &start) * 1000);
+    metrics_add(samples, 1);
+}
+
+static void *quality_monitor_run(void *args)
+{
+    AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    if(!codec)
+        error("Could not find an H.264 decoder for the quality monitor");
+
+    AVCodecContext *ctx = avcodec_alloc_context3(codec);
+    if(!ctx)
+        error("Could not allocate the quality monitor decoder");
+
+    /* Frame threads would hold back the picture for the packet just fed */
+    ctx->thread_count = 1;
+
+    if(avcodec_open2(ctx, codec, NULL) < 0)
+        error("Could not open the quality monitor decoder");
+
+    AVFrame *decoded = avcodec_alloc_frame();
+    if(!decoded)
+        error("Could not allocate the quality monitor frame");
+
+    struct metric *psnr = metrics_gauge("video_psnr_db");
+    struct metric *ssim = metrics_gauge("video_ssim");
+    struct metric *bitrate = metrics_gauge("video_bitrate_kbps");
+    struct metric *compute_ms = metrics_gauge("quality_ms");
+    struct metric *samples = metrics_counter("quality_samples");
+
+    struct timespec last_rate;
+    uint64_t last_bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &last_rate);
+
+    while(1)
+    {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        ++wake.tv_sec;
+
+        pthread_mutex_lock(&queue_mutex);
+
+        if(head == tail)
+            pthread_cond_timedwait(&queue_cond, &queue_mutex, &wake);
+
+        uint8_t have_packet = head != tail;
+
+        pthread_mutex_unlock(&queue_mutex);
+
+        if(have_packet)
+        {
+            struct quality_packet *p = &queue[head % QUALITY_QUEUE];
+            AVPacket pkt;
+            int got_picture = 0;
+
+            if(p->restart)
+                avcodec_flush_buffers(ctx);
+
+            av_init_packet(&pkt);
+            pkt.data = p->data;
+            pkt.size = p->size;
+
+            if(avcodec_decode_video2(ctx, decoded, &got_picture, &pkt) >= 0 && got_picture && p->sampled)
+                quality_compare(decoded, p, psnr, ssim, compute_ms, samples);
+
+            pthread_mutex_lock(&queue_mutex);
+            ++head;
+            pthread_mutex_unlock(&queue_mutex);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        double elapsed = timespec_diff(&now, &last_rate);
+
+        if(elapsed >= 1.0)
+        {
+            uint64_t bytes = sent_bytes;
+
+            metrics_set(bitrate, (bytes - last_bytes) * 8 / 1000.0 / elapsed);
+            last_bytes = bytes;
+            last_rate = now;
+        }
+    }
+
+    return NULL;
+}
+
+static void quality_copy(uint8_t **buffer, int *capacity, const void *data, int size)
+{
+    if(size > *capacity)
+    {
+        free(*buffer);
+
+        *buffer = malloc(size);
+        if(!*buffer)
+            error("Could not allocate quality monitor buffer");
+
+        *capacity = size;
+    }
+
+    memcpy(*buffer, data, size);
+}
+
+void quality_monitor_submit(const uint8_t *data, int size, uint8_t key, const uint8_t *luma, int linesize, int width, int height)
+{
+    static uint8_t started = 0;
+    static uint8_t skipping = 0;
+    static uint32_t frames = 0;
+    static struct metric *dropped;
+
+    if(!started)
+    {
+        interval = config_get_int("video:quality_interval", QUALITY_DEFAULT_INTERVAL);
+        if(interval < 1)
+            error("video:quality_interval must be at least 1");
+
+        dropped = metrics_counter("quality_dropped");
+
+        printf("Quality monitor: comparing every %d frames using %s kernels\n", interval, quality_impl_name());
+
+        pthread_create(&quality_thread, NULL, quality_monitor_run, NULL);
+        started = 1;
+    }
+
+    __sync_fetch_and_add(&sent_bytes, size);
+
+    uint8_t sampled = frames++ % interval == 0;
+
+    /* P frames after a dropped packet would only decode into garbage */
+    if(skipping && !key)
+    {
+        metrics_add(dropped, 1);
+        return;
+    }
+
+    if(pthread_mutex_trylock(&queue_mutex))
+    {
+        skipping = 1;
+        metrics_add(dropped, 1);
+        return;
+    }
+
+    uint8_t full = tail - head == QUALITY_QUEUE;
+
+    pthread_mutex_unlock(&queue_mutex);
+
+    if(full)
+    {
+        skipping = 1;
+        metrics_add(dropped, 1);
+        return;
+    }
+
+    /* The slot is the video thread's until tail moves past it */
+    struct quality_packet *p = &queue[tail % QUALITY_QUEUE];
+
+    quality_copy(&p->data, &p->capacity, data, size);
+    p->size = size;
+    p->restart = skipping;
+    p->sampled = sampled;
+
+    if(sampled)
+    {
+        if(width * height > p->luma_capacity)
+        {
+            free(p->luma);
+
+            p->luma = malloc(width * height);
+            if(!p->luma)
+                error("Could not allocate quality monitor buffer");
+
+            p->luma_capacity = width * height;
+        }
+
+        for(int y = 0; y < height; ++y)
+            memcpy(p->luma + y * width, luma + y * linesize, width);
+
+        p->width = width;
+        p->height = height;
+    }
+
+    skipping = 0;
+
+    if(pthread_mutex_trylock(&queue_mutex))
+    {
+        /* Lost the race with the monitor thread; the slot is still ours, so
+         * the packet is simply not queued */
+        skipping = 1;
+        metrics_add(dropped, 1);
+        return;
+    }
+
+    ++tail;
+    pthread_cond_signal(&queue_cond);
+
+    pthread_mutex_unlock(&queue_mutex);
+}
@@ -0,0 +1,19 @@
+#ifndef QUALITY_MONITOR_H
+#define QUALITY_MONITOR_H
+
+#include <stdint.h>
+
+/* Every this many frames the reconstruction is compared with the encoder
+ * input. Can be overridden with video:quality_interval in the configuration
+ * file. */
+#define QUALITY_DEFAULT_INTERVAL 30
+
+/* Encoded packets waiting for the monitor's decoder. When the queue is full
+ * the monitor skips ahead to the next IDR frame. */
+#define QUALITY_QUEUE 16
+
+/* Called by the video thread once a packet has been sent. luma is the plane
+ * that was encoded, width by height at linesize. */
+void quality_monitor_submit(const uint8_t *data, int size, uint8_t key, const uint8_t *luma, int linesize, int width, int height);
+
+#endif
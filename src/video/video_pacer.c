@@ -0,0 +1,332 @@
+/* User includes */
+#include "video/video_pacer.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+
+/* Kernel pacing is only used where it can be seen to apply, so this can turn
+ * it off even then */
+uint8_t video_pacer_kernel = 1;
+
+static ssize_t write_all(int fd, const uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+
+    while(done < len)
+    {
+        ssize_t ret = write(fd, buf + done, len - done);
+
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return ret;
+        }
+
+        done += ret;
+    }
+
+    return done;
+}
+
+/* Interface the connection leaves through: the one holding its local
+ * address. 0 if there is none. */
+static unsigned int egress_interface(int fd)
+{
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    struct ifaddrs *ifs;
+    unsigned int index = 0;
+
+    if(getsockname(fd, (struct sockaddr*)&local, &len) < 0 || getifaddrs(&ifs) < 0)
+        return 0;
+
+    for(struct ifaddrs *i = ifs; i && !index; i = i->ifa_next)
+    {
+        if(!i->ifa_addr || i->ifa_addr->sa_family != local.ss_family)
+            continue;
+
+        if(local.ss_family == AF_INET &&
+                ((struct sockaddr_in*)i->ifa_addr)->sin_addr.s_addr == ((struct sockaddr_in*)&local)->sin_addr.s_addr)
+            index = if_nametoindex(i->ifa_name);
+        else if(local.ss_family == AF_INET6 &&
+                !memcmp(&((struct sockaddr_in6*)i->ifa_addr)->sin6_addr, &((struct sockaddr_in6*)&local)->sin6_addr, sizeof(struct in6_addr)))
+            index = if_nametoindex(i->ifa_name);
+    }
+
+    freeifaddrs(ifs);
+
+    return index;
+}
+
+/* Whether the interface's packets are scheduled by fq, which is what applies
+ * SO_MAX_PACING_RATE per packet: every qdisc on it is fq, apart from an mq
+ * root spreading the queues over them. TCP's own pacing also takes the rate,
+ * but sends whole TSO bursts at once, so is not counted. */
+static uint8_t interface_has_fq(unsigned int index)
+{
+    struct
+    {
+        struct nlmsghdr header;
+        struct tcmsg tc;
+    } request = {
+        .header = {
+            .nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg)),
+            .nlmsg_type = RTM_GETQDISC,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+        },
+        .tc = { .tcm_family = AF_UNSPEC },
+    };
+    char buf[16384];
+    uint8_t fq = 0, other = 0, done = 0;
+
+    int nl = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if(nl < 0)
+        return 0;
+
+    if(send(nl, &request, request.header.nlmsg_len, 0) < 0)
+    {
+        close(nl);
+        return 0;
+    }
+
+    while(!done)
+    {
+        ssize_t n = recv(nl, buf, sizeof(buf), 0);
+
+        if(n <= 0)
+            break;
+
+        for(struct nlmsghdr *h = (struct nlmsghdr*)buf; NLMSG_OK(h, n); h = NLMSG_NEXT(h, n))
+        {
+            if(h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR)
+            {
+                done = 1;
+                break;
+            }
+
+            struct tcmsg *tc = NLMSG_DATA(h);
+            int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*tc));
+
+            if(h->nlmsg_type != RTM_NEWQDISC || tc->tcm_ifindex != (int)index)
+                continue;
+
+            for(struct rtattr *a = TCA_RTA(tc); RTA_OK(a, len); a = RTA_NEXT(a, len))
+            {
+                if(a->rta_type != TCA_KIND)
+                    continue;
+
+                if(!strcmp(RTA_DATA(a), "fq"))
+                    fq = 1;
+                else if(strcmp(RTA_DATA(a), "mq"))
+                    other = 1;
+            }
+        }
+    }
+
+    close(nl);
+
+    return done && fq && !other;
+}
+
+static void *video_pacer_send(void *arg)
+{
+    struct video_pacer *p = arg;
+
+    pthread_mutex_lock(&p->mutex);
+
+    while(1)
+    {
+        while(!p->count && !p->stop)
+            pthread_cond_wait(&p->cond, &p->mutex);
+
+        if(!p->count)
+            break;
+
+        /* What is contiguous in the ring, up to one burst */
+        size_t chunk = p->count < VIDEO_PACING_BURST ? p->count : VIDEO_PACING_BURST;
+        if(chunk > VIDEO_PACING_QUEUE - p->head)
+            chunk = VIDEO_PACING_QUEUE - p->head;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        if(!p->failed && !token_bucket_take(&p->bucket, chunk, &now))
+        {
+            double delay = token_bucket_delay(&p->bucket, chunk);
+            struct timespec ts = {
+                .tv_sec = (time_t)delay,
+                .tv_nsec = (long)((delay - (time_t)delay) * 1e9),
+            };
+
+            pthread_mutex_unlock(&p->mutex);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&p->mutex);
+            continue;
+        }
+
+        /* Only the sender takes from the ring, so the chunk stays put while
+         * it is written without the lock. After a failure the rest is
+         * dropped. */
+        if(!p->failed)
+        {
+            pthread_mutex_unlock(&p->mutex);
+            ssize_t ret = write_all(p->fd, p->queue + p->head, chunk);
+            pthread_mutex_lock(&p->mutex);
+
+            if(ret < 0)
+                p->failed = 1;
+        }
+
+        p->head = (p->head + chunk) % VIDEO_PACING_QUEUE;
+        p->count -= chunk;
+
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+void video_pacer_init(struct video_pacer *p, int fd, uint8_t enabled, int64_t bit_rate)
+{
+    double bytes_per_second = bit_rate / 8.0 * VIDEO_PACING_HEADROOM;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = fd;
+    p->enabled = enabled;
+
+    if(!enabled)
+        return;
+
+#ifdef SO_MAX_PACING_RATE
+    /* Any socket takes the rate, so it is only relied on where fq is seen to
+     * be scheduling the interface. Loopback never has it. */
+    uint32_t rate = bytes_per_second;
+    if(video_pacer_kernel && interface_has_fq(egress_interface(fd)) &&
+            !setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)))
+        p->kernel_pacing = 1;
+#endif
+
+    if(!p->kernel_pacing)
+    {
+        /* Small paced writes must not be held back waiting for ACKs. */
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        token_bucket_init(&p->bucket, bytes_per_second, VIDEO_PACING_BURST);
+
+        p->queue = malloc(VIDEO_PACING_QUEUE);
+        if(!p->queue)
+            error("Could not allocate the video pacing queue");
+
+        pthread_mutex_init(&p->mutex, NULL);
+        pthread_cond_init(&p->cond, NULL);
+
+        if(pthread_create(&p->sender, NULL, video_pacer_send, p))
+            error("Could not start the video pacing thread");
+    }
+
+    printf("video pacing: %s, %.0f bytes/s\n", p->kernel_pacing ? "kernel (fq)" : "userspace", bytes_per_second);
+}
+
+void video_pacer_set_rate(struct video_pacer *p, int64_t bit_rate)
+{
+    double bytes_per_second = bit_rate / 8.0 * VIDEO_PACING_HEADROOM;
+
+    if(!p->enabled)
+        return;
+
+#ifdef SO_MAX_PACING_RATE
+    if(p->kernel_pacing)
+    {
+        uint32_t rate = bytes_per_second;
+        setsockopt(p->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+        return;
+    }
+#endif
+
+    /* Bytes already queued go out at the new rate */
+    pthread_mutex_lock(&p->mutex);
+    p->bucket.rate = bytes_per_second;
+    pthread_mutex_unlock(&p->mutex);
+}
+
+ssize_t video_pacer_write(struct video_pacer *p, const void *buf, size_t len)
+{
+    if(!p->enabled || p->kernel_pacing)
+        return write_all(p->fd, buf, len);
+
+    const uint8_t *ptr = buf;
+    size_t left = len;
+
+    pthread_mutex_lock(&p->mutex);
+
+    while(left)
+    {
+        /* Only waits when the sender is a full queue behind */
+        while(p->count == VIDEO_PACING_QUEUE && !p->failed)
+            pthread_cond_wait(&p->cond, &p->mutex);
+
+        if(p->failed)
+        {
+            pthread_mutex_unlock(&p->mutex);
+            return -1;
+        }
+
+        size_t tail = (p->head + p->count) % VIDEO_PACING_QUEUE;
+        size_t n = VIDEO_PACING_QUEUE - p->count;
+
+        if(n > VIDEO_PACING_QUEUE - tail)
+            n = VIDEO_PACING_QUEUE - tail;
+        if(n > left)
+            n = left;
+
+        memcpy(p->queue + tail, ptr, n);
+        p->count += n;
+
+        ptr += n;
+        left -= n;
+
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->mutex);
+
+    return len;
+}
+
+void video_pacer_free(struct video_pacer *p)
+{
+    if(!p->enabled || p->kernel_pacing)
+        return;
+
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+
+    pthread_join(p->sender, NULL);
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+    free(p->queue);
+    p->queue = NULL;
+}
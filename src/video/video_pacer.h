@@ -0,0 +1,58 @@
+#ifndef VIDEO_PACER_H
+#define VIDEO_PACER_H
+
+#include "util/token_bucket.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Pacing rate is the encoder target bitrate times this factor, so an average
+ * frame leaves well inside its frame interval while an IDR is spread over a
+ * few of them. */
+#define VIDEO_PACING_HEADROOM 1.5
+
+/* Largest number of bytes handed to the socket at once by the userspace
+ * sender (two full-size TCP segments). */
+#define VIDEO_PACING_BURST 2896
+
+/* Bytes the encoder can queue for the userspace sender before it waits, room
+ * for several IDR frames */
+#define VIDEO_PACING_QUEUE (256 * 1024)
+
+struct video_pacer
+{
+    int fd;
+    uint8_t enabled;
+    uint8_t kernel_pacing;
+
+    /* Userspace pacing: writes are queued here and a sender thread takes them
+     * out through the token bucket, so the encoder never sleeps on the rate */
+    pthread_t sender;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *queue;
+    size_t head;
+    size_t count;
+    uint8_t stop;
+    uint8_t failed;
+    struct token_bucket bucket;
+};
+
+/* Set to 0 to always use the userspace token bucket */
+extern uint8_t video_pacer_kernel;
+
+/* Paces with SO_MAX_PACING_RATE only where the socket goes out through an fq
+ * qdisc, and with the sender thread otherwise */
+void video_pacer_init(struct video_pacer *p, int fd, uint8_t enabled, int64_t bit_rate);
+
+/* For an encoder reopened at another bitrate */
+void video_pacer_set_rate(struct video_pacer *p, int64_t bit_rate);
+
+/* Returns once len bytes are queued or written, or -1 if the connection has
+ * failed */
+ssize_t video_pacer_write(struct video_pacer *p, const void *buf, size_t len);
+
+/* Waits for the queue to drain and stops the sender */
+void video_pacer_free(struct video_pacer *p);
+
+#endif
@@ -0,0 +1,284 @@
+/* User includes */
+#include "video/video_scaler.h"
+#include "util/error.h"
+
+/* Video includes */
+#include <libswscale/swscale.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+
+/* Standard includes */
+#include <string.h>
+
+static int gcd(int a, int b)
+{
+    while(b)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+static int chroma_alignment(enum AVPixelFormat fmt)
+{
+    return 1 << av_pix_fmt_desc_get(fmt)->log2_chroma_h;
+}
+
+/* Bands start on destination rows whose source row is a whole number and
+ * which are whole chroma rows on both sides, so the ratio of every band is
+ * exactly that of the frame. Windows are whole units bigger on each side,
+ * so their ratio is the frame's too and a row inside one is filtered from
+ * the same source rows as it would be over the whole frame. */
+static void video_scaler_layout(struct video_scaler *s)
+{
+    int g = gcd(s->src_h, s->dst_h);
+    int src_unit = s->src_h / g;
+    int dst_unit = s->dst_h / g;
+    int src_align = chroma_alignment(s->src_fmt);
+    int dst_align = chroma_alignment(s->dst_fmt);
+
+    int k = 1;
+    while((src_unit * k) % src_align || (dst_unit * k) % dst_align)
+        ++k;
+
+    src_unit *= k;
+    dst_unit *= k;
+
+    int units = s->dst_h / dst_unit;
+    int n = s->threads < units ? s->threads : units;
+
+    if(n < 1)
+        n = 1;
+
+    int ratio = (s->src_h + s->dst_h - 1) / s->dst_h;
+    int overlap = VIDEO_SCALER_OVERLAP_PER_RATIO * ratio;
+
+    if(overlap < VIDEO_SCALER_OVERLAP_MIN)
+        overlap = VIDEO_SCALER_OVERLAP_MIN;
+
+    int margin = (overlap + src_unit - 1) / src_unit;
+
+    for(int i = 0; i < n; ++i)
+    {
+        struct video_scaler_band *b = &s->bands[i];
+        int first = units * i / n;
+        int last = units * (i + 1) / n;
+
+        b->src_y = first * src_unit;
+        b->dst_y = first * dst_unit;
+
+        /* The last band also takes what is left over after whole units */
+        b->src_h = (i == n - 1 ? s->src_h : last * src_unit) - b->src_y;
+        b->dst_h = (i == n - 1 ? s->dst_h : last * dst_unit) - b->dst_y;
+
+        /* One band covers the frame and needs no window */
+        int before = first < margin ? first : margin;
+        int after = units - last < margin ? units - last : margin;
+
+        if(n == 1)
+            before = after = 0;
+
+        b->win_src_y = b->src_y - before * src_unit;
+        b->win_dst_y = b->dst_y - before * dst_unit;
+        b->win_src_h = (i == n - 1 ? s->src_h : (last + after) * src_unit) - b->win_src_y;
+        b->win_dst_h = (i == n - 1 ? s->dst_h : (last + after) * dst_unit) - b->win_dst_y;
+
+        av_freep(&b->scratch[0]);
+
+        if(n > 1 && av_image_alloc(b->scratch, b->scratch_linesize, s->dst_w, b->win_dst_h, s->dst_fmt, 16) < 0)
+            error("Could not allocate the scaler's band");
+    }
+
+    s->num_bands = n;
+}
+
+/* Offsets every image plane to the band's first row. A palette in data[1]
+ * is passed on as it is. */
+static void band_planes(uint8_t *planes[4], uint8_t *const data[4], const int linesize[4], enum AVPixelFormat fmt, int y)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+
+    for(int p = 0; p < 4; ++p)
+    {
+        int shift = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+
+        if(!data[p] || (p && (desc->flags & AV_PIX_FMT_FLAG_PAL)))
+            planes[p] = data[p];
+        else
+            planes[p] = data[p] + (y >> shift) * linesize[p];
+    }
+}
+
+static void video_scaler_band_run(struct video_scaler_band *b)
+{
+    struct video_scaler *s = b->scaler;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(s->dst_fmt);
+    uint8_t *src[4];
+    uint8_t *dst[4];
+    uint8_t *own[4];
+
+    /* Only rebuilt when the layout changes */
+    b->ctx = sws_getCachedContext(b->ctx, s->src_w, b->win_src_h, s->src_fmt, s->dst_w, b->win_dst_h, s->dst_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+    if(!b->ctx)
+        error("Cannot initialize the conversion context");
+
+    band_planes(src, s->src->data, s->src->linesize, s->src_fmt, b->win_src_y);
+    band_planes(dst, s->dst->data, s->dst->linesize, s->dst_fmt, b->dst_y);
+
+    if(!b->scratch[0])
+    {
+        sws_scale(b->ctx, (const uint8_t* const*)src, s->src->linesize, 0, b->win_src_h, dst, s->dst->linesize);
+        return;
+    }
+
+    sws_scale(b->ctx, (const uint8_t* const*)src, s->src->linesize, 0, b->win_src_h, b->scratch, b->scratch_linesize);
+
+    /* The window's rows either side belong to the neighbouring bands */
+    band_planes(own, b->scratch, b->scratch_linesize, s->dst_fmt, b->dst_y - b->win_dst_y);
+
+    for(int p = 0; p < 4 && dst[p]; ++p)
+    {
+        int shift = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+        int width = av_image_get_linesize(s->dst_fmt, s->dst_w, p);
+
+        if(width <= 0 || (p && (desc->flags & AV_PIX_FMT_FLAG_PAL)))
+            break;
+
+        av_image_copy_plane(dst[p], s->dst->linesize[p], own[p], b->scratch_linesize[p], width, -((-b->dst_h) >> shift));
+    }
+}
+
+static void *video_scaler_worker(void *args)
+{
+    struct video_scaler_band *b = args;
+    struct video_scaler *s = b->scaler;
+    int index = b - s->bands;
+    uint64_t seen = 0;
+
+    while(1)
+    {
+        pthread_mutex_lock(&s->mutex);
+
+        while(s->generation == seen && !s->stop)
+            pthread_cond_wait(&s->start, &s->mutex);
+
+        if(s->stop)
+        {
+            pthread_mutex_unlock(&s->mutex);
+            break;
+        }
+
+        seen = s->generation;
+        uint8_t busy = index < s->num_bands;
+
+        pthread_mutex_unlock(&s->mutex);
+
+        /* Small frames have fewer bands than threads */
+        if(!busy)
+            continue;
+
+        video_scaler_band_run(b);
+
+        pthread_mutex_lock(&s->mutex);
+
+        if(!--s->remaining)
+            pthread_cond_signal(&s->done);
+
+        pthread_mutex_unlock(&s->mutex);
+    }
+
+    return NULL;
+}
+
+void video_scaler_init(struct video_scaler *s, int threads)
+{
+    memset(s, 0, sizeof(*s));
+
+    if(threads < 1)
+        threads = 1;
+    if(threads > VIDEO_SCALER_MAX_THREADS)
+        threads = VIDEO_SCALER_MAX_THREADS;
+
+    s->threads = threads;
+    s->src_fmt = AV_PIX_FMT_NONE;
+    s->dst_fmt = AV_PIX_FMT_NONE;
+
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->start, NULL);
+    pthread_cond_init(&s->done, NULL);
+
+    for(int i = 0; i < threads; ++i)
+        s->bands[i].scaler = s;
+
+    for(int i = 1; i < threads; ++i)
+    {
+        if(pthread_create(&s->bands[i].thread, NULL, video_scaler_worker, &s->bands[i]))
+            error("Could not start scaler thread");
+    }
+}
+
+void video_scaler_scale(struct video_scaler *s, const AVFrame *src, int src_w, int src_h,
+        AVFrame *dst, int dst_w, int dst_h, enum AVPixelFormat dst_fmt)
+{
+    /* Workers are idle between frames, so the layout can change here */
+    if(src_w != s->src_w || src_h != s->src_h || src->format != s->src_fmt ||
+            dst_w != s->dst_w || dst_h != s->dst_h || dst_fmt != s->dst_fmt)
+    {
+        s->src_w = src_w;
+        s->src_h = src_h;
+        s->src_fmt = src->format;
+        s->dst_w = dst_w;
+        s->dst_h = dst_h;
+        s->dst_fmt = dst_fmt;
+
+        video_scaler_layout(s);
+    }
+
+    s->src = src;
+    s->dst = dst;
+
+    if(s->num_bands == 1)
+    {
+        video_scaler_band_run(&s->bands[0]);
+        return;
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    s->remaining = s->num_bands - 1;
+    ++s->generation;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->mutex);
+
+    video_scaler_band_run(&s->bands[0]);
+
+    pthread_mutex_lock(&s->mutex);
+
+    while(s->remaining)
+        pthread_cond_wait(&s->done, &s->mutex);
+
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void video_scaler_free(struct video_scaler *s)
+{
+    pthread_mutex_lock(&s->mutex);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->mutex);
+
+    for(int i = 1; i < s->threads; ++i)
+        pthread_join(s->bands[i].thread, NULL);
+
+    for(int i = 0; i < s->threads; ++i)
+    {
+        sws_freeContext(s->bands[i].ctx);
+        av_freep(&s->bands[i].scratch[0]);
+    }
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->start);
+    pthread_cond_destroy(&s->done);
+}
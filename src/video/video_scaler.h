@@ -0,0 +1,79 @@
+#ifndef VIDEO_SCALER_H
+#define VIDEO_SCALER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+
+#define VIDEO_SCALER_MAX_THREADS 16
+
+/* Source rows a band's window reaches past the band on each side, per unit
+ * of downscaling, and at least. The filter reaches about one source row per
+ * unit either side, twice that for subsampled chroma. */
+#define VIDEO_SCALER_OVERLAP_PER_RATIO 4
+#define VIDEO_SCALER_OVERLAP_MIN 8
+
+struct video_scaler;
+
+/* Rows of the frame one thread scales, with its own context. The source rows
+ * map exactly onto the destination rows, so bands meet without a gap. The
+ * context scales a window of the band plus the rows around it that the
+ * filter reads, into scratch, and only the band's own rows are kept, so the
+ * result is that of one context over the whole frame. */
+struct video_scaler_band
+{
+    struct video_scaler *scaler;
+    struct SwsContext *ctx;
+
+    int src_y;
+    int src_h;
+    int dst_y;
+    int dst_h;
+
+    int win_src_y;
+    int win_src_h;
+    int win_dst_y;
+    int win_dst_h;
+
+    uint8_t *scratch[4];
+    int scratch_linesize[4];
+
+    pthread_t thread;
+};
+
+struct video_scaler
+{
+    int threads;
+    int num_bands;
+    struct video_scaler_band bands[VIDEO_SCALER_MAX_THREADS];
+
+    /* What the bands were laid out for */
+    int src_w, src_h, dst_w, dst_h;
+    enum AVPixelFormat src_fmt, dst_fmt;
+
+    /* The frame being scaled. Workers wait for generation to change and
+     * count remaining down when their band is done. */
+    const AVFrame *src;
+    AVFrame *dst;
+    uint64_t generation;
+    int remaining;
+    uint8_t stop;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+};
+
+/* Starts threads - 1 workers; the caller scales the first band itself. With
+ * one thread this is a single cached context over the whole frame. */
+void video_scaler_init(struct video_scaler *s, int threads);
+
+/* Scales src (of the given size) into dst's planes, which must already be
+ * allocated for dst_w x dst_h in dst_fmt. Returns once the whole frame is
+ * done. */
+void video_scaler_scale(struct video_scaler *s, const AVFrame *src, int src_w, int src_h,
+        AVFrame *dst, int dst_w, int dst_h, enum AVPixelFormat dst_fmt);
+
+void video_scaler_free(struct video_scaler *s);
+
+#endif
@@ -2,8 +2,18 @@
 #include "util/error.h"
 #include "util/data_options.h"
 #include "util/server_init.h"
+#include "util/config.h"
 #include "video/video_server.h"
 #include "video/webcam_video.h"
+#include "video/video_pacer.h"
+#include "video/optical_flow.h"
+#include "video/video_scaler.h"
+#include "video/pose_sei.h"
+#include "qos/qos_governor.h"
+#include "util/event_recorder.h"
+#include "video/quality_monitor.h"
+#include "util/server_clock.h"
+#include "util/numa_place.h"
 
 /* Video includes */
 #include <libavcodec/avcodec.h>
@@ -24,6 +34,18 @@
 #include <netinet/in.h>
 
 uint8_t flip_video = 0;
+uint8_t pace_video = 0;
+
+/* Set by sources after a gap in the input so clients can resync on the next
+ * frame. Set from other threads, so the video thread tests and clears it in
+ * one step, or a gap flagged in between would be lost. */
+volatile uint8_t force_idr = 0;
+
+extern uint8_t compute_flow;
+extern uint8_t run_governor;
+extern uint8_t record_events;
+extern uint8_t monitor_quality;
+extern uint8_t embed_pose;
 
 static void send_video(int fd, int codec_id, struct data_options *dopts);
 static int write_packet(void *opaque, uint8_t *buf, int buf_size);
@@ -51,9 +73,20 @@ void *video_listen(void *args)
 
     listen(server_sockfd, 5);
 
-    int client_sockfd = accept(server_sockfd, (struct sockaddr *) &cli_addr, &clilen);
-    if(client_sockfd < 0)
-        error("ERROR on accept");
+    int client_sockfd;
+
+    while(1)
+    {
+        client_sockfd = accept(server_sockfd, (struct sockaddr *) &cli_addr, &clilen);
+        if(client_sockfd < 0)
+            error("ERROR on accept");
+
+        if(!run_governor || qos_admit())
+            break;
+
+        printf("QoS: refusing video client, host is over capacity\n");
+        close(client_sockfd);
+    }
 
     send_video(client_sockfd, AV_CODEC_ID_H264, server_init->d);
 
@@ -62,7 +95,7 @@ void *video_listen(void *args)
     return NULL;
 }
 
-parrot_video_encapsulation_t *create_frame_header(uint32_t payload_size, AVFrame *frame, uint32_t frame_number, uint64_t stream_byte_position, uint8_t sps, uint8_t pps, uint8_t pkt_flags)
+parrot_video_encapsulation_t *create_frame_header(uint32_t payload_size, AVFrame *frame, uint16_t width, uint16_t height, uint32_t frame_number, uint64_t stream_byte_position, uint8_t sps, uint8_t pps, uint8_t pkt_flags)
 {
     parrot_video_encapsulation_t *new_header = calloc(sizeof(parrot_video_encapsulation_t), 1);
 
@@ -78,15 +111,16 @@ parrot_video_encapsulation_t *create_frame_header(uint32_t payload_size, AVFrame
     new_header->header_size = sizeof(parrot_video_encapsulation_t);
     new_header->payload_size = payload_size;
 
-    new_header->encoded_stream_width = frame->width;
-    new_header->display_width = frame->width;
+    new_header->encoded_stream_width = width;
+    new_header->display_width = width;
 
-    new_header->encoded_stream_height = frame->height;
-    new_header->display_height = frame->height;
+    new_header->encoded_stream_height = height;
+    new_header->display_height = height;
 
     new_header->frame_number = frame_number;
 
-    new_header->timestamp = frame->pts;
+    /* Server clock in ms, the same time base as the clock sync port */
+    new_header->timestamp = server_clock_us() / 1000;
 
     new_header->frame_type = frame->pict_type == AV_PICTURE_TYPE_P ? FRAME_TYPE_P_FRAME : FRAME_TYPE_I_FRAME;
     new_header->frame_type = pkt_flags & AV_PKT_FLAG_KEY ? FRAME_TYPE_I_FRAME : FRAME_TYPE_P_FRAME;
@@ -112,15 +146,47 @@ parrot_video_encapsulation_t *create_frame_header(uint32_t payload_size, AVFrame
 
 static int write_packet(void *opaque, uint8_t *buf, int buf_size)
 {
-    int net_fd = *(int*)opaque;
+    struct video_pacer *pacer = opaque;
 
-    write(net_fd, buf, buf_size);
+    video_pacer_write(pacer, buf, buf_size);
 
     return 0;
 }
 
 static AVStream *setup_output_context(int fd, AVFormatContext *ofcx, AVCodecContext *iccx, AVStream *ist);
 
+AVCodecContext *open_video_encoder(int codec_id, const char *preset, int threads, int width, int height, int64_t bit_rate)
+{
+    AVCodec *out_codec = avcodec_find_encoder(codec_id);
+    if(!out_codec)
+        error("Codec not found");
+
+    AVCodecContext *occx = avcodec_alloc_context3(out_codec);
+    if(!occx)
+        error("Could not allocate context");
+
+    occx->pix_fmt = AV_PIX_FMT_YUV420P;
+    occx->width = width;
+    occx->height = height;
+    occx->time_base= (AVRational){1,VIDEO_FPS};
+    occx->gop_size = VIDEO_FPS;
+    occx->max_b_frames = 0;
+    occx->bit_rate = bit_rate;
+
+    if(threads > 0)
+        occx->thread_count = threads;
+
+    if(preset && *preset)
+        av_opt_set(occx->priv_data, "preset", preset, 0);
+    av_opt_set(occx->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(occx->priv_data, "vprofile", "baseline", 0);
+
+    if (avcodec_open2(occx, out_codec, NULL) < 0)
+        error("Could not open codec");
+
+    return occx;
+}
+
 void flip_frame(AVFrame* pFrame) { 
     for (int i = 0; i < 4; i++) { 
         pFrame->data[i] += pFrame->linesize[i] * (pFrame->height-1); 
@@ -128,6 +194,18 @@ void flip_frame(AVFrame* pFrame) {
     } 
 } 
 
+/* Sources that hand over decoded frames have no packets to read, so an empty
+ * one on the video stream stands in for each frame */
+static int read_input_packet(struct input_stream *in_st, struct data_options *dopts, AVPacket *pkt)
+{
+    if(!dopts->read_video_frame)
+        return av_read_frame(in_st->ifcx, pkt);
+
+    pkt->stream_index = in_st->video_stream_index;
+
+    return 0;
+}
+
 static void send_video(int fd, int codec_id, struct data_options *dopts)
 {
     AVPacket pkt;
@@ -158,35 +236,27 @@ static void send_video(int fd, int codec_id, struct data_options *dopts)
     //open output file
     AVFormatContext *ofcx = avformat_alloc_context();
 
-    AVCodec *out_codec = avcodec_find_encoder(codec_id);
-    if(!out_codec)
-        error("Codec not found");
+    /* Set by encoder calibration (-C) or by hand; otherwise encoder defaults */
+    char *preset = config_get_option("video:encoder_preset");
+    int threads = config_get_int("video:encoder_threads", 0);
 
-    AVCodecContext *occx = avcodec_alloc_context3(out_codec);
-    if(!occx)
-        error("Could not allocate context");
+    /* Only degraded below level 0 when the QoS governor is running */
+    struct qos_stream *qos = qos_stream_register();
+    struct qos_deadline *deadline = qos_deadline_register("video", 1000.0 / VIDEO_FPS, 0);
+    const struct qos_level *level = qos_stream_level(qos);
 
-    occx->pix_fmt = AV_PIX_FMT_YUV420P;
-    occx->width = 640;
-    occx->height = 360;
-    occx->time_base= (AVRational){1,30};
-    occx->gop_size = 30;
-    occx->max_b_frames = 0;
-    occx->bit_rate = 400000;
+    AVCodecContext *occx = open_video_encoder(codec_id, preset, threads, level->width, level->height, VIDEO_BIT_RATE * level->bit_rate_scale);
 
-    //av_opt_set(occx->priv_data, "preset", "ultrafast", 0);
-    av_opt_set(occx->priv_data, "tune", "zerolatency", 0);
-    av_opt_set(occx->priv_data, "vprofile", "baseline", 0);
-
-    if (avcodec_open2(occx, out_codec, NULL) < 0)
-        error("Could not open codec");
+    AVStream *ost = setup_output_context(fd, ofcx, occx, in_st.ist);
 
-    setup_output_context(fd, ofcx, occx, in_st.ist);
+    struct video_pacer pacer;
+    video_pacer_kernel = config_get_int("video:kernel_pacing", 1);
+    video_pacer_init(&pacer, fd, pace_video, occx->bit_rate);
 
     int buffer_size = sizeof(unsigned char) * 1024 * 1024;
     unsigned char *pb_buffer = av_malloc(buffer_size);
 
-    ofcx->pb = avio_alloc_context(pb_buffer, buffer_size, 1, &fd, NULL, &write_packet, NULL);
+    ofcx->pb = avio_alloc_context(pb_buffer, buffer_size, 1, &pacer, NULL, &write_packet, NULL);
 
     avformat_write_header( ofcx, NULL );
 
@@ -197,58 +267,124 @@ static void send_video(int fd, int codec_id, struct data_options *dopts)
     AVFrame *frame;
     AVFrame *rFrame = avcodec_alloc_frame();
 
-    /*int num_bytes = avpicture_get_size(occx->pix_fmt, occx->width, occx->height);
-      uint8_t* rFrame_buffer = av_malloc(num_bytes*sizeof(uint8_t));
-      avpicture_fill((AVPicture*)rFrame, rFrame_buffer, occx->pix_fmt, occx->width, occx->height);*/
-
     int w = in_st.iccx->width;
-    int h = in_st.iccx->height;
-
-    int num_bytes = avpicture_get_size(occx->pix_fmt, w, h);
-    uint8_t* rFrame_buffer = av_malloc(num_bytes*sizeof(uint8_t));
-    avpicture_fill((AVPicture*)rFrame, rFrame_buffer, occx->pix_fmt, w, h);
 
-    struct SwsContext *img_convert_ctx;
+    /* The scaled frame is what the encoder takes, so it is laid out for the
+     * encoder's size at each level, in one buffer big enough for level 0.
+     * With -N it is a pool on the drone's node. */
+    int num_bytes = avpicture_get_size(occx->pix_fmt, VIDEO_WIDTH, VIDEO_HEIGHT);
+    uint8_t* rFrame_buffer;
+
+    if(numa_place_active())
+        rFrame_buffer = numa_place_alloc(num_bytes*sizeof(uint8_t), "converted frame");
+    else
+        rFrame_buffer = av_malloc(num_bytes*sizeof(uint8_t));
+    avpicture_fill((AVPicture*)rFrame, rFrame_buffer, occx->pix_fmt, occx->width, occx->height);
+
+    /* Contexts are kept across frames and only rebuilt when the level
+     * changes the output size */
+    struct video_scaler scaler;
+    video_scaler_init(&scaler, config_get_int("video:scale_threads", 1));
+
+    /* Only sent with a navdata source to take the pose from */
+    struct pose_sei sei = { 0 };
+    uint8_t send_pose = embed_pose && dopts->fill_navdata_demo;
+    navdata_demo_t pose;
+    uint64_t capture_us = 0;
 
     av_init_packet( &pkt );
-    while ( av_read_frame( in_st.ifcx, &pkt ) >= 0) {
+    while ( read_input_packet( &in_st, dopts, &pkt ) >= 0) {
         if ( pkt.stream_index == in_st.video_stream_index ) { //packet is video 
             int got_picture;
 
             frame = avcodec_alloc_frame();
 
-            avcodec_decode_video2(in_st.iccx, frame, &got_picture, &pkt);
+            if(dopts->read_video_frame)
+                got_picture = dopts->read_video_frame(&in_st, frame) >= 0;
+            else
+                avcodec_decode_video2(in_st.iccx, frame, &got_picture, &pkt);
+
+            /* The governor may have changed the level since the last frame.
+             * Resolution and bitrate need a new encoder; the new SPS and PPS
+             * go out with its first IDR. */
+            if(got_picture && qos_stream_level(qos) != level)
+            {
+                level = qos_stream_level(qos);
+
+                avcodec_close(occx);
+                av_free(occx);
+
+                occx = open_video_encoder(codec_id, preset, threads, level->width, level->height, VIDEO_BIT_RATE * level->bit_rate_scale);
+                ost->codec = occx;
+                ost->codec->time_base = ost->time_base;
+
+                avpicture_fill((AVPicture*)rFrame, rFrame_buffer, occx->pix_fmt, occx->width, occx->height);
+
+                video_pacer_set_rate(&pacer, occx->bit_rate);
+            }
+
+            /* Keep level->fps out of every VIDEO_FPS frames */
+            if(got_picture && (ix * level->fps) / VIDEO_FPS == ((ix + 1) * level->fps) / VIDEO_FPS)
+                got_picture = 0;
 
             if(got_picture)
             {
-                frame->pts = ix;
+                struct timespec frame_start;
+                clock_gettime(CLOCK_MONOTONIC, &frame_start);
+
+                /* Pose when the frame came in, before scaling and encoding */
+                if(send_pose)
+                {
+                    capture_us = server_clock_from_timespec(&frame_start);
+                    dopts->fill_navdata_demo(&pose);
+                }
 
-                img_convert_ctx = sws_getContext(w, h, frame->format, occx->width, occx->height, occx->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
-                if(img_convert_ctx == NULL)
-                    error("Cannot initialize the conversion context");
+                frame->pts = ix;
 
                 if(flip_video)
                     flip_frame(frame);
 
-                sws_scale(img_convert_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, in_st.iccx->height, rFrame->data, rFrame->linesize);
+                video_scaler_scale(&scaler, frame, w, in_st.iccx->height, rFrame, occx->width, occx->height, occx->pix_fmt);
 
-                sws_freeContext(img_convert_ctx);
+                if(compute_flow)
+                    optical_flow_submit(rFrame->data[0], rFrame->linesize[0], occx->width, occx->height);
 
                 av_free_packet( &pkt );
                 av_init_packet(&pkt);
                 pkt.data = NULL;
 
+                rFrame->pict_type = __sync_lock_test_and_set(&force_idr, 0) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
                 int ret = avcodec_encode_video2(occx, &pkt, rFrame, &got_picture);
                 if(ret < 0)
                     error("Encoding failed");
 
                 if(got_picture)
                 {
-                    parrot_video_encapsulation_t *p = create_frame_header(pkt.size, frame, ix, pkt.pos, 0, 0, pkt.flags);
-                    write(fd, p, sizeof(parrot_video_encapsulation_t));
-                    av_write_frame( ofcx, &pkt );
+                    /* The encoder has no lookahead, so this is the frame
+                     * just captured */
+                    AVPacket spliced;
+                    AVPacket *out = &pkt;
+
+                    if(send_pose)
+                    {
+                        pose_sei_splice(&sei, &pkt, &spliced, capture_us, &pose);
+                        out = &spliced;
+                    }
+
+                    parrot_video_encapsulation_t *p = create_frame_header(out->size, frame, occx->width, occx->height, ix, out->pos, 0, 0, out->flags);
+                    video_pacer_write(&pacer, p, sizeof(parrot_video_encapsulation_t));
+                    av_write_frame( ofcx, out );
                     free(p);
+
+                    if(record_events)
+                        event_record_video(out->data, out->size, out->flags & AV_PKT_FLAG_KEY);
+
+                    if(monitor_quality)
+                        quality_monitor_submit(out->data, out->size, out->flags & AV_PKT_FLAG_KEY, rFrame->data[0], rFrame->linesize[0], occx->width, occx->height);
                 }
+
+                qos_deadline_check(deadline, &frame_start);
             }
             
             avcodec_free_frame(&frame);
@@ -261,6 +397,11 @@ static void send_video(int fd, int codec_id, struct data_options *dopts)
 
     av_read_pause( in_st.ifcx );
     av_write_trailer( ofcx );
+    video_pacer_free(&pacer);
+
+    video_scaler_free(&scaler);
+    pose_sei_free(&sei);
+    qos_stream_unregister(qos);
 
     avcodec_close( occx );
 
@@ -285,7 +426,7 @@ static AVStream *setup_output_context(int fd, AVFormatContext *ofcx, AVCodecCont
     ost->sample_aspect_ratio.den = occx->sample_aspect_ratio.den;
 
     // Assume r_frame_rate is accurate
-    ost->r_frame_rate = (AVRational){30,1};
+    ost->r_frame_rate = (AVRational){VIDEO_FPS,1};
     ost->avg_frame_rate = ost->r_frame_rate;
     ost->time_base = av_inv_q( ost->r_frame_rate );
     ost->codec->time_base = ost->time_base;
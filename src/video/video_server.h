@@ -5,6 +5,12 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
+/* Format of the stream sent to clients */
+#define VIDEO_WIDTH 640
+#define VIDEO_HEIGHT 360
+#define VIDEO_FPS 30
+#define VIDEO_BIT_RATE 400000
+
 typedef struct {
     uint8_t signature[4]; /* "PaVE" - used to identify the start of frame */
 
@@ -77,5 +83,6 @@ typedef enum {
 }parrot_video_encapsulation_frametypes_t;
 
 void *video_listen(void*);
+AVCodecContext *open_video_encoder(int codec_id, const char *preset, int threads, int width, int height, int64_t bit_rate);
 
 #endif
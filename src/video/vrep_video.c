@@ -1,96 +1,100 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <inttypes.h>
+#include <unistd.h>
 #include "video/video_server.h"
 #include "util/error.h"
 #include "util/data_options.h"
 #include "video/vrep_video.h"
+#include "util/vrep_link.h"
 
-static simxInt client_id;
-static simxInt sensor_handle;
+static simxInt *sensor_handle;
+
+/* The image being handed to the demuxer, copied out of the remote API's
+ * buffer. Allocated at open for the size the demuxer expects and only grown
+ * if the sensor sends more. */
+static char *image_copy = NULL;
+static int image_capacity = 0;
 
 extern uint8_t flip_video;
+extern volatile uint8_t force_idr;
 
 extern pthread_mutex_t vrep_mutex;
 
-void vrep_video_init(struct data_options *d, simxInt id)
+/* Runs on every (re)connection. The stream has a gap, so the next frame is
+ * sent as an IDR for clients to resync on. */
+static void vrep_video_subscribe(simxInt client_id, void *arg)
+{
+    simxInt resolution[2];
+    simxChar *image;
+
+    /* Called again by the link once a lookup that failed succeeds */
+    if(*sensor_handle < 0)
+        return;
+
+    simxGetVisionSensorImage(client_id, *sensor_handle, resolution, &image, 0, simx_opmode_streaming);
+    force_idr = 1;
+}
+
+void vrep_video_init(struct data_options *d)
 {
     flip_video = 1;
-    client_id = id;
     d->open_video_stream = open_vrep_stream;
-    simxInt ret = simxGetIntegerSignal(id, "QCFrontSensor", &sensor_handle, simx_opmode_oneshot_wait);
-    if(ret < 0)
+
+    sensor_handle = vrep_link_signal_handle("QCFrontSensor");
+    if(!vrep_link_wait_handles(VREP_LINK_CONNECT_TIMEOUT) || *sensor_handle < 0)
         error("Could not get sensor handle");
 
-    printf("front sensor handle: %d\n", sensor_handle);
+    printf("front sensor handle: %d\n", *sensor_handle);
+
+    vrep_link_on_connect(vrep_video_subscribe, NULL);
 }
 
 static int read_vrep_stream(void *opaque, uint8_t *buf, int buf_size)
 {
-    static uint8_t init = 1;
-    static char *tmp_image = NULL;
     static char *tmp_image_ptr = NULL;
     static int size_left = 0;
 
     simxInt resolution[2] = {0,0};
-    //    simxInt opmode;
     simxChar *image;
 
-	pthread_mutex_lock(&vrep_mutex);
-
     if(!size_left)
     {
-        int ret;
-
-        if(tmp_image)
+        /* Poll the streamed image without holding the lock in between, so
+         * control commands are not held up. While V-REP is away, or the
+         * sensor handle is being looked up again, this just waits. */
+        while(1)
         {
-            free(tmp_image);
-            tmp_image = NULL;
-            tmp_image_ptr = NULL;
-        }
+            pthread_mutex_lock(&vrep_mutex);
 
-        do
-        {
-            if(init)
-            {
-                ret = simxGetVisionSensorImage(client_id, sensor_handle, resolution, &image, 0, simx_opmode_oneshot_wait);
-                if(ret < 0)
-                    error("Could not read from vision sensor");
+            if(vrep_link_connected() && *sensor_handle >= 0 &&
+                    simxGetVisionSensorImage(vrep_link_client(), *sensor_handle, resolution, &image, 0, simx_opmode_buffer) == simx_error_noerror &&
+                    resolution[0] > 0 && resolution[1] > 0)
+                break;
 
-                ret = simxGetVisionSensorImage(client_id, sensor_handle, resolution, &image, 0, simx_opmode_streaming);
-                if(ret < 0)
-                    error("Could not start streaming from vision sensor");
+            pthread_mutex_unlock(&vrep_mutex);
 
-                init = 0;
-            }
-            else
-            {
-                do
-                {
-                    ret = simxGetVisionSensorImage(client_id, sensor_handle, resolution, &image, 0, simx_opmode_buffer);
-                }
-                while(ret != simx_error_noerror);
+            usleep(VREP_VIDEO_POLL);
+        }
 
-                if(ret != simx_error_noerror)
-                    error("Could not read from vision sensor");
-            }
+        size_left = resolution[0] * resolution[1] * 3;
 
-            size_left = resolution[0] * resolution[1] * 3;
+        if(size_left > image_capacity)
+        {
+            char *grown = realloc(image_copy, size_left);
+            if(!grown)
+                error("Could not allocate V-REP image");
 
-        } while(resolution[0] < 0 || resolution[1] < 0);
+            image_copy = grown;
+            image_capacity = size_left;
+        }
 
-        //        init = !(size_left == 0);
+        tmp_image_ptr = image_copy;
 
-        if(!tmp_image)
-        {
-            tmp_image = malloc(size_left);
-            tmp_image_ptr = tmp_image;
-        }
+        memcpy(image_copy, image, size_left);
 
-        memcpy(tmp_image, image, size_left);
+        pthread_mutex_unlock(&vrep_mutex);
     }
-    
-    pthread_mutex_unlock(&vrep_mutex);
 
     int copy_size;
     if(size_left <= buf_size)
@@ -100,10 +104,7 @@ static int read_vrep_stream(void *opaque, uint8_t *buf, int buf_size)
 
     memcpy(buf, tmp_image_ptr, copy_size);
 
-    if(size_left <= buf_size)
-        tmp_image_ptr = tmp_image;
-    else
-        tmp_image_ptr += copy_size;
+    tmp_image_ptr += copy_size;
 
     size_left -= copy_size;
 
@@ -112,6 +113,14 @@ static int read_vrep_stream(void *opaque, uint8_t *buf, int buf_size)
 
 void open_vrep_stream(struct input_stream *in_stream)
 {
+    if(!image_copy)
+    {
+        image_capacity = VIDEO_WIDTH * VIDEO_HEIGHT * 3;
+        image_copy = malloc(image_capacity);
+        if(!image_copy)
+            error("Could not allocate V-REP image");
+    }
+
     //open rtsp
     in_stream->ifcx = avformat_alloc_context();
 
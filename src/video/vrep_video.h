@@ -3,7 +3,10 @@
 
 #include "libs/vrep/extApi.h"
 
-void vrep_video_init(struct data_options *d, simxInt id);
+/* Wait between polls for a new image from the vision sensor, us */
+#define VREP_VIDEO_POLL 1000
+
+void vrep_video_init(struct data_options *d);
 void open_vrep_stream(struct input_stream *in_stream);
 
 #endif
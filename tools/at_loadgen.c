@@ -0,0 +1,262 @@
+/*
+ * AT command load generator.
+ *
+ * Sends AT*PCMD_MAG (or AT*REF) datagrams to the control port from several
+ * threads, each with a few sockets so the traffic comes from many source
+ * ports, the way a swarm of clients or a high-rate autopilot would. Datagrams
+ * go out in sendmmsg() batches, optionally paced to a total rate.
+ *
+ * Every datagram from a socket carries that socket's next sequence number,
+ * which is what the server's per-source ordering relies on.
+ */
+
+#define _GNU_SOURCE
+
+/* User includes */
+#include "util/port_numbers.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_BATCH 64
+#define MAX_DATAGRAM 256
+
+struct loadgen_options
+{
+    struct sockaddr_in target;
+    int threads;
+    int sources;            /* sockets per thread */
+    int batch;              /* datagrams per sendmmsg() */
+    int commands;           /* AT commands per datagram */
+    double rate;            /* commands per second over all threads, 0 for unlimited */
+    double duration;        /* seconds */
+    uint8_t ref;            /* send AT*REF instead of AT*PCMD_MAG */
+};
+
+struct loadgen_worker
+{
+    pthread_t thread;
+    const struct loadgen_options *o;
+    uint64_t sent;          /* commands */
+    uint64_t errors;
+};
+
+static double timespec_seconds(const struct timespec *t)
+{
+    return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+static int format_datagram(char *buf, const struct loadgen_options *o, uint32_t *seq)
+{
+    int len = 0;
+
+    for(int c = 0; c < o->commands; ++c)
+    {
+        if(o->ref)
+            len += snprintf(buf + len, MAX_DATAGRAM - len, "AT*REF=%" PRIu32 ",290718208\r", (*seq)++);
+        else
+            len += snprintf(buf + len, MAX_DATAGRAM - len, "AT*PCMD_MAG=%" PRIu32 ",1,0,1036831949,0,0,0,0\r", (*seq)++);
+    }
+
+    return len;
+}
+
+static void *loadgen_run(void *args)
+{
+    struct loadgen_worker *w = args;
+    const struct loadgen_options *o = w->o;
+
+    int fds[o->sources];
+    uint32_t seqs[o->sources];
+
+    for(int i = 0; i < o->sources; ++i)
+    {
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if(fds[i] < 0 || connect(fds[i], (struct sockaddr*)&o->target, sizeof(o->target)) < 0)
+            error("Could not open load socket");
+
+        seqs[i] = 1;
+    }
+
+    char buffers[MAX_BATCH][MAX_DATAGRAM];
+    struct iovec iovecs[MAX_BATCH];
+    struct mmsghdr msgs[MAX_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for(int i = 0; i < o->batch; ++i)
+    {
+        iovecs[i].iov_base = buffers[i];
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Seconds between batches from this thread */
+    double interval = o->rate > 0 ? (double)o->batch * o->commands * o->threads / o->rate : 0;
+
+    struct timespec now, next;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double start = timespec_seconds(&now);
+    next = now;
+
+    for(int source = 0; ; source = (source + 1) % o->sources)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(timespec_seconds(&now) - start >= o->duration)
+            break;
+
+        for(int i = 0; i < o->batch; ++i)
+            iovecs[i].iov_len = format_datagram(buffers[i], o, &seqs[source]);
+
+        int sent = sendmmsg(fds[source], msgs, o->batch, 0);
+
+        if(sent < 0)
+            ++w->errors;
+        else
+            w->sent += (uint64_t)sent * o->commands;
+
+        if(interval > 0)
+        {
+            long ns = next.tv_nsec + (long)(interval * 1e9);
+            next.tv_sec += ns / 1000000000L;
+            next.tv_nsec = ns % 1000000000L;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+    }
+
+    for(int i = 0; i < o->sources; ++i)
+        close(fds[i]);
+
+    return NULL;
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-a <address>\tServer address (default 127.0.0.1).\n"\
+            "\t-p <port>\tControl port (default %d).\n"\
+            "\t-t <threads>\tSending threads (default 4).\n"\
+            "\t-s <sources>\tSockets, and so source ports, per thread (default 4).\n"\
+            "\t-b <batch>\tDatagrams per sendmmsg() (default 32, at most %d).\n"\
+            "\t-c <commands>\tAT commands per datagram (default 1).\n"\
+            "\t-r <rate>\tTotal commands per second, 0 for as fast as possible (default 0).\n"\
+            "\t-d <seconds>\tDuration (default 10).\n"\
+            "\t-R\t\tSend AT*REF instead of AT*PCMD_MAG.\n",
+            pname, CONTROL_PORT, MAX_BATCH);
+}
+
+int main(int argc, char **argv)
+{
+    struct loadgen_options o = {
+        .threads = 4,
+        .sources = 4,
+        .batch = 32,
+        .commands = 1,
+        .rate = 0,
+        .duration = 10,
+        .ref = 0,
+    };
+
+    const char *address = "127.0.0.1";
+    int port = CONTROL_PORT;
+    int c;
+
+    while ((c = getopt (argc, argv, "ha:p:t:s:b:c:r:d:R")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'a':
+                address = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 't':
+                o.threads = atoi(optarg);
+                break;
+            case 's':
+                o.sources = atoi(optarg);
+                break;
+            case 'b':
+                o.batch = atoi(optarg);
+                break;
+            case 'c':
+                o.commands = atoi(optarg);
+                break;
+            case 'r':
+                o.rate = atof(optarg);
+                break;
+            case 'd':
+                o.duration = atof(optarg);
+                break;
+            case 'R':
+                o.ref = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(o.threads < 1 || o.sources < 1 || o.batch < 1 || o.batch > MAX_BATCH || o.commands < 1 || o.commands > 4 || o.duration <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&o.target, 0, sizeof(o.target));
+    o.target.sin_family = AF_INET;
+    o.target.sin_port = htons(port);
+    if(inet_pton(AF_INET, address, &o.target.sin_addr) != 1)
+        error("Invalid address %s", address);
+
+    struct loadgen_worker *workers = calloc(o.threads, sizeof(struct loadgen_worker));
+    if(!workers)
+        error("Could not allocate workers");
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(int i = 0; i < o.threads; ++i)
+    {
+        workers[i].o = &o;
+        pthread_create(&workers[i].thread, NULL, loadgen_run, &workers[i]);
+    }
+
+    uint64_t sent = 0, errors = 0;
+
+    for(int i = 0; i < o.threads; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+        sent += workers[i].sent;
+        errors += workers[i].errors;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = timespec_seconds(&end) - timespec_seconds(&start);
+
+    printf("Sent %" PRIu64 " commands from %d sources in %.2f s: %.0f commands/s, %" PRIu64 " failed sends\n",
+            sent, o.threads * o.sources, elapsed, sent / elapsed, errors);
+
+    free(workers);
+
+    return 0;
+}
@@ -0,0 +1,419 @@
+/*
+ * One-way latency probe.
+ *
+ * Estimates the offset between this host's clock and the server clock with
+ * the clock sync port (server run with -T), then uses it to split latency by
+ * direction: client to server on the control port (AT*CLOCK), and server to
+ * client for navdata (navdata_time option) and video (PaVE timestamp). The
+ * offset is only as good as the fastest exchange's round trip, which is
+ * printed alongside as the error bound.
+ */
+
+#define _GNU_SOURCE
+
+/* User includes */
+#include "util/port_numbers.h"
+#include "util/server_clock.h"
+#include "util/clock_offset.h"
+#include "navdata/navdata_common.h"
+#include "video/video_server.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Server ports are the drone's plus this, as netem_proxy maps them */
+#define DRONE_PORT_OFFSET 20000
+
+/* Replies later than this are counted as lost */
+#define REPLY_TIMEOUT_MS 500
+
+/* Period of navdata_time's seconds field, and of the PaVE timestamp */
+#define NAVDATA_TIME_PERIOD (2048ULL * 1000000)
+#define PAVE_TIMESTAMP_PERIOD (1ULL << 32)
+
+struct probe_options
+{
+    struct in_addr address;
+    int samples;
+    int interval_ms;
+    int port_offset;    /* taken off every server port */
+};
+
+static uint64_t client_clock_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec t = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&t, NULL);
+}
+
+static int open_socket(const struct probe_options *o, int type, int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port - o->port_offset),
+        .sin_addr = o->address,
+    };
+
+    int fd = socket(AF_INET, type, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        error("Could not connect to port %d", port - o->port_offset);
+
+    struct timeval timeout = { 0, REPLY_TIMEOUT_MS * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    return fd;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double*)a, db = *(const double*)b;
+
+    return (da > db) - (da < db);
+}
+
+static void print_stats(const char *name, double *ms, int count, int wanted)
+{
+    if(!count)
+    {
+        printf("%-22s no samples\n", name);
+        return;
+    }
+
+    qsort(ms, count, sizeof(double), compare_doubles);
+
+    printf("%-22s min %7.3f  median %7.3f  p95 %7.3f  max %7.3f ms  (%d/%d samples)\n",
+            name, ms[0], ms[count / 2], ms[(count * 95) / 100 < count ? (count * 95) / 100 : count - 1], ms[count - 1], count, wanted);
+}
+
+/* One exchange on the clock sync socket. Returns 0 if the reply was lost. */
+static uint8_t clocksync_exchange(int fd, struct clock_offset *estimate, uint32_t sequence, struct clocksync_packet *reply)
+{
+    struct clocksync_packet p = {
+        .magic = CLOCKSYNC_MAGIC,
+        .sequence = sequence,
+    };
+
+    p.client_send = client_clock_us();
+
+    if(send(fd, &p, sizeof(p), 0) != sizeof(p))
+        return 0;
+
+    while(1)
+    {
+        if(recv(fd, reply, sizeof(*reply), 0) != sizeof(*reply))
+            return 0;
+
+        uint64_t t4 = client_clock_us();
+
+        /* A late reply to an earlier exchange */
+        if(reply->magic != CLOCKSYNC_MAGIC || reply->sequence != sequence)
+            continue;
+
+        clock_offset_add(estimate, reply->client_send, reply->server_receive, reply->server_send, t4);
+
+        return 1;
+    }
+}
+
+static void probe_sync(const struct probe_options *o, int fd, struct clock_offset *estimate, uint32_t *sequence)
+{
+    struct clocksync_packet reply;
+    double rtt[o->samples];
+    int count = 0;
+
+    for(int i = 0; i < o->samples; ++i)
+    {
+        uint64_t start = client_clock_us();
+
+        if(clocksync_exchange(fd, estimate, (*sequence)++, &reply))
+            rtt[count++] = (client_clock_us() - start) / 1000.0;
+
+        sleep_ms(o->interval_ms);
+    }
+
+    int64_t offset, err;
+
+    if(!clock_offset_estimate(estimate, &offset, &err))
+        error("No replies from the clock sync port; is the server running with -T?");
+
+    printf("Clock offset (server - client): %+.3f ms +- %.3f ms\n", offset / 1000.0, err / 1000.0);
+    print_stats("Clock sync round trip", rtt, count, o->samples);
+}
+
+/* Client to server: sends AT*CLOCK with a token, then asks the clock sync port
+ * when it arrived */
+static void probe_control(const struct probe_options *o, int sync_fd, struct clock_offset *estimate, uint32_t *sequence)
+{
+    int fd = open_socket(o, SOCK_DGRAM, CONTROL_PORT);
+    double ms[o->samples];
+    int count = 0;
+
+    for(int i = 0; i < o->samples; ++i)
+    {
+        char command[64];
+        struct clocksync_packet reply;
+        uint32_t token = i + 1;
+
+        int len = snprintf(command, sizeof(command), "AT*CLOCK=%d,%" PRIu32 "\r", i + 1, token);
+
+        uint64_t sent = client_clock_us();
+        send(fd, command, len, 0);
+
+        /* Give the control thread a moment to see it before asking */
+        sleep_ms(o->interval_ms / 2);
+
+        int64_t offset, err;
+
+        if(clocksync_exchange(sync_fd, estimate, (*sequence)++, &reply) && reply.control_token == token && clock_offset_estimate(estimate, &offset, &err))
+            ms[count++] = ((int64_t)(reply.control_receive - offset) - (int64_t)sent) / 1000.0;
+
+        sleep_ms(o->interval_ms / 2);
+    }
+
+    print_stats("Control (up)", ms, count, o->samples);
+
+    close(fd);
+}
+
+/* Returns the navdata_time option of a packet, or 0 if it has none */
+static uint32_t navdata_find_time(const uint8_t *packet, int len)
+{
+    int offset = offsetof(navdata_t, options);
+
+    while(offset + (int)sizeof(navdata_option_t) <= len)
+    {
+        const navdata_option_t *option = (const navdata_option_t*)(packet + offset);
+
+        if(option->tag == NAVDATA_TIME_TAG && offset + (int)sizeof(navdata_time_t) <= len)
+            return ((const navdata_time_t*)option)->time;
+
+        if(!option->size)
+            break;
+
+        offset += option->size;
+    }
+
+    return 0;
+}
+
+/* Server to client: the navdata_time option is stamped just before sending */
+static void probe_navdata(const struct probe_options *o, struct clock_offset *estimate)
+{
+    int fd = open_socket(o, SOCK_DGRAM, NAVDATA_PORT);
+    double ms[o->samples];
+    int count = 0, received = 0, timeouts = 0;
+    uint32_t request = 1;
+    int64_t offset, err;
+
+    clock_offset_estimate(estimate, &offset, &err);
+
+    send(fd, &request, sizeof(request), 0);
+
+    while(received < o->samples)
+    {
+        uint8_t packet[2048];
+        int len = recv(fd, packet, sizeof(packet), 0);
+        uint64_t now = client_clock_us();
+
+        if(len < 0)
+        {
+            if(++timeouts == 5)
+                break;
+
+            /* Ask again; the request may have been lost */
+            send(fd, &request, sizeof(request), 0);
+            continue;
+        }
+
+        timeouts = 0;
+        ++received;
+
+        uint32_t packed = navdata_find_time(packet, len);
+
+        if(!packed)
+            continue;
+
+        uint64_t server_us = (packed >> 21) * 1000000ULL + (packed & 0x1FFFFF);
+        uint64_t sent = clock_offset_unwrap(now + offset, server_us, NAVDATA_TIME_PERIOD);
+
+        ms[count++] = ((int64_t)(now + offset) - (int64_t)sent) / 1000.0;
+    }
+
+    print_stats("Navdata (down)", ms, count, o->samples);
+
+    close(fd);
+}
+
+static uint8_t read_exactly(int fd, void *buf, size_t size)
+{
+    for(size_t got = 0; got < size;)
+    {
+        ssize_t n = recv(fd, (uint8_t*)buf + got, size - got, 0);
+
+        if(n <= 0)
+            return 0;
+
+        got += n;
+    }
+
+    return 1;
+}
+
+/* Server to client: the PaVE timestamp is taken as the frame is sent. It only
+ * has millisecond resolution. */
+static void probe_video(const struct probe_options *o, struct clock_offset *estimate)
+{
+    int fd = open_socket(o, SOCK_STREAM, VIDEO_PORT);
+    double ms[o->samples];
+    int count = 0;
+    int64_t offset, err;
+
+    clock_offset_estimate(estimate, &offset, &err);
+
+    while(count < o->samples)
+    {
+        parrot_video_encapsulation_t header;
+
+        if(!read_exactly(fd, &header, offsetof(parrot_video_encapsulation_t, header_size) + sizeof(header.header_size)))
+            break;
+
+        if(memcmp(header.signature, "PaVE", 4) || header.header_size < sizeof(header))
+            error("Lost PaVE framing");
+
+        uint8_t *rest = (uint8_t*)&header + offsetof(parrot_video_encapsulation_t, header_size) + sizeof(header.header_size);
+
+        if(!read_exactly(fd, rest, sizeof(header) - (rest - (uint8_t*)&header)))
+            break;
+
+        uint64_t now = client_clock_us();
+        uint64_t sent = clock_offset_unwrap((now + offset) / 1000, header.timestamp, PAVE_TIMESTAMP_PERIOD);
+
+        ms[count++] = (int64_t)(now + offset) / 1000.0 - (int64_t)sent;
+
+        /* Skip any header extension and the frame itself */
+        for(uint32_t skip = header.header_size - sizeof(header) + header.payload_size; skip;)
+        {
+            uint8_t buf[4096];
+            uint32_t chunk = skip < sizeof(buf) ? skip : sizeof(buf);
+
+            if(!read_exactly(fd, buf, chunk))
+                break;
+
+            skip -= chunk;
+        }
+    }
+
+    print_stats("Video (down)", ms, count, o->samples);
+
+    close(fd);
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-a <address>\tServer address (default 127.0.0.1).\n"\
+            "\t-n <samples>\tSamples per measurement (default 20).\n"\
+            "\t-i <ms>\t\tInterval between clock sync exchanges (default 100).\n"\
+            "\t-p\t\tUse the drone ports (5551-5559), e.g. to go through netem_proxy.\n"\
+            "\t-C\t\tMeasure client to server latency on the control port.\n"\
+            "\t-N\t\tMeasure server to client latency of navdata.\n"\
+            "\t-V\t\tMeasure server to client latency of video.\n",
+            pname);
+}
+
+int main(int argc, char **argv)
+{
+    struct probe_options o = {
+        .samples = 20,
+        .interval_ms = 100,
+    };
+
+    const char *address = "127.0.0.1";
+    uint8_t control = 0, navdata = 0, video = 0;
+    int c;
+
+    while ((c = getopt (argc, argv, "ha:n:i:pCNV")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'a':
+                address = optarg;
+                break;
+            case 'n':
+                o.samples = atoi(optarg);
+                break;
+            case 'i':
+                o.interval_ms = atoi(optarg);
+                break;
+            case 'p':
+                o.port_offset = DRONE_PORT_OFFSET;
+                break;
+            case 'C':
+                control = 1;
+                break;
+            case 'N':
+                navdata = 1;
+                break;
+            case 'V':
+                video = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(o.samples < 1 || o.interval_ms < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(inet_pton(AF_INET, address, &o.address) != 1)
+        error("Invalid address %s", address);
+
+    struct clock_offset estimate;
+    uint32_t sequence = 1;
+
+    clock_offset_init(&estimate);
+
+    int sync_fd = open_socket(&o, SOCK_DGRAM, CLOCKSYNC_PORT);
+
+    probe_sync(&o, sync_fd, &estimate, &sequence);
+
+    if(control)
+        probe_control(&o, sync_fd, &estimate, &sequence);
+    if(navdata)
+        probe_navdata(&o, &estimate);
+    if(video)
+        probe_video(&o, &estimate);
+
+    close(sync_fd);
+
+    return 0;
+}
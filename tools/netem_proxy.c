@@ -0,0 +1,763 @@
+/*
+ * Loopback network impairment proxy.
+ *
+ * Sits between the client and the server for every service port and applies
+ * delay, jitter, loss, reordering and a bandwidth cap per port and direction.
+ * The client side listens on the drone port (5551-5559) and forwards to the
+ * server port from port_numbers.h, so the forwarding rules from
+ * setup_test_forwarding only need to point at the drone port instead.
+ */
+
+/* User includes */
+#include "util/port_numbers.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PORT_OFFSET 20000
+#define MAX_CHUNK 1448
+#define MAX_EVENTS 32
+
+/* Packets held at once. Datagrams past it are dropped, as a full router
+ * queue would. */
+#define MAX_QUEUED 16384
+
+/* Bytes read from one side of a connection and not yet written to the other
+ * before the proxy stops reading, so a slow peer backs up its own connection
+ * rather than the proxy's memory */
+#define STREAM_WINDOW (256 * 1024)
+
+enum { DIR_UP = 0, DIR_DOWN = 1 };  /* up: client -> server, down: server -> client */
+
+struct link_params
+{
+    double delay_ms;
+    double jitter_ms;
+    double loss;        /* probability, 0-1 */
+    double reorder;     /* probability, 0-1 */
+    double rate_kbps;   /* 0 means unlimited */
+};
+
+struct service
+{
+    const char *name;
+    uint16_t port;
+    int type;
+
+    struct link_params params[2];
+    uint64_t link_free[2];
+
+    int listen_fd;
+    int upstream_fd;
+    struct sockaddr_in client;
+    uint8_t have_client;
+};
+
+struct delivery
+{
+    uint64_t due;
+    uint64_t received;
+    uint64_t seq;
+    struct service *svc;
+    struct tcp_pair *pair;
+    int dir;
+    size_t len;             /* a zero length stream delivery carries an EOF */
+    size_t done;            /* bytes of it the peer has taken */
+    struct delivery *next;
+    uint8_t data[MAX_CHUNK];
+};
+
+struct tcp_pair
+{
+    struct service *svc;
+    int fd[2];              /* indexed by the direction the data read from it travels */
+    struct endpoint *ep[2];
+    uint64_t last_due[2];
+    uint8_t eof[2];
+    uint8_t watched[2];
+    int refs;
+
+    /* Per direction: bytes read and not yet written on, and what is due but
+     * waiting for the peer to take it, in order */
+    size_t pending[2];
+    struct delivery *backlog[2];
+    struct delivery *backlog_tail[2];
+
+    struct tcp_pair *next_dead;
+};
+
+/* Marks an epoll registration as a listening socket, an upstream UDP socket
+ * or one side of a TCP pair. */
+struct endpoint
+{
+    enum { EP_LISTEN, EP_UPSTREAM, EP_STREAM } kind;
+    struct service *svc;
+    struct tcp_pair *pair;
+    int dir;
+};
+
+static struct service services[] = {
+    { .name = "ftp", .port = FTP_LISTEN_PORT, .type = SOCK_STREAM },
+    { .name = "auth", .port = AUTH_PORT, .type = SOCK_STREAM },
+    { .name = "navdata", .port = NAVDATA_PORT, .type = SOCK_DGRAM },
+    { .name = "video", .port = VIDEO_PORT, .type = SOCK_STREAM },
+    { .name = "control", .port = CONTROL_PORT, .type = SOCK_DGRAM },
+    { .name = "controlcomm", .port = CONTROLCOMM_LISTEN_PORT, .type = SOCK_STREAM },
+    { .name = "clocksync", .port = CLOCKSYNC_PORT, .type = SOCK_DGRAM },
+};
+
+#define NUM_SERVICES (sizeof(services) / sizeof(services[0]))
+
+static struct delivery **heap;
+static size_t heap_len;
+static size_t heap_cap;
+static uint64_t next_seq;
+
+/* Pairs released while handling a batch of events, which may still have
+ * events in it, and are freed after it */
+static struct tcp_pair *dead_pairs;
+
+static FILE *log_file;
+static uint64_t rng_state = 88172645463325252ULL;
+static int epfd;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64, seeded from the command line so impairment runs are repeatable */
+static double random_unit(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint8_t delivery_before(struct delivery *a, struct delivery *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void heap_push(struct delivery *d)
+{
+    if(heap_len == heap_cap)
+    {
+        heap_cap = heap_cap ? heap_cap * 2 : 256;
+        heap = realloc(heap, heap_cap * sizeof(*heap));
+        if(!heap)
+            error("Could not grow delivery queue");
+    }
+
+    size_t i = heap_len++;
+    while(i && delivery_before(d, heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = d;
+}
+
+static struct delivery *heap_pop(void)
+{
+    struct delivery *top = heap[0];
+    struct delivery *last = heap[--heap_len];
+    size_t i = 0;
+
+    while(1)
+    {
+        size_t child = 2 * i + 1;
+        if(child >= heap_len)
+            break;
+        if(child + 1 < heap_len && delivery_before(heap[child + 1], heap[child]))
+            ++child;
+        if(!delivery_before(heap[child], last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    if(heap_len)
+        heap[i] = last;
+
+    return top;
+}
+
+static void log_packet(struct delivery *d, uint64_t sent, const char *event)
+{
+    if(!log_file)
+        return;
+
+    fprintf(log_file, "%" PRIu64 ",%" PRIu64 ",%s,%s,%zu,%s\n", d->received, sent, d->svc->name, d->dir == DIR_UP ? "up" : "down", d->len, event);
+}
+
+static void release_pair(struct tcp_pair *pair)
+{
+    if(--pair->refs)
+        return;
+
+    close(pair->fd[DIR_UP]);
+    close(pair->fd[DIR_DOWN]);
+
+    pair->next_dead = dead_pairs;
+    dead_pairs = pair;
+}
+
+static void free_dead_pairs(void)
+{
+    while(dead_pairs)
+    {
+        struct tcp_pair *pair = dead_pairs;
+
+        dead_pairs = pair->next_dead;
+        free(pair->ep[DIR_UP]);
+        free(pair->ep[DIR_DOWN]);
+        free(pair);
+    }
+}
+
+/* fd[k] is read while its direction has room, and written to while the other
+ * direction has a backlog. It is left out of epoll while neither, so a hung up
+ * socket does not wake the loop until its pair is done with it. */
+static void update_events(struct tcp_pair *pair, int k)
+{
+    struct epoll_event ev = { .events = 0, .data = { .ptr = pair->ep[k] } };
+
+    if(!pair->eof[k] && pair->pending[k] < STREAM_WINDOW)
+        ev.events |= EPOLLIN;
+
+    if(pair->backlog[!k])
+        ev.events |= EPOLLOUT;
+
+    if(!ev.events)
+    {
+        if(pair->watched[k])
+            epoll_ctl(epfd, EPOLL_CTL_DEL, pair->fd[k], NULL);
+    }
+    else if(epoll_ctl(epfd, pair->watched[k] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pair->fd[k], &ev) < 0)
+    {
+        error("epoll_ctl");
+    }
+
+    pair->watched[k] = ev.events != 0;
+}
+
+/* Writes what the peer will take of the backlog going in dir without
+ * blocking. Returns 0 if that released the pair. */
+static uint8_t flush_stream(struct tcp_pair *pair, int dir)
+{
+    int out_fd = pair->fd[!dir];
+
+    /* Already released in this batch of events, its sockets closed */
+    if(!pair->refs)
+        return 0;
+
+    while(pair->backlog[dir])
+    {
+        struct delivery *d = pair->backlog[dir];
+        const char *event = "sent";
+
+        if(!d->len)
+        {
+            shutdown(out_fd, SHUT_WR);
+            event = "eof";
+        }
+        else
+        {
+            ssize_t ret = send(out_fd, d->data + d->done, d->len - d->done, MSG_NOSIGNAL);
+
+            if(ret < 0 && errno == EINTR)
+                continue;
+
+            if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+
+            if(ret < 0)
+                event = "failed";
+            else if((d->done += ret) < d->len)
+                continue;
+        }
+
+        log_packet(d, now_us(), event);
+
+        pair->pending[dir] -= d->len;
+        pair->backlog[dir] = d->next;
+        free(d);
+
+        if(pair->refs == 1)
+        {
+            release_pair(pair);
+            return 0;
+        }
+
+        release_pair(pair);
+    }
+
+    update_events(pair, dir);
+    update_events(pair, !dir);
+
+    return 1;
+}
+
+/* Applies the link model to a packet received now and queues it. */
+static void schedule(struct delivery *d)
+{
+    struct link_params *lp = &d->svc->params[d->dir];
+    uint64_t *link_free = &d->svc->link_free[d->dir];
+    uint8_t stream = d->pair != NULL;
+
+    if(!stream && lp->loss > 0 && random_unit() < lp->loss)
+    {
+        log_packet(d, 0, "dropped");
+        free(d);
+        return;
+    }
+
+    /* Streams are held back by their window instead */
+    if(!stream && heap_len >= MAX_QUEUED)
+    {
+        log_packet(d, 0, "overflow");
+        free(d);
+        return;
+    }
+
+    uint64_t start = d->received > *link_free ? d->received : *link_free;
+    if(lp->rate_kbps > 0)
+        *link_free = start + (uint64_t)(d->len * 8 * 1000.0 / lp->rate_kbps);
+    else
+        *link_free = start;
+
+    double delay = lp->delay_ms;
+    if(lp->jitter_ms > 0)
+        delay += (2 * random_unit() - 1) * lp->jitter_ms;
+
+    /* Like netem, a reordered datagram skips the delay line and overtakes
+     * whatever is queued behind it. */
+    if(!stream && lp->reorder > 0 && random_unit() < lp->reorder)
+        delay = 0;
+
+    if(delay < 0)
+        delay = 0;
+
+    d->due = *link_free + (uint64_t)(delay * 1000);
+    d->seq = next_seq++;
+
+    if(stream)
+    {
+        /* Byte streams can be delayed but never reordered. */
+        if(d->due < d->pair->last_due[d->dir])
+            d->due = d->pair->last_due[d->dir];
+        d->pair->last_due[d->dir] = d->due;
+        ++d->pair->refs;
+    }
+
+    heap_push(d);
+}
+
+static void deliver(struct delivery *d)
+{
+    uint64_t sent = now_us();
+    struct service *svc = d->svc;
+
+    /* Queued behind anything the peer has not taken yet, and never waited
+     * for, so one slow peer does not hold up the rest */
+    if(d->pair)
+    {
+        struct tcp_pair *pair = d->pair;
+
+        if(pair->backlog[d->dir])
+            pair->backlog_tail[d->dir]->next = d;
+        else
+            pair->backlog[d->dir] = d;
+
+        pair->backlog_tail[d->dir] = d;
+
+        flush_stream(pair, d->dir);
+        return;
+    }
+    else if(d->dir == DIR_UP)
+    {
+        send(svc->upstream_fd, d->data, d->len, MSG_DONTWAIT);
+        log_packet(d, sent, "sent");
+    }
+    else if(svc->have_client)
+    {
+        sendto(svc->listen_fd, d->data, d->len, MSG_DONTWAIT, (struct sockaddr*)&svc->client, sizeof(svc->client));
+        log_packet(d, sent, "sent");
+    }
+
+    free(d);
+}
+
+static struct delivery *new_delivery(struct service *svc, struct tcp_pair *pair, int dir)
+{
+    struct delivery *d = calloc(sizeof(struct delivery), 1);
+    if(!d)
+        error("Could not allocate delivery");
+
+    d->svc = svc;
+    d->pair = pair;
+    d->dir = dir;
+    d->received = now_us();
+
+    return d;
+}
+
+static void watch(int fd, struct endpoint *ep)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data = { .ptr = ep } };
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        error("epoll_ctl");
+}
+
+static int open_socket(int type, uint16_t port, uint8_t listening)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = { .s_addr = htonl(INADDR_LOOPBACK) },
+        .sin_port = htons(port),
+    };
+
+    int fd = socket(AF_INET, type, 0);
+    if(fd < 0)
+        error("ERROR opening socket");
+
+    if(listening)
+    {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+            error("ERROR on binding port %d", port);
+
+        if(type == SOCK_STREAM)
+            listen(fd, 5);
+    }
+    else if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        return -1;
+
+    if(type == SOCK_STREAM)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    return fd;
+}
+
+static void accept_stream(struct service *svc)
+{
+    int client_fd = accept(svc->listen_fd, NULL, NULL);
+    if(client_fd < 0)
+        return;
+
+    int server_fd = open_socket(SOCK_STREAM, svc->port, 0);
+    if(server_fd < 0)
+    {
+        close(client_fd);
+        return;
+    }
+
+    struct tcp_pair *pair = calloc(sizeof(struct tcp_pair), 1);
+    struct endpoint *up = calloc(sizeof(struct endpoint), 1);
+    struct endpoint *down = calloc(sizeof(struct endpoint), 1);
+
+    if(!pair || !up || !down)
+        error("Could not allocate connection");
+
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    pair->svc = svc;
+    pair->fd[DIR_UP] = client_fd;
+    pair->fd[DIR_DOWN] = server_fd;
+    pair->ep[DIR_UP] = up;
+    pair->ep[DIR_DOWN] = down;
+    pair->refs = 1;
+
+    *up = (struct endpoint){ .kind = EP_STREAM, .svc = svc, .pair = pair, .dir = DIR_UP };
+    *down = (struct endpoint){ .kind = EP_STREAM, .svc = svc, .pair = pair, .dir = DIR_DOWN };
+
+    watch(client_fd, up);
+    watch(server_fd, down);
+    pair->watched[DIR_UP] = pair->watched[DIR_DOWN] = 1;
+}
+
+static void read_stream(struct endpoint *ep)
+{
+    struct tcp_pair *pair = ep->pair;
+    struct delivery *d = new_delivery(ep->svc, pair, ep->dir);
+
+    ssize_t ret = read(pair->fd[ep->dir], d->data, MAX_CHUNK);
+
+    if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        free(d);
+        return;
+    }
+
+    if(ret <= 0)
+    {
+        /* Forward the EOF in order behind the queued data. The socket stays
+         * registered while the other direction still writes to it. */
+        pair->eof[ep->dir] = 1;
+        update_events(pair, ep->dir);
+
+        d->len = 0;
+        schedule(d);
+
+        if(pair->eof[DIR_UP] && pair->eof[DIR_DOWN])
+            release_pair(pair);
+
+        return;
+    }
+
+    d->len = ret;
+    pair->pending[ep->dir] += ret;
+    schedule(d);
+
+    update_events(pair, ep->dir);
+}
+
+static void read_datagram(struct endpoint *ep)
+{
+    struct service *svc = ep->svc;
+    struct delivery *d;
+
+    if(ep->kind == EP_LISTEN)
+    {
+        socklen_t len = sizeof(svc->client);
+        d = new_delivery(svc, NULL, DIR_UP);
+
+        ssize_t ret = recvfrom(svc->listen_fd, d->data, MAX_CHUNK, 0, (struct sockaddr*)&svc->client, &len);
+        if(ret < 0)
+        {
+            free(d);
+            return;
+        }
+
+        svc->have_client = 1;
+        d->len = ret;
+    }
+    else
+    {
+        d = new_delivery(svc, NULL, DIR_DOWN);
+
+        ssize_t ret = recv(svc->upstream_fd, d->data, MAX_CHUNK, 0);
+        if(ret < 0)
+        {
+            free(d);
+            return;
+        }
+
+        d->len = ret;
+    }
+
+    schedule(d);
+}
+
+static struct service *find_service(const char *name)
+{
+    for(size_t i = 0; i < NUM_SERVICES; ++i)
+        if(!strcmp(services[i].name, name) || atoi(name) == services[i].port || atoi(name) == services[i].port - PORT_OFFSET)
+            return &services[i];
+
+    return NULL;
+}
+
+/* Parses <service|port|all>[/up|/down]:key=value,... */
+static void parse_link(char *spec)
+{
+    char *params = strchr(spec, ':');
+    if(!params)
+        error("Bad link specification %s", spec);
+    *params++ = 0;
+
+    int dir_first = DIR_UP;
+    int dir_last = DIR_DOWN;
+    char *dir = strchr(spec, '/');
+    if(dir)
+    {
+        *dir++ = 0;
+        if(!strcmp(dir, "up"))
+            dir_last = DIR_UP;
+        else if(!strcmp(dir, "down"))
+            dir_first = DIR_DOWN;
+        else
+            error("Bad direction %s", dir);
+    }
+
+    struct link_params lp;
+    memset(&lp, 0, sizeof(lp));
+
+    char *saveptr = NULL;
+    for(char *kv = strtok_r(params, ",", &saveptr); kv; kv = strtok_r(NULL, ",", &saveptr))
+    {
+        char key[16];
+        double value;
+
+        if(sscanf(kv, "%15[^=]=%lf", key, &value) != 2)
+            error("Bad link parameter %s", kv);
+
+        if(!strcmp(key, "delay"))
+            lp.delay_ms = value;
+        else if(!strcmp(key, "jitter"))
+            lp.jitter_ms = value;
+        else if(!strcmp(key, "loss"))
+            lp.loss = value / 100.0;
+        else if(!strcmp(key, "reorder"))
+            lp.reorder = value / 100.0;
+        else if(!strcmp(key, "rate"))
+            lp.rate_kbps = value;
+        else
+            error("Unknown link parameter %s", key);
+    }
+
+    for(size_t i = 0; i < NUM_SERVICES; ++i)
+    {
+        if(strcmp(spec, "all") && &services[i] != find_service(spec))
+            continue;
+
+        for(int d = dir_first; d <= dir_last; ++d)
+            services[i].params[d] = lp;
+    }
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-l <link>\tImpair a link, e.g. video/down:delay=40,jitter=10,rate=2000 or all:loss=1.\n"\
+            "\t\t\tLinks are named by service (ftp, auth, navdata, video, control, controlcomm,\n"\
+            "\t\t\tclocksync), port or all, optionally followed by /up (client to server) or /down.\n"\
+            "\t\t\tDelay and jitter are in ms, loss and reorder in percent (datagram services only)\n"\
+            "\t\t\tand rate in kbit/s.\n"\
+            "\t-o <file>\tLog per-packet timing (received and sent microseconds) as CSV.\n"\
+            "\t-s <seed>\tSeed for the impairment random generator.\n"\
+            "FTP passive data connections are not proxied.\n",
+            pname);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt (argc, argv, "hl:o:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'l':
+                parse_link(optarg);
+                break;
+            case 'o':
+                log_file = fopen(optarg, "w");
+                if(!log_file)
+                    error("Could not open %s", optarg);
+                fprintf(log_file, "received_us,sent_us,service,direction,bytes,event\n");
+                break;
+            case 's':
+                rng_state = strtoull(optarg, NULL, 0) | 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    /* A client going away mid-write must not take the proxy with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1(0);
+    if(epfd < 0)
+        error("epoll_create1");
+
+    for(size_t i = 0; i < NUM_SERVICES; ++i)
+    {
+        struct service *svc = &services[i];
+        struct endpoint *ep = calloc(sizeof(struct endpoint), 1);
+
+        svc->listen_fd = open_socket(svc->type, svc->port - PORT_OFFSET, 1);
+        *ep = (struct endpoint){ .kind = EP_LISTEN, .svc = svc };
+        watch(svc->listen_fd, ep);
+
+        if(svc->type == SOCK_DGRAM)
+        {
+            struct endpoint *up = calloc(sizeof(struct endpoint), 1);
+
+            svc->upstream_fd = open_socket(SOCK_DGRAM, svc->port, 0);
+            *up = (struct endpoint){ .kind = EP_UPSTREAM, .svc = svc };
+            watch(svc->upstream_fd, up);
+        }
+
+        printf("%s: %d -> %d\n", svc->name, svc->port - PORT_OFFSET, svc->port);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while(1)
+    {
+        int timeout = -1;
+        if(heap_len)
+        {
+            uint64_t now = now_us();
+            timeout = heap[0]->due > now ? (int)((heap[0]->due - now + 999) / 1000) : 0;
+        }
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if(n < 0 && errno != EINTR)
+            error("epoll_wait");
+
+        for(int i = 0; i < n; ++i)
+        {
+            struct endpoint *ep = events[i].data.ptr;
+
+            if(ep->kind == EP_STREAM)
+            {
+                if(events[i].events & EPOLLOUT && !flush_stream(ep->pair, !ep->dir))
+                    continue;
+
+                if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && !ep->pair->eof[ep->dir])
+                    read_stream(ep);
+            }
+            else if(ep->svc->type == SOCK_STREAM)
+                accept_stream(ep->svc);
+            else
+                read_datagram(ep);
+        }
+
+        uint64_t now = now_us();
+        while(heap_len && heap[0]->due <= now)
+            deliver(heap_pop());
+
+        free_dead_pairs();
+
+        if(log_file)
+            fflush(log_file);
+    }
+
+    return 0;
+}
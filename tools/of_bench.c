@@ -0,0 +1,191 @@
+/*
+ * Optical flow benchmark.
+ *
+ * Times the block matching used for navdata_vision_of on synthetic frames at
+ * the bottom camera (320x240) and front camera (640x360) resolutions, once per
+ * SAD implementation the CPU supports. Each frame is the previous one shifted
+ * by a known amount, so the mean error of the estimate is reported as well.
+ */
+
+/* User includes */
+#include "video/block_flow.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#define MARGIN 32
+
+struct resolution
+{
+    int width;
+    int height;
+};
+
+static const struct resolution resolutions[] = {
+    { 320, 240 },
+    { 640, 360 },
+};
+
+static const struct
+{
+    enum flow_impl impl;
+    const char *name;
+} impls[] = {
+    { FLOW_IMPL_SCALAR, "scalar" },
+    { FLOW_IMPL_SSE2, "sse2" },
+    { FLOW_IMPL_AVX2, "avx2" },
+};
+
+/* Box-blurred noise, so every block has some texture to match */
+static uint8_t *make_texture(int width, int height, unsigned seed)
+{
+    uint8_t *noise = malloc(width * height);
+    uint8_t *texture = malloc(width * height);
+
+    if(!noise || !texture)
+        error("Could not allocate texture");
+
+    srand(seed);
+
+    for(int i = 0; i < width * height; ++i)
+        noise[i] = rand() & 0xFF;
+
+    for(int y = 0; y < height; ++y)
+    {
+        for(int x = 0; x < width; ++x)
+        {
+            int sum = 0, n = 0;
+
+            for(int ky = -2; ky <= 2; ++ky)
+            {
+                for(int kx = -2; kx <= 2; ++kx)
+                {
+                    int sx = x + kx, sy = y + ky;
+
+                    if(sx < 0 || sy < 0 || sx >= width || sy >= height)
+                        continue;
+
+                    sum += noise[sy * width + sx];
+                    ++n;
+                }
+            }
+
+            texture[y * width + x] = sum / n;
+        }
+    }
+
+    free(noise);
+
+    return texture;
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void bench(const struct resolution *r, int iterations, int shift_x, int shift_y)
+{
+    int stride = r->width + 2 * MARGIN;
+    uint8_t *texture = make_texture(stride, r->height + 2 * MARGIN, 1);
+
+    /* The content moves by (shift_x, shift_y) from prev to cur */
+    const uint8_t *prev_luma = texture + MARGIN * stride + MARGIN;
+    const uint8_t *cur_luma = prev_luma - shift_y * stride - shift_x;
+
+    struct flow_pyramid prev, cur;
+    flow_pyramid_init(&prev, r->width, r->height);
+    flow_pyramid_init(&cur, r->width, r->height);
+    flow_pyramid_build(&prev, prev_luma, stride);
+
+    for(int i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i)
+    {
+        if(!flow_set_impl(impls[i].impl))
+        {
+            printf("%dx%d\t%-6s\tnot supported\n", r->width, r->height, impls[i].name);
+            continue;
+        }
+
+        float dx[FLOW_BLOCKS], dy[FLOW_BLOCKS];
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for(int n = 0; n < iterations; ++n)
+        {
+            flow_pyramid_build(&cur, cur_luma, stride);
+            flow_estimate(&prev, &cur, dx, dy);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double err = 0;
+        for(int b = 0; b < FLOW_BLOCKS; ++b)
+            err += hypot(dx[b] - shift_x, dy[b] - shift_y);
+
+        printf("%dx%d\t%-6s\t%.3f ms/frame\tmean error %.2f px\n", r->width, r->height, impls[i].name,
+                elapsed_ms(&start, &end) / iterations, err / FLOW_BLOCKS);
+    }
+
+    flow_pyramid_free(&prev);
+    flow_pyramid_free(&cur);
+    free(texture);
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-n <frames>\tNumber of frames to time per case (default 1000).\n"\
+            "\t-x <pixels>\tHorizontal shift between frames (default 5, at most %d).\n"\
+            "\t-y <pixels>\tVertical shift between frames (default -3, at most %d).\n",
+            pname, MARGIN, MARGIN);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 1000;
+    int shift_x = 5;
+    int shift_y = -3;
+    int c;
+
+    while ((c = getopt (argc, argv, "hn:x:y:")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'x':
+                shift_x = atoi(optarg);
+                break;
+            case 'y':
+                shift_y = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(iterations < 1 || abs(shift_x) > MARGIN || abs(shift_y) > MARGIN)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for(int i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); ++i)
+        bench(&resolutions[i], iterations, shift_x, shift_y);
+
+    return 0;
+}
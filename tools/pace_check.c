@@ -0,0 +1,224 @@
+/*
+ * Loopback check of paced video transmission.
+ *
+ * Sends one frame over a loopback TCP connection through the same pacer the
+ * video server uses with -P, and records when each piece of it arrives. A
+ * paced frame should arrive spread over its size divided by the pacing rate,
+ * rather than as one burst. Exits non-zero if it does not. Run with -n to see
+ * the unpaced burst for comparison, and with -u to check the userspace token
+ * bucket on an interface scheduled by fq.
+ */
+
+#define _GNU_SOURCE
+
+/* User includes */
+#include "video/video_pacer.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Networking includes */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_READS 65536
+
+/* A paced frame must take at least this much of the time the rate implies */
+#define MIN_SPREAD 0.8
+
+struct arrivals
+{
+    int fd;
+    size_t expected;
+    int count;
+    double time[MAX_READS];
+    size_t bytes[MAX_READS];
+};
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void *receive_frame(void *args)
+{
+    struct arrivals *a = args;
+    uint8_t buf[65536];
+    size_t total = 0;
+
+    while(total < a->expected && a->count < MAX_READS)
+    {
+        ssize_t n = read(a->fd, buf, sizeof(buf));
+
+        if(n <= 0)
+            break;
+
+        a->time[a->count] = now_seconds();
+        a->bytes[a->count++] = n;
+        total += n;
+    }
+
+    return NULL;
+}
+
+/* Connected loopback TCP pair */
+static void loopback_pair(int *sender, int *receiver)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+            getsockname(listener, (struct sockaddr*)&addr, &len) < 0)
+        error("Could not listen on loopback");
+
+    *sender = socket(AF_INET, SOCK_STREAM, 0);
+    if(*sender < 0 || connect(*sender, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        error("Could not connect on loopback");
+
+    *receiver = accept(listener, NULL, NULL);
+    if(*receiver < 0)
+        error("Could not accept on loopback");
+
+    close(listener);
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-b <bit/s>\tEncoder bit rate the pacing rate is derived from (default 1000000).\n"\
+            "\t-s <bytes>\tSize of the frame, e.g. an IDR (default 40000).\n"\
+            "\t-n\t\tSend without pacing.\n"\
+            "\t-u\t\tPace in userspace even where an fq qdisc would apply SO_MAX_PACING_RATE.\n"\
+            "\t-v\t\tPrint every arrival.\n",
+            pname);
+}
+
+int main(int argc, char **argv)
+{
+    int64_t bit_rate = 1000000;
+    size_t size = 40000;
+    uint8_t paced = 1, verbose = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "hb:s:nuv")) != -1)
+    {
+        switch(c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'b':
+                bit_rate = atoll(optarg);
+                break;
+            case 's':
+                size = atol(optarg);
+                break;
+            case 'n':
+                paced = 0;
+                break;
+            case 'u':
+                video_pacer_kernel = 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(bit_rate < 1 || size < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static struct arrivals a;
+    int sender;
+    pthread_t receiver_thread;
+
+    loopback_pair(&sender, &a.fd);
+    a.expected = size;
+
+    struct video_pacer pacer;
+    video_pacer_init(&pacer, sender, paced, bit_rate);
+
+    uint8_t *frame = calloc(size, 1);
+    if(!frame)
+        error("Could not allocate the frame");
+
+    pthread_create(&receiver_thread, NULL, receive_frame, &a);
+
+    double start = now_seconds();
+
+    if(video_pacer_write(&pacer, frame, size) < 0)
+        error("Could not send the frame");
+
+    /* The userspace sender returns as soon as the frame is queued */
+    double queued = now_seconds() - start;
+
+    video_pacer_free(&pacer);
+    pthread_join(receiver_thread, NULL);
+
+    if(!a.count)
+        error("Nothing arrived");
+
+    double max_gap = 0.0;
+    size_t total = 0;
+
+    for(int i = 0; i < a.count; ++i)
+    {
+        double gap = i ? a.time[i] - a.time[i - 1] : a.time[0] - start;
+
+        if(i && gap > max_gap)
+            max_gap = gap;
+
+        total += a.bytes[i];
+
+        if(verbose)
+            printf("%8.3f ms  +%7.3f ms  %6zu bytes  %8zu total\n", (a.time[i] - start) * 1e3, gap * 1e3, a.bytes[i], total);
+    }
+
+    /* The first burst leaves straight away, the rest at the pacing rate */
+    double rate = bit_rate / 8.0 * VIDEO_PACING_HEADROOM;
+    double spread = a.time[a.count - 1] - a.time[0];
+    double wanted = size > VIDEO_PACING_BURST ? (size - VIDEO_PACING_BURST) / rate : 0.0;
+
+    printf("%zu bytes in %d reads over %.3f ms, largest gap %.3f ms; at %.0f bytes/s pacing spreads it over %.3f ms\n",
+            total, a.count, spread * 1e3, max_gap * 1e3, rate, wanted * 1e3);
+    printf("The sender was held up for %.3f ms\n", queued * 1e3);
+
+    if(total != size)
+    {
+        printf("FAIL: %zu of %zu bytes arrived\n", total, size);
+        return 1;
+    }
+
+    if(paced && spread < wanted * MIN_SPREAD)
+    {
+        printf("FAIL: the frame arrived as a burst\n");
+        return 1;
+    }
+
+    printf(paced ? "OK: the frame was spread over the interval\n" : "Unpaced\n");
+
+    close(sender);
+    close(a.fd);
+    free(frame);
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Sliced scaling benchmark.
+ *
+ * Times the banded scaler the video server uses (video:scale_threads) on a
+ * synthetic 720p or 1080p YUV420P frame scaled to the encoder's 640x360, for
+ * each thread count up to the one given, and compares every result with one
+ * context over the whole frame. Rows next to a band edge are compared on
+ * their own, as that is where a band that did not see its neighbours' rows
+ * would differ. Wall time shows the speedup on as many cores as threads, CPU
+ * time what the overlapping rows cost.
+ */
+
+/* User includes */
+#include "video/video_scaler.h"
+#include "video/video_server.h"
+#include "util/error.h"
+
+/* Video includes */
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Box-blurred noise with a fine vertical ripple, so a filter clamped at a
+ * band edge shows up */
+static void fill_source(AVFrame *f, int width, int height)
+{
+    srand(1);
+
+    for(int y = 0; y < height; ++y)
+    {
+        for(int x = 0; x < width; ++x)
+            f->data[0][y * f->linesize[0] + x] = ((y & 3) < 2 ? 64 : 192) + (rand() & 0x1F) - 16;
+    }
+
+    for(int p = 1; p < 3; ++p)
+    {
+        for(int y = 0; y < height / 2; ++y)
+        {
+            for(int x = 0; x < width / 2; ++x)
+                f->data[p][y * f->linesize[p] + x] = 128 + ((x + 3 * y) & 0x3F) - 32;
+        }
+    }
+}
+
+static void alloc_frame(AVFrame *f, int width, int height)
+{
+    memset(f, 0, sizeof(*f));
+    f->format = AV_PIX_FMT_YUV420P;
+
+    if(av_image_alloc(f->data, f->linesize, width, height, AV_PIX_FMT_YUV420P, 16) < 0)
+        error("Could not allocate a %dx%d frame", width, height);
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Largest difference from the reference over all planes, and over the rows
+ * within two of a band edge */
+static void compare(const AVFrame *a, const AVFrame *ref, const struct video_scaler *s, int width, int height,
+        int *max_diff, int *edge_diff)
+{
+    *max_diff = *edge_diff = 0;
+
+    for(int p = 0; p < 3; ++p)
+    {
+        int shift = p ? 1 : 0;
+
+        for(int y = 0; y < height >> shift; ++y)
+        {
+            uint8_t edge = 0;
+
+            for(int b = 1; b < s->num_bands; ++b)
+                edge |= abs(y - (s->bands[b].dst_y >> shift)) <= 2;
+
+            for(int x = 0; x < width >> shift; ++x)
+            {
+                int d = abs(a->data[p][y * a->linesize[p] + x] - ref->data[p][y * ref->linesize[p] + x]);
+
+                if(d > *max_diff)
+                    *max_diff = d;
+                if(edge && d > *edge_diff)
+                    *edge_diff = d;
+            }
+        }
+    }
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-n <frames>\tNumber of frames to time per case (default 200).\n"\
+            "\t-t <threads>\tMost threads to try (default 4, at most %d).\n"\
+            "\t-7\t\tUse a 720p source instead of 1080p.\n",
+            pname, VIDEO_SCALER_MAX_THREADS);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = 200;
+    int max_threads = 4;
+    int src_w = 1920, src_h = 1080;
+    int c;
+
+    while ((c = getopt (argc, argv, "hn:t:7")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case '7':
+                src_w = 1280;
+                src_h = 720;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(iterations < 1 || max_threads < 1 || max_threads > VIDEO_SCALER_MAX_THREADS)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    AVFrame src, ref, dst;
+    alloc_frame(&src, src_w, src_h);
+    alloc_frame(&ref, VIDEO_WIDTH, VIDEO_HEIGHT);
+    alloc_frame(&dst, VIDEO_WIDTH, VIDEO_HEIGHT);
+
+    fill_source(&src, src_w, src_h);
+
+    struct SwsContext *whole = sws_getContext(src_w, src_h, AV_PIX_FMT_YUV420P, VIDEO_WIDTH, VIDEO_HEIGHT, AV_PIX_FMT_YUV420P,
+            SWS_BILINEAR, NULL, NULL, NULL);
+    if(!whole)
+        error("Cannot initialize the conversion context");
+
+    sws_scale(whole, (const uint8_t* const*)src.data, src.linesize, 0, src_h, ref.data, ref.linesize);
+    sws_freeContext(whole);
+
+    printf("%dx%d to %dx%d YUV420P on %ld CPUs\n", src_w, src_h, VIDEO_WIDTH, VIDEO_HEIGHT, sysconf(_SC_NPROCESSORS_ONLN));
+
+    double single = 0;
+
+    for(int threads = 1; threads <= max_threads; ++threads)
+    {
+        struct video_scaler s;
+        struct timespec start, end, cpu_start, cpu_end;
+        int max_diff, edge_diff;
+
+        video_scaler_init(&s, threads);
+
+        /* The first frame lays the bands out and builds the contexts */
+        video_scaler_scale(&s, &src, src_w, src_h, &dst, VIDEO_WIDTH, VIDEO_HEIGHT, AV_PIX_FMT_YUV420P);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+        for(int n = 0; n < iterations; ++n)
+            video_scaler_scale(&s, &src, src_w, src_h, &dst, VIDEO_WIDTH, VIDEO_HEIGHT, AV_PIX_FMT_YUV420P);
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double ms = elapsed_ms(&start, &end) / iterations;
+        double cpu_ms = elapsed_ms(&cpu_start, &cpu_end) / iterations;
+        if(threads == 1)
+            single = ms;
+
+        compare(&dst, &ref, &s, VIDEO_WIDTH, VIDEO_HEIGHT, &max_diff, &edge_diff);
+
+        printf("%d threads\t%d bands\t%.3f ms/frame\t%.2fx\t%.3f CPU ms/frame\tmax difference %d, at band edges %d\n",
+                threads, s.num_bands, ms, single / ms, cpu_ms, max_diff, edge_diff);
+
+        video_scaler_free(&s);
+    }
+
+    av_freep(&src.data[0]);
+    av_freep(&ref.data[0]);
+    av_freep(&dst.data[0]);
+
+    return 0;
+}
@@ -0,0 +1,390 @@
+/*
+ * Monte-Carlo batch runner for the native simulation.
+ *
+ * Flies many headless runs of one command script (built in, or read with -i;
+ * journaled AT commands work too) on every CPU. Each run draws its own wind,
+ * gusts, mass, controller gains around the CTRL_DEFAULT_* values and sensor
+ * noise from the seed and its run number, so any run can be flown again on
+ * its own with -r. Every run adds a row to one CSV file as it finishes, and a
+ * summary is printed at the end.
+ */
+
+#define _GNU_SOURCE
+
+/* User includes */
+#include "sim/sim_model.h"
+#include "sim/sim_script.h"
+#include "sim/sim_batch.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+/* Tilt past this is a crash, as is touching down faster than CRASH_SPEED */
+#define CRASH_TILT 60.0f
+#define CRASH_SPEED 2.0f
+
+/* Seconds flown after the script's last step before a run is cut off */
+#define SETTLE_TIME 30.0
+
+struct batch_options
+{
+    uint64_t seed;
+    float wind;             /* m/s, most */
+    float gust;             /* m/s, most */
+    float mass_spread;      /* fraction either way */
+    float gain_spread;      /* fraction either way */
+    float noise;            /* most multiple of the default noise */
+    double duration;
+    struct sim_script script;
+    FILE *out;
+};
+
+struct run_params
+{
+    uint64_t seed;
+    float wind, wind_dir, gust, mass, gain_scale, noise_scale;
+};
+
+struct run_result
+{
+    uint8_t crashed;
+    uint8_t landed;
+    float flight_time;
+    float max_tilt;
+    float p95_tilt;
+    float hover_drift;      /* rms horizontal speed while told to hover, m/s */
+    float final_offset;     /* m from the takeoff point */
+    float max_altitude;
+};
+
+/* Per worker totals, added up at the end */
+struct worker_totals
+{
+    int runs;
+    int crashed;
+    int landed;
+    double p95_tilt;
+    double hover_drift;
+    double final_offset;
+} __attribute__ ((aligned (64)));
+
+static struct worker_totals totals[SIM_BATCH_MAX_WORKERS];
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+/* splitmix64, so nearby run numbers get unrelated seeds */
+static uint64_t run_seed(uint64_t seed, int run)
+{
+    uint64_t z = seed + (uint64_t)(run + 1) * 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+static float spread(struct sim_rng *r, float fraction)
+{
+    return 1.0f + fraction * (2.0f * sim_rng_uniform(r) - 1.0f);
+}
+
+static void draw_params(const struct batch_options *o, int run, struct run_params *rp, struct sim_params *p)
+{
+    struct sim_rng r = { run_seed(o->seed, run) };
+
+    sim_params_default(p);
+
+    rp->seed = sim_rng_next(&r);
+    rp->wind = o->wind * sim_rng_uniform(&r);
+    rp->wind_dir = 2.0f * (float)M_PI * sim_rng_uniform(&r);
+    rp->gust = o->gust * sim_rng_uniform(&r);
+    rp->mass = p->nominal_mass * spread(&r, o->mass_spread);
+    rp->noise_scale = o->noise * sim_rng_uniform(&r);
+
+    p->wind[0] = rp->wind * cosf(rp->wind_dir);
+    p->wind[1] = rp->wind * sinf(rp->wind_dir);
+    p->gust = rp->gust;
+    p->mass = rp->mass;
+    p->angle_noise *= rp->noise_scale;
+    p->rate_noise *= rp->noise_scale;
+    p->velocity_noise *= rp->noise_scale;
+
+    /* Each gain on its own, and the mean scale reported */
+    float *gains[] = { &p->gains.pq_kp, &p->gains.ea_kp, &p->gains.ea_ki, &p->gains.r_kp, &p->gains.alt_kp, &p->gains.alt_ki };
+    int count = sizeof(gains) / sizeof(gains[0]);
+
+    rp->gain_scale = 0;
+
+    for(int i = 0; i < count; ++i)
+    {
+        float scale = spread(&r, o->gain_spread);
+
+        *gains[i] *= scale;
+        rp->gain_scale += scale / count;
+    }
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float*)a, fb = *(const float*)b;
+
+    return (fa > fb) - (fa < fb);
+}
+
+static void fly(const struct batch_options *o, const struct sim_params *p, uint64_t seed, struct sim_pool *pool, struct run_result *r)
+{
+    uint64_t max_steps = o->duration / p->dt + 1;
+    float *tilts = sim_pool_alloc(pool, max_steps * sizeof(float));
+    uint64_t samples = 0, hover_samples = 0;
+    double drift = 0, takeoff = -1;
+    struct sim_state s;
+    int next = 0;
+
+    sim_init(&s, seed);
+    memset(r, 0, sizeof(*r));
+
+    while(s.t < o->duration && !r->crashed)
+    {
+        sim_script_apply(&o->script, &next, &s);
+
+        float vz = s.vel[2];
+        uint8_t airborne = s.pos[2] > 0;
+
+        sim_step(&s, p);
+
+        if(airborne && s.pos[2] <= 0 && vz < -CRASH_SPEED)
+            r->crashed = 1;
+
+        if(s.mode == SIM_LANDED && next == o->script.count && takeoff >= 0)
+            break;
+
+        if(s.pos[2] <= 0)
+            continue;
+
+        if(takeoff < 0)
+            takeoff = s.t;
+
+        float tilt = fmaxf(fabsf(s.angle[0]), fabsf(s.angle[1])) * 180.0f / (float)M_PI;
+
+        tilts[samples++] = tilt;
+        r->max_tilt = fmaxf(r->max_tilt, tilt);
+        r->max_altitude = fmaxf(r->max_altitude, s.pos[2]);
+
+        if(tilt > CRASH_TILT)
+            r->crashed = 1;
+
+        if(s.mode == SIM_FLYING && !s.command.roll && !s.command.pitch)
+        {
+            drift += s.vel[0] * s.vel[0] + s.vel[1] * s.vel[1];
+            ++hover_samples;
+        }
+    }
+
+    if(samples)
+    {
+        qsort(tilts, samples, sizeof(float), compare_floats);
+        r->p95_tilt = tilts[samples * 95 / 100];
+    }
+
+    r->landed = !r->crashed && s.mode == SIM_LANDED && takeoff >= 0;
+    r->flight_time = takeoff >= 0 ? s.t - takeoff : 0;
+    r->hover_drift = hover_samples ? sqrt(drift / hover_samples) : 0;
+    r->final_offset = hypotf(s.pos[0], s.pos[1]);
+}
+
+static void write_header(FILE *out)
+{
+    fprintf(out, "run,seed,wind,wind_dir,gust,mass,gain_scale,noise_scale,"
+            "crashed,landed,flight_time,max_tilt,p95_tilt,hover_drift,final_offset,max_altitude\n");
+}
+
+static void batch_run(int run, int worker, struct sim_pool *pool, void *arg)
+{
+    const struct batch_options *o = arg;
+    struct run_params rp;
+    struct sim_params p;
+    struct run_result r;
+
+    draw_params(o, run, &rp, &p);
+    fly(o, &p, rp.seed, pool, &r);
+
+    /* One call per row: stdio locks the stream for each call, so rows from
+     * different workers never interleave */
+    fprintf(o->out, "%d,%" PRIu64 ",%.3f,%.3f,%.3f,%.4f,%.4f,%.3f,%d,%d,%.3f,%.3f,%.3f,%.4f,%.3f,%.3f\n",
+            run, rp.seed, rp.wind, rp.wind_dir, rp.gust, rp.mass, rp.gain_scale, rp.noise_scale,
+            r.crashed, r.landed, r.flight_time, r.max_tilt, r.p95_tilt, r.hover_drift, r.final_offset, r.max_altitude);
+
+    struct worker_totals *t = &totals[worker];
+
+    ++t->runs;
+    t->crashed += r.crashed;
+    t->landed += r.landed;
+    t->p95_tilt += r.p95_tilt;
+    t->hover_drift += r.hover_drift;
+    t->final_offset += r.final_offset;
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-n <runs>\tNumber of runs (default 1000).\n"\
+            "\t-j <workers>\tWorker threads (default one per CPU).\n"\
+            "\t-S <seed>\tSeed the runs are drawn from (default 1).\n"\
+            "\t-i <filename>\tCommand script or AT journal to fly (default a box pattern).\n"\
+            "\t-o <filename>\tResult file (default sim_batch.csv, - for stdout).\n"\
+            "\t-r <run>\tFly only this run, e.g. to look again at one that crashed.\n"\
+            "\t-W <m/s>\tMost steady wind (default 3).\n"\
+            "\t-g <m/s>\tMost gust strength (default 1).\n"\
+            "\t-M <fraction>\tMass spread either way (default 0.2).\n"\
+            "\t-G <fraction>\tSpread of each controller gain either way (default 0.3).\n"\
+            "\t-N <scale>\tMost multiple of the default sensor noise (default 3).\n",
+            pname);
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    static struct batch_options o = {
+        .seed = 1,
+        .wind = 3.0f,
+        .gust = 1.0f,
+        .mass_spread = 0.2f,
+        .gain_spread = 0.3f,
+        .noise = 3.0f,
+    };
+
+    int runs = 1000, workers = cpus > 0 ? cpus : 1, only = -1;
+    const char *script = NULL, *output = "sim_batch.csv";
+    int c;
+
+    while ((c = getopt (argc, argv, "hn:j:S:i:o:r:W:g:M:G:N:")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'S':
+                o.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'i':
+                script = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'r':
+                only = atoi(optarg);
+                break;
+            case 'W':
+                o.wind = atof(optarg);
+                break;
+            case 'g':
+                o.gust = atof(optarg);
+                break;
+            case 'M':
+                o.mass_spread = atof(optarg);
+                break;
+            case 'G':
+                o.gain_spread = atof(optarg);
+                break;
+            case 'N':
+                o.noise = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(runs < 1 || workers < 1 || workers > SIM_BATCH_MAX_WORKERS)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(script)
+    {
+        if(!sim_script_read(script, &o.script))
+            return 1;
+    }
+    else
+        sim_script_default(&o.script);
+
+    if(!o.script.count)
+        error("Script %s has no commands", script);
+
+    o.duration = o.script.steps[o.script.count - 1].t + SETTLE_TIME;
+
+    o.out = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if(!o.out)
+        error("Could not open %s", output);
+
+    write_header(o.out);
+
+    /* Room for a tilt sample every step, plus alignment */
+    size_t pool_size = (o.duration / SIM_DEFAULT_DT + 2) * sizeof(float) + 64;
+
+    if(only >= 0)
+    {
+        struct sim_pool pool = { malloc(pool_size), pool_size, 0 };
+
+        batch_run(only, 0, &pool, &o);
+        free(pool.base);
+
+        return 0;
+    }
+
+    struct sim_batch_stats stats;
+    double start = now_ms();
+
+    sim_batch_run(runs, workers, pool_size, batch_run, &o, &stats);
+
+    double elapsed = now_ms() - start;
+    struct worker_totals all = { 0 };
+
+    for(int i = 0; i < workers; ++i)
+    {
+        all.runs += totals[i].runs;
+        all.crashed += totals[i].crashed;
+        all.landed += totals[i].landed;
+        all.p95_tilt += totals[i].p95_tilt;
+        all.hover_drift += totals[i].hover_drift;
+        all.final_offset += totals[i].final_offset;
+    }
+
+    if(o.out != stdout)
+        fclose(o.out);
+
+    printf("%d runs of %.0f s in %.2f s on %d workers (%.0f runs/s, %.0fx real time)\n", all.runs, o.duration, elapsed / 1000,
+            workers, all.runs / (elapsed / 1000), all.runs * o.duration / (elapsed / 1000));
+    printf("Runs per worker %d to %d, %" PRIu64 " steals\n", stats.min_runs, stats.max_runs, stats.steals);
+    printf("Crashed %d (%.1f%%), landed %d (%.1f%%)\n", all.crashed, 100.0 * all.crashed / all.runs, all.landed, 100.0 * all.landed / all.runs);
+    printf("Mean p95 tilt %.2f deg, hover drift %.3f m/s, final offset %.2f m\n", all.p95_tilt / all.runs,
+            all.hover_drift / all.runs, all.final_offset / all.runs);
+    if(output && strcmp(output, "-"))
+        printf("Results in %s\n", output);
+
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Checkpoint and fork for the native simulation.
+ *
+ * Flies a survey with a simple waypoint autopilot (takeoff, climb, then a
+ * lawnmower pattern for the shared prefix), checkpoints the simulation and
+ * forks it into K landing variants, each with its own wind and random stream,
+ * running headless on its own CPU. With -c it also runs every variant from
+ * scratch, checks the results match the forked ones bit for bit, and reports
+ * the time the checkpoint saved.
+ */
+
+#define _GNU_SOURCE
+
+/* User includes */
+#include "sim/sim_model.h"
+#include "sim/sim_fork.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+/* Autopilot limits */
+#define MAX_SPEED 5.0f
+#define MAX_TILT 0.3f
+#define MAX_CLIMB 1.0f
+#define CRUISE_ALTITUDE 3.0f
+
+/* Within this of a waypoint, the next one is taken */
+#define WAYPOINT_RADIUS 1.0f
+
+/* Survey legs, metres */
+#define LEG_LENGTH 80.0f
+#define LEG_SPACING 10.0f
+
+struct fork_options
+{
+    uint64_t seed;
+    double prefix;          /* s of simulated time before the checkpoint */
+    double suffix;          /* s each variant may take to land */
+    float wind;             /* m/s, turned with the variant */
+    float gust;             /* m/s */
+    uint8_t from_scratch;
+};
+
+struct variant_result
+{
+    uint8_t landed;
+    float land_time;        /* s after the checkpoint */
+    float miss;             /* m from the pad at touchdown */
+    float max_tilt;         /* degrees */
+    uint64_t steps;
+};
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+static float clampf(float v, float limit)
+{
+    return v < -limit ? -limit : (v > limit ? limit : v);
+}
+
+/* The autopilot under test sits outside the simulation, so its own state is
+ * not in the checkpoint; each phase starts it afresh */
+struct autopilot
+{
+    float wind[2];      /* m/s^2, integral of the velocity error */
+};
+
+/* Flies towards target from the simulated position, as motion capture would
+ * give it, and the drone's own velocity estimate. Returns the horizontal
+ * distance left. */
+static float autopilot(struct autopilot *a, struct sim_state *s, const struct sim_params *p, const float target[3])
+{
+    float d[2] = { target[0] - s->pos[0], target[1] - s->pos[1] };
+    float distance = sqrtf(d[0] * d[0] + d[1] * d[1]);
+    float speed = distance > 0 ? fminf(0.8f * distance, MAX_SPEED) / distance : 0;
+    float accel[2];
+
+    for(int i = 0; i < 2; ++i)
+    {
+        float err = d[i] * speed - s->sensed.vel[i];
+
+        a->wind[i] = clampf(a->wind[i] + 0.5f * err * p->dt, 3.0f);
+        accel[i] = 2.0f * err + a->wind[i];
+    }
+
+    float cy = cosf(s->sensed.angle[2]), sy = sinf(s->sensed.angle[2]);
+    float forward = cy * accel[0] + sy * accel[1];
+    float left = -sy * accel[0] + cy * accel[1];
+
+    s->command.pitch = clampf(forward / 9.81f, MAX_TILT);
+    s->command.roll = clampf(-left / 9.81f, MAX_TILT);
+    s->command.vert_speed = clampf(0.8f * (target[2] - s->pos[2]), MAX_CLIMB);
+    s->command.yaw_rate = 0;
+
+    return distance;
+}
+
+/* Waypoint i of the survey: back and forth along x, a row further along y
+ * each time */
+static void survey_waypoint(int i, float w[3])
+{
+    w[0] = ((i + 1) / 2) % 2 ? LEG_LENGTH : 0.0f;
+    w[1] = (i / 2) * LEG_SPACING;
+    w[2] = CRUISE_ALTITUDE;
+}
+
+static void fly_prefix(struct sim_state *s, const struct sim_params *p, double until)
+{
+    struct autopilot pilot = { { 0 } };
+    int waypoint = 0;
+    float w[3];
+
+    survey_waypoint(waypoint, w);
+    sim_set_flying(s, 1);
+
+    while(s->t < until)
+    {
+        if(s->mode == SIM_FLYING && autopilot(&pilot, s, p, w) < WAYPOINT_RADIUS)
+            survey_waypoint(++waypoint, w);
+
+        sim_step(s, p);
+    }
+}
+
+static void variant_params(const struct fork_options *o, int variant, struct sim_params *p)
+{
+    float heading = variant * 2.4f;
+
+    sim_params_default(p);
+
+    p->wind[0] = o->wind * cosf(heading);
+    p->wind[1] = o->wind * sinf(heading);
+    p->gust = o->gust * (1 + variant % 3);
+}
+
+/* Lands on a pad a few metres ahead of where the checkpoint left the drone */
+static void run_variant(struct sim_state *s, int variant, void *arg, void *result)
+{
+    const struct fork_options *o = arg;
+    struct variant_result *r = result;
+    struct autopilot pilot = { { 0 } };
+    struct sim_params p;
+
+    if(o->from_scratch)
+    {
+        struct sim_params prefix_params;
+
+        sim_params_default(&prefix_params);
+        sim_init(s, o->seed);
+        fly_prefix(s, &prefix_params, o->prefix);
+    }
+
+    variant_params(o, variant, &p);
+
+    /* Diverge the random stream as well as the wind */
+    s->rng.s ^= (variant + 1) * 0x9E3779B97F4A7C15ULL;
+    if(!s->rng.s)
+        s->rng.s = 1;
+
+    double start = s->t;
+    uint64_t steps = s->steps;
+    float pad[3] = { s->pos[0] + 5.0f, s->pos[1], 0.0f };
+
+    while(s->t < start + o->suffix && s->mode != SIM_LANDED)
+    {
+        float hover[3] = { pad[0], pad[1], s->pos[2] };
+        float distance = autopilot(&pilot, s, &p, hover);
+
+        if(distance < 0.3f)
+            s->command.vert_speed = -0.5f;
+        if(distance < 0.3f && s->pos[2] < 0.3f)
+            sim_set_flying(s, 0);
+
+        sim_step(s, &p);
+
+        float tilt = fmaxf(fabsf(s->angle[0]), fabsf(s->angle[1])) * 180.0f / (float)M_PI;
+        r->max_tilt = fmaxf(r->max_tilt, tilt);
+    }
+
+    r->landed = s->mode == SIM_LANDED;
+    r->land_time = s->t - start;
+    r->miss = hypotf(s->pos[0] - pad[0], s->pos[1] - pad[1]);
+    r->steps = s->steps - steps;
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-k <variants>\tVariants to fork from the checkpoint (default twice the CPUs).\n"\
+            "\t-p <seconds>\tSimulated time of the shared prefix (default 600).\n"\
+            "\t-s <seconds>\tSimulated time each variant may take to land (default 60).\n"\
+            "\t-S <seed>\tSeed of the random stream (default 1).\n"\
+            "\t-W <m/s>\tWind speed; each variant blows from another direction (default 2).\n"\
+            "\t-g <m/s>\tGust strength (default 0.5).\n"\
+            "\t-w <filename>\tWrite the checkpoint to a file (load it in the server with sim:checkpoint).\n"\
+            "\t-r <filename>\tFork from a checkpoint file instead of flying the prefix.\n"\
+            "\t-c\t\tAlso run every variant from scratch, check the results match and compare times.\n",
+            pname);
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct fork_options o = {
+        .seed = 1,
+        .prefix = 600.0,
+        .suffix = 60.0,
+        .wind = 2.0f,
+        .gust = 0.5f,
+    };
+
+    int variants = 2 * (cpus > 0 ? cpus : 1);
+    const char *write_file = NULL, *read_file = NULL;
+    uint8_t compare = 0;
+    int c;
+
+    while ((c = getopt (argc, argv, "hk:p:s:S:W:g:w:r:c")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 'k':
+                variants = atoi(optarg);
+                break;
+            case 'p':
+                o.prefix = atof(optarg);
+                break;
+            case 's':
+                o.suffix = atof(optarg);
+                break;
+            case 'S':
+                o.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'W':
+                o.wind = atof(optarg);
+                break;
+            case 'g':
+                o.gust = atof(optarg);
+                break;
+            case 'w':
+                write_file = optarg;
+                break;
+            case 'r':
+                read_file = optarg;
+                break;
+            case 'c':
+                compare = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(variants < 1 || o.prefix < 0 || o.suffix <= 0 || (compare && read_file))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct sim_state checkpoint;
+    struct sim_params params;
+    double start = now_ms();
+
+    sim_params_default(&params);
+
+    if(read_file)
+    {
+        if(!sim_checkpoint_read(read_file, &checkpoint))
+            error("Could not read checkpoint %s", read_file);
+    }
+    else
+    {
+        sim_init(&checkpoint, o.seed);
+        fly_prefix(&checkpoint, &params, o.prefix);
+    }
+
+    double prefix_ms = now_ms() - start;
+
+    printf("Checkpoint at %.1f s: (%.1f, %.1f, %.1f) m, %s\n", checkpoint.t, checkpoint.pos[0], checkpoint.pos[1], checkpoint.pos[2],
+            checkpoint.mode == SIM_FLYING ? "flying" : "not flying");
+
+    if(write_file && !sim_checkpoint_write(write_file, &checkpoint))
+        error("Could not write checkpoint %s", write_file);
+
+    struct variant_result *forked = calloc(variants, sizeof(struct variant_result));
+
+    start = now_ms();
+    int failed = sim_fork(&checkpoint, variants, run_variant, &o, forked, sizeof(struct variant_result));
+    double fork_ms = now_ms() - start;
+
+    printf("%-8s %-7s %9s %8s %9s\n", "Variant", "Landed", "Time (s)", "Miss (m)", "Tilt (deg)");
+
+    for(int i = 0; i < variants; ++i)
+        printf("%-8d %-7s %9.2f %8.3f %9.2f\n", i, forked[i].landed ? "yes" : "no", forked[i].land_time, forked[i].miss, forked[i].max_tilt);
+
+    if(failed)
+        printf("%d variants did not finish\n", failed);
+
+    printf("Prefix %.1f ms, %d forked variants %.1f ms, total %.1f ms on %ld CPUs\n", prefix_ms, variants, fork_ms, prefix_ms + fork_ms, cpus);
+
+    if(compare)
+    {
+        struct variant_result *scratch = calloc(variants, sizeof(struct variant_result));
+        struct sim_state fresh;
+
+        sim_init(&fresh, o.seed);
+        o.from_scratch = 1;
+
+        start = now_ms();
+        sim_fork(&fresh, variants, run_variant, &o, scratch, sizeof(struct variant_result));
+        double scratch_ms = now_ms() - start;
+
+        int mismatches = 0;
+
+        for(int i = 0; i < variants; ++i)
+            mismatches += memcmp(&forked[i], &scratch[i], sizeof(struct variant_result)) != 0;
+
+        printf("From scratch %.1f ms, %.0f%% saved by the checkpoint; %d of %d results differ\n", scratch_ms,
+                100.0 * (1.0 - (prefix_ms + fork_ms) / scratch_ms), mismatches, variants);
+
+        free(scratch);
+        free(forked);
+
+        return mismatches != 0;
+    }
+
+    free(forked);
+
+    return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * Stand-in for V-REP to run the server's plugin build without the simulator.
+ *
+ * Exports the part of the V-REP API the plugin binds and steps a scene with
+ * one drone and its front camera. Each step it sends the plugin the same
+ * messages V-REP does, then plays the drone's script: it drains the
+ * QCCommands queue, flies the newest command with simple kinematics and
+ * renders a pattern that scrolls under the camera as the drone moves. Run it
+ * from bin/ so the plugin finds the configuration, and point clients at it as
+ * at the standalone server.
+ */
+
+#define _GNU_SOURCE
+#define V_REP_LIBRARY
+
+/* User includes */
+#include "libs/vrep/v_repLib.h"
+#include "control/vrep_control.h"
+#include "util/error.h"
+
+/* Standard includes */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#define BODY_HANDLE 1
+#define SENSOR_HANDLE 2
+
+#define SENSOR_WIDTH 640
+#define SENSOR_HEIGHT 360
+
+/* Pattern pixels per metre the drone moves */
+#define PIXELS_PER_METRE 100.0f
+
+#define GRAVITY 9.81f
+#define DRAG 0.5f
+
+#define MAX_SIGNALS 8
+
+typedef unsigned char (*plugin_start)(void*, int);
+typedef void (*plugin_end)(void);
+typedef void *(*plugin_message)(int, int*, void*, int*);
+
+struct string_signal
+{
+    char name[32];
+    simChar *value;
+    simInt length;
+};
+
+static struct string_signal signals[MAX_SIGNALS];
+
+/* The drone, in the world frame */
+static float position[3];
+static float speed[3];
+static float attitude[3];      /* roll, pitch, yaw */
+static float yaw_rate;
+
+static struct string_signal *find_signal(const simChar *name, uint8_t create)
+{
+    for(int i = 0; i < MAX_SIGNALS; ++i)
+    {
+        if(signals[i].value && !strcmp(signals[i].name, name))
+            return &signals[i];
+    }
+
+    for(int i = 0; create && i < MAX_SIGNALS; ++i)
+    {
+        if(!signals[i].value)
+        {
+            strncpy(signals[i].name, name, sizeof(signals[i].name) - 1);
+            return &signals[i];
+        }
+    }
+
+    return NULL;
+}
+
+simInt simGetObjectHandle(const simChar *objectName)
+{
+    if(!strcmp(objectName, "Quadricopter"))
+        return BODY_HANDLE;
+
+    if(!strcmp(objectName, "Quadricopter_frontCamera"))
+        return SENSOR_HANDLE;
+
+    return -1;
+}
+
+simInt simGetObjectPosition(simInt objectHandle, simInt relativeToObjectHandle, simFloat *p)
+{
+    if(objectHandle != BODY_HANDLE)
+        return -1;
+
+    memcpy(p, position, sizeof(position));
+
+    return 1;
+}
+
+/* x, y, z, w, as V-REP gives them */
+simInt simGetObjectQuaternion(simInt objectHandle, simInt relativeToObjectHandle, simFloat *q)
+{
+    if(objectHandle != BODY_HANDLE)
+        return -1;
+
+    float cr = cosf(attitude[0] / 2), sr = sinf(attitude[0] / 2);
+    float cp = cosf(attitude[1] / 2), sp = sinf(attitude[1] / 2);
+    float cy = cosf(attitude[2] / 2), sy = sinf(attitude[2] / 2);
+
+    q[0] = sr * cp * cy - cr * sp * sy;
+    q[1] = cr * sp * cy + sr * cp * sy;
+    q[2] = cr * cp * sy - sr * sp * cy;
+    q[3] = cr * cp * cy + sr * sp * sy;
+
+    return 1;
+}
+
+simInt simGetObjectVelocity(simInt objectHandle, simFloat *linearVelocity, simFloat *angularVelocity)
+{
+    if(objectHandle != BODY_HANDLE)
+        return -1;
+
+    memcpy(linearVelocity, speed, sizeof(speed));
+    angularVelocity[0] = 0.0f;
+    angularVelocity[1] = 0.0f;
+    angularVelocity[2] = yaw_rate;
+
+    return 1;
+}
+
+simInt simGetVisionSensorResolution(simInt visionSensorHandle, simInt *resolution)
+{
+    if(visionSensorHandle != SENSOR_HANDLE)
+        return -1;
+
+    resolution[0] = SENSOR_WIDTH;
+    resolution[1] = SENSOR_HEIGHT;
+
+    return 1;
+}
+
+/* A checkerboard on the ground seen from ahead, shaded by altitude */
+simFloat *simGetVisionSensorImage(simInt visionSensorHandle)
+{
+    if(visionSensorHandle != SENSOR_HANDLE)
+        return NULL;
+
+    simFloat *image = malloc(SENSOR_WIDTH * SENSOR_HEIGHT * 3 * sizeof(simFloat));
+    if(!image)
+        return NULL;
+
+    int dx = position[1] * PIXELS_PER_METRE;
+    int dy = position[0] * PIXELS_PER_METRE;
+    float shade = 1.0f / (1.0f + position[2]);
+
+    for(int y = 0; y < SENSOR_HEIGHT; ++y)
+    {
+        for(int x = 0; x < SENSOR_WIDTH; ++x)
+        {
+            simFloat *pixel = image + (y * SENSOR_WIDTH + x) * 3;
+            uint8_t square = (((x + dx) >> 5) ^ ((y + dy) >> 5)) & 1;
+
+            pixel[0] = square ? shade : 0.0f;
+            pixel[1] = (float)y / SENSOR_HEIGHT;
+            pixel[2] = square ? 0.0f : shade;
+        }
+    }
+
+    return image;
+}
+
+simChar *simGetStringSignal(const simChar *signalName, simInt *stringLength)
+{
+    struct string_signal *s = find_signal(signalName, 0);
+
+    if(!s)
+        return NULL;
+
+    simChar *copy = malloc(s->length ? s->length : 1);
+    if(!copy)
+        return NULL;
+
+    memcpy(copy, s->value, s->length);
+    *stringLength = s->length;
+
+    return copy;
+}
+
+simInt simSetStringSignal(const simChar *signalName, const simChar *signalValue, simInt stringLength)
+{
+    struct string_signal *s = find_signal(signalName, 1);
+
+    if(!s)
+        return -1;
+
+    simChar *value = realloc(s->value, stringLength ? stringLength : 1);
+    if(!value)
+        return -1;
+
+    memcpy(value, signalValue, stringLength);
+    s->value = value;
+    s->length = stringLength;
+
+    return 1;
+}
+
+simInt simReleaseBuffer(simChar *buffer)
+{
+    free(buffer);
+
+    return 1;
+}
+
+/* What maindrone.lua does with the queue, without the sub-step weighting.
+ * Returns the number of commands drained. */
+static int drone_script(float dt)
+{
+    static struct vrep_command command;
+    struct string_signal *s = find_signal(VREP_CONTROL_SIGNAL, 0);
+    int count = 0;
+
+    if(s)
+    {
+        count = s->length / sizeof(struct vrep_command);
+
+        if(count)
+            memcpy(&command, s->value + (count - 1) * sizeof(struct vrep_command), sizeof(command));
+
+        free(s->value);
+        s->value = NULL;
+    }
+
+    attitude[0] = command.roll;
+    attitude[1] = command.pitch;
+    yaw_rate = command.yaw_rate;
+    attitude[2] += yaw_rate * dt;
+
+    /* Tilt accelerates the drone in its heading frame */
+    float forward = GRAVITY * tanf(attitude[1]);
+    float left = -GRAVITY * tanf(attitude[0]);
+    float cy = cosf(attitude[2]), sy = sinf(attitude[2]);
+
+    speed[0] += (cy * forward - sy * left - DRAG * speed[0]) * dt;
+    speed[1] += (sy * forward + cy * left - DRAG * speed[1]) * dt;
+    speed[2] = command.vert_speed;
+
+    for(int i = 0; i < 3; ++i)
+        position[i] += speed[i] * dt;
+
+    if(position[2] < 0.0f)
+    {
+        position[2] = 0.0f;
+        speed[2] = 0.0f;
+    }
+
+    return count;
+}
+
+static void usage(char *pname)
+{
+    printf("Usage: %s [options] [plugin]\n"\
+            "Options:\n"\
+            "\t-h\t\tPrint this help text.\n"\
+            "\t-s <ms>\t\tSimulation time step (default 50).\n"\
+            "\t-n <steps>\tStop after this many steps (default: run until killed).\n"\
+            "The plugin defaults to ./libv_repExtDrone.so.\n",
+            pname);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "./libv_repExtDrone.so";
+    int step_ms = 50;
+    long steps = -1;
+    int c;
+
+    while ((c = getopt (argc, argv, "hs:n:")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            case 's':
+                step_ms = atoi(optarg);
+                break;
+            case 'n':
+                steps = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind < argc)
+        path = argv[optind];
+
+    if(step_ms < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Loaded privately, as V-REP loads plugins, so the plugin's bindings
+     * resolve to this program's API */
+    void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(!lib)
+        error("Could not load %s: %s", path, dlerror());
+
+    plugin_start start;
+    plugin_end end;
+    plugin_message message;
+
+    *(void**)&start = dlsym(lib, "v_repStart");
+    *(void**)&end = dlsym(lib, "v_repEnd");
+    *(void**)&message = dlsym(lib, "v_repMessage");
+
+    if(!start || !end || !message)
+        error("%s is not a V-REP plugin", path);
+
+    if(!start(NULL, 0))
+        error("%s did not start", path);
+
+    int aux[4] = { 0 }, reply[4] = { 0 };
+    int report = step_ms < 1000 ? 1000 / step_ms : 1;
+    float dt = step_ms / 1000.0f;
+    long commands = 0;
+    struct timespec next;
+
+    message(sim_message_eventcallback_simulationabouttostart, aux, NULL, reply);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for(long step = 0; steps < 0 || step < steps; ++step)
+    {
+        message(sim_message_eventcallback_mainscriptabouttobecalled, aux, NULL, reply);
+        commands += drone_script(dt);
+        message(sim_message_eventcallback_modulehandleinsensingpart, aux, NULL, reply);
+
+        if(step % report == 0)
+            printf("t %.2f s: at (%.2f, %.2f, %.2f), yaw %.2f, %ld commands\n", step * dt, position[0], position[1], position[2], attitude[2], commands);
+
+        /* Real time, on an absolute schedule */
+        long ns = next.tv_nsec + step_ms * 1000000L;
+        next.tv_sec += ns / 1000000000;
+        next.tv_nsec = ns % 1000000000;
+
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL))
+            ;
+    }
+
+    message(sim_message_eventcallback_simulationended, aux, NULL, reply);
+    end();
+
+    return 0;
+}
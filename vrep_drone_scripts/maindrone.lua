@@ -54,9 +54,81 @@ if (simGetScriptExecutionCount()==0) then
 	heliQuaternion=simGetObjectQuaternion(heli, -1)
 	simSetObjectQuaternion(targetObj, -1, heliQuaternion)
 
+	-- The last command from the server {time, roll, pitch, vertical speed, yaw rate},
+	-- held until a newer one, and the end of the last step on the server's clock
+	command={0,0,0,0,0}
+	stepEnd=nil
+
+	-- The last propeller forces from the server's controller and how long
+	-- it has been since they changed
+	serverSequence=nil
+	serverAge=0
+
+	-- Copies made for a swarm are named Quadricopter#0, #1 and so on. Their
+	-- signals carry the same suffix, so each drone has its own command queue
+	-- and attitude signals and the first drone keeps the plain names.
+	suffix=simGetNameSuffix(nil)
+	if (suffix>=0) then
+		signalSuffix='#'..suffix
+	else
+		signalSuffix=''
+	end
+
 	done=false
 end
 
+-- Drain the commands the server queued since the last step. The remote API is
+-- served from this thread between steps, so nothing is appended between the
+-- get and the clear.
+queued=simGetStringSignal('QCCommands'..signalSuffix)
+simClearStringSignal('QCCommands'..signalSuffix)
+
+commands={}
+if (queued) then
+	floats=simUnpackFloats(queued)
+	for i=1,#floats-4,5 do
+		commands[#commands+1]={floats[i],floats[i+1],floats[i+2],floats[i+3],floats[i+4]}
+	end
+	-- Control shards flush on their own, so batches can arrive out of order
+	table.sort(commands,function(a,b) return a[1]<b[1] end)
+end
+
+-- This step covers the last ts seconds of commands. If the simulation is
+-- slower than real time the window jumps forward to the newest command.
+if (#commands>0) then
+	latest=commands[#commands][1]
+	if (stepEnd==nil or latest>stepEnd+ts) then
+		stepEnd=latest
+	else
+		stepEnd=stepEnd+ts
+	end
+elseif (stepEnd) then
+	stepEnd=stepEnd+ts
+end
+
+-- Forces are set once a step, so each command counts for the part of the step
+-- it was in force. Commands from before the step only update the held one.
+setpoint={command[2],command[3],command[4],command[5]}
+if (stepEnd) then
+	t=stepEnd-ts
+	setpoint={0,0,0,0}
+	for _,c in ipairs(commands) do
+		if (c[1]>t) then
+			for j=1,4,1 do
+				setpoint[j]=setpoint[j]+command[j+1]*(c[1]-t)
+			end
+			t=c[1]
+		end
+		command=c
+	end
+	for j=1,4,1 do
+		setpoint[j]=(setpoint[j]+command[j+1]*(stepEnd-t))/ts
+	end
+end
+
+-- The force model below has no yaw control, so setpoint[4] is unused
+desiredAngle={setpoint[1],setpoint[2],0}
+
 s=simGetObjectSizeFactor(d)
 
 pos=simGetObjectPosition(d,-1)
@@ -87,93 +159,113 @@ print(width)
 print("Length:")
 print(length)
 
-heliQuaternion=simGetObjectQuaternion(heli, -1)
+-- The server's attitude controller (-A) flies on these
+simSetStringSignal('QCAirframe'..signalSuffix,simPackFloats({mass,width,length,-gravity[3]}))
+
+-- Forces from the server's controller while it keeps sending them. If it
+-- goes away its sequence number stops moving and this script flies again.
+serverForces=simGetStringSignal('QCForces'..signalSuffix)
+if (serverForces) then
+	f=simUnpackFloats(serverForces)
+	if (f[1]~=serverSequence) then
+		serverSequence=f[1]
+		serverAge=0
+	else
+		serverAge=serverAge+ts
+	end
+end
+
+if (serverForces and serverAge<0.1) then
+	propForces={f[2],f[3],f[4],f[5]}
+else
+	heliQuaternion=simGetObjectQuaternion(heli, -1)
 
-mag=math.sqrt(heliQuaternion[3]*heliQuaternion[3] + heliQuaternion[4]*heliQuaternion[4])
-targetQuaternion={0,0,heliQuaternion[3]/mag,heliQuaternion[4]/mag}
+	mag=math.sqrt(heliQuaternion[3]*heliQuaternion[3] + heliQuaternion[4]*heliQuaternion[4])
+	targetQuaternion={0,0,heliQuaternion[3]/mag,heliQuaternion[4]/mag}
 
-simSetObjectQuaternion(targetObj, -1, targetQuaternion)
+	simSetObjectQuaternion(targetObj, -1, targetQuaternion)
 
-print("Orientation:")
-print(heliQuaternion[1])
-print(heliQuaternion[2])
-print(heliQuaternion[3])
-print(heliQuaternion[4])
+	print("Orientation:")
+	print(heliQuaternion[1])
+	print(heliQuaternion[2])
+	print(heliQuaternion[3])
+	print(heliQuaternion[4])
 
-heliQuaternion=simGetObjectQuaternion(heli, targetObj)
+	heliQuaternion=simGetObjectQuaternion(heli, targetObj)
 
-print("Adjusted orientation:")
-print(heliQuaternion[1])
-print(heliQuaternion[2])
-print(heliQuaternion[3])
-print(heliQuaternion[4])
+	print("Adjusted orientation:")
+	print(heliQuaternion[1])
+	print(heliQuaternion[2])
+	print(heliQuaternion[3])
+	print(heliQuaternion[4])
 
-heliAngle={0,0,0}
+	heliAngle={0,0,0}
 
-mag=math.sqrt(heliQuaternion[1]*heliQuaternion[1] + heliQuaternion[4]*heliQuaternion[4])
-if(mag~=0) then
-	sideQuaternion={heliQuaternion[1]/mag,0,0,heliQuaternion[4]/mag}
-	heliAngle[1]=2*math.acos(sideQuaternion[4])
-	if(heliAngle[1]>math.pi/2) then
-		heliAngle[1]=heliAngle[1]-math.pi
+	mag=math.sqrt(heliQuaternion[1]*heliQuaternion[1] + heliQuaternion[4]*heliQuaternion[4])
+	if(mag~=0) then
+		sideQuaternion={heliQuaternion[1]/mag,0,0,heliQuaternion[4]/mag}
+		heliAngle[1]=2*math.acos(sideQuaternion[4])
+		if(heliAngle[1]>math.pi/2) then
+			heliAngle[1]=heliAngle[1]-math.pi
+		end
 	end
-end
 
-force[1]=2*mass*(desiredAngle[1]-heliAngle[1])/width
-force[1]=force[1]-tForce[1]
-tForce[1]=tForce[1]+force[1]
+	force[1]=2*mass*(desiredAngle[1]-heliAngle[1])/width
+	force[1]=force[1]-tForce[1]
+	tForce[1]=tForce[1]+force[1]
 
 
-mag=math.sqrt(heliQuaternion[2]*heliQuaternion[2] + heliQuaternion[4]*heliQuaternion[4])
-if(mag~=0) then
-	forwardQuaternion={0,heliQuaternion[2]/mag,0,heliQuaternion[4]/mag}
-	heliAngle[2]=2*math.acos(forwardQuaternion[4])
-	if(heliAngle[2]>math.pi/2) then
-		heliAngle[2]=heliAngle[2]-math.pi
+	mag=math.sqrt(heliQuaternion[2]*heliQuaternion[2] + heliQuaternion[4]*heliQuaternion[4])
+	if(mag~=0) then
+		forwardQuaternion={0,heliQuaternion[2]/mag,0,heliQuaternion[4]/mag}
+		heliAngle[2]=2*math.acos(forwardQuaternion[4])
+		if(heliAngle[2]>math.pi/2) then
+			heliAngle[2]=heliAngle[2]-math.pi
+		end
 	end
-end
 
-force[2]=2*mass*(desiredAngle[2]-heliAngle[2])/length
-force[2]=force[2]-tForce[2]
-tForce[2]=tForce[2]+force[2]
+	force[2]=2*mass*(desiredAngle[2]-heliAngle[2])/length
+	force[2]=force[2]-tForce[2]
+	tForce[2]=tForce[2]+force[2]
 
---QC is facing along positive X
+	--QC is facing along positive X
 
-vertAngle=2*math.acos((math.cos(heliAngle[2])+math.cos(heliAngle[1]))/(math.sqrt(2+2*math.cos(heliAngle[2])*math.cos(heliAngle[1]))))
+	vertAngle=2*math.acos((math.cos(heliAngle[2])+math.cos(heliAngle[1]))/(math.sqrt(2+2*math.cos(heliAngle[2])*math.cos(heliAngle[1]))))
 
-print("vertAngle:")
-print(vertAngle)
+	print("vertAngle:")
+	print(vertAngle)
 
-v0=simGetObjectVelocity(heli)
+	v0=simGetObjectVelocity(heli)
 
-desiredVelocity=0.1
+	desiredVelocity=setpoint[3]
 
-force[3] = (-(gravity[3]) + desiredVelocity - v0[3]) * mass / math.cos(vertAngle)
+	force[3] = (-(gravity[3]) + desiredVelocity - v0[3]) * mass / math.cos(vertAngle)
 
-print("velocity:")
-print(v0[1])
-print(v0[2])
-print(v0[3])
+	print("velocity:")
+	print(v0[1])
+	print(v0[2])
+	print(v0[3])
 
-print("angle:")
-print(heliAngle[1])
-print(heliAngle[2])
-print(heliAngle[3])
+	print("angle:")
+	print(heliAngle[1])
+	print(heliAngle[2])
+	print(heliAngle[3])
 
-print("Force:")
-print(force[1])
-print(force[2])
-print(force[3])
+	print("Force:")
+	print(force[1])
+	print(force[2])
+	print(force[3])
 
-print("tForce:")
-print(tForce[1])
-print(tForce[2])
-print(tForce[3])
+	print("tForce:")
+	print(tForce[1])
+	print(tForce[2])
+	print(tForce[3])
 
-propForces[1]=force[3]/4 - force[2] / 4 + force[1] / 4
-propForces[2]=force[3]/4 + force[2] / 4 + force[1] / 4
-propForces[3]=force[3]/4 + force[2] / 4 - force[1] / 4
-propForces[4]=force[3]/4 - force[2] / 4 - force[1] / 4
+	propForces[1]=force[3]/4 - force[2] / 4 + force[1] / 4
+	propForces[2]=force[3]/4 + force[2] / 4 + force[1] / 4
+	propForces[3]=force[3]/4 + force[2] / 4 - force[1] / 4
+	propForces[4]=force[3]/4 - force[2] / 4 - force[1] / 4
+end
 
 -- Send the desired motor velocities to the 4 rotors:
 for i=1,4,1 do